@@ -0,0 +1,392 @@
+#!/usr/bin/env python3
+# -*- mode: python; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-
+
+# Benchmarks of the PCM object that don't need a sound card. They run
+# against ALSA's null plugin, the file plugin (which discards into a null
+# slave) and the free-running virtual device, so the numbers show the cost
+# of pyalsaaudio and alsa-lib, not of a driver.
+#
+# The results are written as JSON, and two result files can be compared:
+#
+#   python3 benchmarks/bench.py -o before.json
+#   python3 benchmarks/bench.py -o after.json --compare before.json
+
+import alsaaudio
+import json
+import platform
+import sys
+import threading
+import time
+import tracemalloc
+from argparse import ArgumentParser
+from contextlib import closing
+
+DEVICES = ['null', 'file:FILE=/dev/null,FORMAT=raw',
+		   'pyalsaaudio_virtual:CLOCK=0']
+PERIODS = [16, 64, 256, 1024, 4096, 8192]
+CHANNELS = [1, 2, 8, 64]
+THREADS = [1, 2, 4, 8]
+
+SAMPLE_SIZE = 2 # PCM_FORMAT_S16_LE
+
+def package_version():
+	try:
+		from importlib.metadata import version
+		return version('pyalsaaudio')
+	except Exception:
+		return None
+
+def open_pcm(device, pcmtype, channels=2, periodsize=256):
+	return alsaaudio.PCM(pcmtype, alsaaudio.PCM_NORMAL, device=device,
+						 channels=channels, rate=48000,
+						 format=alsaaudio.PCM_FORMAT_S16_LE,
+						 periodsize=periodsize, periods=4)
+
+def timeit(fn, calls, repeat):
+	'''The best and the median time per call in ns over `repeat` runs'''
+	times = []
+	for _ in range(repeat):
+		start = time.perf_counter_ns()
+		for _ in range(calls):
+			fn()
+		times.append((time.perf_counter_ns() - start) / calls)
+	times.sort()
+	return times[0], times[len(times) // 2]
+
+def allocations(fn, calls):
+	'''Memory blocks kept and peak bytes traced per call.
+
+	Blocks kept per call should be 0; anything else is a leak. The peak
+	shows the size of the temporary objects a call allocates.'''
+	fn()
+	before = sys.getallocatedblocks()
+	for _ in range(calls):
+		fn()
+	kept = (sys.getallocatedblocks() - before) / calls
+
+	tracemalloc.start()
+	try:
+		fn()
+		current, peak = tracemalloc.get_traced_memory()
+	finally:
+		tracemalloc.stop()
+
+	return kept, peak - current
+
+def bench_calls(device, calls, repeat):
+	'''Per-call overhead of read(), write(), avail() and status()'''
+	results = []
+
+	# The virtual device is new in 0.12
+	try:
+		open_pcm(device, alsaaudio.PCM_PLAYBACK).close()
+	except alsaaudio.ALSAAudioError as e:
+		return [{ 'benchmark': 'call', 'device': device, 'error': str(e) }]
+
+	with closing(open_pcm(device, alsaaudio.PCM_PLAYBACK, periodsize=16)) as pcm:
+		data = b'\0' * 16 * 2 * SAMPLE_SIZE
+		ops = [('write', lambda: pcm.write(data)),
+			   ('avail', lambda: pcm.avail()),
+			   ('status', lambda: pcm.status())]
+		results += measure(device, 'playback', ops, calls, repeat)
+
+	with closing(open_pcm(device, alsaaudio.PCM_CAPTURE, periodsize=16)) as pcm:
+		buffer = bytearray(16 * 2 * SAMPLE_SIZE)
+		ops = [('read', lambda: pcm.read()),
+			   ('read_into', lambda: pcm.read_into(buffer)),
+			   ('avail', lambda: pcm.avail()),
+			   ('status', lambda: pcm.status())]
+		results += measure(device, 'capture', ops, calls, repeat)
+
+	return results
+
+def measure(device, direction, ops, calls, repeat):
+	results = []
+	for name, fn in ops:
+		result = {
+			'benchmark': 'call',
+			'device': device,
+			'direction': direction,
+			'op': name,
+		}
+		try:
+			fn()
+		except AttributeError:
+			# Older versions lack some of the methods
+			result['error'] = 'not supported'
+			results.append(result)
+			continue
+
+		best, median = timeit(fn, calls, repeat)
+		kept, peak = allocations(fn, calls)
+		result.update({
+			'ns_per_call': best,
+			'median_ns_per_call': median,
+			'blocks_kept_per_call': kept,
+			'peak_bytes_per_call': peak,
+		})
+		results.append(result)
+
+	return results
+
+def bench_throughput(device, periods, channels, frames):
+	'''Frames per second written and read in periods of each size'''
+	results = []
+
+	for direction, pcmtype in (('playback', alsaaudio.PCM_PLAYBACK),
+							   ('capture', alsaaudio.PCM_CAPTURE)):
+		for nchannels in channels:
+			for periodsize in periods:
+				result = {
+					'benchmark': 'throughput',
+					'device': device,
+					'direction': direction,
+					'channels': nchannels,
+					'period_size': periodsize,
+				}
+				try:
+					pcm = open_pcm(device, pcmtype, nchannels, periodsize)
+				except alsaaudio.ALSAAudioError as e:
+					result['error'] = str(e)
+					results.append(result)
+					continue
+
+				with closing(pcm):
+					periodsize = pcm.info()['period_size']
+					buffer = bytearray(periodsize * nchannels * SAMPLE_SIZE)
+					if pcmtype == alsaaudio.PCM_PLAYBACK:
+						fn = lambda: pcm.write(buffer)
+					elif hasattr(pcm, 'read_into'):
+						fn = lambda: pcm.read_into(buffer)
+					else:
+						fn = lambda: pcm.read()[0]
+
+					# Versions before 0.12 have no stats(), so count here
+					has_stats = hasattr(pcm, 'stats')
+					n = max(frames // periodsize, 16)
+					if has_stats:
+						# blocked_ns is only counted after enable_stats()
+						if hasattr(pcm, 'enable_stats'):
+							pcm.enable_stats()
+						pcm.stats(reset=True)
+					done = 0
+					start = time.perf_counter_ns()
+					for _ in range(n):
+						res = fn()
+						if res > 0:
+							done += res
+					elapsed = time.perf_counter_ns() - start
+
+					if has_stats:
+						stats = pcm.stats()
+						result.update({
+							'blocked_ns_per_call':
+								stats.blocked_ns / max(stats.calls, 1),
+							'xruns': stats.xruns,
+						})
+
+				result.update({
+					'period_size': periodsize,
+					'frames': done,
+					'frames_per_s': done * 1e9 / elapsed,
+				})
+				results.append(result)
+
+	return results
+
+def bench_open(device, threads, opens):
+	'''Devices opened and closed per second by several threads at once.
+
+	Opening and closing don't hold the GIL, so this scales with the
+	number of threads as far as alsa-lib and the driver allow.'''
+	results = []
+
+	for nthreads in threads:
+		barrier = threading.Barrier(nthreads + 1)
+		errors = []
+
+		def worker():
+			barrier.wait()
+			try:
+				for _ in range(opens):
+					open_pcm(device, alsaaudio.PCM_PLAYBACK).close()
+			except alsaaudio.ALSAAudioError as e:
+				errors.append(str(e))
+
+		workers = [threading.Thread(target=worker) for _ in range(nthreads)]
+		for t in workers:
+			t.start()
+		barrier.wait()
+		start = time.perf_counter_ns()
+		for t in workers:
+			t.join()
+		elapsed = time.perf_counter_ns() - start
+
+		result = {
+			'benchmark': 'open',
+			'device': device,
+			'threads': nthreads,
+		}
+		if errors:
+			result['error'] = errors[0]
+		else:
+			result['opens_per_s'] = nthreads * opens * 1e9 / elapsed
+		results.append(result)
+
+	return results
+
+def bench_parallel(device, threads, frames):
+	'''Frames written per second by several threads at once, each to its
+	own PCM.
+
+	Objects don't share a lock, so on free-threaded builds the total should
+	grow linearly with the number of threads: `scaling` is the total
+	relative to that many times the rate of a single thread.'''
+	results = []
+	single = None
+
+	for nthreads in threads:
+		barrier = threading.Barrier(nthreads + 1)
+		errors = []
+
+		def worker():
+			try:
+				with closing(open_pcm(device, alsaaudio.PCM_PLAYBACK)) as pcm:
+					periodsize = pcm.info()['period_size']
+					buffer = bytes(periodsize * 2 * SAMPLE_SIZE)
+					barrier.wait()
+					for _ in range(max(frames // periodsize, 16)):
+						pcm.write(buffer)
+					pcm.drop()
+			except alsaaudio.ALSAAudioError as e:
+				errors.append(str(e))
+				barrier.abort()
+			except threading.BrokenBarrierError:
+				pass
+
+		workers = [threading.Thread(target=worker) for _ in range(nthreads)]
+		for t in workers:
+			t.start()
+		try:
+			barrier.wait()
+		except threading.BrokenBarrierError:
+			pass
+		start = time.perf_counter_ns()
+		for t in workers:
+			t.join()
+		elapsed = time.perf_counter_ns() - start
+
+		result = {
+			'benchmark': 'parallel',
+			'device': device,
+			'threads': nthreads,
+		}
+		if errors:
+			result['error'] = errors[0]
+		else:
+			rate = nthreads * frames * 1e9 / elapsed
+			if single is None and nthreads == 1:
+				single = rate
+			result['frames_per_s'] = rate
+			if single:
+				result['scaling'] = rate / (nthreads * single)
+		results.append(result)
+
+	return results
+
+def key(result):
+	return tuple(result.get(k) for k in ('benchmark', 'device', 'direction',
+										 'op', 'channels', 'period_size',
+										 'threads'))
+
+def compare(baseline, results, threshold):
+	'''Print the change against a baseline to stderr. Returns the number of
+	benchmarks that got slower by more than `threshold` percent.'''
+	old = { key(r): r for r in baseline['results'] }
+	regressions = 0
+
+	for r in results['results']:
+		b = old.get(key(r))
+		if not b or 'error' in r or 'error' in b:
+			continue
+		if r['benchmark'] == 'call':
+			change = (r['ns_per_call'] / b['ns_per_call'] - 1) * 100
+			name = '%s %s %s' % (r['device'], r['direction'], r['op'])
+		elif r['benchmark'] == 'open':
+			change = (b['opens_per_s'] / r['opens_per_s'] - 1) * 100
+			name = '%s open %d threads' % (r['device'], r['threads'])
+		elif r['benchmark'] == 'parallel':
+			change = (b['frames_per_s'] / r['frames_per_s'] - 1) * 100
+			name = '%s write %d threads' % (r['device'], r['threads'])
+		else:
+			change = (b['frames_per_s'] / r['frames_per_s'] - 1) * 100
+			name = '%s %s %dch %d' % (r['device'], r['direction'],
+									  r['channels'], r['period_size'])
+		mark = ''
+		if change > threshold:
+			mark = ' <- slower'
+			regressions += 1
+		print('%-60s %+7.1f%%%s' % (name, change, mark), file=sys.stderr)
+
+	return regressions
+
+def main():
+	parser = ArgumentParser(description='Benchmark pyalsaaudio without a '
+							'sound card')
+	parser.add_argument('-d', '--device', action='append',
+						help='PCM device to benchmark (default: %s)' %
+						', '.join(DEVICES))
+	parser.add_argument('-o', '--output', help='write the JSON results to '
+						'this file instead of stdout')
+	parser.add_argument('--calls', type=int, default=10000,
+						help='calls per run of the per-call benchmarks')
+	parser.add_argument('--repeat', type=int, default=5,
+						help='runs of the per-call benchmarks')
+	parser.add_argument('--frames', type=int, default=1 << 20,
+						help='frames per throughput benchmark')
+	parser.add_argument('--periods', type=int, nargs='+', default=PERIODS)
+	parser.add_argument('--channels', type=int, nargs='+', default=CHANNELS)
+	parser.add_argument('--threads', type=int, nargs='+', default=THREADS,
+						help='numbers of threads opening devices or writing '
+						'at once')
+	parser.add_argument('--opens', type=int, default=50,
+						help='devices opened by each thread')
+	parser.add_argument('--compare', metavar='BASELINE',
+						help='compare with the JSON results in BASELINE')
+	parser.add_argument('--threshold', type=float, default=10.0,
+						help='percentage by which a benchmark may get slower '
+						'before --compare reports a regression')
+	args = parser.parse_args()
+
+	results = {
+		'version': package_version(),
+		'asoundlib_version': alsaaudio.asoundlib_version(),
+		'python': sys.version,
+		'machine': platform.machine(),
+		'time': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+		'results': [],
+	}
+
+	for device in args.device or DEVICES:
+		results['results'] += bench_calls(device, args.calls, args.repeat)
+		results['results'] += bench_throughput(device, args.periods,
+											   args.channels, args.frames)
+		results['results'] += bench_open(device, args.threads, args.opens)
+		results['results'] += bench_parallel(device, args.threads,
+											 args.frames)
+
+	if args.output:
+		with open(args.output, 'w') as f:
+			json.dump(results, f, indent=2)
+	else:
+		json.dump(results, sys.stdout, indent=2)
+		print()
+
+	if args.compare:
+		with open(args.compare) as f:
+			baseline = json.load(f)
+		if compare(baseline, results, args.threshold):
+			sys.exit(1)
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# -*- mode: python; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-
+
+## asyncloopback.py
+##
+## Copies audio from a capture device to a playback device, and reports
+## mixer changes, all from a single asyncio event loop.
+##
+## Compare with loopback.py, which does the polling by hand.
+##
+## python asyncloopback.py -c hw:1 -p default -m Master
+
+import sys
+import asyncio
+import getopt
+import alsaaudio
+
+def usage():
+	print('usage: asyncloopback.py [-c <capture>] [-p <playback>] [-m <control>]',
+		  file=sys.stderr)
+	sys.exit(2)
+
+async def loopback(capture, playback):
+	while True:
+		frames, data = await capture.aread()
+		if frames < 0:
+			print('overrun', file=sys.stderr)
+			continue
+		if await playback.awrite(data) < 0:
+			print('underrun', file=sys.stderr)
+
+async def watch(mixer):
+	while True:
+		await mixer.wait_event()
+		print('%s: %s' % (mixer.mixer(), mixer.getvolume()))
+
+async def main(capture_device, playback_device, control):
+	capture = alsaaudio.PCM(alsaaudio.PCM_CAPTURE, device=capture_device,
+							channels=2, rate=44100, format=alsaaudio.PCM_FORMAT_S16_LE,
+							periodsize=256)
+	playback = alsaaudio.PCM(device=playback_device,
+							 channels=2, rate=44100, format=alsaaudio.PCM_FORMAT_S16_LE,
+							 periodsize=256)
+	mixer = alsaaudio.Mixer(control)
+
+	await asyncio.gather(loopback(capture, playback), watch(mixer))
+
+if __name__ == '__main__':
+
+	capture_device = 'default'
+	playback_device = 'default'
+	control = 'Master'
+
+	opts, args = getopt.getopt(sys.argv[1:], 'c:p:m:')
+	for o, a in opts:
+		if o == '-c':
+			capture_device = a
+		elif o == '-p':
+			playback_device = a
+		elif o == '-m':
+			control = a
+		else:
+			usage()
+
+	try:
+		asyncio.run(main(capture_device, playback_device, control))
+	except KeyboardInterrupt:
+		pass
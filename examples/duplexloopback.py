@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# -*- mode: python; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-
+
+## duplexloopback.py
+##
+## Copies audio from a capture device to a playback device, with both
+## streams linked so that they start at the same sample.
+##
+## Each period costs a single call into alsaaudio.
+##
+## python duplexloopback.py -c hw:1 -p default
+
+import sys
+import getopt
+import alsaaudio
+
+def usage():
+	print('usage: duplexloopback.py [-c <capture>] [-p <playback>]',
+		  file=sys.stderr)
+	sys.exit(2)
+
+if __name__ == '__main__':
+
+	capture_device = 'default'
+	playback_device = 'default'
+
+	opts, args = getopt.getopt(sys.argv[1:], 'c:p:')
+	for o, a in opts:
+		if o == '-c':
+			capture_device = a
+		elif o == '-p':
+			playback_device = a
+		else:
+			usage()
+
+	duplex = alsaaudio.Duplex(capture_device, playback_device,
+							  channels=2, rate=44100, format=alsaaudio.PCM_FORMAT_S16_LE,
+							  periodsize=256)
+
+	# Two periods of silence (2 channels, 2 bytes per sample) give the
+	# capture side time to catch up
+	data = b'\0' * 2 * 256 * 4
+
+	try:
+		while True:
+			written, frames, data = duplex.transfer(data)
+			if written < 0 or frames < 0:
+				print('xrun', file=sys.stderr)
+	except KeyboardInterrupt:
+		pass
+
+	duplex.close()
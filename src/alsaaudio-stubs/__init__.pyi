@@ -1,4 +1,8 @@
+from asyncio import Future
 from typing import Final, final
+from typing_extensions import Buffer
+from collections.abc import Callable, Mapping, Sequence
+from os import PathLike
 
 PCM_PLAYBACK: Final[int]
 PCM_CAPTURE: Final[int]
@@ -7,6 +11,16 @@ PCM_NORMAL: Final[int]
 PCM_NONBLOCK: Final[int]
 PCM_ASYNC: Final[int]
 
+PCM_ACCESS_RW_INTERLEAVED: Final[int]
+PCM_ACCESS_RW_NONINTERLEAVED: Final[int]
+PCM_ACCESS_MMAP_INTERLEAVED: Final[int]
+PCM_ACCESS_MMAP_NONINTERLEAVED: Final[int]
+
+PCM_RESAMPLE_NONE: Final[int]
+PCM_RESAMPLE_FAST: Final[int]
+PCM_RESAMPLE_MEDIUM: Final[int]
+PCM_RESAMPLE_BEST: Final[int]
+
 PCM_FORMAT_S8: Final[int]
 PCM_FORMAT_U8: Final[int]
 PCM_FORMAT_S16_LE: Final[int]
@@ -80,6 +94,12 @@ def pcms(pcmtype: int) -> list[str]: ...
 def cards() -> list[str]: ...
 def mixers(cardindex: int = -1, device: str = 'default') -> list[str]: ...
 def asoundlib_version() -> str: ...
+def capabilities(
+	device: str = 'default',
+	type: int = PCM_PLAYBACK,
+	cache: str | PathLike[str] | None = None,
+	refresh: bool = False,
+) -> Capabilities: ...
 
 def card_indexes() -> list[int]: ...
 def card_name(index: int): ...
@@ -100,12 +120,33 @@ class PCM:
 		format: int = PCM_FORMAT_S16_LE,
 		periodsize: int = 32,
 		periods: int = 4,
+		access: int = PCM_ACCESS_RW_INTERLEAVED,
+		resample: int = PCM_RESAMPLE_NONE,
+		avail_min: int = -1,
+		start_threshold: int = -1,
+		stop_threshold: int = -1,
+		silence_threshold: int = -1,
+		silence_size: int = -1,
+		period_event: int = -1,
 	) -> None: ...
 	def close(self) -> None: ...
 	def dumpinfo(self) -> None: ...
 	def info(self) -> dict: ...
 	def state(self) -> int: ...
 	def htimestamp(self) -> tuple[int, int, int]: ...
+	def status(self) -> Status: ...
+	def stats(self, reset: bool = False) -> Stats: ...
+	def enable_stats(self, enable: bool = True) -> None: ...
+	def set_sw_params(
+		self,
+		*,
+		avail_min: int = -1,
+		start_threshold: int = -1,
+		stop_threshold: int = -1,
+		silence_threshold: int = -1,
+		silence_size: int = -1,
+		period_event: int = -1,
+	) -> dict[str, int]: ...
 	def set_tstamp_mode(self, mode: int = PCM_TSTAMP_ENABLE) -> None: ...
 	def get_tstamp_mode(self) -> int: ...
 	def set_tstamp_type(self, type: int = PCM_TSTAMP_TYPE_GETTIMEOFDAY) -> None: ...
@@ -121,14 +162,155 @@ class PCM:
 	def setrate(self, rate: int) -> None: ...
 	def setformat(self, format: int) -> int: ...
 	def setperiodsize(self, period: int) -> int: ...
-	def read(self) -> tuple[int, bytes]: ...
+	def configure(
+		self,
+		*,
+		rate: int = -1,
+		format: int = -1,
+		channels: int = -1,
+		period_size: int = -1,
+		periods: int = -1,
+		buffer_size: int = -1,
+		latency_us: int = -1,
+	) -> dict[str, int]: ...
+	def read(self, frames: int = -1) -> tuple[int, bytes]: ...
+	def read_into(self, buffer: Buffer) -> int: ...
 	def write(self, data: bytes) -> int: ...
+	def writev(self, buffers: Sequence[Buffer]) -> int: ...
+	def write_float(self, data: Buffer, dither: bool = False) -> int: ...
+	def read_float(self, frames: int = -1) -> tuple[int, bytes]: ...
+	def set_channel_matrix(self, matrix: Sequence[Sequence[float]] | None) -> None: ...
+	def set_gain(self, db: float, ramp_ms: float = 0.0) -> None: ...
+	def get_gain(self) -> float: ...
+	def enable_meters(self, enable: bool = True) -> None: ...
+	def meters(self) -> Meters: ...
+	def read_planar(self) -> tuple[int, list[bytes]]: ...
+	def write_planar(self, buffers: Sequence[Buffer]) -> int: ...
 	def avail(self) -> int: ...
 	def pause(self, enable: bool = True) -> int: ...
 	def drop(self) -> int: ...
 	def drain(self) -> int: ...
+	def start(self, callback: Callable[[memoryview], object] | RingBuffer, frames_per_callback: int = -1) -> None: ...
+	def stop(self) -> None: ...
+	def xruns(self) -> int: ...
+	def mmap_begin(self, frames: int = -1) -> tuple[int, memoryview]: ...
+	def mmap_commit(self, frames: int = -1) -> int: ...
 	def polldescriptors(self) -> list[tuple[int, int]]: ...
 	def polldescriptors_revents(self, descriptors: list[tuple[int, int]]) -> int: ...
+	def aread(self) -> Future[tuple[int, bytes]]: ...
+	def awrite(self, data: Buffer) -> Future[int]: ...
+
+@final
+class Meters(tuple[tuple[float, ...], tuple[float, ...], tuple[float, ...], float]):
+	@property
+	def peak(self) -> tuple[float, ...]: ...
+	@property
+	def rms(self) -> tuple[float, ...]: ...
+	@property
+	def momentary(self) -> tuple[float, ...]: ...
+	@property
+	def loudness(self) -> float: ...
+
+@final
+class Status(tuple[int, int, int, int, float, float, float, int]):
+	@property
+	def state(self) -> int: ...
+	@property
+	def avail(self) -> int: ...
+	@property
+	def delay(self) -> int: ...
+	@property
+	def avail_max(self) -> int: ...
+	@property
+	def trigger_tstamp(self) -> float: ...
+	@property
+	def tstamp(self) -> float: ...
+	@property
+	def audio_tstamp(self) -> float: ...
+	@property
+	def overrange(self) -> int: ...
+
+@final
+class Stats(tuple[int, int, int, int, int, int, int, int | None, int | None]):
+	@property
+	def calls(self) -> int: ...
+	@property
+	def frames(self) -> int: ...
+	@property
+	def xruns(self) -> int: ...
+	@property
+	def eagain(self) -> int: ...
+	@property
+	def partial(self) -> int: ...
+	@property
+	def blocked_ns(self) -> int: ...
+	@property
+	def max_blocked_ns(self) -> int: ...
+	@property
+	def min_avail(self) -> int | None: ...
+	@property
+	def max_avail(self) -> int | None: ...
+
+@final
+class Capabilities(tuple[str, int, str | None, Mapping[str, int], tuple[int, ...], int, int, tuple[int, ...], int, int, int, int, int, int]):
+	@property
+	def device(self) -> str: ...
+	@property
+	def type(self) -> int: ...
+	@property
+	def card_id(self) -> str | None: ...
+	@property
+	def formats(self) -> Mapping[str, int]: ...
+	@property
+	def channels(self) -> tuple[int, ...]: ...
+	@property
+	def channels_min(self) -> int: ...
+	@property
+	def channels_max(self) -> int: ...
+	@property
+	def rates(self) -> tuple[int, ...]: ...
+	@property
+	def rate_min(self) -> int: ...
+	@property
+	def rate_max(self) -> int: ...
+	@property
+	def period_size_min(self) -> int: ...
+	@property
+	def period_size_max(self) -> int: ...
+	@property
+	def buffer_size_min(self) -> int: ...
+	@property
+	def buffer_size_max(self) -> int: ...
+
+@final
+class DeviceMonitor:
+	def __init__(self) -> None: ...
+	def cards(self) -> tuple[str, ...]: ...
+	def pcms(self, pcmtype: int = PCM_PLAYBACK) -> tuple[str, ...]: ...
+	def update(self) -> bool: ...
+	def fileno(self) -> int: ...
+	def close(self) -> None: ...
+
+@final
+class RingBuffer:
+	def __init__(self, frames: int, framesize: int) -> None: ...
+	def __buffer__(self, flags: int, /) -> memoryview: ...
+	def write(self, data: Buffer) -> int: ...
+	def read(self, frames: int = -1) -> bytes: ...
+	def read_into(self, buffer: Buffer) -> int: ...
+	def available(self) -> int: ...
+	def space(self) -> int: ...
+	def capacity(self) -> int: ...
+	def framesize(self) -> int: ...
+	def xruns(self) -> int: ...
+
+@final
+class Duplex:
+	def __init__(self, capture_device: str = 'default', playback_device: str = 'default', mode: int = PCM_NORMAL, rate: int = 44100, channels: int = 2, format: int = PCM_FORMAT_S16_LE, periodsize: int = 32, periods: int = 4) -> None: ...
+	def capture(self) -> PCM: ...
+	def playback(self) -> PCM: ...
+	def transfer(self, data: Buffer) -> tuple[int, int, bytes]: ...
+	def close(self) -> None: ...
 
 @final
 class Mixer:
@@ -150,5 +332,6 @@ class Mixer:
 	def setrec(self, capture: int, channel: (int | None) = None) -> None: ...
 	def polldescriptors(self) -> list[tuple[int, int]]: ...
 	def handleevents(self) -> int: ...
+	def wait_event(self) -> Future[int]: ...
 
 class ALSAAudioError(Exception): ...
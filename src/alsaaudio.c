@@ -26,11 +26,33 @@
 #endif
 
 #include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
 #include <alsa/version.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
+
+/* Number of dither generators, one per SIMD lane, see alsaconv_uniform() */
+#define ALSACONV_LANES 8
+
+/* Software parameters, in the order of their keyword arguments */
+enum {
+	ALSAPCM_SW_AVAIL_MIN,
+	ALSAPCM_SW_START_THRESHOLD,
+	ALSAPCM_SW_STOP_THRESHOLD,
+	ALSAPCM_SW_SILENCE_THRESHOLD,
+	ALSAPCM_SW_SILENCE_SIZE,
+	ALSAPCM_SW_PERIOD_EVENT,
+	ALSAPCM_SW_PARAMS
+};
+
 static const snd_pcm_format_t ALSAFormats[] = {
 	SND_PCM_FORMAT_S8,
 	SND_PCM_FORMAT_U8,
@@ -100,6 +122,89 @@ typedef enum volume_units_t {
 
 typedef struct {
 	PyObject_HEAD;
+
+	char *data;
+	int framesize;
+	/* Capacity in frames, always a power of two */
+	size_t frames;
+
+	/* Frames written and read so far. Each is only ever modified by one
+	   side, so no locking is needed with a single producer and a single
+	   consumer. */
+	atomic_size_t head;
+	atomic_size_t tail;
+
+	/* The sides in use, ALSARING_PRODUCER and/or ALSARING_CONSUMER. A PCM's
+	   I/O thread owns its side from start() to stop(), a method only while
+	   it runs. */
+	atomic_int owners;
+
+	atomic_ulong xruns;
+} alsaring_t;
+
+#define ALSARING_PRODUCER 1
+#define ALSARING_CONSUMER 2
+
+/* Wakeups without a pending operation before a poller stops watching */
+#define ALSAPOLLER_MAX_IDLE 16
+
+/* Drives PCM.aread(), PCM.awrite() and Mixer.wait_event() from an asyncio
+   event loop. A PCM or Mixer has at most one poller, which stays registered
+   with the loop between operations, so a stream of back-to-back awaits
+   doesn't touch the loop's selector. */
+typedef struct {
+	PyObject_HEAD;
+
+	/* The PCM or Mixer this poller belongs to. This is only a strong
+	   reference while an operation is pending. */
+	PyObject *owner;
+	bool is_mixer;
+
+	/* The loop the owner's poll descriptors are registered with */
+	PyObject *loop;
+	/* Wakeups in a row with no operation pending, see alsapoller_call() */
+	int idle;
+
+	/* The pending operation, if future is set */
+	PyObject *future;
+	PyObject *buffer_obj;	// aread(): the bytes object being filled
+	Py_buffer data;			// awrite(): the caller's data
+	snd_pcm_uframes_t frames;
+	snd_pcm_uframes_t done;
+} alsapoller_t;
+
+/* Level meters, see below */
+typedef struct alsameter alsameter_t;
+
+/* Sample rate conversion, see below */
+typedef struct alsaresampler alsaresampler_t;
+
+/* Performance counters of read() and write(), see PCM.stats() */
+typedef struct {
+	unsigned long long calls;
+	unsigned long long frames;
+	unsigned long long eagain;
+	unsigned long long partial;
+	/* Time spent in the transfer functions without the GIL */
+	uint64_t blocked_ns, blocked_max_ns;
+	/* Frames available when transfers started, or -1 before the first */
+	snd_pcm_sframes_t avail_min, avail_max;
+	/* PCM.xruns() when the counters were last reset */
+	unsigned long xruns_base;
+} alsapcm_stats_t;
+
+typedef struct {
+	PyObject_HEAD;
+
+	/* Held by every method, see alsalock_acquire() */
+	pthread_mutex_t lock;
+	/* Signalled when a transfer returns or the I/O thread was joined */
+	pthread_cond_t cond;
+	/* A transfer is in flight, see alsapcm_io_begin(), or close() waits
+	   for one to return */
+	bool io_busy;
+	bool closing;
+
 	long pcmtype;
 	int pcmmode;
 	char *cardname;
@@ -112,13 +217,88 @@ typedef struct {
 	snd_pcm_format_t format;
 	unsigned int periods;
 	snd_pcm_uframes_t periodsize;
+	snd_pcm_access_t access;
 	int framesize;
+	snd_pcm_uframes_t buffersize;
+
+	/* Software parameters to apply on top of alsa-lib's defaults, or -1
+	   to leave one alone, see set_sw_params() */
+	long swparams[ALSAPCM_SW_PARAMS];
+
+	/* Area handed out by mmap_begin(), pending mmap_commit() */
+	PyObject *mmap_view;
+	snd_pcm_uframes_t mmap_offset;
+	snd_pcm_uframes_t mmap_frames;
+
+	/* Realtime I/O thread, see start() */
+	bool thread_running;
+	bool thread_joining;
+	pthread_t thread;
+	atomic_int thread_stop;
+	/* The interpreter that called start(), and the thread state the I/O
+	   thread runs the callback in, created on its first call */
+	PyInterpreterState *interp;
+	PyThreadState *tstate;
+	int thread_error;
+	PyObject *thread_exc_type, *thread_exc_value, *thread_exc_tb;
+	PyObject *callback;
+	alsaring_t *ring;
+	PyObject *cbview;
+	char *cbbuffer;
+	snd_pcm_uframes_t cbframes;
+
+	atomic_ulong xruns;
+
+	/* Counters for stats(), updated under the lock. The time and avail
+	   counters cost two clock reads and an avail update per transfer, so
+	   they are only kept after enable_stats(). */
+	alsapcm_stats_t stats;
+	atomic_int stats_timing;
+
+	/* Scratch buffer and dither state for write_float() and read_float() */
+	char *convbuf;
+	size_t convsize;
+	uint32_t dither[ALSACONV_LANES];
+
+	/* Gain matrix with one row per output and one column per input
+	   channel, see set_channel_matrix() */
+	float *matrix;
+	unsigned int matrix_in, matrix_out;
+
+	/* Software gain for write(), see set_gain(). While gain_ramp frames
+	   remain, gain moves towards gain_target by gain_step per frame. */
+	float gain, gain_target, gain_step;
+	snd_pcm_uframes_t gain_ramp;
+
+	/* Level meters, see enable_meters() */
+	alsameter_t *meters;
+
+	/* Sample rate conversion between the rate asked for and the rate the
+	   device runs at, see the `resample` argument */
+	int resample;
+	unsigned int user_rate;
+	alsaresampler_t *resampler;
+
+	/* Resampled frames in the PCM's format that the device didn't accept
+	   yet. They are written before any new input, see
+	   alsapcm_write_pending(). */
+	char *pending;
+	size_t pendingcap;
+	snd_pcm_uframes_t npending;
+
+	/* Cached poll descriptors, see alsapcm_get_pollfds() */
+	struct pollfd *pollfds;
+	int npollfds;
+	alsapoller_t *poller;
 
 } alsapcm_t;
 
 typedef struct {
 	PyObject_HEAD;
 
+	/* Held by every method, see alsalock_acquire() */
+	pthread_mutex_t lock;
+
 	/* Mixer identification */
 	char *cardname;
 	char *controlname;
@@ -139,2938 +319,10069 @@ typedef struct {
 	long cmin_dB, cmax_dB;
 
 	snd_mixer_t *handle;
+
+	/* Cached poll descriptors, see alsamixer_get_pollfds() */
+	struct pollfd *pollfds;
+	int npollfds;
+	alsapoller_t *poller;
 } alsamixer_t;
 
+typedef struct {
+	PyObject_HEAD;
+
+	/* The two sides, linked with snd_pcm_link() */
+	alsapcm_t *capture;
+	alsapcm_t *playback;
+	bool linked;
+} alsaduplex_t;
+
 /******************************************/
-/* PCM object wrapper				   */
+/* Module state							  */
 /******************************************/
 
-static PyTypeObject ALSAPCMType;
-static PyObject *ALSAAudioError;
-
-static long
-get_pcmtype(PyObject *obj)
-{
-	if (!obj || (obj == Py_None)) {
-		return SND_PCM_STREAM_PLAYBACK;
-	}
+/* Everything the module creates at import time lives in the module's state,
+   so that each (sub)interpreter has its own exception, types and caches. */
+typedef struct {
+	PyObject *error;
+	PyTypeObject *pcm_type;
+	PyTypeObject *mixer_type;
+	PyTypeObject *ring_type;
+	PyTypeObject *duplex_type;
+	PyTypeObject *devmon_type;
+	PyTypeObject *poller_type;
+	PyTypeObject *meters_type;
+	PyTypeObject *status_type;
+	PyTypeObject *stats_type;
+	PyTypeObject *caps_type;
+	PyObject *caps_cache;			// capabilities() by (device, pcmtype)
+	PyObject *get_running_loop;		// asyncio.get_running_loop
+	PyObject *running;				// PCMs with a running I/O thread
+} alsaaudio_state_t;
+
+#if PY_MAJOR_VERSION >= 3 && PY_VERSION_HEX < 0x03090000
+#error "pyalsaaudio needs Python 3.9 or later"
+#endif
 
-#if PY_MAJOR_VERSION > 2
-	if (PyLong_Check(obj)) {
-		long pcmtype = PyLong_AS_LONG(obj);
-		if (pcmtype == SND_PCM_STREAM_PLAYBACK ||
-			pcmtype == SND_PCM_STREAM_CAPTURE) {
-			return pcmtype;
-		}
-	}
+/* Like the static types they replaced, our types can't be changed from
+   Python */
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define ALSAAUDIO_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE)
 #else
-	if (PyInt_Check(obj)) {
-		long pcmtype = PyInt_AS_LONG(obj);
-		if (pcmtype == SND_PCM_STREAM_PLAYBACK ||
-			pcmtype == SND_PCM_STREAM_CAPTURE) {
-			return pcmtype;
-		}
-	}
+#define ALSAAUDIO_TPFLAGS Py_TPFLAGS_DEFAULT
 #endif
 
-	if (PyUnicode_Check(obj)) {
-#if PY_MAJOR_VERSION > 2
-		if (PyUnicode_CompareWithASCIIString(obj, "playback") == 0)
-			return SND_PCM_STREAM_PLAYBACK;
-		else if (PyUnicode_CompareWithASCIIString(obj, "capture") == 0)
-			return SND_PCM_STREAM_CAPTURE;
-#else
-		const char *dirstr = PyUnicode_AS_DATA(obj);
-		if (strcasecmp(dirstr, "playback")==0)
-			return SND_PCM_STREAM_PLAYBACK;
-		else if (strcasecmp(dirstr, "capture")==0)
-			return SND_PCM_STREAM_CAPTURE;
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
 #endif
-	}
 
-	PyErr_SetString(ALSAAudioError, "PCM type must be PCM_PLAYBACK (0) "
-					"or PCM_CAPTURE (1)");
-	return -1;
+/* The state of an object's module. Our types can't be subclassed, so the
+   module is the one of the object's type. */
+#define alsaaudio_state_of(obj) \
+	((alsaaudio_state_t *)PyType_GetModuleState(Py_TYPE(obj)))
+
+/* The state of one of our types, for tp_new */
+#define alsaaudio_type_state(type) \
+	((alsaaudio_state_t *)PyType_GetModuleState(type))
+
+/* The state of the module object that a module function is bound to */
+#define alsaaudio_module_state(m) \
+	((alsaaudio_state_t *)PyModule_GetState(m))
+
+/* The ALSAAudioError of an object's module. Each instance of the module has
+   its own, so objects must raise the one of the module that created them.
+   Code without an object at hand gets the state passed in. */
+#define ALSAAudioError(obj) (alsaaudio_state_of(obj)->error)
+
+/* Software gain, see below */
+static bool alsapcm_gain_active(alsapcm_t *self);
+static void alsapcm_gain_apply(alsapcm_t *self, char *buf,
+							   snd_pcm_uframes_t frames);
+static void alsapcm_gain_advance(alsapcm_t *self, snd_pcm_sframes_t frames);
+
+/* Frames the resampler produced that are still to be written, see below */
+static snd_pcm_sframes_t alsapcm_write_pending(alsapcm_t *self);
+
+/* asyncio support, see below */
+static void alsapoller_detach(alsapoller_t **slot);
+#if PY_MAJOR_VERSION >= 3
+static PyObject *alsapcm_aread(alsapcm_t *self, PyObject *args);
+static PyObject *alsapcm_awrite(alsapcm_t *self, PyObject *args);
+static PyObject *alsamixer_wait_event(alsamixer_t *self, PyObject *args);
+#endif
+
+/******************************************/
+/* Object locks							  */
+/******************************************/
+
+/* PCM, Mixer and DeviceMonitor objects have a lock that each method holds
+   from start to end, including the parts that run without the GIL, except
+   while the transfer methods of a PCM block, see ALSAPCM_BEGIN_BLOCKING().
+   This is all the synchronization these objects need on free-threaded
+   builds, so that independent devices don't contend on any global lock. */
+
+static void
+alsalock_acquire(pthread_mutex_t *lock)
+{
+	if (pthread_mutex_trylock(lock) == 0)
+		return;
+
+	// The holder may need the GIL to finish, so wait without it
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(lock);
+	Py_END_ALLOW_THREADS
 }
 
-static bool is_value_volume_unit(long unit)
+static void
+alsalock_release(pthread_mutex_t *lock)
 {
-	if (unit == VOLUME_UNITS_PERCENTAGE ||
-		unit == VOLUME_UNITS_RAW ||
-		unit == VOLUME_UNITS_DB) {
-		return true;
-	}
-	return false;
+	pthread_mutex_unlock(lock);
 }
 
-static PyObject *
-alsacard_list(PyObject *self, PyObject *args)
+/* Define name_locked(), which calls the method `name` under the lock of
+   `self`, for use in the method tables */
+#define ALSALOCK_METHOD(name, type)										\
+	static PyObject *													\
+	name##_locked(type *self, PyObject *args)							\
+	{																	\
+		PyObject *res;													\
+		alsalock_acquire(&self->lock);									\
+		res = name(self, args);											\
+		alsalock_release(&self->lock);									\
+		return res;														\
+	}
+
+#define ALSALOCK_METHOD_KW(name, type)									\
+	static PyObject *													\
+	name##_locked(type *self, PyObject *args, PyObject *kwds)			\
+	{																	\
+		PyObject *res;													\
+		alsalock_acquire(&self->lock);									\
+		res = name(self, args, kwds);									\
+		alsalock_release(&self->lock);									\
+		return res;														\
+	}
+
+/* The transfer methods of a PCM don't hold its lock while they block in
+   ALSA, so that avail(), status(), drop(), pause() and close() don't wait
+   for the device. Instead, they mark the PCM as busy with a transfer from
+   start to end, see alsapcm_io_begin(), which keeps other transfers and
+   reconfiguration out, and which close() waits for. These replace
+   Py_BEGIN_ALLOW_THREADS and Py_END_ALLOW_THREADS around the blocking
+   calls. */
+#define ALSAPCM_BEGIN_BLOCKING(self)									\
+	Py_BEGIN_ALLOW_THREADS												\
+	pthread_mutex_unlock(&(self)->lock);
+
+#define ALSAPCM_END_BLOCKING(self)										\
+	pthread_mutex_lock(&(self)->lock);									\
+	Py_END_ALLOW_THREADS
+
+/******************************************/
+/* Ring buffer object					 */
+/******************************************/
+
+/* Frames that can be read from the ring. Safe to call from the consumer. */
+static size_t
+alsaring_count(alsaring_t *self)
 {
-	int rc;
-	int card = -1;
-	snd_ctl_card_info_t *info;
-	snd_ctl_t *handle;
-	PyObject *result = NULL;
+	size_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
 
-	if (!PyArg_ParseTuple(args,":cards"))
-		return NULL;
+	return head - tail;
+}
 
-	snd_ctl_card_info_alloca(&info);
-	result = PyList_New(0);
+/* Frames that can be written to the ring. Safe to call from the producer. */
+static size_t
+alsaring_space(alsaring_t *self)
+{
+	size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_acquire);
 
-	for (rc = snd_card_next(&card); !rc && (card >= 0);
-		 rc = snd_card_next(&card))
-	{
-		char name[64];
-		int err;
-		PyObject *item;
+	return self->frames - (head - tail);
+}
 
-		/* One would be tempted to think that snd_card_get_name returns a name
-		   that is actually meaningful for any further operations.
+/* Producer side: copy up to `frames` frames into the ring, and return the
+   number of frames copied. Wait-free, and doesn't need the GIL. */
+static size_t
+alsaring_write(alsaring_t *self, const char *data, size_t frames)
+{
+	size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+	size_t pos, chunk;
 
-		   Not in ALSA land. Here we need the id, not the name */
+	if (frames > alsaring_space(self))
+		frames = alsaring_space(self);
 
-		sprintf(name, "hw:%d", card);
-		if ((err = snd_ctl_open(&handle, name, 0)) < 0) {
-			PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(err), name);
-			return NULL;
-		}
-		if ((err = snd_ctl_card_info(handle, info)) < 0) {
-			PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(err), name);
-			snd_ctl_close(handle);
-			Py_DECREF(result);
-			return NULL;
-		}
+	pos = head & (self->frames - 1);
+	chunk = self->frames - pos < frames ? self->frames - pos : frames;
 
-		item = PyUnicode_FromString(snd_ctl_card_info_get_id(info));
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	memcpy(self->data + pos * self->framesize, data, chunk * self->framesize);
+	memcpy(self->data, data + chunk * self->framesize,
+		   (frames - chunk) * self->framesize);
 
-		snd_ctl_close(handle);
-	}
+	atomic_store_explicit(&self->head, head + frames, memory_order_release);
 
-	return result;
+	return frames;
 }
 
-static PyObject *
-alsacard_list_indexes(PyObject *self, PyObject *args)
+/* Consumer side: copy up to `frames` frames out of the ring, and return the
+   number of frames copied. Wait-free, and doesn't need the GIL. */
+static size_t
+alsaring_read(alsaring_t *self, char *data, size_t frames)
 {
-	int rc;
-	int card = -1;
-	PyObject *result = NULL;
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+	size_t pos, chunk;
 
-	if (!PyArg_ParseTuple(args,":card_indexes"))
-		return NULL;
+	if (frames > alsaring_count(self))
+		frames = alsaring_count(self);
 
-	result = PyList_New(0);
+	pos = tail & (self->frames - 1);
+	chunk = self->frames - pos < frames ? self->frames - pos : frames;
 
-	for (rc = snd_card_next(&card); !rc && (card >= 0);
-		 rc = snd_card_next(&card))
-	{
-		PyObject *item = PyLong_FromLong(card);
+	memcpy(data, self->data + pos * self->framesize, chunk * self->framesize);
+	memcpy(data + chunk * self->framesize, self->data,
+		   (frames - chunk) * self->framesize);
 
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	atomic_store_explicit(&self->tail, tail + frames, memory_order_release);
+
+	return frames;
+}
+
+/* Claim a side of the ring. Raises EBUSY and returns -1 if it has an owner
+   already, which enforces the single producer and single consumer. */
+static int
+alsaring_claim(alsaring_t *self, int side)
+{
+	if (atomic_fetch_or(&self->owners, side) & side) {
+		PyErr_Format(ALSAAudioError(self),
+					 "%s [RingBuffer %s]", strerror(EBUSY),
+					 side == ALSARING_PRODUCER ? "producer" : "consumer");
+		return -1;
 	}
+	return 0;
+}
 
-	return result;
+static void
+alsaring_unclaim(alsaring_t *self, int side)
+{
+	atomic_fetch_and(&self->owners, ~side);
 }
 
 static PyObject *
-alsacard_name(PyObject *self, PyObject *args)
+alsaring_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-	int err, card;
-	PyObject *result = NULL;
-	char *name = NULL, *longname = NULL;
+	alsaring_t *self;
+	Py_ssize_t frames;
+	int framesize;
+	size_t capacity = 1;
 
-	if (!PyArg_ParseTuple(args,"i:card_name", &card))
+	char *kw[] = { "frames", "framesize", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ni:RingBuffer", kw,
+									 &frames, &framesize))
 		return NULL;
 
-	err = snd_card_get_name(card, &name);
-	if (err < 0) {
-		PyErr_Format(ALSAAudioError, "%s [%d]", snd_strerror(err), card);
-		goto exit;
+	if (frames <= 0 || framesize <= 0) {
+		PyErr_SetString(alsaaudio_type_state(type)->error,
+						"frames and framesize must be positive");
+		return NULL;
 	}
 
-	err = snd_card_get_longname(card, &longname);
-	if (err < 0) {
-		PyErr_Format(ALSAAudioError, "%s [%d]", snd_strerror(err), card);
-		goto exit;
+	while (capacity < (size_t)frames)
+		capacity <<= 1;
+
+	if (capacity > (size_t)PY_SSIZE_T_MAX / framesize)
+		return PyErr_NoMemory();
+
+	if (!(self = (alsaring_t *)PyObject_New(alsaring_t, type)))
+		return NULL;
+
+	self->data = PyMem_Calloc(capacity, framesize);
+	if (!self->data) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
 	}
+	self->framesize = framesize;
+	self->frames = capacity;
+	atomic_init(&self->head, 0);
+	atomic_init(&self->tail, 0);
+	atomic_init(&self->owners, 0);
+	atomic_init(&self->xruns, 0);
 
-	result = PyTuple_New(2);
-	PyTuple_SetItem(result, 0, PyUnicode_FromString(name));
-	PyTuple_SetItem(result, 1, PyUnicode_FromString(longname));
+	return (PyObject *)self;
+}
 
-exit:
-	free(name);
-	free(longname);
+static void
+alsaring_dealloc(alsaring_t *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
 
-	return result;
+	PyMem_Free(self->data);
+	PyObject_Del(self);
+	Py_DECREF(type);
 }
 
 static PyObject *
-alsapcm_list(PyObject *self, PyObject *args, PyObject *kwds)
+alsaring_write_method(alsaring_t *self, PyObject *args)
 {
-	PyObject *pcmtypeobj = NULL;
-	long pcmtype;
-	PyObject *result = NULL;
-	PyObject *item;
-	void **hints, **n;
-	char *name, *io;
-	const char *filter;
+	Py_buffer buf;
+	size_t frames;
 
-	char *kw[] = { "pcmtype", NULL };
+	if (!PyArg_ParseTuple(args,"y*:write", &buf))
+		return NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:pcms", kw, &pcmtypeobj)) {
+	if (buf.len % self->framesize) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Data size must be a multiple of framesize");
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
 
-	pcmtype = get_pcmtype(pcmtypeobj);
-	if (pcmtype < 0) {
+	if (alsaring_claim(self, ALSARING_PRODUCER) < 0) {
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
 
-	result = PyList_New(0);
+	frames = alsaring_write(self, buf.buf, buf.len / self->framesize);
+	alsaring_unclaim(self, ALSARING_PRODUCER);
+	PyBuffer_Release(&buf);
 
-	if (snd_device_name_hint(-1, "pcm", &hints) < 0)
-		return result;
+	return PyLong_FromSize_t(frames);
+}
 
-	n = hints;
-	filter = pcmtype == SND_PCM_STREAM_CAPTURE ? "Input" : "Output";
-	while (*n != NULL) {
-		name = snd_device_name_get_hint(*n, "NAME");
-		io = snd_device_name_get_hint(*n, "IOID");
-		if (io != NULL && strcmp(io, filter) != 0)
-			goto __end;
+static PyObject *
+alsaring_read_method(alsaring_t *self, PyObject *args)
+{
+	Py_ssize_t frames = -1;
+	size_t count;
+	PyObject *result;
 
-		item = PyUnicode_FromString(name);
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	if (!PyArg_ParseTuple(args,"|n:read", &frames))
+		return NULL;
 
-	__end:
-		if (name != NULL)
-			free(name);
-		if (io != NULL)
-			free(io);
-		n++;
-	}
-	snd_device_name_free_hint(hints);
+	if (alsaring_claim(self, ALSARING_CONSUMER) < 0)
+		return NULL;
+
+	count = alsaring_count(self);
+	if (frames >= 0 && (size_t)frames < count)
+		count = frames;
+
+	result = PyBytes_FromStringAndSize(NULL, count * self->framesize);
+	if (result)
+		alsaring_read(self, PyBytes_AS_STRING(result), count);
+	alsaring_unclaim(self, ALSARING_CONSUMER);
 
 	return result;
 }
 
-static int alsapcm_setup(alsapcm_t *self)
+static PyObject *
+alsaring_read_into(alsaring_t *self, PyObject *args)
 {
-	int res,dir;
-	snd_pcm_hw_params_t *hwparams;
+	Py_buffer buf;
+	size_t frames;
 
-	/* Allocate a hwparam structure on the stack,
-	   and fill it with configuration space */
-	snd_pcm_hw_params_alloca(&hwparams);
-	res = snd_pcm_hw_params_any(self->handle, hwparams);
-	if (res < 0) {
-		return res;
+	if (!PyArg_ParseTuple(args,"w*:read_into", &buf))
+		return NULL;
+
+	if (alsaring_claim(self, ALSARING_CONSUMER) < 0) {
+		PyBuffer_Release(&buf);
+		return NULL;
 	}
 
-	/* Fill it with default values.
+	frames = alsaring_read(self, buf.buf, buf.len / self->framesize);
+	alsaring_unclaim(self, ALSARING_CONSUMER);
+	PyBuffer_Release(&buf);
 
-	   We don't care if any of this fails - we'll read the actual values
-	   back out.
-	 */
-	snd_pcm_hw_params_set_access(self->handle, hwparams,
-								 SND_PCM_ACCESS_RW_INTERLEAVED);
-	snd_pcm_hw_params_set_format(self->handle, hwparams, self->format);
-	snd_pcm_hw_params_set_channels(self->handle, hwparams,
-								   self->channels);
+	return PyLong_FromSize_t(frames);
+}
 
-	dir = 0;
-	snd_pcm_hw_params_set_rate_near(self->handle, hwparams, &self->rate, &dir);
-	snd_pcm_hw_params_set_period_size_near(self->handle, hwparams,
-										   &self->periodsize, &dir);
-	snd_pcm_hw_params_set_periods_near(self->handle, hwparams, &self->periods, &dir);
+static PyObject *
+alsaring_available(alsaring_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":available"))
+		return NULL;
 
-	/* Write it to the device */
-	res = snd_pcm_hw_params(self->handle, hwparams);
+	return PyLong_FromSize_t(alsaring_count(self));
+}
 
-	/* Query current settings. These may differ from the requested values,
-	   which should therefore be sync'ed with actual values */
-	snd_pcm_hw_params_current(self->handle, hwparams);
+static PyObject *
+alsaring_space_method(alsaring_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":space"))
+		return NULL;
 
-	snd_pcm_hw_params_get_format(hwparams, &self->format);
-	snd_pcm_hw_params_get_channels(hwparams, &self->channels);
-	snd_pcm_hw_params_get_rate(hwparams, &self->rate, &dir);
-	snd_pcm_hw_params_get_period_size(hwparams, &self->periodsize, &dir);
-	snd_pcm_hw_params_get_periods(hwparams, &self->periods, &dir);
+	return PyLong_FromSize_t(alsaring_space(self));
+}
 
-	self->framesize = self->channels * snd_pcm_format_physical_width(self->format)/8;
+static PyObject *
+alsaring_capacity(alsaring_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":capacity"))
+		return NULL;
 
-	return res;
+	return PyLong_FromSize_t(self->frames);
 }
 
 static PyObject *
-alsapcm_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+alsaring_framesize(alsaring_t *self, PyObject *args)
 {
-	int res;
-	alsapcm_t *self;
-	PyObject *pcmtypeobj = NULL;
-	long pcmtype;
-	int pcmmode = 0;
-	char *device = "default";
-	char *card = NULL;
-	int cardidx = -1;
-	char hw_device[128];
-	int rate = 44100;
-	int channels = 2;
-	int format = SND_PCM_FORMAT_S16_LE;
-	int periods = 4;
-	int periodsize = 32;
+	if (!PyArg_ParseTuple(args,":framesize"))
+		return NULL;
 
-	char *kw[] = { "type", "mode", "device", "cardindex", "card",
-				   "rate", "channels", "format", "periodsize", "periods", NULL };
+	return PyLong_FromLong(self->framesize);
+}
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oisiziiiii", kw,
-									 &pcmtypeobj, &pcmmode, &device, &cardidx, &card,
-									 &rate, &channels, &format, &periodsize, &periods))
+static PyObject *
+alsaring_xruns(alsaring_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":xruns"))
 		return NULL;
 
-	if (cardidx >= 0) {
-		if (cardidx < 32) {
-			snprintf(hw_device, sizeof(hw_device), "hw:%d", cardidx);
-			device = hw_device;
-		}
-		else {
-			PyErr_Format(ALSAAudioError, "Invalid card number %d", cardidx);
-			return NULL;
-		}
-	}
-	else if (card) {
-		// The card kw argument is deprecated
-		PyErr_WarnEx(PyExc_DeprecationWarning,
-					 "The `card` keyword argument is deprecated. "
-					 "Please use `device` instead", 1);
+	return PyLong_FromUnsignedLong(atomic_load(&self->xruns));
+}
 
-		// If we find a colon, we assume it is a real ALSA cardname
-		if (strchr(card, ':')) {
-			device = card;
-		}
+/* The buffer protocol exposes the raw ring storage */
+static int
+alsaring_getbuffer(alsaring_t *self, Py_buffer *view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject *)self, self->data,
+							 self->frames * self->framesize, 0, flags);
+}
 
-		snprintf(hw_device, sizeof(hw_device), "default:CARD=%s", card);
-		device = hw_device;
-	}
+static PyMethodDef alsaring_methods[] = {
+	{"write", (PyCFunction)alsaring_write_method, METH_VARARGS},
+	{"read", (PyCFunction)alsaring_read_method, METH_VARARGS},
+	{"read_into", (PyCFunction)alsaring_read_into, METH_VARARGS},
+	{"available", (PyCFunction)alsaring_available, METH_VARARGS},
+	{"space", (PyCFunction)alsaring_space_method, METH_VARARGS},
+	{"capacity", (PyCFunction)alsaring_capacity, METH_VARARGS},
+	{"framesize", (PyCFunction)alsaring_framesize, METH_VARARGS},
+	{"xruns", (PyCFunction)alsaring_xruns, METH_VARARGS},
+	{NULL, NULL}
+};
 
-	pcmtype = get_pcmtype(pcmtypeobj);
-	if (pcmtype < 0) {
-		return NULL;
-	}
+static PyType_Slot alsaring_slots[] = {
+	{ Py_tp_dealloc, (void *)alsaring_dealloc },
+	{ Py_tp_new, (void *)alsaring_new },
+	{ Py_tp_doc, "Single-producer, single-consumer ring buffer of audio frames." },
+	{ Py_tp_methods, alsaring_methods },
+	{ Py_bf_getbuffer, (void *)alsaring_getbuffer },
+	{ 0, NULL },
+};
 
-	if (pcmmode < 0 || pcmmode > SND_PCM_ASYNC) {
-		PyErr_SetString(ALSAAudioError, "Invalid PCM mode");
-		return NULL;
-	}
+static PyType_Spec alsaring_spec = {
+	"alsaaudio.RingBuffer",
+	sizeof(alsaring_t),
+	0,
+	ALSAAUDIO_TPFLAGS,
+	alsaring_slots,
+};
 
-	if (!(self = (alsapcm_t *)PyObject_New(alsapcm_t, &ALSAPCMType)))
-		return NULL;
+/******************************************/
+/* Sample format conversion				*/
+/******************************************/
 
-	self->handle = 0;
-	self->pcmtype = pcmtype;
-	self->pcmmode = pcmmode;
-	self->channels = channels;
-	self->rate = rate;
-	self->format = format;
-	self->periods = periods;
-	self->periodsize = periodsize;
+/* Conversion between float32 samples in [-1.0, 1.0) and a PCM's sample
+   format, used by PCM.write_float() and PCM.read_float().
 
-	res = snd_pcm_open(&(self->handle), device, self->pcmtype,
-					   self->pcmmode);
+   Integer samples are scaled by 2^(width - 1) and clipped, and NaN becomes
+   0. The optional TPDF dither adds the difference of two uniform random
+   values of one LSB each before rounding. It uses one xorshift32 generator
+   per SIMD lane, and is skipped for 32 bit formats, whose LSB is below the
+   precision of a float. */
 
-	if (res >= 0) {
-		res = alsapcm_setup(self);
-	}
+/* A uniform random float in [0, 1) */
+static inline float
+alsaconv_uniform(uint32_t *state)
+{
+	union { uint32_t i; float f; } u;
+	uint32_t x = *state;
 
-	if (res >= 0) {
-		self->cardname = strdup(device);
-	}
-	else {
-		if (self->handle)
-		{
-			snd_pcm_close(self->handle);
-			self->handle = 0;
-		}
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res), device);
-		return NULL;
-	}
-	return (PyObject *)self;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	u.i = (x >> 9) | 0x3f800000;
+	return u.f - 1.0f;
 }
 
-static void alsapcm_dealloc(alsapcm_t *self)
+static void
+alsaconv_seed(uint32_t *dither)
 {
-	if (self->handle)
-		snd_pcm_close(self->handle);
-	free(self->cardname);
-	PyObject_Del(self);
+	int i;
+
+	for (i = 0; i < ALSACONV_LANES; i++)
+		dither[i] = 0x9e3779b9u * (i + 1);
 }
 
-static PyObject *
-alsapcm_close(alsapcm_t *self, PyObject *args)
+/* Whether float32 samples can be converted to and from this format */
+static bool
+alsaconv_supported(snd_pcm_format_t format)
 {
-	if (!PyArg_ParseTuple(args,":close"))
-		return NULL;
+	if (format == SND_PCM_FORMAT_FLOAT || format == SND_PCM_FORMAT_FLOAT64)
+		return true;
 
-	if (self->handle)
-	{
-		if (self->pcmtype == SND_PCM_STREAM_PLAYBACK) {
-			Py_BEGIN_ALLOW_THREADS
-			snd_pcm_drain(self->handle);
-			Py_END_ALLOW_THREADS
-		}
-		snd_pcm_close(self->handle);
+	return snd_pcm_format_linear(format) == 1 &&
+		snd_pcm_format_float(format) == 0 &&
+		snd_pcm_format_width(format) <= 32;
+}
 
-		self->handle = 0;
-	}
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	defined(__SSE2__)
+#define ALSACONV_X86 1
+#include <immintrin.h>
 
-	Py_INCREF(Py_None);
-	return Py_None;
+/* Dithered samples for four lanes, in LSBs */
+static inline __m128
+alsaconv_tpdf_sse2(__m128i *state)
+{
+	__m128i a, b;
+	const __m128i one = _mm_set1_epi32(0x3f800000);
+
+	a = *state;
+	a = _mm_xor_si128(a, _mm_slli_epi32(a, 13));
+	a = _mm_xor_si128(a, _mm_srli_epi32(a, 17));
+	a = _mm_xor_si128(a, _mm_slli_epi32(a, 5));
+	b = a;
+	b = _mm_xor_si128(b, _mm_slli_epi32(b, 13));
+	b = _mm_xor_si128(b, _mm_srli_epi32(b, 17));
+	b = _mm_xor_si128(b, _mm_slli_epi32(b, 5));
+	*state = b;
+
+	a = _mm_or_si128(_mm_srli_epi32(a, 9), one);
+	b = _mm_or_si128(_mm_srli_epi32(b, 9), one);
+	return _mm_sub_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b));
 }
 
-static PyObject *
-alsapcm_dumpinfo(alsapcm_t *self, PyObject *args)
+/* Convert four samples to int32 after scaling, dithering and clipping */
+static inline __m128i
+alsaconv_quantize_sse2(__m128 x, __m128 scale, __m128 lo, __m128 hi,
+					   __m128i *state)
 {
-	unsigned int val,val2;
-	snd_pcm_access_t acc;
-	snd_pcm_format_t fmt;
-	snd_pcm_subformat_t subfmt;
-	int dir;
-	snd_pcm_uframes_t frames;
-	snd_pcm_hw_params_t *hwparams;
-	snd_pcm_hw_params_alloca(&hwparams);
-	snd_pcm_hw_params_current(self->handle,hwparams);
+	// NaN becomes silence
+	x = _mm_and_ps(_mm_mul_ps(x, scale), _mm_cmpord_ps(x, x));
+	if (state)
+		x = _mm_add_ps(x, alsaconv_tpdf_sse2(state));
+	x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+	return _mm_cvtps_epi32(x);
+}
 
-	if (!PyArg_ParseTuple(args,":dumpinfo"))
-		return NULL;
+/* Returns the number of samples converted */
+static size_t
+alsaconv_from_float_sse2(snd_pcm_format_t format, const float *src,
+						 char *dst, size_t n, uint32_t *dither)
+{
+	__m128i state, *pstate = NULL;
+	size_t i = 0;
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	if (dither) {
+		state = _mm_loadu_si128((const __m128i *)dither);
+		pstate = &state;
 	}
 
-	printf("PCM handle name = '%s'\n", snd_pcm_name(self->handle));
-	printf("PCM state = %s\n",
-		   snd_pcm_state_name(snd_pcm_state(self->handle)));
-
-	snd_pcm_hw_params_get_access(hwparams, &acc);
-	printf("access type = %s\n", snd_pcm_access_name(acc));
-
-	snd_pcm_hw_params_get_format(hwparams, &fmt);
-	printf("format = '%s' (%s)\n",
-		   snd_pcm_format_name(fmt),
-		   snd_pcm_format_description(fmt));
-
-	snd_pcm_hw_params_get_subformat(hwparams, &subfmt);
-	printf("subformat = '%s' (%s)\n",
-		   snd_pcm_subformat_name(subfmt),
-		   snd_pcm_subformat_description(subfmt));
+	if (format == SND_PCM_FORMAT_S16_LE) {
+		const __m128 scale = _mm_set1_ps(32768.0f);
+		const __m128 lo = _mm_set1_ps(-32768.0f);
+		const __m128 hi = _mm_set1_ps(32767.0f);
 
-	snd_pcm_hw_params_get_channels(hwparams, &val);
-	printf("channels = %d\n", val);
+		for (; i + 8 <= n; i += 8) {
+			__m128i a = alsaconv_quantize_sse2(_mm_loadu_ps(src + i),
+											   scale, lo, hi, pstate);
+			__m128i b = alsaconv_quantize_sse2(_mm_loadu_ps(src + i + 4),
+											   scale, lo, hi, pstate);
+			_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packs_epi32(a, b));
+		}
+	}
+	else if (format == SND_PCM_FORMAT_S32_LE) {
+		const __m128 scale = _mm_set1_ps(2147483648.0f);
+		const __m128 lo = _mm_set1_ps(-2147483648.0f);
+		// The largest float below 2^31
+		const __m128 hi = _mm_set1_ps(2147483520.0f);
 
-	snd_pcm_hw_params_get_rate(hwparams, &val, &dir);
-	printf("rate = %d bps\n", val);
+		for (; i + 4 <= n; i += 4) {
+			__m128i a = alsaconv_quantize_sse2(_mm_loadu_ps(src + i),
+											   scale, lo, hi, pstate);
+			_mm_storeu_si128((__m128i *)(dst + 4 * i), a);
+		}
+	}
 
-	snd_pcm_hw_params_get_period_time(hwparams, &val, &dir);
-	printf("period time = %d us\n", val);
+	if (dither)
+		_mm_storeu_si128((__m128i *)dither, state);
 
-	snd_pcm_hw_params_get_period_size(hwparams, &frames, &dir);
-	printf("period size = %d frames\n", (int)frames);
+	return i;
+}
 
-	snd_pcm_hw_params_get_buffer_time(hwparams, &val, &dir);
-	printf("buffer time = %d us\n", val);
+static size_t
+alsaconv_to_float_sse2(snd_pcm_format_t format, const char *src,
+					   float *dst, size_t n)
+{
+	size_t i = 0;
 
-	snd_pcm_hw_params_get_buffer_size(hwparams, &frames);
-	printf("buffer size = %d frames\n", (int)frames);
+	if (format == SND_PCM_FORMAT_S16_LE) {
+		const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
 
-	snd_pcm_hw_params_get_periods(hwparams, &val, &dir);
-	printf("periods per buffer = %d\n", val);
+		for (; i + 8 <= n; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+			__m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+			__m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+			_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+		}
+	}
+	else if (format == SND_PCM_FORMAT_S32_LE) {
+		const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
 
-	snd_pcm_hw_params_get_rate_numden(hwparams, &val, &val2);
-	printf("exact rate = %d/%d bps\n", val, val2);
+		for (; i + 4 <= n; i += 4) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+		}
+	}
 
-	val = snd_pcm_hw_params_get_sbits(hwparams);
-	printf("significant bits = %d\n", val);
+	return i;
+}
 
-	val = snd_pcm_format_width(self->format);
-	printf("nominal bits = %d\n", val);
+__attribute__((target("avx2"))) static inline __m256
+alsaconv_tpdf_avx2(__m256i *state)
+{
+	__m256i a, b;
+	const __m256i one = _mm256_set1_epi32(0x3f800000);
+
+	a = *state;
+	a = _mm256_xor_si256(a, _mm256_slli_epi32(a, 13));
+	a = _mm256_xor_si256(a, _mm256_srli_epi32(a, 17));
+	a = _mm256_xor_si256(a, _mm256_slli_epi32(a, 5));
+	b = a;
+	b = _mm256_xor_si256(b, _mm256_slli_epi32(b, 13));
+	b = _mm256_xor_si256(b, _mm256_srli_epi32(b, 17));
+	b = _mm256_xor_si256(b, _mm256_slli_epi32(b, 5));
+	*state = b;
+
+	a = _mm256_or_si256(_mm256_srli_epi32(a, 9), one);
+	b = _mm256_or_si256(_mm256_srli_epi32(b, 9), one);
+	return _mm256_sub_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b));
+}
 
-	val = snd_pcm_format_physical_width(self->format);
-	printf("physical bits = %d\n", val);
+__attribute__((target("avx2"))) static inline __m256i
+alsaconv_quantize_avx2(__m256 x, __m256 scale, __m256 lo, __m256 hi,
+					   __m256i *state)
+{
+	// NaN becomes silence
+	x = _mm256_and_ps(_mm256_mul_ps(x, scale),
+					  _mm256_cmp_ps(x, x, _CMP_ORD_Q));
+	if (state)
+		x = _mm256_add_ps(x, alsaconv_tpdf_avx2(state));
+	x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+	return _mm256_cvtps_epi32(x);
+}
 
-	val = snd_pcm_hw_params_is_batch(hwparams);
-	printf("is batch = %d\n", val);
+__attribute__((target("avx2"))) static size_t
+alsaconv_from_float_avx2(snd_pcm_format_t format, const float *src,
+						 char *dst, size_t n, uint32_t *dither)
+{
+	__m256i state, *pstate = NULL;
+	size_t i = 0;
+
+	if (dither) {
+		state = _mm256_loadu_si256((const __m256i *)dither);
+		pstate = &state;
+	}
+
+	if (format == SND_PCM_FORMAT_S16_LE) {
+		const __m256 scale = _mm256_set1_ps(32768.0f);
+		const __m256 lo = _mm256_set1_ps(-32768.0f);
+		const __m256 hi = _mm256_set1_ps(32767.0f);
+
+		for (; i + 16 <= n; i += 16) {
+			__m256i a = alsaconv_quantize_avx2(_mm256_loadu_ps(src + i),
+											   scale, lo, hi, pstate);
+			__m256i b = alsaconv_quantize_avx2(_mm256_loadu_ps(src + i + 8),
+											   scale, lo, hi, pstate);
+			// packs works within 128 bit lanes, so restore the order
+			__m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+												 0xd8);
+			_mm256_storeu_si256((__m256i *)(dst + 2 * i), p);
+		}
+	}
+	else if (format == SND_PCM_FORMAT_S32_LE) {
+		const __m256 scale = _mm256_set1_ps(2147483648.0f);
+		const __m256 lo = _mm256_set1_ps(-2147483648.0f);
+		const __m256 hi = _mm256_set1_ps(2147483520.0f);
 
-	val = snd_pcm_hw_params_is_block_transfer(hwparams);
-	printf("is block transfer = %d\n", val);
+		for (; i + 8 <= n; i += 8) {
+			__m256i a = alsaconv_quantize_avx2(_mm256_loadu_ps(src + i),
+											   scale, lo, hi, pstate);
+			_mm256_storeu_si256((__m256i *)(dst + 4 * i), a);
+		}
+	}
 
-	val = snd_pcm_hw_params_is_double(hwparams);
-	printf("is double = %d\n", val);
+	if (dither)
+		_mm256_storeu_si256((__m256i *)dither, state);
 
-	val = snd_pcm_hw_params_is_half_duplex(hwparams);
-	printf("is half duplex = %d\n", val);
+	return i;
+}
 
-	val = snd_pcm_hw_params_is_joint_duplex(hwparams);
-	printf("is joint duplex = %d\n", val);
+__attribute__((target("avx2"))) static size_t
+alsaconv_to_float_avx2(snd_pcm_format_t format, const char *src,
+					   float *dst, size_t n)
+{
+	size_t i = 0;
 
-	val = snd_pcm_hw_params_can_overrange(hwparams);
-	printf("can overrange = %d\n", val);
+	if (format == SND_PCM_FORMAT_S16_LE) {
+		const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
 
-	val = snd_pcm_hw_params_can_mmap_sample_resolution(hwparams);
-	printf("can mmap = %d\n", val);
+		for (; i + 8 <= n; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+			__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x));
+			_mm256_storeu_ps(dst + i, _mm256_mul_ps(f, scale));
+		}
+	}
+	else if (format == SND_PCM_FORMAT_S32_LE) {
+		const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
 
-	val = snd_pcm_hw_params_can_pause(hwparams);
-	printf("can pause = %d\n", val);
+		for (; i + 8 <= n; i += 8) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+			_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x),
+													scale));
+		}
+	}
 
-	val = snd_pcm_hw_params_can_resume(hwparams);
-	printf("can resume = %d\n", val);
+	return i;
+}
 
-	val = snd_pcm_hw_params_can_sync_start(hwparams);
-	printf("can sync start = %d\n", val);
+/* Called from the I/O thread and from threads without the GIL, so the cache
+   is atomic. Threads that race to fill it store the same value. libgcc has
+   run __builtin_cpu_init() by the time the module is loaded. */
+static bool
+alsaconv_have_avx2(void)
+{
+	static atomic_int have = -1;
+	int h = atomic_load_explicit(&have, memory_order_relaxed);
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	if (h < 0) {
+		h = __builtin_cpu_supports("avx2") ? 1 : 0;
+		atomic_store_explicit(&have, h, memory_order_relaxed);
+	}
+	return h;
 }
+#endif
 
-static PyObject *
-alsapcm_info(alsapcm_t *self, PyObject *args)
+/* Convert `n` float32 samples to `format`. `dither` is NULL, or the state
+   of the dither generators. */
+static void
+alsaconv_from_float(snd_pcm_format_t format, const float *src, char *dst,
+					size_t n, uint32_t *dither)
 {
-	PyObject *info;
-	PyObject *value;
+	size_t i = 0;
+	int width, bytes, k;
+	bool is_signed, little;
+	double scale, lo, hi;
 
-	unsigned int val,val2;
-	snd_pcm_access_t acc;
-	snd_pcm_format_t fmt;
-	snd_pcm_subformat_t subfmt;
-	int dir;
-	snd_pcm_uframes_t frames;
-	snd_pcm_hw_params_t *hwparams;
-	snd_pcm_hw_params_alloca(&hwparams);
-	snd_pcm_hw_params_current(self->handle,hwparams);
-
-	snd_pcm_info_t * pcm_info;
-	snd_pcm_info_alloca(&pcm_info);
+	if (format == SND_PCM_FORMAT_FLOAT) {
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+	if (format == SND_PCM_FORMAT_FLOAT64) {
+		for (i = 0; i < n; i++)
+			((double *)dst)[i] = src[i];
+		return;
+	}
 
-	if (!PyArg_ParseTuple(args,":info"))
-		return NULL;
+	// A float has 24 bits of precision, so dither below that is lost
+	if (snd_pcm_format_width(format) > 24)
+		dither = NULL;
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+#ifdef ALSACONV_X86
+	if (format == SND_PCM_FORMAT_S16_LE || format == SND_PCM_FORMAT_S32_LE) {
+		if (alsaconv_have_avx2())
+			i = alsaconv_from_float_avx2(format, src, dst, n, dither);
+		else
+			i = alsaconv_from_float_sse2(format, src, dst, n, dither);
 	}
+#endif
 
-	info = PyDict_New();
+	if (i == n)
+		return;
 
-	value=PyUnicode_FromString(snd_pcm_name(self->handle));
-	PyDict_SetItemString(info,"name",value);
-	Py_DECREF(value);
+	width = snd_pcm_format_width(format);
+	bytes = snd_pcm_format_physical_width(format) / 8;
+	is_signed = snd_pcm_format_signed(format) == 1;
+	little = snd_pcm_format_little_endian(format) == 1;
+	scale = (double)(1ULL << (width - 1));
+	lo = -scale;
+	hi = scale - 1.0;
+
+	for (; i < n; i++) {
+		double x = src[i] * scale;
+		uint64_t u;
+		char *p = dst + i * bytes;
+
+		if (isnan(x))
+			x = 0.0;
+		if (dither)
+			x += alsaconv_uniform(dither) - alsaconv_uniform(dither);
+		if (x < lo)
+			x = lo;
+		else if (x > hi)
+			x = hi;
+
+		// Two's complement, which also sign extends into the container
+		u = (uint64_t)(int64_t)lrint(x);
+		if (!is_signed)
+			u = (u + (1ULL << (width - 1))) & ((1ULL << width) - 1);
+
+		for (k = 0; k < bytes; k++)
+			p[little ? k : bytes - 1 - k] = (char)(u >> (8 * k));
+	}
+}
 
-	snd_pcm_info(self->handle, pcm_info);
+/* Convert `n` samples in `format` to float32 */
+static void
+alsaconv_to_float(snd_pcm_format_t format, const char *src, float *dst,
+				  size_t n)
+{
+	size_t i = 0;
+	int width, bytes, k;
+	bool is_signed, little;
+	double scale;
 
-	value = PyLong_FromLong((long) snd_pcm_info_get_card(pcm_info));
-	PyDict_SetItemString(info,"card_no",value);
-	Py_DECREF(value);
+	if (format == SND_PCM_FORMAT_FLOAT) {
+		memcpy(dst, src, n * sizeof(float));
+		return;
+	}
+	if (format == SND_PCM_FORMAT_FLOAT64) {
+		for (i = 0; i < n; i++)
+			dst[i] = (float)((const double *)src)[i];
+		return;
+	}
 
-	value = PyLong_FromUnsignedLong((unsigned long) snd_pcm_info_get_device(pcm_info));
-	PyDict_SetItemString(info,"device_no",value);
-	Py_DECREF(value);
+#ifdef ALSACONV_X86
+	if (format == SND_PCM_FORMAT_S16_LE || format == SND_PCM_FORMAT_S32_LE) {
+		if (alsaconv_have_avx2())
+			i = alsaconv_to_float_avx2(format, src, dst, n);
+		else
+			i = alsaconv_to_float_sse2(format, src, dst, n);
+	}
+#endif
 
-	value = PyLong_FromUnsignedLong((unsigned long) snd_pcm_info_get_subdevice(pcm_info));
-	PyDict_SetItemString(info,"subdevice_no",value);
-	Py_DECREF(value);
+	if (i == n)
+		return;
 
-	value=PyUnicode_FromString(snd_pcm_state_name(snd_pcm_state(self->handle)));
-	PyDict_SetItemString(info,"state",value);
-	Py_DECREF(value);
+	width = snd_pcm_format_width(format);
+	bytes = snd_pcm_format_physical_width(format) / 8;
+	is_signed = snd_pcm_format_signed(format) == 1;
+	little = snd_pcm_format_little_endian(format) == 1;
+	scale = 1.0 / (double)(1ULL << (width - 1));
 
-	snd_pcm_hw_params_get_access(hwparams, &acc);
-	value=PyUnicode_FromString(snd_pcm_access_name(acc));
-	PyDict_SetItemString(info,"access_type",value);
-	Py_DECREF(value);
+	for (; i < n; i++) {
+		const unsigned char *p = (const unsigned char *)src + i * bytes;
+		uint64_t u = 0;
+		int64_t v;
 
-	value = PyLong_FromUnsignedLong((unsigned long) self->pcmtype);
-	PyDict_SetItemString(info," (call value) type",value);
-	Py_DECREF(value);
-	value=PyUnicode_FromString(snd_pcm_stream_name((snd_pcm_stream_t) self->pcmtype));
-	PyDict_SetItemString(info," (call value) type_name",value);
-	Py_DECREF(value);
+		for (k = 0; k < bytes; k++)
+			u |= (uint64_t)p[little ? k : bytes - 1 - k] << (8 * k);
 
-	value = PyLong_FromUnsignedLong((unsigned long) self->pcmmode);
-	PyDict_SetItemString(info," (call value) mode",value);
-	Py_DECREF(value);
-	switch(self->pcmmode){
-		case 0:
-			value = PyUnicode_FromString("PCM_NORMAL");
-			break;
-		case SND_PCM_NONBLOCK:
-			value = PyUnicode_FromString("PCM_NONBLOCK");
-			break;
-		case SND_PCM_ASYNC:
-			value = PyUnicode_FromString("PCM_ASYNC");
-			break;
+		u &= (1ULL << width) - 1;
+		if (is_signed)
+			// Sign extend from the sample width
+			v = (int64_t)(u << (64 - width)) >> (64 - width);
+		else
+			v = (int64_t)u - (int64_t)(1ULL << (width - 1));
+
+		dst[i] = (float)(v * scale);
 	}
-	PyDict_SetItemString(info," (call value) mode_name",value);
-	Py_DECREF(value);
+}
 
-	snd_pcm_hw_params_get_format(hwparams, &fmt);
-	value=PyLong_FromUnsignedLong((unsigned long)fmt);
-	PyDict_SetItemString(info,"format",value);
-	Py_DECREF(value);
-	value=PyUnicode_FromString(snd_pcm_format_name(fmt));
-	PyDict_SetItemString(info,"format_name",value);
-	Py_DECREF(value);
-	value=PyUnicode_FromString(snd_pcm_format_description(fmt));
-	PyDict_SetItemString(info,"format_description",value);
-	Py_DECREF(value);
+/* Whether samples in `format` have more precision than a float holds */
+static bool
+alsaconv_wide(snd_pcm_format_t format)
+{
+	return format != SND_PCM_FORMAT_FLOAT && snd_pcm_format_width(format) > 24;
+}
 
+/* Scale `n` samples in `format` by `gain` in place, clipping integer
+   samples. This works in double precision, for the formats that a round
+   trip through float32 would truncate, see alsaconv_wide(). */
+static void
+alsaconv_scale(snd_pcm_format_t format, char *data, size_t n, double gain)
+{
+	size_t i;
+	int width, bytes, k;
+	bool is_signed, little;
+	double lo, hi;
+
+	if (format == SND_PCM_FORMAT_FLOAT64) {
+		for (i = 0; i < n; i++)
+			((double *)data)[i] *= gain;
+		return;
+	}
 
-	snd_pcm_hw_params_get_subformat(hwparams, &subfmt);
-	value=PyUnicode_FromString(snd_pcm_subformat_name(subfmt));
-	PyDict_SetItemString(info,"subformat_name",value);
-	Py_DECREF(value);
-	value=PyUnicode_FromString(snd_pcm_subformat_description(subfmt));
-	PyDict_SetItemString(info,"subformat_description",value);
-	Py_DECREF(value);
+	width = snd_pcm_format_width(format);
+	bytes = snd_pcm_format_physical_width(format) / 8;
+	is_signed = snd_pcm_format_signed(format) == 1;
+	little = snd_pcm_format_little_endian(format) == 1;
+	lo = -(double)(1ULL << (width - 1));
+	hi = -lo - 1.0;
 
-	snd_pcm_hw_params_get_channels(hwparams, &val);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"channels", value);
-	Py_DECREF(value);
+	for (i = 0; i < n; i++) {
+		unsigned char *p = (unsigned char *)data + i * bytes;
+		uint64_t u = 0;
+		double x;
 
-	snd_pcm_hw_params_get_rate(hwparams, &val, &dir);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"rate", value);
-	Py_DECREF(value);
+		for (k = 0; k < bytes; k++)
+			u |= (uint64_t)p[little ? k : bytes - 1 - k] << (8 * k);
 
-	snd_pcm_hw_params_get_period_time(hwparams, &val, &dir);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"period_time", value);
-	Py_DECREF(value);
+		u &= (1ULL << width) - 1;
+		if (is_signed)
+			x = (double)((int64_t)(u << (64 - width)) >> (64 - width));
+		else
+			x = (double)((int64_t)u - (int64_t)(1ULL << (width - 1)));
 
-	snd_pcm_hw_params_get_period_size(hwparams, &frames, &dir);
-	value=PyLong_FromUnsignedLong((unsigned long) frames);
-	PyDict_SetItemString(info,"period_size", value);
-	Py_DECREF(value);
+		x *= gain;
+		if (x < lo)
+			x = lo;
+		else if (x > hi)
+			x = hi;
 
-	snd_pcm_hw_params_get_buffer_time(hwparams, &val, &dir);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"buffer_time", value);
-	Py_DECREF(value);
+		u = (uint64_t)(int64_t)lrint(x);
+		if (!is_signed)
+			u = (u + (1ULL << (width - 1))) & ((1ULL << width) - 1);
 
-	snd_pcm_hw_params_get_buffer_size(hwparams, &frames);
-	value=PyLong_FromUnsignedLong((unsigned long) frames);
-	PyDict_SetItemString(info,"buffer_size", value);
-	Py_DECREF(value);
+		for (k = 0; k < bytes; k++)
+			p[little ? k : bytes - 1 - k] = (unsigned char)(u >> (8 * k));
+	}
+}
 
-	snd_pcm_hw_params_get_periods(hwparams, &val, &dir);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"periods", value);
-	Py_DECREF(value);
+#ifdef ALSACONV_X86
+/* Largest matrix, in floats after padding, that alsaconv_mix_sse2() takes */
+#define ALSACONV_MIX_MAX 256
+
+/* The bulk of alsaconv_mix(). Each output vector is the sum of the matrix'
+   columns, scaled by the input samples. Mono and stereo outputs pack two or
+   four frames into a vector, wider outputs are padded to a multiple of four
+   channels; the padding spills into the next frame, so the last frame is
+   left to the caller. Returns the number of frames done. */
+static size_t
+alsaconv_mix_sse2(const float *matrix, unsigned int in, unsigned int out,
+				  const float *restrict src, float *restrict dst, size_t frames)
+{
+	float cols[ALSACONV_MIX_MAX];
+	unsigned int padded = (out + 3) & ~3u, i, o;
+	size_t f = 0;
 
-	snd_pcm_hw_params_get_rate_numden(hwparams, &val, &val2);
-	value=PyTuple_Pack(2,PyLong_FromUnsignedLong((unsigned long) val) \
-				,PyLong_FromUnsignedLong((unsigned long) val2));
-	PyDict_SetItemString(info,"rate_numden", value);
-	Py_DECREF(value);
+	if ((size_t)in * padded > ALSACONV_MIX_MAX)
+		return 0;
 
-	val = snd_pcm_hw_params_get_sbits(hwparams);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"significant_bits", value);
-	Py_DECREF(value);
+	if (out <= 2) {
+		unsigned int k = 4 / out;
 
-	val = snd_pcm_format_width(self->format);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"nominal_bits", value);
-	Py_DECREF(value);
+		for (i = 0; i < in; i++)
+			for (o = 0; o < 4; o++)
+				cols[i * 4 + o] = matrix[(o % out) * in + i];
 
-	val = snd_pcm_format_physical_width(self->format);
-	value=PyLong_FromUnsignedLong((unsigned long) val);
-	PyDict_SetItemString(info,"physical_bits", value);
-	Py_DECREF(value);
+		for (; f + k <= frames; f += k, src += k * in, dst += 4) {
+			__m128 acc = _mm_setzero_ps();
 
-	val = snd_pcm_hw_params_is_batch(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"is_batch", value);
-	Py_DECREF(value);
+			if (in <= 2) {
+				// Spread the samples of each input channel over the lanes
+				__m128 x[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
 
-	val = snd_pcm_hw_params_is_block_transfer(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"is_block_transfer", value);
-	Py_DECREF(value);
+				if (k == 2 && in == 1)
+					x[0] = _mm_castpd_ps(_mm_load_sd((const double *)src));
+				else
+					x[0] = _mm_loadu_ps(src);
+				if (k == 4 && in == 2) {
+					__m128 v = _mm_loadu_ps(src + 4);
 
-	val = snd_pcm_hw_params_is_double(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"is_double", value);
-	Py_DECREF(value);
+					x[1] = _mm_shuffle_ps(x[0], v, _MM_SHUFFLE(3, 1, 3, 1));
+					x[0] = _mm_shuffle_ps(x[0], v, _MM_SHUFFLE(2, 0, 2, 0));
+				}
+				else if (k == 2 && in == 2) {
+					x[1] = _mm_shuffle_ps(x[0], x[0], _MM_SHUFFLE(3, 3, 1, 1));
+					x[0] = _mm_shuffle_ps(x[0], x[0], _MM_SHUFFLE(2, 2, 0, 0));
+				}
+				else if (k == 2)
+					x[0] = _mm_unpacklo_ps(x[0], x[0]);
 
-	val = snd_pcm_hw_params_is_half_duplex(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"is_half_duplex", value);
-	Py_DECREF(value);
+				for (i = 0; i < in; i++)
+					acc = _mm_add_ps(acc, _mm_mul_ps(x[i],
+													 _mm_loadu_ps(cols + i * 4)));
+			}
+			else {
+				for (i = 0; i < in; i++) {
+					__m128 x = k == 2 ?
+						_mm_set_ps(src[in + i], src[in + i], src[i], src[i]) :
+						_mm_set_ps(src[3 * in + i], src[2 * in + i],
+								   src[in + i], src[i]);
+					acc = _mm_add_ps(acc, _mm_mul_ps(x,
+													 _mm_loadu_ps(cols + i * 4)));
+				}
+			}
+			_mm_storeu_ps(dst, acc);
+		}
+		return f;
+	}
 
-	val = snd_pcm_hw_params_is_joint_duplex(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"is_joint_duplex", value);
-	Py_DECREF(value);
+	for (i = 0; i < in; i++)
+		for (o = 0; o < padded; o++)
+			cols[i * padded + o] = o < out ? matrix[o * in + i] : 0.0f;
 
-	val = snd_pcm_hw_params_can_overrange(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"can_overrange", value);
-	Py_DECREF(value);
+	for (; f + 1 < frames; f++, src += in, dst += out) {
+		for (o = 0; o < padded; o += 4) {
+			__m128 acc = _mm_setzero_ps();
 
-	val = snd_pcm_hw_params_can_mmap_sample_resolution(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"can_mmap_sample_resolution", value);
-	Py_DECREF(value);
+			for (i = 0; i < in; i++)
+				acc = _mm_add_ps(acc,
+								 _mm_mul_ps(_mm_set1_ps(src[i]),
+											_mm_loadu_ps(cols + i * padded + o)));
+			_mm_storeu_ps(dst + o, acc);
+		}
+	}
+	return f;
+}
+#endif
 
-	val = snd_pcm_hw_params_can_pause(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"can_pause", value);
-	Py_DECREF(value);
+/* Multiply each of `frames` frames of `in` channels with the `out` x `in`
+   gain matrix, producing frames of `out` channels */
+static void
+alsaconv_mix(const float *matrix, unsigned int in, unsigned int out,
+			 const float *restrict src, float *restrict dst, size_t frames)
+{
+	size_t f = 0;
+	unsigned int i, o;
 
-	val = snd_pcm_hw_params_can_resume(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"can_resume", value);
-	Py_DECREF(value);
+#ifdef ALSACONV_X86
+	f = alsaconv_mix_sse2(matrix, in, out, src, dst, frames);
+	src += f * in;
+	dst += f * out;
+#endif
 
-	val = snd_pcm_hw_params_can_sync_start(hwparams);
-	value=PyBool_FromLong((unsigned long) val);
-	PyDict_SetItemString(info,"can_sync_start", value);
-	Py_DECREF(value);
+	for (; f < frames; f++, src += in, dst += out) {
+		const float *row = matrix;
 
-	return info;
+		for (o = 0; o < out; o++, row += in) {
+			float acc = 0.0f;
+
+			for (i = 0; i < in; i++)
+				acc += row[i] * src[i];
+			dst[o] = acc;
+		}
+	}
 }
 
-static PyObject *
-alsa_asoundlib_version(PyObject * module, PyObject *args)
+/******************************************/
+/* Metering								*/
+/******************************************/
+
+/* Per-channel peak and RMS levels since the last PCM.meters() call, and EBU
+   R128 momentary loudness: the K-weighted mean square over a 400 ms window,
+   advanced in 100 ms blocks. */
+
+#define ALSAMETER_BLOCKS 4
+/* Frames converted to float32 at a time */
+#define ALSAMETER_CHUNK 256
+
+typedef struct {
+	float peak;
+	double sumsq;
+	/* State of the two K-weighting biquads */
+	double z[4];
+	/* K-weighted sums of squares of the current and the last blocks */
+	double block;
+	double blocks[ALSAMETER_BLOCKS];
+} alsameter_channel_t;
+
+struct alsameter {
+	/* The layout the meters were set up for. Frames in any other layout
+	   are ignored, so a stale meter can't read past a buffer. */
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned long frames;
+
+	/* K-weighting filter coefficients, as per ITU-R BS.1770 */
+	double b[2][3], a[2][3];
+
+	snd_pcm_uframes_t block_size;
+	snd_pcm_uframes_t block_frames;
+	unsigned int block_index;
+	unsigned int blocks_filled;
+
+	float *tmp;
+	alsameter_channel_t ch[];
+};
+
+static alsameter_t *
+alsameter_new(snd_pcm_format_t format, unsigned int channels,
+			  unsigned int rate)
 {
-	if (!PyArg_ParseTuple(args,":asoundlib_version"))
+	alsameter_t *m;
+	double f0, g, q, k, vh, vb, a0;
+
+	m = PyMem_Malloc(sizeof(alsameter_t) +
+					 channels * sizeof(alsameter_channel_t));
+	if (!m)
 		return NULL;
 
-	return PyUnicode_FromString(snd_asoundlib_version());
+	memset(m, 0, sizeof(alsameter_t) + channels * sizeof(alsameter_channel_t));
+	m->tmp = PyMem_New(float, ALSAMETER_CHUNK * channels);
+	if (!m->tmp) {
+		PyMem_Free(m);
+		return NULL;
+	}
+
+	m->format = format;
+	m->channels = channels;
+	m->block_size = rate / 10 ? rate / 10 : 1;
+
+	// High shelf, modelling the acoustic effect of the head
+	f0 = 1681.974450955533;
+	g = 3.999843853973347;
+	q = 0.7071752369554196;
+	k = tan(M_PI * f0 / rate);
+	vh = pow(10.0, g / 20.0);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1.0 + k / q + k * k;
+	m->b[0][0] = (vh + vb * k / q + k * k) / a0;
+	m->b[0][1] = 2.0 * (k * k - vh) / a0;
+	m->b[0][2] = (vh - vb * k / q + k * k) / a0;
+	m->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+	m->a[0][2] = (1.0 - k / q + k * k) / a0;
+
+	// High pass (the RLB weighting curve)
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+	m->b[1][0] = 1.0;
+	m->b[1][1] = -2.0;
+	m->b[1][2] = 1.0;
+	m->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+	m->a[1][2] = (1.0 - k / q + k * k) / a0;
+
+	return m;
 }
 
-static PyObject *
-alsapcm_state(alsapcm_t *self, PyObject *args)
+static void
+alsameter_free(alsameter_t *m)
 {
-	if (!PyArg_ParseTuple(args,":state"))
-		return NULL;
-
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	if (m) {
+		PyMem_Free(m->tmp);
+		PyMem_Free(m);
 	}
-
-	return PyLong_FromUnsignedLong((unsigned long) snd_pcm_state(self->handle));
 }
 
-static PyObject *
-alsapcm_htimestamp(alsapcm_t *self, PyObject *args)
+/* Accumulate `frames` float32 frames that don't cross a block boundary.
+   Sample c of frame f is at x[f * fstride + c * cstride], which covers
+   both interleaved and planar samples. Each channel is done in one go, with
+   its filter state in registers. */
+static void
+alsameter_accumulate(alsameter_t *m, const float *x, size_t fstride,
+					 size_t cstride, snd_pcm_uframes_t frames)
 {
-	snd_htimestamp_t tstamp;
-	snd_pcm_uframes_t avail;
-	PyObject *result = NULL;
+	unsigned int c;
+
+	for (c = 0; c < m->channels; c++) {
+		alsameter_channel_t *ch = &m->ch[c];
+		const float *p = x + c * cstride;
+		double z0 = ch->z[0], z1 = ch->z[1], z2 = ch->z[2], z3 = ch->z[3];
+		double sumsq = 0.0, block = 0.0;
+		float peak = ch->peak;
+		snd_pcm_uframes_t f;
+
+		for (f = 0; f < frames; f++, p += fstride) {
+			float mag = fabsf(*p);
+			double y, v;
+
+			if (mag > peak)
+				peak = mag;
+			sumsq += (double)*p * *p;
+
+			// Two biquads, in transposed direct form II
+			y = m->b[0][0] * *p + z0;
+			z0 = m->b[0][1] * *p - m->a[0][1] * y + z1;
+			z1 = m->b[0][2] * *p - m->a[0][2] * y;
+			v = y;
+			y = m->b[1][0] * v + z2;
+			z2 = m->b[1][1] * v - m->a[1][1] * y + z3;
+			z3 = m->b[1][2] * v - m->a[1][2] * y;
+
+			block += y * y;
+		}
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+		ch->z[0] = z0;
+		ch->z[1] = z1;
+		ch->z[2] = z2;
+		ch->z[3] = z3;
+		ch->peak = peak;
+		ch->sumsq += sumsq;
+		ch->block += block;
+	}
+
+	m->frames += frames;
+	m->block_frames += frames;
+	if (m->block_frames == m->block_size) {
+		for (c = 0; c < m->channels; c++) {
+			m->ch[c].blocks[m->block_index] = m->ch[c].block;
+			m->ch[c].block = 0.0;
+		}
+		m->block_index = (m->block_index + 1) % ALSAMETER_BLOCKS;
+		if (m->blocks_filled < ALSAMETER_BLOCKS)
+			m->blocks_filled++;
+		m->block_frames = 0;
 	}
+}
 
-	snd_pcm_htimestamp(self->handle , &avail, &tstamp);
-
-	result = PyTuple_New(3);
-	PyTuple_SetItem(result, 0, PyLong_FromLongLong(tstamp.tv_sec));
-	PyTuple_SetItem(result, 1, PyLong_FromLong(tstamp.tv_nsec));
-	PyTuple_SetItem(result, 2, PyLong_FromLong(avail));
+/* Accumulate `frames` float32 frames, splitting them at block boundaries */
+static void
+alsameter_run(alsameter_t *m, const float *x, size_t fstride, size_t cstride,
+			  snd_pcm_uframes_t frames)
+{
+	while (frames) {
+		snd_pcm_uframes_t n = m->block_size - m->block_frames;
 
-	return result;
+		if (n > frames)
+			n = frames;
+		alsameter_accumulate(m, x, fstride, cstride, n);
+		x += n * fstride;
+		frames -= n;
+	}
 }
 
-static PyObject *
-alsapcm_set_tstamp_mode(alsapcm_t *self, PyObject *args)
+/* Update the meters with `frames` interleaved float32 frames of `channels`
+   channels. The float paths meter the samples they already have, without
+   converting them again. */
+static void
+alsameter_update_float(alsameter_t *m, unsigned int channels,
+					   const float *samples, snd_pcm_uframes_t frames)
 {
-	snd_pcm_tstamp_t mode = SND_PCM_TSTAMP_ENABLE;
-	int err;
+	if (channels == m->channels)
+		alsameter_run(m, samples, channels, 1, frames);
+}
 
-	if (!PyArg_ParseTuple(args,"|i:set_tstamp_mode", &mode))
-		return NULL;
+/* Update the meters with `frames` interleaved frames in `format`. They are
+   converted in chunks that stay in the cache. */
+static void
+alsameter_update(alsameter_t *m, snd_pcm_format_t format,
+				 unsigned int channels, const char *data,
+				 snd_pcm_uframes_t frames)
+{
+	size_t framesize = channels * snd_pcm_format_physical_width(format) / 8;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	if (format != m->format || channels != m->channels)
+		return;
+
+	while (frames) {
+		snd_pcm_uframes_t n = frames < ALSAMETER_CHUNK ?
+			frames : ALSAMETER_CHUNK;
+
+		alsaconv_to_float(format, data, m->tmp, n * channels);
+		alsameter_run(m, m->tmp, channels, 1, n);
+
+		data += n * framesize;
+		frames -= n;
 	}
+}
 
-	snd_pcm_sw_params_t* swParams;
-	snd_pcm_sw_params_alloca( &swParams);
+/* Update the meters with `frames` non-interleaved frames in `format`, with
+   one buffer per channel */
+static void
+alsameter_update_planar(alsameter_t *m, snd_pcm_format_t format,
+						unsigned int channels, void **bufs,
+						snd_pcm_uframes_t frames)
+{
+	size_t samplesize = snd_pcm_format_physical_width(format) / 8;
+	snd_pcm_uframes_t done = 0;
+	unsigned int c;
 
-	snd_pcm_sw_params_current(self->handle, swParams);
+	if (format != m->format || channels != m->channels)
+		return;
 
-	snd_pcm_sw_params_set_tstamp_mode(self->handle, swParams, mode);
+	while (done < frames) {
+		snd_pcm_uframes_t n = frames - done < ALSAMETER_CHUNK ?
+			frames - done : ALSAMETER_CHUNK;
 
-	err = snd_pcm_sw_params(self->handle, swParams);
+		for (c = 0; c < channels; c++)
+			alsaconv_to_float(format, (char *)bufs[c] + done * samplesize,
+							  m->tmp + c * ALSAMETER_CHUNK, n);
+		alsameter_run(m, m->tmp, 1, ALSAMETER_CHUNK, n);
 
-	if (err < 0) {
-		PyErr_SetString(PyExc_RuntimeError, "Unable to set pcm tstamp mode!");
-		return NULL;
+		done += n;
 	}
+}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+static double
+alsameter_db(double power)
+{
+	return power > 0.0 ? 10.0 * log10(power) : -Py_HUGE_VAL;
 }
 
+#if PY_MAJOR_VERSION >= 3
+static PyStructSequence_Field alsameters_fields[] = {
+	{"peak", "Per-channel peak level in dBFS since the last call"},
+	{"rms", "Per-channel RMS level in dBFS since the last call"},
+	{"momentary", "Per-channel momentary loudness in LUFS"},
+	{"loudness", "Momentary loudness of all channels in LUFS"},
+	{NULL}
+};
+
+static PyStructSequence_Desc alsameters_desc = {
+	"alsaaudio.Meters",
+	"Levels measured by PCM.meters()",
+	alsameters_fields,
+	4
+};
+
+/* Return the levels as a Meters object, and restart peak and RMS metering */
 static PyObject *
-alsapcm_get_tstamp_mode(alsapcm_t *self, PyObject *args)
+alsameter_read(alsameter_t *m, PyTypeObject *type)
 {
-	snd_pcm_tstamp_t mode;
-	int err;
+	PyObject *result, *peak, *rms, *momentary;
+	double total = 0.0;
+	unsigned int c, b;
+
+	result = PyStructSequence_New(type);
+	peak = PyTuple_New(m->channels);
+	rms = PyTuple_New(m->channels);
+	momentary = PyTuple_New(m->channels);
+	if (!result || !peak || !rms || !momentary)
+		goto error;
+
+	for (c = 0; c < m->channels; c++) {
+		alsameter_channel_t *ch = &m->ch[c];
+		double ms = 0.0;
+		PyObject *item;
 
-	if (!PyArg_ParseTuple(args,":get_tstamp_mode"))
-		return NULL;
+		for (b = 0; b < m->blocks_filled; b++)
+			ms += ch->blocks[b];
+		if (m->blocks_filled)
+			ms /= m->blocks_filled * m->block_size;
+		total += ms;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+		if (!(item = PyFloat_FromDouble(alsameter_db((double)ch->peak *
+													   ch->peak))))
+			goto error;
+		PyTuple_SET_ITEM(peak, c, item);
 
-	snd_pcm_sw_params_t* swParams;
-	snd_pcm_sw_params_alloca( &swParams);
+		if (!(item = PyFloat_FromDouble(alsameter_db(m->frames ?
+													   ch->sumsq / m->frames :
+													   0.0))))
+			goto error;
+		PyTuple_SET_ITEM(rms, c, item);
 
-	snd_pcm_sw_params_current(self->handle, swParams);
+		if (!(item = PyFloat_FromDouble(-0.691 + alsameter_db(ms))))
+			goto error;
+		PyTuple_SET_ITEM(momentary, c, item);
 
-	err = snd_pcm_sw_params_get_tstamp_mode(swParams, &mode);
+		ch->peak = 0.0f;
+		ch->sumsq = 0.0;
+	}
+	m->frames = 0;
 
-	if (err < 0) {
-		PyErr_SetString(PyExc_RuntimeError, "Unable to get pcm tstamp mode!");
+	/* Steal reference counts */
+	PyStructSequence_SET_ITEM(result, 0, peak);
+	PyStructSequence_SET_ITEM(result, 1, rms);
+	PyStructSequence_SET_ITEM(result, 2, momentary);
+	PyStructSequence_SET_ITEM(result, 3,
+							  PyFloat_FromDouble(-0.691 + alsameter_db(total)));
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
 		return NULL;
 	}
 
-	return PyLong_FromUnsignedLong((unsigned long) mode);
+	return result;
+
+ error:
+	Py_XDECREF(result);
+	Py_XDECREF(peak);
+	Py_XDECREF(rms);
+	Py_XDECREF(momentary);
+	return NULL;
 }
+#endif
 
-static PyObject *
-alsapcm_set_tstamp_type(alsapcm_t *self, PyObject *args)
-{
-	snd_pcm_tstamp_type_t type = SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY;
-	int err;
+/******************************************/
+/* Resampling							  */
+/******************************************/
 
-	if (!PyArg_ParseTuple(args,"|i:set_tstamp_type", &type))
-		return NULL;
+/* A polyphase windowed-sinc resampler for an exact rational rate ratio,
+   used when a device runs at a different rate than requested. For L output
+   frames, M input frames are consumed; the filter has one set of `taps`
+   coefficients for each of the L phases. */
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+typedef struct {
+	const char *name;
+	unsigned int taps;		// at 1:1, a multiple of 8
+	double beta;			// of the Kaiser window
+	double rolloff;			// the passband edge, relative to Nyquist
+} alsaresample_quality_t;
+
+static const alsaresample_quality_t ALSAResampleQualities[] = {
+	{ "none", 0, 0.0, 0.0 },
+	{ "fast", 16, 6.0, 0.85 },
+	{ "medium", 32, 8.0, 0.92 },
+	{ "best", 64, 10.0, 0.95 },
+};
 
-	snd_pcm_sw_params_t* swParams;
-	snd_pcm_sw_params_alloca( &swParams);
+#define ALSARESAMPLE_MAX_COEFS (4 * 1024 * 1024)
 
-	snd_pcm_sw_params_current(self->handle, swParams);
+typedef float (*alsaresample_dot_t)(const float *a, const float *b,
+									unsigned int n);
 
-	snd_pcm_sw_params_set_tstamp_type(self->handle, swParams, type);
+struct alsaresampler {
+	unsigned int channels;
+	unsigned int l, m;
+	unsigned int taps;
+	float *coefs;
+	alsaresample_dot_t dot;
+
+	/* Unconsumed input, one row of `cap` frames per channel. The window of
+	   the next output frame starts at frame `start`, at phase `phase`. */
+	float *hist;
+	size_t cap, nhist, start;
+	unsigned int phase;
+
+	/* Interleaved output of the last alsaresampler_process() call */
+	float *out;
+	size_t outcap;
+};
 
-	err = snd_pcm_sw_params(self->handle, swParams);
+static float
+alsaresample_dot_scalar(const float *a, const float *b, unsigned int n)
+{
+	float acc[8] = { 0 };
+	unsigned int i, k;
 
-	if (err < 0) {
-		PyErr_SetString(PyExc_RuntimeError, "Unable to set pcm tstamp type!");
-		return NULL;
-	}
+	for (i = 0; i < n; i += 8)
+		for (k = 0; k < 8; k++)
+			acc[k] += a[i + k] * b[i + k];
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	return (acc[0] + acc[4]) + (acc[1] + acc[5]) +
+		(acc[2] + acc[6]) + (acc[3] + acc[7]);
 }
 
-static PyObject *
-alsapcm_get_tstamp_type(alsapcm_t *self, PyObject *args)
+#ifdef ALSACONV_X86
+static float
+alsaresample_dot_sse(const float *a, const float *b, unsigned int n)
 {
-	snd_pcm_tstamp_type_t type;
-	int err;
-
-	if (!PyArg_ParseTuple(args,":get_tstamp_type"))
-		return NULL;
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	float r[4];
+	unsigned int i;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	for (i = 0; i < n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),
+										   _mm_loadu_ps(b + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+										   _mm_loadu_ps(b + i + 4)));
 	}
+	_mm_storeu_ps(r, _mm_add_ps(acc0, acc1));
 
-	snd_pcm_sw_params_t* swParams;
-	snd_pcm_sw_params_alloca( &swParams);
+	return (r[0] + r[2]) + (r[1] + r[3]);
+}
 
-	snd_pcm_sw_params_current(self->handle, swParams);
+__attribute__((target("avx2,fma"))) static float
+alsaresample_dot_avx2(const float *a, const float *b, unsigned int n)
+{
+	__m256 acc = _mm256_setzero_ps();
+	__m128 r;
+	unsigned int i;
 
-	err = snd_pcm_sw_params_get_tstamp_type(swParams, &type);
+	for (i = 0; i < n; i += 8)
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+							  acc);
 
-	if (err < 0) {
-		PyErr_SetString(PyExc_RuntimeError, "Unable to get pcm tstamp type!");
-		return NULL;
-	}
+	r = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+	r = _mm_add_ss(r, _mm_shuffle_ps(r, r, 1));
 
-	return PyLong_FromUnsignedLong((unsigned long) type);
+	return _mm_cvtss_f32(r);
 }
+#endif
 
-
-// auxiliary function
-
-static PyObject *
-alsapcm_getformats(alsapcm_t *self, PyObject *args)
+/* The zeroth order modified Bessel function of the first kind */
+static double
+alsaresample_i0(double x)
 {
-	snd_pcm_t *pcm = self->handle;
-	if (!pcm) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+	double sum = 1.0, term = 1.0;
+	int k;
 
-	snd_pcm_hw_params_t *params;
-	snd_pcm_hw_params_alloca(&params);
-	int err = snd_pcm_hw_params_any(pcm, params);
-	if (err < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get hardware parameters");
-		return NULL;
+	for (k = 1; k < 50; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
 	}
+	return sum;
+}
 
-	PyObject *fmts = PyDict_New();
-	for (size_t i = 0; i < ARRAY_SIZE(ALSAFormats); ++i) {
-		snd_pcm_format_t format = ALSAFormats[i];
-		if (!snd_pcm_hw_params_test_format(pcm, params, format)) {
-			const char *name = snd_pcm_format_name(format);
-			PyObject *pname=PyUnicode_FromString(name);
-			PyObject *value=PyLong_FromLong((long)format);
-			PyDict_SetItem(fmts,pname,value);
-		}
+static unsigned int
+alsaresample_gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int t = a % b;
+		a = b;
+		b = t;
 	}
-	return fmts;
+	return a;
 }
 
-static PyObject *
-alsapcm_getratemaxmin(alsapcm_t *self, PyObject *args)
+static void
+alsaresampler_free(alsaresampler_t *r)
 {
-	snd_pcm_t *pcm = self->handle;
-	if (!pcm) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	if (r) {
+		PyMem_Free(r->coefs);
+		PyMem_Free(r->hist);
+		PyMem_Free(r->out);
+		PyMem_Free(r);
 	}
+}
 
-	snd_pcm_hw_params_t *params;
-	snd_pcm_hw_params_alloca(&params);
-	int err = snd_pcm_hw_params_any(pcm, params);
-	if (err < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get hardware parameters");
-		return NULL;
-	}
+/* Create a resampler from `in_rate` to `out_rate`. Sets an exception and
+   returns NULL on failure. */
+static alsaresampler_t *
+alsaresampler_new(alsaaudio_state_t *state, unsigned int channels,
+				  unsigned int in_rate, unsigned int out_rate, int quality)
+{
+	const alsaresample_quality_t *q = &ALSAResampleQualities[quality];
+	alsaresampler_t *r;
+	unsigned int g, p, j;
+	double cutoff, half, norm;
 
-	unsigned min, max;
-	if (snd_pcm_hw_params_get_rate_min(params, &min,NULL)<0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get minimum supported bitrate");
-		return NULL;
-	}
-	if (snd_pcm_hw_params_get_rate_max(params, &max,NULL)<0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get maximum supported bitrate");
-		return NULL;
-	}
+	r = PyMem_Malloc(sizeof(alsaresampler_t));
+	if (!r)
+		return (alsaresampler_t *)PyErr_NoMemory();
+	memset(r, 0, sizeof(alsaresampler_t));
 
-	PyObject *minp=PyLong_FromLong(min);
-	PyObject *maxp=PyLong_FromLong(max);
-	return PyTuple_Pack(2, minp, maxp);
-}
+	g = alsaresample_gcd(in_rate, out_rate);
+	r->channels = channels;
+	r->l = out_rate / g;
+	r->m = in_rate / g;
 
-static PyObject *
-alsapcm_getrates(alsapcm_t *self, PyObject *args)
-{
-	snd_pcm_t *pcm = self->handle;
-	if (!pcm) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	// When downsampling, the filter must get longer to keep its steepness
+	cutoff = q->rolloff;
+	r->taps = q->taps;
+	if (r->m > r->l) {
+		cutoff *= (double)r->l / r->m;
+		r->taps = ((unsigned int)ceil((double)q->taps * r->m / r->l) + 7) & ~7u;
 	}
 
-	snd_pcm_hw_params_t *params;
-	snd_pcm_hw_params_alloca(&params);
-	int err = snd_pcm_hw_params_any(pcm, params);
-	if (err < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get hardware parameters");
+	if ((size_t)r->l * r->taps > ALSARESAMPLE_MAX_COEFS) {
+		PyErr_Format(state->error, "Cannot resample from %u Hz to %u Hz",
+					 in_rate, out_rate);
+		alsaresampler_free(r);
 		return NULL;
 	}
 
-	unsigned min, max;
-	if (snd_pcm_hw_params_get_rate_min(params, &min, NULL) <0 ) {
-		PyErr_SetString(ALSAAudioError, "Cannot get minimum supported bitrate");
-		return NULL;
-	}
-	if (snd_pcm_hw_params_get_rate_max(params, &max, NULL) < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get maximum supported bitrate");
-		return NULL;
+	r->coefs = PyMem_New(float, (size_t)r->l * r->taps);
+	if (!r->coefs) {
+		alsaresampler_free(r);
+		return (alsaresampler_t *)PyErr_NoMemory();
 	}
 
-	if (min == max) {
-		return PyLong_FromLong(min);
-	}
-	else if (!snd_pcm_hw_params_test_rate(pcm, params, min + 1, 0)) {
-		PyObject *minp=PyLong_FromLong(min);
-		PyObject *maxp=PyLong_FromLong(max);
-		return PyTuple_Pack(2,minp,maxp);
-	}
-	else {
-		PyObject *rates=PyList_New(0);
-		for (size_t i=0; i<ARRAY_SIZE(ALSARates); i++) {
-			unsigned rate = ALSARates[i];
-			if (!snd_pcm_hw_params_test_rate(pcm, params, rate, 0)) {
-				PyObject *prate=PyLong_FromLong(rate);
-				PyList_Append(rates,prate);
-			}
+	// Phase p interpolates at p / l input frames past the window's center
+	half = r->taps / 2.0;
+	norm = alsaresample_i0(q->beta);
+	for (p = 0; p < r->l; p++) {
+		float *c = r->coefs + (size_t)p * r->taps;
+		double sum = 0.0;
+
+		for (j = 0; j < r->taps; j++) {
+			double d = (double)j - (half - 1.0) - (double)p / r->l;
+			double x = d / half;
+			double h = cutoff;
+
+			if (d != 0.0)
+				h = sin(M_PI * cutoff * d) / (M_PI * d);
+			h *= x >= -1.0 && x <= 1.0 ?
+				alsaresample_i0(q->beta * sqrt(1.0 - x * x)) / norm : 0.0;
+
+			c[j] = (float)h;
+			sum += h;
 		}
-		return rates;
+		// Unity gain at DC for every phase
+		for (j = 0; j < r->taps; j++)
+			c[j] = (float)(c[j] / sum);
+	}
+
+	r->dot = alsaresample_dot_scalar;
+#ifdef ALSACONV_X86
+	if (alsaconv_have_avx2() && __builtin_cpu_supports("fma"))
+		r->dot = alsaresample_dot_avx2;
+	else
+		r->dot = alsaresample_dot_sse;
+#endif
+
+	// Start with half a window of silence, so output starts with the input
+	r->nhist = r->taps / 2 - 1;
+	r->cap = r->taps;
+	r->hist = PyMem_New(float, r->cap * channels);
+	if (!r->hist) {
+		alsaresampler_free(r);
+		return (alsaresampler_t *)PyErr_NoMemory();
 	}
+	memset(r->hist, 0, r->cap * channels * sizeof(float));
+
+	return r;
 }
 
-static PyObject *
-alsapcm_getchannels(alsapcm_t *self,PyObject *args)
+/* The number of input frames that yield about `frames` output frames */
+static size_t
+alsaresampler_input_frames(alsaresampler_t *r, size_t frames)
 {
-	snd_pcm_t *pcm = self->handle;
-	if (!pcm) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+	return ((uint64_t)frames * r->m + r->l - 1) / r->l;
+}
 
-	snd_pcm_hw_params_t *params;
-	snd_pcm_hw_params_alloca(&params);
-	int err = snd_pcm_hw_params_any(pcm, params);
-	if (err < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get hardware parameters");
-		return NULL;
-	}
+/* Resample `frames` interleaved frames from `in`, and point `*out` at the
+   interleaved output frames, which stay valid until the next call.
 
-	unsigned min, max;
-	if (snd_pcm_hw_params_get_channels_min(params, &min) < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get minimum supported number of channels");
-		return NULL;
-	}
+   Returns the number of output frames, or -1 with an exception set. */
+static Py_ssize_t
+alsaresampler_process(alsaresampler_t *r, const float *in, size_t frames,
+					  float **out)
+{
+	unsigned int c;
+	size_t f, n, need, outmax;
 
-	if (snd_pcm_hw_params_get_channels_max(params, &max) < 0) {
-		PyErr_SetString(ALSAAudioError, "Cannot get maximum supported number of channels");
-		return NULL;
-	}
+	need = r->nhist + frames;
+	if (need > r->cap) {
+		size_t cap = need + need / 2;
+		float *hist = PyMem_New(float, cap * r->channels);
 
-	PyObject *out = PyList_New(0);
-	for (unsigned ch=min;ch<=max;++ch) {
-		if (!snd_pcm_hw_params_test_channels(pcm, params, ch)) {
-			PyObject *pch=PyLong_FromLong(ch);
-			PyList_Append(out,pch);
+		if (!hist) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		for (c = 0; c < r->channels; c++)
+			memcpy(hist + c * cap, r->hist + c * r->cap,
+				   r->nhist * sizeof(float));
+		PyMem_Free(r->hist);
+		r->hist = hist;
+		r->cap = cap;
+	}
+
+	// Deinterleave, so the filter runs on contiguous samples
+	for (c = 0; c < r->channels; c++) {
+		float *h = r->hist + c * r->cap + r->nhist;
+		for (f = 0; f < frames; f++)
+			h[f] = in[f * r->channels + c];
+	}
+	r->nhist = need;
+
+	outmax = need >= r->taps ?
+		((uint64_t)(need - r->taps + 1) * r->l) / r->m + 2 : 0;
+	if (outmax > r->outcap) {
+		float *o = PyMem_Realloc(r->out, outmax * r->channels * sizeof(float));
+		if (!o) {
+			PyErr_NoMemory();
+			return -1;
 		}
+		r->out = o;
+		r->outcap = outmax;
 	}
-	return out;
-}
 
-static PyObject *
-alsapcm_setchannels(alsapcm_t *self, PyObject *args)
-{
-	int channels, saved;
-	int res;
+	for (n = 0; r->start + r->taps <= r->nhist; n++) {
+		const float *coefs = r->coefs + (size_t)r->phase * r->taps;
 
-	if (!PyArg_ParseTuple(args,"i:setchannels", &channels))
-		return NULL;
+		for (c = 0; c < r->channels; c++)
+			r->out[n * r->channels + c] =
+				r->dot(coefs, r->hist + c * r->cap + r->start, r->taps);
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+		r->phase += r->m;
+		r->start += r->phase / r->l;
+		r->phase %= r->l;
 	}
 
-	PyErr_WarnEx(PyExc_DeprecationWarning,
-				 "This function is deprecated. "
-				 "Please use the named parameter `channels` to `PCM()` instead", 1);
-
-	saved = self->channels;
-	self->channels = channels;
-	res = alsapcm_setup(self);
-	if (res < 0)
-	{
-		self->channels = saved;
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
-		return NULL;
+	// Keep what the next windows need
+	if (r->start) {
+		size_t keep = r->start < r->nhist ? r->nhist - r->start : 0;
+		for (c = 0; c < r->channels; c++)
+			memmove(r->hist + c * r->cap, r->hist + c * r->cap + r->start,
+					keep * sizeof(float));
+		r->start -= r->nhist - keep;
+		r->nhist = keep;
 	}
-	return PyLong_FromLong(self->channels);
+
+	*out = r->out;
+	return n;
 }
 
-static PyObject *
-alsapcm_pcmtype(alsapcm_t *self, PyObject *args)
-{
-	if (!PyArg_ParseTuple(args,":pcmtype"))
-		return NULL;
+/******************************************/
+/* Virtual PCM device					  */
+/******************************************/
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+/* An alsa-lib ioplug device that lives in this module, so tests and
+   benchmarks can run timing and xrun handling without a sound card. It is
+   opened like any other PCM, as "pyalsaaudio_virtual", with optional
+   arguments:
 
-	return PyLong_FromLong(self->pcmtype);
+   CLOCK    the device's clock relative to the nominal rate, or 0 to
+            consume and produce frames as fast as they are transferred
+   JITTER   how late period wakeups may be, in microseconds
+   XRUN     inject an xrun every XRUN periods, 0 for never
+   SUSPEND  suspend the device every SUSPEND periods, 0 for never
+   SEED     the seed of the jitter, so runs can be repeated
+
+   For example "pyalsaaudio_virtual:CLOCK=1.001,JITTER=500,XRUN=100".
+
+   Playback discards the frames written, capture produces silence. The
+   device position follows CLOCK_MONOTONIC, and a timerfd wakes up pollers
+   at each period boundary. */
+
+#define ALSAVIRTUAL_NAME "pyalsaaudio_virtual"
+
+typedef struct {
+	snd_pcm_ioplug_t io;
+
+	double clock;
+	unsigned int jitter;
+	unsigned int xrun_every;
+	unsigned int suspend_every;
+	uint32_t rng;
+
+	/* Frames transferred by the application since the last prepare, and
+	   frames played or captured by the device since it was started */
+	uint64_t transferred;
+	uint64_t position;
+
+	bool running;
+	uint64_t start_ns;
+	uint64_t next_xrun, next_suspend;
+} alsavirtual_t;
+
+static uint64_t
+alsapcm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static PyObject *
-alsapcm_pcmmode(alsapcm_t *self, PyObject *args)
+/* Frames played or captured by the device's clock since it was started */
+static uint64_t
+alsavirtual_clock_frames(alsavirtual_t *virt)
 {
-	if (!PyArg_ParseTuple(args,":pcmmode"))
-		return NULL;
+	return (alsapcm_now_ns() - virt->start_ns) * 1e-9 * virt->io.rate *
+		virt->clock;
+}
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+/* Arm the timer for the next period boundary, plus jitter */
+static void
+alsavirtual_arm(alsavirtual_t *virt)
+{
+	snd_pcm_ioplug_t *io = &virt->io;
+	struct itimerspec its = { { 0, 0 }, { 0, 1 } };
+	uint64_t period, when;
+
+	// Free-running devices are always ready: expire at once
+	if (virt->clock > 0) {
+		period = alsavirtual_clock_frames(virt) / io->period_size + 1;
+		when = virt->start_ns + (uint64_t)(period * io->period_size * 1e9 /
+										   (io->rate * virt->clock));
+		if (virt->jitter) {
+			virt->rng ^= virt->rng << 13;
+			virt->rng ^= virt->rng >> 17;
+			virt->rng ^= virt->rng << 5;
+			when += (uint64_t)(virt->rng % (virt->jitter + 1)) * 1000;
+		}
+		its.it_value.tv_sec = when / 1000000000;
+		its.it_value.tv_nsec = when % 1000000000;
 	}
 
-	return PyLong_FromLong(self->pcmmode);
+	timerfd_settime(io->poll_fd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
-static PyObject *
-alsapcm_cardname(alsapcm_t *self, PyObject *args)
+/*
+ * Expire the timer once without re-arming it, so that a transfer blocked
+ * in poll() notices the stop the way it would on a hardware device
+ */
+static void
+alsavirtual_wake(alsavirtual_t *virt)
 {
-	if (!PyArg_ParseTuple(args,":cardname"))
-		return NULL;
-
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+	struct itimerspec its = { { 0, 0 }, { 0, 1 } };
 
-	return PyUnicode_FromString(self->cardname);
+	timerfd_settime(virt->io.poll_fd, 0, &its, NULL);
 }
 
-static PyObject *
-alsapcm_setrate(alsapcm_t *self, PyObject *args)
+static int
+alsavirtual_start(snd_pcm_ioplug_t *io)
 {
-	int rate, saved;
-	int res;
+	alsavirtual_t *virt = io->private_data;
 
-	if (!PyArg_ParseTuple(args,"i:setrate", &rate))
-		return NULL;
+	virt->running = true;
+	virt->start_ns = alsapcm_now_ns();
+	virt->position = 0;
+	virt->next_xrun = virt->xrun_every;
+	virt->next_suspend = virt->suspend_every;
+	alsavirtual_arm(virt);
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+	return 0;
+}
 
-	PyErr_WarnEx(PyExc_DeprecationWarning,
-				 "This function is deprecated. "
-				 "Please use the named parameter `rate` to `PCM()` instead", 1);
+static int
+alsavirtual_stop(snd_pcm_ioplug_t *io)
+{
+	alsavirtual_t *virt = io->private_data;
 
-	saved = self->rate;
-	self->rate = rate;
-	res = alsapcm_setup(self);
-	if (res < 0)
-	{
-		self->rate = saved;
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
-		return NULL;
-	}
-	return PyLong_FromLong(self->rate);
+	virt->running = false;
+	alsavirtual_wake(virt);
+
+	return 0;
 }
 
-static PyObject *
-alsapcm_setformat(alsapcm_t *self, PyObject *args)
+static int
+alsavirtual_prepare(snd_pcm_ioplug_t *io)
 {
-	int format, saved;
-	int res;
+	alsavirtual_t *virt = io->private_data;
 
-	if (!PyArg_ParseTuple(args,"i:setformat", &format))
-		return NULL;
+	alsavirtual_stop(io);
+	virt->transferred = 0;
+	virt->position = 0;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-	}
+	return 0;
+}
 
-	PyErr_WarnEx(PyExc_DeprecationWarning,
-				 "This function is deprecated. "
-				 "Please use the named parameter `format` to `PCM()` instead", 1);
+/* Continue where the device was suspended */
+static int
+alsavirtual_resume(snd_pcm_ioplug_t *io)
+{
+	alsavirtual_t *virt = io->private_data;
 
-	saved = self->format;
-	self->format = format;
-	res = alsapcm_setup(self);
-	if (res < 0)
-	{
-		self->format = saved;
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
-		return NULL;
-	}
-	return PyLong_FromLong(self->format);
+	if (virt->clock > 0)
+		virt->start_ns = alsapcm_now_ns() -
+			(uint64_t)(virt->position * 1e9 / (io->rate * virt->clock));
+	virt->running = true;
+	alsavirtual_arm(virt);
+
+	return snd_pcm_ioplug_set_state(io, SND_PCM_STATE_RUNNING);
 }
 
-static PyObject *
-alsapcm_setperiodsize(alsapcm_t *self, PyObject *args)
+static snd_pcm_sframes_t
+alsavirtual_pointer(snd_pcm_ioplug_t *io)
 {
-	int periodsize, saved;
-	int res;
+	alsavirtual_t *virt = io->private_data;
+	bool playback = io->stream == SND_PCM_STREAM_PLAYBACK;
+	uint64_t position;
 
-	if (!PyArg_ParseTuple(args,"i:setperiodsize", &periodsize))
-		return NULL;
+	if (!virt->running)
+		return virt->position % io->buffer_size;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+	if (virt->clock > 0)
+		position = alsavirtual_clock_frames(virt);
+	else if (playback)
+		position = virt->transferred;
+	else
+		position = virt->transferred + io->period_size;
+
+	// A negative pointer puts the stream into the XRUN state
+	if (playback ? position > virt->transferred :
+		position > virt->transferred + io->buffer_size)
+		return -EPIPE;
+
+	if (virt->xrun_every &&
+		position / io->period_size >= virt->next_xrun) {
+		virt->next_xrun += virt->xrun_every;
+		return -EPIPE;
 	}
 
-	PyErr_WarnEx(PyExc_DeprecationWarning,
-				 "This function is deprecated. "
-				 "Please use the named parameter `periodsize` to `PCM()` instead", 1);
+	virt->position = position;
 
-	saved = self->periodsize;
-	self->periodsize = periodsize;
-	res = alsapcm_setup(self);
-	if (res < 0)
-	{
-		self->periodsize = saved;
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
+	if (virt->suspend_every &&
+		position / io->period_size >= virt->next_suspend) {
+		virt->next_suspend += virt->suspend_every;
+		alsavirtual_stop(io);
+		snd_pcm_ioplug_set_state(io, SND_PCM_STATE_SUSPENDED);
+	}
 
+	return position % io->buffer_size;
+}
 
+static snd_pcm_sframes_t
+alsavirtual_transfer(snd_pcm_ioplug_t *io, const snd_pcm_channel_area_t *areas,
+					 snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
+{
+	alsavirtual_t *virt = io->private_data;
 
-		return NULL;
-	}
+	if (io->stream == SND_PCM_STREAM_CAPTURE)
+		snd_pcm_areas_silence(areas, offset, io->channels, size, io->format);
 
-	return PyLong_FromLong(self->periodsize);
+	virt->transferred += size;
+	return size;
 }
 
-static PyObject *
-alsapcm_read(alsapcm_t *self, PyObject *args)
+static int
+alsavirtual_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+						 unsigned int nfds, unsigned short *revents)
 {
-	snd_pcm_state_t state;
-	int res;
-	int size = self->framesize * self->periodsize;
-	int sizeout = 0;
-	PyObject *buffer_obj, *tuple_obj, *res_obj;
-	char *buffer;
+	alsavirtual_t *virt = io->private_data;
+	uint64_t expirations;
 
-	if (!PyArg_ParseTuple(args,":read"))
-		return NULL;
+	*revents = 0;
+	if (nfds != 1 || !(pfd->revents & POLLIN))
+		return 0;
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
-  }
+	if (read(io->poll_fd, &expirations, sizeof(expirations)) < 0 &&
+		errno != EAGAIN)
+		return -errno;
 
-	if (self->pcmtype != SND_PCM_STREAM_CAPTURE)
-	{
-		PyErr_Format(ALSAAudioError, "Cannot read from playback PCM [%s]",
-					 self->cardname);
-		return NULL;
-	}
+	if (virt->running)
+		alsavirtual_arm(virt);
 
-#if PY_MAJOR_VERSION < 3
-	buffer_obj = PyString_FromStringAndSize(NULL, size);
-	if (!buffer_obj)
-		return NULL;
-	buffer = PyString_AS_STRING(buffer_obj);
-#else
-	buffer_obj = PyBytes_FromStringAndSize(NULL, size);
-	if (!buffer_obj)
-		return NULL;
-	buffer = PyBytes_AS_STRING(buffer_obj);
-#endif
+	*revents = io->stream == SND_PCM_STREAM_PLAYBACK ? POLLOUT : POLLIN;
+	return 0;
+}
 
-	// After drop() and drain(), we need to prepare the stream again.
-	// Note that fresh streams are already prepared by snd_pcm_hw_params().
-	state = snd_pcm_state(self->handle);
-	if ((state != SND_PCM_STATE_SETUP) ||
-		!(res = snd_pcm_prepare(self->handle))) {
+static int
+alsavirtual_close(snd_pcm_ioplug_t *io)
+{
+	alsavirtual_t *virt = io->private_data;
 
-		Py_BEGIN_ALLOW_THREADS
-		res = snd_pcm_readi(self->handle, buffer, self->periodsize);
-		Py_END_ALLOW_THREADS
+	close(io->poll_fd);
+	free(virt);
 
-		if (res == -EPIPE) {
-			// This means buffer overrun, which we need to report.
-			// However, we recover the stream, so the next PCM.read() will work
-			// again. If recovery fails (very unlikely), report that instead.
-			if (!(res = snd_pcm_prepare(self->handle)))
-				res = -EPIPE;
-		}
-	}
+	return 0;
+}
 
-	if (res != -EPIPE)
-	{
-		if (res == -EAGAIN)
-		{
-			res = 0;
-		}
-		else if (res < 0) {
-			PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-						 self->cardname);
+static const snd_pcm_ioplug_callback_t alsavirtual_callback = {
+	.start = alsavirtual_start,
+	.stop = alsavirtual_stop,
+	.pointer = alsavirtual_pointer,
+	.transfer = alsavirtual_transfer,
+	.close = alsavirtual_close,
+	.prepare = alsavirtual_prepare,
+	.resume = alsavirtual_resume,
+	.poll_revents = alsavirtual_poll_revents,
+};
 
-			Py_DECREF(buffer_obj);
-			return NULL;
-		}
+static int
+alsavirtual_set_constraints(snd_pcm_ioplug_t *io)
+{
+	static const unsigned int access[] = {
+		SND_PCM_ACCESS_RW_INTERLEAVED,
+		SND_PCM_ACCESS_RW_NONINTERLEAVED,
+		SND_PCM_ACCESS_MMAP_INTERLEAVED,
+		SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+	};
+	unsigned int formats[ARRAY_SIZE(ALSAFormats)];
+	unsigned int i, n = 0;
+	int res;
+
+	// Only formats with a sample width can be filled with silence
+	for (i = 0; i < ARRAY_SIZE(ALSAFormats); i++)
+		if (snd_pcm_format_physical_width(ALSAFormats[i]) > 0)
+			formats[n++] = ALSAFormats[i];
+
+	if ((res = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
+											 ARRAY_SIZE(access), access)) < 0 ||
+		(res = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT,
+											 n, formats)) < 0 ||
+		(res = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS,
+											   1, 256)) < 0 ||
+		(res = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
+											   ALSARates[0],
+											   ALSARates[ARRAY_SIZE(ALSARates) - 1])) < 0 ||
+		(res = snd_pcm_ioplug_set_param_minmax(io,
+											   SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+											   16, 1 << 22)) < 0 ||
+		(res = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIODS,
+											   2, 1024)) < 0 ||
+		(res = snd_pcm_ioplug_set_param_minmax(io,
+											   SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+											   32, 1 << 24)) < 0)
+		return res;
+
+	return 0;
+}
+
+/* The entry point alsa-lib looks up when the device is opened */
+SND_PCM_PLUGIN_DEFINE_FUNC(pyalsaaudio_virtual)
+{
+	snd_config_iterator_t i, next;
+	alsavirtual_t *virt;
+	double clock = 1.0;
+	long jitter = 0, xrun = 0, suspend = 0, seed = 1;
+	int res;
+
+	(void)root;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *id;
+
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (!strcmp(id, "comment") || !strcmp(id, "type") ||
+			!strcmp(id, "hint"))
+			continue;
+
+		if (!strcmp(id, "clock"))
+			res = snd_config_get_ireal(n, &clock);
+		else if (!strcmp(id, "jitter"))
+			res = snd_config_get_integer(n, &jitter);
+		else if (!strcmp(id, "xrun"))
+			res = snd_config_get_integer(n, &xrun);
+		else if (!strcmp(id, "suspend"))
+			res = snd_config_get_integer(n, &suspend);
+		else if (!strcmp(id, "seed"))
+			res = snd_config_get_integer(n, &seed);
 		else
-		{
-			sizeout = res * self->framesize;
+			res = -EINVAL;
+
+		if (res < 0) {
+			SNDERR("Invalid field %s", id);
+			return -EINVAL;
 		}
 	}
 
-	if (size != sizeout) {
-#if PY_MAJOR_VERSION < 3
-		/* If the following fails, it will free the object */
-		if (_PyString_Resize(&buffer_obj, sizeout))
-			return NULL;
-#else
-		/* If the following fails, it will free the object */
-		if (_PyBytes_Resize(&buffer_obj, sizeout))
-			return NULL;
-#endif
+	if (clock < 0 || jitter < 0 || xrun < 0 || suspend < 0) {
+		SNDERR("Negative arguments are invalid");
+		return -EINVAL;
+	}
+
+	virt = calloc(1, sizeof(alsavirtual_t));
+	if (!virt)
+		return -ENOMEM;
+
+	virt->clock = clock;
+	virt->jitter = jitter;
+	virt->xrun_every = xrun;
+	virt->suspend_every = suspend;
+	// xorshift doesn't leave zero
+	virt->rng = seed ? (uint32_t)seed : 1;
+
+	virt->io.version = SND_PCM_IOPLUG_VERSION;
+	virt->io.name = "pyalsaaudio virtual PCM";
+	virt->io.callback = &alsavirtual_callback;
+	virt->io.private_data = virt;
+	virt->io.poll_events = POLLIN;
+	virt->io.poll_fd = timerfd_create(CLOCK_MONOTONIC,
+									  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (virt->io.poll_fd < 0) {
+		res = -errno;
+		free(virt);
+		return res;
 	}
 
-	res_obj = PyLong_FromLong(res);
-	if (!res_obj) {
-		Py_DECREF(buffer_obj);
-		return NULL;
+	res = snd_pcm_ioplug_create(&virt->io, name, stream, mode);
+	if (res < 0) {
+		close(virt->io.poll_fd);
+		free(virt);
+		return res;
 	}
-	tuple_obj = PyTuple_New(2);
-	if (!tuple_obj) {
-		Py_DECREF(buffer_obj);
-		Py_DECREF(res_obj);
-		return NULL;
+
+	// From here on, closing the PCM frees virt
+	if ((res = alsavirtual_set_constraints(&virt->io)) < 0) {
+		snd_pcm_ioplug_delete(&virt->io);
+		return res;
 	}
-	/* Steal reference counts */
-	PyTuple_SET_ITEM(tuple_obj, 0, res_obj);
-	PyTuple_SET_ITEM(tuple_obj, 1, buffer_obj);
 
-	return tuple_obj;
+	*pcmp = virt->io.pcm;
+	return 0;
 }
 
-static PyObject *alsapcm_write(alsapcm_t *self, PyObject *args)
+SND_PCM_PLUGIN_SYMBOL(pyalsaaudio_virtual);
+
+/* The configuration that defines the virtual device, in addition to the
+   global configuration. The plugin library is this module itself. */
+static snd_config_t *ALSAVirtualConfig;
+static pthread_mutex_t ALSAVirtualLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char alsavirtual_config_text[] =
+	"pcm." ALSAVIRTUAL_NAME " {\n"
+	"	@args [ CLOCK JITTER XRUN SUSPEND SEED ]\n"
+	"	@args.CLOCK { type real default 1.0 }\n"
+	"	@args.JITTER { type integer default 0 }\n"
+	"	@args.XRUN { type integer default 0 }\n"
+	"	@args.SUSPEND { type integer default 0 }\n"
+	"	@args.SEED { type integer default 1 }\n"
+	"	type " ALSAVIRTUAL_NAME "\n"
+	"	clock $CLOCK\n"
+	"	jitter $JITTER\n"
+	"	xrun $XRUN\n"
+	"	suspend $SUSPEND\n"
+	"	seed $SEED\n"
+	"}\n"
+	"pcm_type." ALSAVIRTUAL_NAME " {\n"
+	"}\n";
+
+static int
+alsavirtual_load_config(void)
 {
-	int datalen;
-	char *data;
+	snd_config_t *conf = NULL, *type, *lib;
+	snd_input_t *in;
+	Dl_info info;
+	int res;
 
-#if PY_MAJOR_VERSION < 3
-	if (!PyArg_ParseTuple(args,"s#:write", &data, &datalen))
-		return NULL;
-#else
-	Py_buffer buf;
+	if (!dladdr((void *)&alsavirtual_callback, &info) || !info.dli_fname)
+		return -ENOENT;
 
-	if (!PyArg_ParseTuple(args,"y*:write", &buf))
-		return NULL;
+	if ((res = snd_input_buffer_open(&in, alsavirtual_config_text, -1)) < 0)
+		return res;
+	if ((res = snd_config_top(&conf)) >= 0)
+		res = snd_config_load(conf, in);
+	snd_input_close(in);
 
-	data = buf.buf;
-	datalen = buf.len;
-#endif
+	if (res >= 0)
+		res = snd_config_search(conf, "pcm_type." ALSAVIRTUAL_NAME, &type);
+	if (res >= 0 &&
+		(res = snd_config_imake_string(&lib, "lib", info.dli_fname)) >= 0 &&
+		(res = snd_config_add(type, lib)) < 0)
+		snd_config_delete(lib);
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
+	if (res < 0) {
+		if (conf)
+			snd_config_delete(conf);
+		return res;
+	}
 
-#if PY_MAJOR_VERSION >= 3
-		PyBuffer_Release(&buf);
-#endif
+	ALSAVirtualConfig = conf;
+	return 0;
+}
 
-		return NULL;
-	}
+/* Devices are opened without the GIL, so the configuration is built under
+   a lock of its own */
+static int
+alsavirtual_config(snd_config_t **confp)
+{
+	int res = 0;
 
-	if (datalen % self->framesize)
-	{
-		PyErr_SetString(ALSAAudioError,
-						"Data size must be a multiple of framesize");
+	pthread_mutex_lock(&ALSAVirtualLock);
+	if (!ALSAVirtualConfig)
+		res = alsavirtual_load_config();
+	*confp = ALSAVirtualConfig;
+	pthread_mutex_unlock(&ALSAVirtualLock);
 
-#if PY_MAJOR_VERSION >= 3
-		PyBuffer_Release(&buf);
-#endif
-		return NULL;
-	}
+	return res;
+}
 
+/* Open a PCM like snd_pcm_open(), or the virtual device */
+static int
+alsapcm_open(snd_pcm_t **pcmp, const char *device, snd_pcm_stream_t stream,
+			 int mode)
+{
+	size_t len = strlen(ALSAVIRTUAL_NAME);
+	snd_config_t *conf;
 	int res;
-	// After drop() and drain(), we need to prepare the stream again.
-	// Note that fresh streams are already prepared by snd_pcm_hw_params().
-	snd_pcm_state_t state = snd_pcm_state(self->handle);
-	if ((state != SND_PCM_STATE_SETUP) ||
-		!(res = snd_pcm_prepare(self->handle))) {
 
-		Py_BEGIN_ALLOW_THREADS
-		res = snd_pcm_writei(self->handle, data, datalen/self->framesize);
-		Py_END_ALLOW_THREADS
+	if (strncmp(device, ALSAVIRTUAL_NAME, len) ||
+		(device[len] != '\0' && device[len] != ':'))
+		return snd_pcm_open(pcmp, device, stream, mode);
 
-		if (res == -EPIPE) {
-			// This means buffer underrun, which we need to report.
-			// However, we recover the stream, so the next PCM.write() will work
-			// again. If recovery fails (very unlikely), report that instead.
-			if (!(res = snd_pcm_prepare(self->handle)))
-				res = -EPIPE;
-		}
-	}
+	if ((res = alsavirtual_config(&conf)) < 0)
+		return res;
 
-	if (res != -EPIPE)
-	{
-		if (res == -EAGAIN)
-		{
-			res = 0;
-		}
-		else if (res < 0) {
-			PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-						 self->cardname);
+	return snd_pcm_open_lconf(pcmp, device, stream, mode, conf);
+}
 
-#if PY_MAJOR_VERSION >= 3
-			PyBuffer_Release(&buf);
-#endif
+/******************************************/
+/* PCM object wrapper				   */
+/******************************************/
 
-			return NULL;
+static long
+get_pcmtype(alsaaudio_state_t *state, PyObject *obj)
+{
+	if (!obj || (obj == Py_None)) {
+		return SND_PCM_STREAM_PLAYBACK;
+	}
+
+#if PY_MAJOR_VERSION > 2
+	if (PyLong_Check(obj)) {
+		long pcmtype = PyLong_AS_LONG(obj);
+		if (pcmtype == SND_PCM_STREAM_PLAYBACK ||
+			pcmtype == SND_PCM_STREAM_CAPTURE) {
+			return pcmtype;
+		}
+	}
+#else
+	if (PyInt_Check(obj)) {
+		long pcmtype = PyInt_AS_LONG(obj);
+		if (pcmtype == SND_PCM_STREAM_PLAYBACK ||
+			pcmtype == SND_PCM_STREAM_CAPTURE) {
+			return pcmtype;
 		}
 	}
+#endif
 
-#if PY_MAJOR_VERSION >= 3
-	PyBuffer_Release(&buf);
+	if (PyUnicode_Check(obj)) {
+#if PY_MAJOR_VERSION > 2
+		if (PyUnicode_CompareWithASCIIString(obj, "playback") == 0)
+			return SND_PCM_STREAM_PLAYBACK;
+		else if (PyUnicode_CompareWithASCIIString(obj, "capture") == 0)
+			return SND_PCM_STREAM_CAPTURE;
+#else
+		const char *dirstr = PyUnicode_AS_DATA(obj);
+		if (strcasecmp(dirstr, "playback")==0)
+			return SND_PCM_STREAM_PLAYBACK;
+		else if (strcasecmp(dirstr, "capture")==0)
+			return SND_PCM_STREAM_CAPTURE;
 #endif
+	}
 
-	return PyLong_FromLong(res);
+	PyErr_SetString(state->error, "PCM type must be PCM_PLAYBACK (0) "
+					"or PCM_CAPTURE (1)");
+	return -1;
+}
+
+static bool is_value_volume_unit(long unit)
+{
+	if (unit == VOLUME_UNITS_PERCENTAGE ||
+		unit == VOLUME_UNITS_RAW ||
+		unit == VOLUME_UNITS_DB) {
+		return true;
+	}
+	return false;
 }
 
+/* The ids of all cards, as returned by cards() */
 static PyObject *
-alsapcm_avail(alsapcm_t *self, PyObject *args)
+alsacard_ids(alsaaudio_state_t *state)
 {
-	if (!PyArg_ParseTuple(args,":avail"))
-		return NULL;
+	int rc;
+	int card = -1;
+	snd_ctl_card_info_t *info;
+	snd_ctl_t *handle;
+	PyObject *result = NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
+	snd_ctl_card_info_alloca(&info);
+	result = PyList_New(0);
+	if (!result)
 		return NULL;
-	}
 
-	long avail = snd_pcm_avail(self->handle);
-	// if (avail < 0)
-	// {
-	// 	PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(avail),
-	// 				 self->cardname);
+	for (rc = snd_card_next(&card); !rc && (card >= 0);
+		 rc = snd_card_next(&card))
+	{
+		char name[64];
+		int err;
+		PyObject *item;
 
-	// 	return NULL;
-	// }
+		/* One would be tempted to think that snd_card_get_name returns a name
+		   that is actually meaningful for any further operations.
 
-	return PyLong_FromLong(avail);
-}
+		   Not in ALSA land. Here we need the id, not the name */
 
-static PyObject *alsapcm_pause(alsapcm_t *self, PyObject *args)
-{
-	int enabled=1, res;
+		sprintf(name, "hw:%d", card);
+		if ((err = snd_ctl_open(&handle, name, 0)) < 0) {
+			PyErr_Format(state->error, "%s [%s]", snd_strerror(err), name);
+			Py_DECREF(result);
+			return NULL;
+		}
+		if ((err = snd_ctl_card_info(handle, info)) < 0) {
+			PyErr_Format(state->error, "%s [%s]", snd_strerror(err), name);
+			snd_ctl_close(handle);
+			Py_DECREF(result);
+			return NULL;
+		}
 
-	if (!PyArg_ParseTuple(args,"|i:pause", &enabled))
-		return NULL;
+		item = PyUnicode_FromString(snd_ctl_card_info_get_id(info));
+		PyList_Append(result, item);
+		Py_DECREF(item);
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
-		return NULL;
+		snd_ctl_close(handle);
 	}
 
-	res = snd_pcm_pause(self->handle, enabled);
-	if (res < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
+	return result;
+}
 
+static PyObject *
+alsacard_list(PyObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":cards"))
 		return NULL;
-	}
-	return PyLong_FromLong(res);
+
+	return alsacard_ids(alsaaudio_module_state(self));
 }
 
-static PyObject *alsapcm_drop(alsapcm_t *self)
+static PyObject *
+alsacard_list_indexes(PyObject *self, PyObject *args)
 {
-	int res;
+	int rc;
+	int card = -1;
+	PyObject *result = NULL;
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
+	if (!PyArg_ParseTuple(args,":card_indexes"))
 		return NULL;
-	}
 
-	res = snd_pcm_drop(self->handle);
+	result = PyList_New(0);
 
-	if (res < 0)
+	for (rc = snd_card_next(&card); !rc && (card >= 0);
+		 rc = snd_card_next(&card))
 	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
+		PyObject *item = PyLong_FromLong(card);
 
-		return NULL;
+		PyList_Append(result, item);
+		Py_DECREF(item);
 	}
 
-	return PyLong_FromLong(res);
+	return result;
 }
 
-static PyObject *alsapcm_drain(alsapcm_t *self)
+static PyObject *
+alsacard_name(PyObject *self, PyObject *args)
 {
-	int res;
+	int err, card;
+	PyObject *result = NULL;
+	char *name = NULL, *longname = NULL;
 
-	if (!self->handle) {
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
+	if (!PyArg_ParseTuple(args,"i:card_name", &card))
 		return NULL;
+
+	err = snd_card_get_name(card, &name);
+	if (err < 0) {
+		PyErr_Format(alsaaudio_module_state(self)->error, "%s [%d]",
+					 snd_strerror(err), card);
+		goto exit;
 	}
 
-	Py_BEGIN_ALLOW_THREADS
-	res = snd_pcm_drain(self->handle);
-	Py_END_ALLOW_THREADS
+	err = snd_card_get_longname(card, &longname);
+	if (err < 0) {
+		PyErr_Format(alsaaudio_module_state(self)->error, "%s [%d]",
+					 snd_strerror(err), card);
+		goto exit;
+	}
 
-	if (res < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(res),
-					 self->cardname);
+	result = PyTuple_New(2);
+	PyTuple_SetItem(result, 0, PyUnicode_FromString(name));
+	PyTuple_SetItem(result, 1, PyUnicode_FromString(longname));
 
-		return NULL;
-	}
+exit:
+	free(name);
+	free(longname);
 
-	return PyLong_FromLong(res);
+	return result;
 }
 
+/* The names of the PCM devices for `pcmtype`, as returned by pcms() */
 static PyObject *
-alsapcm_polldescriptors(alsapcm_t *self, PyObject *args)
+alsapcm_names(long pcmtype)
 {
-	int i, count, rc;
-	PyObject *result;
-	struct pollfd *fds;
-
-	if (!PyArg_ParseTuple(args,":polldescriptors"))
-		return NULL;
+	PyObject *result = NULL;
+	PyObject *item;
+	void **hints, **n;
+	char *name, *io;
+	const char *filter;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "PCM device is closed");
+	result = PyList_New(0);
+	if (!result)
 		return NULL;
-	}
 
-	count = snd_pcm_poll_descriptors_count(self->handle);
-	if (count < 0)
-	{
-		PyErr_Format(ALSAAudioError, "Can't get poll descriptor count [%s]",
-					 self->cardname);
-		return NULL;
-	}
+	if (snd_device_name_hint(-1, "pcm", &hints) < 0)
+		return result;
 
-	fds = (struct pollfd*)calloc(count, sizeof(struct pollfd));
-	if (!fds)
-	{
-		PyErr_Format(PyExc_MemoryError, "Out of memory [%s]",
-					 self->cardname);
-		return NULL;
-	}
+	n = hints;
+	filter = pcmtype == SND_PCM_STREAM_CAPTURE ? "Input" : "Output";
+	while (*n != NULL) {
+		name = snd_device_name_get_hint(*n, "NAME");
+		io = snd_device_name_get_hint(*n, "IOID");
+		if (io != NULL && strcmp(io, filter) != 0)
+			goto __end;
 
-	result = PyList_New(count);
-	rc = snd_pcm_poll_descriptors(self->handle, fds, (unsigned int)count);
-	if (rc != count)
-	{
-		PyErr_Format(ALSAAudioError, "Can't get poll descriptors [%s]",
-					 self->cardname);
-		free(fds);
-		return NULL;
-	}
+		item = PyUnicode_FromString(name);
+		PyList_Append(result, item);
+		Py_DECREF(item);
 
-	for (i = 0; i < count; ++i)
-	{
-		PyList_SetItem(result, i,
-					   Py_BuildValue("ih", fds[i].fd, fds[i].events));
+	__end:
+		if (name != NULL)
+			free(name);
+		if (io != NULL)
+			free(io);
+		n++;
 	}
-	free(fds);
+	snd_device_name_free_hint(hints);
 
 	return result;
 }
 
 static PyObject *
-alsapcm_polldescriptors_revents(alsapcm_t *self, PyObject *args)
+alsapcm_list(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	PyObject *list_obj;
+	PyObject *pcmtypeobj = NULL;
+	long pcmtype;
 
-	if (!PyArg_ParseTuple(args, "O!:polldescriptors_revents", &PyList_Type, &list_obj))
-	{
-		PyErr_SetString(PyExc_TypeError, "parameter must be a list.");
+	char *kw[] = { "pcmtype", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:pcms", kw, &pcmtypeobj)) {
 		return NULL;
 	}
 
-	Py_ssize_t list_size = PyList_Size(list_obj);
-
-	struct pollfd *fds = (struct pollfd*)calloc(list_size, sizeof(struct pollfd));
-	if (!fds)
-	{
-		PyErr_Format(PyExc_MemoryError, "Out of memory [%s]",
-					 self->cardname);
+	pcmtype = get_pcmtype(alsaaudio_module_state(self), pcmtypeobj);
+	if (pcmtype < 0) {
 		return NULL;
 	}
 
-	for (int i = 0; i < list_size; i++)
-	{
-		PyObject *tuple_obj = PyList_GetItem(list_obj, i);
-		if(!PyTuple_Check(tuple_obj)) {
-			PyErr_SetString(PyExc_TypeError, "list items must be tuples.");
-			free(fds);
-			return NULL;
-		}
+	return alsapcm_names(pcmtype);
+}
 
-		Py_ssize_t tuple_size = PyTuple_Size(tuple_obj);
-		if (tuple_size != 2) {
-			PyErr_SetString(PyExc_TypeError, "tuples inside list must be (fd: int, mask: int)");
-			free(fds);
-			return NULL;
-		}
+#if PY_MAJOR_VERSION >= 3
+/******************************************/
+/* Device capabilities					  */
+/******************************************/
 
-		PyObject* t0 = PyTuple_GetItem(tuple_obj, 0);
-		PyObject* t1 = PyTuple_GetItem(tuple_obj, 1);
+/* What a device supports, probed once per device and stream type, and
+   optionally kept on disk for devices backed by a card */
+
+static PyStructSequence_Field alsacaps_fields[] = {
+	{"device", "The name of the PCM device"},
+	{"type", "PCM_PLAYBACK or PCM_CAPTURE"},
+	{"card_id", "The id of the device's card, or None"},
+	{"formats", "Supported sample formats, keyed by name"},
+	{"channels", "Supported channel counts, up to 32"},
+	{"channels_min", "The smallest supported channel count"},
+	{"channels_max", "The largest supported channel count"},
+	{"rates", "Supported well-known rates"},
+	{"rate_min", "The lowest supported rate"},
+	{"rate_max", "The highest supported rate"},
+	{"period_size_min", "The smallest period size in frames"},
+	{"period_size_max", "The largest period size in frames"},
+	{"buffer_size_min", "The smallest buffer size in frames"},
+	{"buffer_size_max", "The largest buffer size in frames"},
+	{NULL}
+};
 
-		if (!PyLong_Check(t0) || !PyLong_Check(t1)) {
-			PyErr_SetString(PyExc_TypeError, "tuples inside list must be (fd: int, mask: int)");
-			free(fds);
-			return NULL;
-		}
+#define ALSACAPS_FIELDS (ARRAY_SIZE(alsacaps_fields) - 1)
+#define ALSACAPS_FORMATS 3
+#define ALSACAPS_MAX_CHANNELS 32
 
-		// leave fds[i].event as 0 (from calloc) for now
-		fds[i].fd = PyLong_AS_LONG(t0);
-		fds[i].revents = PyLong_AS_LONG(t1);
-	}
+static PyStructSequence_Desc alsacaps_desc = {
+	"alsaaudio.Capabilities",
+	"What a PCM device supports, see capabilities()",
+	alsacaps_fields,
+	ALSACAPS_FIELDS
+};
 
-	unsigned short revents;
-	int rc = snd_pcm_poll_descriptors_revents(self->handle, fds, (unsigned short)list_size, &revents);
-	if (rc < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(rc),
-					 self->cardname);
-		free(fds);
-		return NULL;
-	}
+/* The id of a card as a string, or None if there is no such card */
+static PyObject *
+alsacaps_card_id(int card)
+{
+	snd_ctl_card_info_t *info;
+	snd_ctl_t *ctl;
+	char name[32];
+	PyObject *id;
 
-	free(fds);
+	if (card < 0)
+		Py_RETURN_NONE;
 
-	return PyLong_FromLong(revents);
-}
+	snd_ctl_card_info_alloca(&info);
+	snprintf(name, sizeof(name), "hw:%d", card);
+	if (snd_ctl_open(&ctl, name, 0) < 0)
+		Py_RETURN_NONE;
 
-/* ALSA PCM Object Bureaucracy */
+	if (snd_ctl_card_info(ctl, info) < 0) {
+		id = Py_None;
+		Py_INCREF(id);
+	}
+	else
+		id = PyUnicode_FromString(snd_ctl_card_info_get_id(info));
 
-static PyMethodDef alsapcm_methods[] = {
-	{"pcmtype", (PyCFunction)alsapcm_pcmtype, METH_VARARGS},
-	{"pcmmode", (PyCFunction)alsapcm_pcmmode, METH_VARARGS},
-	{"cardname", (PyCFunction)alsapcm_cardname, METH_VARARGS},
-	{"getchannels", (PyCFunction)alsapcm_getchannels, METH_VARARGS},
-	{"setchannels", (PyCFunction)alsapcm_setchannels, METH_VARARGS},
-	{"setrate", (PyCFunction)alsapcm_setrate, METH_VARARGS},
-	{"setformat", (PyCFunction)alsapcm_setformat, METH_VARARGS},
-	{"setperiodsize", (PyCFunction)alsapcm_setperiodsize, METH_VARARGS},
-	{"htimestamp", (PyCFunction) alsapcm_htimestamp, METH_VARARGS},
-	{"set_tstamp_type", (PyCFunction) alsapcm_set_tstamp_type, METH_VARARGS},
-	{"set_tstamp_mode", (PyCFunction) alsapcm_set_tstamp_mode, METH_VARARGS},
-	{"get_tstamp_type", (PyCFunction) alsapcm_get_tstamp_type, METH_VARARGS},
-	{"get_tstamp_mode", (PyCFunction) alsapcm_get_tstamp_mode, METH_VARARGS},
-	{"dumpinfo", (PyCFunction)alsapcm_dumpinfo, METH_VARARGS},
-	{"info", (PyCFunction)alsapcm_info, METH_VARARGS},
-	{"state", (PyCFunction)alsapcm_state, METH_VARARGS},
-	{"getformats", (PyCFunction)alsapcm_getformats, METH_VARARGS},
-	{"getratebounds", (PyCFunction)alsapcm_getratemaxmin, METH_VARARGS},
-	{"getrates", (PyCFunction)alsapcm_getrates, METH_VARARGS},
-	{"read", (PyCFunction)alsapcm_read, METH_VARARGS},
-	{"write", (PyCFunction)alsapcm_write, METH_VARARGS},
-	{"avail", (PyCFunction)alsapcm_avail, METH_VARARGS},
-	{"pause", (PyCFunction)alsapcm_pause, METH_VARARGS},
-	{"drop", (PyCFunction)alsapcm_drop, METH_VARARGS},
-	{"drain", (PyCFunction)alsapcm_drain, METH_VARARGS},
-	{"close", (PyCFunction)alsapcm_close, METH_VARARGS},
-	{"polldescriptors", (PyCFunction)alsapcm_polldescriptors, METH_VARARGS},
-	{"polldescriptors_revents", (PyCFunction)alsapcm_polldescriptors_revents, METH_VARARGS},
-	{NULL, NULL}
-};
+	snd_ctl_close(ctl);
+	return id;
+}
 
-static PyMethodDef alsa_methods[] = {
-	{"asoundlib_version", (PyCFunction) alsa_asoundlib_version, METH_VARARGS},
-	{NULL, NULL}
-};
+static PyObject *
+alsacaps_probe(alsaaudio_state_t *state, const char *device, long pcmtype,
+			   int *card)
+{
+	snd_pcm_t *pcm;
+	snd_pcm_hw_params_t *params;
+	snd_pcm_info_t *info;
+	snd_pcm_uframes_t pmin = 0, pmax = 0, bmin = 0, bmax = 0;
+	unsigned int rmin = 0, rmax = 0, cmin = 0, cmax = 0, ch;
+	PyObject *caps = NULL, *formats = NULL, *channels = NULL, *rates = NULL;
+	PyObject *item;
+	size_t i;
+	int res, dir = 0;
 
+	snd_pcm_hw_params_alloca(&params);
+	snd_pcm_info_alloca(&info);
 
-#if PY_VERSION_HEX < 0x02020000
-static PyObject *
-alsapcm_getattr(alsapcm_t *self, char *name) {
-	return Py_FindMethod(alsapcm_methods, (PyObject *)self, name);
-}
-#endif
+	Py_BEGIN_ALLOW_THREADS
+	res = alsapcm_open(&pcm, device, pcmtype, SND_PCM_NONBLOCK);
+	Py_END_ALLOW_THREADS
+	if (res < 0) {
+		PyErr_Format(state->error, "%s [%s]", snd_strerror(res), device);
+		return NULL;
+	}
 
-static PyTypeObject ALSAPCMType = {
-#if PY_MAJOR_VERSION < 3
-	PyObject_HEAD_INIT(&PyType_Type)
-	0,							  /* ob_size */
-#else
-	PyVarObject_HEAD_INIT(&PyType_Type, 0)
-#endif
-	"alsaaudio.PCM",				/* tp_name */
-	sizeof(alsapcm_t),			  /* tp_basicsize */
-	0,							  /* tp_itemsize */
-	/* methods */
-	(destructor) alsapcm_dealloc,   /* tp_dealloc */
-	0,							  /* print */
-#if PY_VERSION_HEX < 0x02020000
-	(getattrfunc)alsapcm_getattr,   /* tp_getattr */
-#else
-	0,							  /* tp_getattr */
-#endif
-	0,							  /* tp_setattr */
-	0,							  /* tp_compare */
-	0,							  /* tp_repr */
-	0,							  /* tp_as_number */
-	0,							  /* tp_as_sequence */
-	0,							  /* tp_as_mapping */
-	0,							  /* tp_hash */
-	0,							  /* tp_call */
-	0,							  /* tp_str */
-#if PY_VERSION_HEX >= 0x02020000
-	PyObject_GenericGetAttr,		/* tp_getattro */
-#else
-	0,							  /* tp_getattro */
-#endif
-	0,							  /* tp_setattro */
-	0,							  /* tp_as_buffer */
-	Py_TPFLAGS_DEFAULT,			 /* tp_flags */
-	"ALSA PCM device.",			 /* tp_doc */
-	0,							/* tp_traverse */
-	0,							/* tp_clear */
-	0,							/* tp_richcompare */
-	0,							/* tp_weaklistoffset */
-	0,							/* tp_iter */
-	0,							/* tp_iternext */
-	alsapcm_methods,				  /* tp_methods */
-	0,							/* tp_members */
-};
+	res = snd_pcm_hw_params_any(pcm, params);
+	if (res < 0) {
+		PyErr_Format(state->error, "%s [%s]", snd_strerror(res), device);
+		goto exit;
+	}
 
+	*card = snd_pcm_info(pcm, info) < 0 ? -1 : snd_pcm_info_get_card(info);
 
-/******************************************/
-/* Mixer object wrapper				   */
-/******************************************/
+	snd_pcm_hw_params_get_channels_min(params, &cmin);
+	snd_pcm_hw_params_get_channels_max(params, &cmax);
+	snd_pcm_hw_params_get_rate_min(params, &rmin, &dir);
+	snd_pcm_hw_params_get_rate_max(params, &rmax, &dir);
+	snd_pcm_hw_params_get_period_size_min(params, &pmin, &dir);
+	snd_pcm_hw_params_get_period_size_max(params, &pmax, &dir);
+	snd_pcm_hw_params_get_buffer_size_min(params, &bmin);
+	snd_pcm_hw_params_get_buffer_size_max(params, &bmax);
 
-static PyTypeObject ALSAMixerType;
+	if (!(formats = PyDict_New()))
+		goto exit;
+	for (i = 0; i < ARRAY_SIZE(ALSAFormats); i++) {
+		if (snd_pcm_hw_params_test_format(pcm, params, ALSAFormats[i]))
+			continue;
+		item = PyLong_FromLong(ALSAFormats[i]);
+		if (!item || PyDict_SetItemString(formats,
+										  snd_pcm_format_name(ALSAFormats[i]),
+										  item) < 0) {
+			Py_XDECREF(item);
+			goto exit;
+		}
+		Py_DECREF(item);
+	}
 
-#define MIXER_CAP_VOLUME			0x0001
-#define MIXER_CAP_VOLUME_JOINED	 0x0002
-#define MIXER_CAP_PVOLUME		   0x0004
-#define MIXER_CAP_PVOLUME_JOINED	0x0008
-#define MIXER_CAP_CVOLUME		   0x0010
-#define MIXER_CAP_CVOLUME_JOINED	0x0020
+	// Plugins claim to support thousands of channels
+	if (!(channels = PyList_New(0)))
+		goto exit;
+	for (ch = cmin; ch <= cmax && ch <= ALSACAPS_MAX_CHANNELS; ch++) {
+		if (snd_pcm_hw_params_test_channels(pcm, params, ch))
+			continue;
+		item = PyLong_FromUnsignedLong(ch);
+		if (!item || PyList_Append(channels, item) < 0) {
+			Py_XDECREF(item);
+			goto exit;
+		}
+		Py_DECREF(item);
+	}
 
-#define MIXER_CAP_SWITCH			0x0001
-#define MIXER_CAP_SWITCH_JOINED	 0x0002
-#define MIXER_CAP_PSWITCH		   0x0004
-#define MIXER_CAP_PSWITCH_JOINED	0x0008
-#define MIXER_CAP_CSWITCH		   0x0010
-#define MIXER_CAP_CSWITCH_JOINED	0x0020
-#define MIXER_CAP_CSWITCH_EXCLUSIVE 0x0040
+	if (!(rates = PyList_New(0)))
+		goto exit;
+	for (i = 0; i < ARRAY_SIZE(ALSARates); i++) {
+		if (snd_pcm_hw_params_test_rate(pcm, params, ALSARates[i], 0))
+			continue;
+		item = PyLong_FromUnsignedLong(ALSARates[i]);
+		if (!item || PyList_Append(rates, item) < 0) {
+			Py_XDECREF(item);
+			goto exit;
+		}
+		Py_DECREF(item);
+	}
 
-#define MIXER_CHANNEL_ALL -1
+	if (!(caps = PyStructSequence_New(state->caps_type)))
+		goto exit;
 
-static int
-alsamixer_gethandle(char *cardname, snd_mixer_t **handle)
-{
-	int err;
-	if ((err = snd_mixer_open(handle, 0)) < 0)
-		return err;
-	if ((err = snd_mixer_attach(*handle, cardname)) >= 0 &&
-		(err = snd_mixer_selem_register(*handle, NULL, NULL)) >= 0 &&
-		(err = snd_mixer_load(*handle)) >= 0)
-		return 0;
-	snd_mixer_close(*handle);
-	return err;
+	PyStructSequence_SET_ITEM(caps, 0, PyUnicode_FromString(device));
+	PyStructSequence_SET_ITEM(caps, 1, PyLong_FromLong(pcmtype));
+	PyStructSequence_SET_ITEM(caps, 2, alsacaps_card_id(*card));
+	PyStructSequence_SET_ITEM(caps, 3, PyDictProxy_New(formats));
+	PyStructSequence_SET_ITEM(caps, 4, PyList_AsTuple(channels));
+	PyStructSequence_SET_ITEM(caps, 5, PyLong_FromUnsignedLong(cmin));
+	PyStructSequence_SET_ITEM(caps, 6, PyLong_FromUnsignedLong(cmax));
+	PyStructSequence_SET_ITEM(caps, 7, PyList_AsTuple(rates));
+	PyStructSequence_SET_ITEM(caps, 8, PyLong_FromUnsignedLong(rmin));
+	PyStructSequence_SET_ITEM(caps, 9, PyLong_FromUnsignedLong(rmax));
+	PyStructSequence_SET_ITEM(caps, 10, PyLong_FromUnsignedLong(pmin));
+	PyStructSequence_SET_ITEM(caps, 11, PyLong_FromUnsignedLong(pmax));
+	PyStructSequence_SET_ITEM(caps, 12, PyLong_FromUnsignedLong(bmin));
+	PyStructSequence_SET_ITEM(caps, 13, PyLong_FromUnsignedLong(bmax));
+
+	for (i = 0; i < ALSACAPS_FIELDS; i++) {
+		if (!PyStructSequence_GET_ITEM(caps, i)) {
+			Py_CLEAR(caps);
+			break;
+		}
+	}
+
+ exit:
+	Py_XDECREF(formats);
+	Py_XDECREF(channels);
+	Py_XDECREF(rates);
+	Py_BEGIN_ALLOW_THREADS
+	snd_pcm_close(pcm);
+	Py_END_ALLOW_THREADS
+	return caps;
 }
 
+/* Read the on-disk cache as a dict. A missing or damaged cache is empty. */
 static PyObject *
-alsamixer_list(PyObject *self, PyObject *args, PyObject *kwds)
+alsacaps_load(const char *path)
 {
-	snd_mixer_t *handle;
-	snd_mixer_selem_id_t *sid;
-	snd_mixer_elem_t *elem;
-	int err;
-	int cardidx = -1;
-	char hw_device[128];
-	char *device = "default";
-	PyObject *result;
-
-	char *kw[] = { "cardindex", "device", NULL };
+	PyObject *json, *text = NULL, *cache = NULL;
+	FILE *f;
+	char *buf = NULL;
+	long size;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|is", kw,
-									 &cardidx, &device))
-		return NULL;
+	if ((f = fopen(path, "rb"))) {
+		if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 &&
+			fseek(f, 0, SEEK_SET) == 0 && (buf = PyMem_Malloc(size)) &&
+			fread(buf, 1, size, f) == (size_t)size)
+			text = PyUnicode_DecodeUTF8(buf, size, NULL);
+		PyMem_Free(buf);
+		fclose(f);
+	}
 
-	if (cardidx >= 0) {
-		if (cardidx < 32) {
-			snprintf(hw_device, sizeof(hw_device), "hw:%d", cardidx);
-			device = hw_device;
-		}
-		else {
-			PyErr_Format(ALSAAudioError, "Invalid card number %d", cardidx);
-			return NULL;
-		}
+	if (text && (json = PyImport_ImportModule("json"))) {
+		cache = PyObject_CallMethod(json, "loads", "O", text);
+		Py_DECREF(json);
 	}
+	Py_XDECREF(text);
 
-	snd_mixer_selem_id_alloca(&sid);
-	err = alsamixer_gethandle(device, &handle);
-	if (err < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(err), device);
-		return NULL;
+	if (!cache || !PyDict_Check(cache)) {
+		Py_XDECREF(cache);
+		PyErr_Clear();
+		cache = PyDict_New();
 	}
+	return cache;
+}
 
-	result = PyList_New(0);
+/* Write the on-disk cache, replacing the old one in a single step.
+   Failing to write it is not an error. */
+static void
+alsacaps_save(const char *path, PyObject *cache)
+{
+	PyObject *json, *text = NULL;
+	const char *data;
+	Py_ssize_t size;
+	char *tmp;
+	FILE *f;
+	bool ok;
+
+	if ((json = PyImport_ImportModule("json"))) {
+		text = PyObject_CallMethod(json, "dumps", "O", cache);
+		Py_DECREF(json);
+	}
+
+	if (!text || !(data = PyUnicode_AsUTF8AndSize(text, &size)) ||
+		!(tmp = PyMem_Malloc(strlen(path) + 5))) {
+		Py_XDECREF(text);
+		PyErr_Clear();
+		return;
+	}
 
-	for (elem = snd_mixer_first_elem(handle); elem;
-		 elem = snd_mixer_elem_next(elem))
-	{
-		PyObject *mixer;
-		snd_mixer_selem_get_id(elem, sid);
-		mixer = PyUnicode_FromString(snd_mixer_selem_id_get_name(sid));
-		PyList_Append(result,mixer);
-		Py_DECREF(mixer);
+	sprintf(tmp, "%s.tmp", path);
+	if ((f = fopen(tmp, "wb"))) {
+		ok = fwrite(data, 1, size, f) == (size_t)size;
+		ok = fclose(f) == 0 && ok;
+		if (!ok || rename(tmp, path) < 0)
+			remove(tmp);
 	}
-	snd_mixer_close(handle);
 
-	return result;
+	PyMem_Free(tmp);
+	Py_DECREF(text);
 }
 
-static snd_mixer_elem_t *
-alsamixer_find_elem(snd_mixer_t *handle, char *control, int id)
+/* A cache entry: the card's index, its id, and the capabilities as a list */
+static PyObject *
+alsacaps_to_entry(PyObject *caps, int card)
 {
-	snd_mixer_selem_id_t *sid;
+	PyObject *fields, *formats, *entry;
+	Py_ssize_t i;
 
-	snd_mixer_selem_id_alloca(&sid);
-	snd_mixer_selem_id_set_index(sid, id);
-	snd_mixer_selem_id_set_name(sid, control);
-	return snd_mixer_find_selem(handle, sid);
+	if (!(fields = PyList_New(ALSACAPS_FIELDS)))
+		return NULL;
+
+	for (i = 0; i < (Py_ssize_t)ALSACAPS_FIELDS; i++) {
+		PyObject *item = PyStructSequence_GET_ITEM(caps, i);
+		Py_INCREF(item);
+		PyList_SET_ITEM(fields, i, item);
+	}
+
+	// json can't serialize the read-only view
+	if (!(formats = PyDict_Copy(PyStructSequence_GET_ITEM(caps, ALSACAPS_FORMATS)))) {
+		Py_DECREF(fields);
+		return NULL;
+	}
+	PyList_SetItem(fields, ALSACAPS_FORMATS, formats);
+
+	entry = Py_BuildValue("{s:i,s:O,s:N}", "card", card,
+						  "card_id", PyStructSequence_GET_ITEM(caps, 2),
+						  "fields", fields);
+	return entry;
 }
 
+/* The capabilities in a cache entry, if the entry is well-formed and the
+   same card is still at the same index. Returns NULL without an exception
+   otherwise. */
 static PyObject *
-alsamixer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+alsacaps_from_entry(PyTypeObject *type, PyObject *entry)
 {
-	alsamixer_t *self;
-	int err;
-	char *control = "Master";
-	char *device = "default";
-	char hw_device[128];
-	int cardidx = -1;
-	int id = 0;
-	snd_mixer_elem_t *elem;
-	int channel;
-	char *kw[] = { "control", "id", "cardindex", "device", NULL };
+	PyObject *card, *card_id, *fields, *current, *caps, *item;
+	Py_ssize_t i;
+	long index;
+	int same;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|siis", kw,
-									 &control, &id, &cardidx, &device)) {
+	if (!PyDict_Check(entry) ||
+		!(card = PyDict_GetItemString(entry, "card")) ||
+		!PyLong_Check(card) ||
+		!(card_id = PyDict_GetItemString(entry, "card_id")) ||
+		!(fields = PyDict_GetItemString(entry, "fields")) ||
+		!PyList_Check(fields) ||
+		PyList_GET_SIZE(fields) != (Py_ssize_t)ALSACAPS_FIELDS ||
+		!PyDict_Check(PyList_GET_ITEM(fields, ALSACAPS_FORMATS)))
+		return NULL;
+
+	index = PyLong_AsLong(card);
+	if ((index == -1 && PyErr_Occurred()) || index > INT_MAX ||
+		!(current = alsacaps_card_id(index))) {
+		PyErr_Clear();
+		return NULL;
+	}
+	same = PyObject_RichCompareBool(current, card_id, Py_EQ);
+	Py_DECREF(current);
+	if (same <= 0) {
+		PyErr_Clear();
 		return NULL;
 	}
 
-	if (cardidx >= 0) {
-		if (cardidx < 32) {
-			snprintf(hw_device, sizeof(hw_device), "hw:%d", cardidx);
-			device = hw_device;
-		}
-		else {
-			PyErr_Format(ALSAAudioError, "Invalid card number %d", cardidx);
+	if (!(caps = PyStructSequence_New(type))) {
+		PyErr_Clear();
+		return NULL;
+	}
+
+	for (i = 0; i < (Py_ssize_t)ALSACAPS_FIELDS; i++) {
+		item = PyList_GET_ITEM(fields, i);
+		if (i == ALSACAPS_FORMATS)
+			item = PyDictProxy_New(item);
+		else if (PyList_Check(item))
+			item = PyList_AsTuple(item);
+		else
+			Py_INCREF(item);
+
+		if (!item) {
+			PyErr_Clear();
+			Py_DECREF(caps);
 			return NULL;
 		}
+		PyStructSequence_SET_ITEM(caps, i, item);
 	}
 
-	if (!(self = (alsamixer_t *)PyObject_New(alsamixer_t, &ALSAMixerType)))
-		return NULL;
+	return caps;
+}
 
-	self->handle = 0;
+static PyObject *
+alsa_capabilities(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	alsaaudio_state_t *state = PyModule_GetState(self);
+	char *device = "default";
+	PyObject *pcmtypeobj = NULL;
+	PyObject *path_obj = Py_None, *path = NULL;
+	PyObject *key, *caps = NULL, *cache = NULL, *entry = NULL;
+	const char *cache_path = NULL;
+	int refresh = 0, card = -1;
+	long pcmtype;
 
-	err = alsamixer_gethandle(device, &self->handle);
-	if (err < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(err), device);
+	char *kw[] = { "device", "type", "cache", "refresh", NULL };
 
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sOOp:capabilities", kw,
+									 &device, &pcmtypeobj, &path_obj,
+									 &refresh))
 		return NULL;
-	}
-
-	self->cardname = strdup(device);
-	self->controlname = strdup(control);
-	self->controlid = id;
 
-	elem = alsamixer_find_elem(self->handle,control, id);
-	if (!elem)
-	{
-		snd_mixer_close(self->handle);
-		PyErr_Format(ALSAAudioError,
-					 "Unable to find mixer control %s,%i [%s]",
-					 self->controlname, self->controlid, self->cardname);
-		free(self->cardname);
-		free(self->controlname);
+	pcmtype = get_pcmtype(state, pcmtypeobj);
+	if (pcmtype < 0)
 		return NULL;
+
+	if (path_obj != Py_None) {
+		if (!PyUnicode_FSConverter(path_obj, &path))
+			return NULL;
+		cache_path = PyBytes_AS_STRING(path);
 	}
-	/* Determine mixer capabilities */
-	self->volume_cap = self->switch_cap = 0;
-	if (snd_mixer_selem_has_common_volume(elem))
-	{
-		self->volume_cap |= MIXER_CAP_VOLUME;
-		if (snd_mixer_selem_has_playback_volume_joined(elem))
-			self->volume_cap |= MIXER_CAP_VOLUME_JOINED;
+
+	if (!(key = Py_BuildValue("(sl)", device, pcmtype)))
+		goto exit;
+
+	if (!refresh) {
+#if PY_VERSION_HEX >= 0x030D0000
+		// Another thread may replace the entry, so don't borrow it
+		if (PyDict_GetItemRef(state->caps_cache, key, &caps) != 0)
+			goto exit;
+#else
+		caps = PyDict_GetItemWithError(state->caps_cache, key);
+		if (caps) {
+			Py_INCREF(caps);
+			goto exit;
+		}
+		if (PyErr_Occurred())
+			goto exit;
+#endif
 	}
-	else
-	{
-		if (snd_mixer_selem_has_playback_volume(elem))
-		{
-			self->volume_cap |= MIXER_CAP_PVOLUME;
-			if (snd_mixer_selem_has_playback_volume_joined(elem))
-				self->volume_cap |= MIXER_CAP_PVOLUME_JOINED;
+
+	if (cache_path) {
+		cache = alsacaps_load(cache_path);
+		if (!cache)
+			goto exit;
+		if (!(entry = PyUnicode_FromFormat("%ld:%s", pcmtype, device)))
+			goto exit;
+		if (!refresh) {
+			PyObject *cached = PyDict_GetItem(cache, entry);
+			if (cached)
+				caps = alsacaps_from_entry(state->caps_type, cached);
 		}
-		if (snd_mixer_selem_has_capture_volume(elem))
+	}
+
+	if (!caps) {
+		if (!(caps = alsacaps_probe(state, device, pcmtype, &card)))
+			goto exit;
+
+		// Only devices backed by a card can be recognized later
+		if (cache && card >= 0) {
+			PyObject *value = alsacaps_to_entry(caps, card);
+			if (!value || PyDict_SetItem(cache, entry, value) < 0) {
+				Py_XDECREF(value);
+				Py_CLEAR(caps);
+				goto exit;
+			}
+			Py_DECREF(value);
+			alsacaps_save(cache_path, cache);
+		}
+	}
+
+	if (PyDict_SetItem(state->caps_cache, key, caps) < 0)
+		Py_CLEAR(caps);
+
+ exit:
+	Py_XDECREF(key);
+	Py_XDECREF(cache);
+	Py_XDECREF(entry);
+	Py_XDECREF(path);
+	return caps;
+}
+#endif
+
+/* Apply the software parameters in `values` that aren't negative on top of
+   those in effect. Thresholds beyond the boundary are clamped to it. */
+static int
+alsapcm_apply_sw_params(alsapcm_t *self, const long *values)
+{
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t boundary, val;
+	int i, res = 0;
+
+	for (i = 0; i < ALSAPCM_SW_PARAMS && values[i] < 0; i++)
+		;
+	if (i == ALSAPCM_SW_PARAMS)
+		return 0;
+
+	snd_pcm_sw_params_alloca(&swparams);
+	res = snd_pcm_sw_params_current(self->handle, swparams);
+	if (res < 0)
+		return res;
+	snd_pcm_sw_params_get_boundary(swparams, &boundary);
+
+	for (i = 0; i < ALSAPCM_SW_PARAMS && res >= 0; i++) {
+		if (values[i] < 0)
+			continue;
+
+		val = (snd_pcm_uframes_t)values[i] < boundary ? values[i] : boundary;
+		switch (i) {
+		case ALSAPCM_SW_AVAIL_MIN:
+			res = snd_pcm_sw_params_set_avail_min(self->handle, swparams, val);
+			break;
+		case ALSAPCM_SW_START_THRESHOLD:
+			res = snd_pcm_sw_params_set_start_threshold(self->handle,
+														swparams, val);
+			break;
+		case ALSAPCM_SW_STOP_THRESHOLD:
+			res = snd_pcm_sw_params_set_stop_threshold(self->handle,
+													   swparams, val);
+			break;
+		case ALSAPCM_SW_SILENCE_THRESHOLD:
+			res = snd_pcm_sw_params_set_silence_threshold(self->handle,
+														  swparams, val);
+			break;
+		case ALSAPCM_SW_SILENCE_SIZE:
+			res = snd_pcm_sw_params_set_silence_size(self->handle,
+													 swparams, val);
+			break;
+		case ALSAPCM_SW_PERIOD_EVENT:
+			res = snd_pcm_sw_params_set_period_event(self->handle, swparams,
+													 values[i] != 0);
+			break;
+		}
+	}
+
+	if (res < 0)
+		return res;
+
+	return snd_pcm_sw_params(self->handle, swparams);
+}
+
+/* Sync the configurable parameters with the hardware parameters in effect,
+   which may differ from the requested values */
+static void
+alsapcm_get_hw_params(alsapcm_t *self, snd_pcm_hw_params_t *hwparams)
+{
+	int dir;
+
+	snd_pcm_hw_params_current(self->handle, hwparams);
+
+	snd_pcm_hw_params_get_format(hwparams, &self->format);
+	snd_pcm_hw_params_get_channels(hwparams, &self->channels);
+	snd_pcm_hw_params_get_rate(hwparams, &self->rate, &dir);
+	snd_pcm_hw_params_get_period_size(hwparams, &self->periodsize, &dir);
+	snd_pcm_hw_params_get_periods(hwparams, &self->periods, &dir);
+	snd_pcm_hw_params_get_buffer_size(hwparams, &self->buffersize);
+
+	self->framesize = self->channels * snd_pcm_format_physical_width(self->format)/8;
+}
+
+static int alsapcm_setup(alsapcm_t *self)
+{
+	int res,dir;
+	snd_pcm_hw_params_t *hwparams;
+
+	/* Allocate a hwparam structure on the stack,
+	   and fill it with configuration space */
+	snd_pcm_hw_params_alloca(&hwparams);
+	res = snd_pcm_hw_params_any(self->handle, hwparams);
+	if (res < 0) {
+		return res;
+	}
+
+	/* The access type determines which transfer functions we use, so it
+	   has to be honoured exactly */
+	res = snd_pcm_hw_params_set_access(self->handle, hwparams, self->access);
+	if (res < 0) {
+		return res;
+	}
+
+	/* Fill it with default values.
+
+	   We don't care if any of this fails - we'll read the actual values
+	   back out.
+	 */
+	snd_pcm_hw_params_set_format(self->handle, hwparams, self->format);
+	snd_pcm_hw_params_set_channels(self->handle, hwparams,
+								   self->channels);
+
+	dir = 0;
+	snd_pcm_hw_params_set_rate_near(self->handle, hwparams, &self->rate, &dir);
+	snd_pcm_hw_params_set_period_size_near(self->handle, hwparams,
+										   &self->periodsize, &dir);
+	snd_pcm_hw_params_set_periods_near(self->handle, hwparams, &self->periods, &dir);
+
+	/* Write it to the device */
+	res = snd_pcm_hw_params(self->handle, hwparams);
+
+	/* Query current settings. These may differ from the requested values,
+	   which should therefore be sync'ed with actual values */
+	alsapcm_get_hw_params(self, hwparams);
+
+	/* Installing the hardware parameters reset the software parameters to
+	   their defaults */
+	if (res >= 0)
+		res = alsapcm_apply_sw_params(self, self->swparams);
+
+	return res;
+}
+
+/* Convert between the rate asked for and the rate the device settled on,
+   if the caller wants that. Sets an exception and returns -1 on failure. */
+static int
+alsapcm_setup_resampler(alsapcm_t *self)
+{
+	bool interleaved = self->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
+		self->access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+	alsaresampler_free(self->resampler);
+	self->resampler = NULL;
+	// Pending frames are in the old format
+	self->npending = 0;
+
+	if (!self->resample || self->rate == self->user_rate)
+		return 0;
+
+	if (!interleaved) {
+		PyErr_Format(ALSAAudioError(self), "Resampling needs interleaved "
+					 "access [%s]", self->cardname);
+		return -1;
+	}
+
+	if (!alsaconv_supported(self->format)) {
+		PyErr_Format(ALSAAudioError(self), "Cannot resample %s samples [%s]",
+					 snd_pcm_format_name(self->format), self->cardname);
+		return -1;
+	}
+
+	if (self->pcmtype == SND_PCM_STREAM_PLAYBACK)
+		self->resampler = alsaresampler_new(alsaaudio_state_of(self),
+											self->channels, self->user_rate,
+											self->rate, self->resample);
+	else
+		self->resampler = alsaresampler_new(alsaaudio_state_of(self),
+											self->channels, self->rate,
+											self->user_rate, self->resample);
+
+	return self->resampler ? 0 : -1;
+}
+
+static PyObject *
+alsapcm_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	int res;
+	alsaaudio_state_t *state = alsaaudio_type_state(type);
+	alsapcm_t *self;
+	PyObject *pcmtypeobj = NULL;
+	long pcmtype;
+	int pcmmode = 0;
+	char *device = "default";
+	char *card = NULL;
+	int cardidx = -1;
+	char hw_device[128];
+	int rate = 44100;
+	int channels = 2;
+	int format = SND_PCM_FORMAT_S16_LE;
+	int periods = 4;
+	int periodsize = 32;
+	int access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	int resample = 0;
+	long swparams[ALSAPCM_SW_PARAMS] = { -1, -1, -1, -1, -1, -1 };
+
+	char *kw[] = { "type", "mode", "device", "cardindex", "card",
+				   "rate", "channels", "format", "periodsize", "periods",
+				   "access", "resample", "avail_min", "start_threshold",
+				   "stop_threshold", "silence_threshold", "silence_size",
+				   "period_event", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oisiziiiiiiillllll", kw,
+									 &pcmtypeobj, &pcmmode, &device, &cardidx, &card,
+									 &rate, &channels, &format, &periodsize, &periods,
+									 &access, &resample,
+									 &swparams[ALSAPCM_SW_AVAIL_MIN],
+									 &swparams[ALSAPCM_SW_START_THRESHOLD],
+									 &swparams[ALSAPCM_SW_STOP_THRESHOLD],
+									 &swparams[ALSAPCM_SW_SILENCE_THRESHOLD],
+									 &swparams[ALSAPCM_SW_SILENCE_SIZE],
+									 &swparams[ALSAPCM_SW_PERIOD_EVENT]))
+		return NULL;
+
+	if (cardidx >= 0) {
+		if (cardidx < 32) {
+			snprintf(hw_device, sizeof(hw_device), "hw:%d", cardidx);
+			device = hw_device;
+		}
+		else {
+			PyErr_Format(state->error, "Invalid card number %d", cardidx);
+			return NULL;
+		}
+	}
+	else if (card) {
+		// The card kw argument is deprecated
+		PyErr_WarnEx(PyExc_DeprecationWarning,
+					 "The `card` keyword argument is deprecated. "
+					 "Please use `device` instead", 1);
+
+		// If we find a colon, we assume it is a real ALSA cardname
+		if (strchr(card, ':')) {
+			device = card;
+		}
+
+		snprintf(hw_device, sizeof(hw_device), "default:CARD=%s", card);
+		device = hw_device;
+	}
+
+	pcmtype = get_pcmtype(state, pcmtypeobj);
+	if (pcmtype < 0) {
+		return NULL;
+	}
+
+	if (pcmmode < 0 || pcmmode > SND_PCM_ASYNC) {
+		PyErr_SetString(state->error, "Invalid PCM mode");
+		return NULL;
+	}
+
+	if (access != SND_PCM_ACCESS_RW_INTERLEAVED &&
+		access != SND_PCM_ACCESS_RW_NONINTERLEAVED &&
+		access != SND_PCM_ACCESS_MMAP_INTERLEAVED &&
+		access != SND_PCM_ACCESS_MMAP_NONINTERLEAVED) {
+		PyErr_SetString(state->error, "Invalid PCM access type");
+		return NULL;
+	}
+
+	if (resample < 0 || resample >= (int)ARRAY_SIZE(ALSAResampleQualities)) {
+		PyErr_SetString(state->error, "Invalid resampling quality");
+		return NULL;
+	}
+
+	if (!(self = (alsapcm_t *)PyObject_New(alsapcm_t, type)))
+		return NULL;
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	self->io_busy = false;
+	self->closing = false;
+	self->handle = 0;
+	self->pcmtype = pcmtype;
+	self->pcmmode = pcmmode;
+	self->channels = channels;
+	self->rate = rate;
+	self->format = format;
+	self->periods = periods;
+	self->periodsize = periodsize;
+	self->access = access;
+	memcpy(self->swparams, swparams, sizeof(swparams));
+	self->mmap_view = NULL;
+	self->mmap_offset = 0;
+	self->mmap_frames = 0;
+	self->thread_running = false;
+	atomic_init(&self->thread_stop, 0);
+	self->thread_error = 0;
+	self->thread_exc_type = self->thread_exc_value = self->thread_exc_tb = NULL;
+	self->callback = NULL;
+	self->ring = NULL;
+	self->cbview = NULL;
+	self->cbbuffer = NULL;
+	self->cbframes = 0;
+	atomic_init(&self->xruns, 0);
+	memset(&self->stats, 0, sizeof(self->stats));
+	self->stats.avail_min = self->stats.avail_max = -1;
+	atomic_init(&self->stats_timing, 0);
+	self->convbuf = NULL;
+	self->convsize = 0;
+	alsaconv_seed(self->dither);
+	self->matrix = NULL;
+	self->matrix_in = self->matrix_out = 0;
+	self->gain = self->gain_target = 1.0f;
+	self->gain_step = 0.0f;
+	self->gain_ramp = 0;
+	self->meters = NULL;
+	self->resample = resample;
+	self->user_rate = rate;
+	self->resampler = NULL;
+	self->pending = NULL;
+	self->pendingcap = 0;
+	self->npending = 0;
+	self->pollfds = NULL;
+	self->npollfds = 0;
+	self->poller = NULL;
+	self->cardname = NULL;
+
+	// Opening a busy device, or one behind a slow bus, can take a while
+	Py_BEGIN_ALLOW_THREADS
+	res = alsapcm_open(&(self->handle), device, self->pcmtype,
+					   self->pcmmode);
+
+	if (res >= 0) {
+		res = alsapcm_setup(self);
+	}
+
+	if (res < 0 && self->handle) {
+		snd_pcm_close(self->handle);
+		self->handle = 0;
+	}
+	Py_END_ALLOW_THREADS
+
+	if (res < 0) {
+		PyErr_Format(state->error, "%s [%s]", snd_strerror(res), device);
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	if (!(self->cardname = strdup(device))) {
+		PyErr_NoMemory();
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	if (alsapcm_setup_resampler(self) < 0) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+/* Perform a single transfer of `frames` frames in the stream's direction,
+   using the transfer function matching the access type. For non-interleaved
+   access, `data` points to an array of per-channel buffers.
+
+   Called without the GIL. */
+static snd_pcm_sframes_t
+alsapcm_transfer_frames(alsapcm_t *self, void *data, snd_pcm_uframes_t frames)
+{
+	if (self->pcmtype == SND_PCM_STREAM_PLAYBACK) {
+		switch (self->access) {
+		case SND_PCM_ACCESS_MMAP_INTERLEAVED:
+			return snd_pcm_mmap_writei(self->handle, data, frames);
+		case SND_PCM_ACCESS_MMAP_NONINTERLEAVED:
+			return snd_pcm_mmap_writen(self->handle, data, frames);
+		case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+			return snd_pcm_writen(self->handle, data, frames);
+		default:
+			return snd_pcm_writei(self->handle, data, frames);
+		}
+	}
+	else {
+		switch (self->access) {
+		case SND_PCM_ACCESS_MMAP_INTERLEAVED:
+			return snd_pcm_mmap_readi(self->handle, data, frames);
+		case SND_PCM_ACCESS_MMAP_NONINTERLEAVED:
+			return snd_pcm_mmap_readn(self->handle, data, frames);
+		case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+			return snd_pcm_readn(self->handle, data, frames);
+		default:
+			return snd_pcm_readi(self->handle, data, frames);
+		}
+	}
+}
+
+/* Make the stream ready for alsapcm_transfer_frames(). Returns 0 or a
+   negative error code. */
+static int
+alsapcm_transfer_prepare(alsapcm_t *self)
+{
+	// The I/O thread owns the stream while it is running
+	if (self->thread_running)
+		return -EBUSY;
+
+	// After drop() and drain(), we need to prepare the stream again.
+	// Note that fresh streams are already prepared by snd_pcm_hw_params().
+	if (snd_pcm_state(self->handle) == SND_PCM_STATE_SETUP)
+		return snd_pcm_prepare(self->handle);
+
+	return 0;
+}
+
+/* Transfer `frames` interleaved frames, retrying short transfers until all
+   frames were transferred. The loop stops early when the device isn't ready
+   in non-blocking mode, or on an error. The number of frames transferred is
+   added to `*done`.
+
+   Returns the result of the last transfer. Called without the GIL. */
+static snd_pcm_sframes_t
+alsapcm_transfer_interleaved(alsapcm_t *self, char *data,
+							 snd_pcm_uframes_t frames, snd_pcm_uframes_t *done)
+{
+	snd_pcm_sframes_t res;
+	snd_pcm_uframes_t n = 0;
+
+	do {
+		res = alsapcm_transfer_frames(self, data + n * self->framesize,
+									  frames - n);
+		if (res <= 0)
+			break;
+		n += res;
+	} while (n < frames);
+
+	*done += n;
+	return res;
+}
+
+/* Turn the result of the last transfer into the return value of
+   alsapcm_transfer(), recovering the stream after an underrun or overrun */
+static snd_pcm_sframes_t
+alsapcm_transfer_finish(alsapcm_t *self, snd_pcm_sframes_t res,
+						snd_pcm_uframes_t done)
+{
+	if (res == -EPIPE) {
+		atomic_fetch_add(&self->xruns, 1);
+		// This means buffer underrun or overrun, which we need to report.
+		// However, we recover the stream, so the next PCM.write() or
+		// PCM.read() will work again. If recovery fails (very unlikely),
+		// report that instead.
+		if (!(res = snd_pcm_prepare(self->handle)))
+			res = -EPIPE;
+	}
+
+	if (done)
+		return done;
+
+	// drop() in another thread stopped the stream under a blocked transfer
+	if (res == -EBADFD && snd_pcm_state(self->handle) == SND_PCM_STATE_SETUP)
+		res = 0;
+
+	if (res == -EAGAIN)
+		res = 0;
+
+	return res;
+}
+
+/* Start timing a transfer for stats(), if enable_stats() asked for it.
+   Stores the frames available in `*avail`, or -1. Returns the start time,
+   or 0 when the transfer isn't timed. Called without the GIL. */
+static uint64_t
+alsapcm_stats_begin(alsapcm_t *self, snd_pcm_sframes_t *avail)
+{
+	if (!atomic_load_explicit(&self->stats_timing, memory_order_relaxed)) {
+		*avail = -1;
+		return 0;
+	}
+
+	*avail = snd_pcm_avail_update(self->handle);
+	return alsapcm_now_ns();
+}
+
+/* The time a transfer took since alsapcm_stats_begin(), or 0 */
+static uint64_t
+alsapcm_stats_end(uint64_t start)
+{
+	return start ? alsapcm_now_ns() - start : 0;
+}
+
+/* Account a transfer of `frames` frames in the counters of stats(). `res`
+   and `done` are what the transfer functions returned, before
+   alsapcm_transfer_finish(), `avail` is the number of frames available when
+   the transfer started, and `ns` the time it took without the GIL. */
+static void
+alsapcm_stats_update(alsapcm_t *self, snd_pcm_uframes_t frames,
+					 snd_pcm_sframes_t res, snd_pcm_uframes_t done,
+					 snd_pcm_sframes_t avail, uint64_t ns)
+{
+	alsapcm_stats_t *stats = &self->stats;
+
+	// Non-interleaved transfers aren't retried, and only report in res
+	if (!done && res > 0)
+		done = res;
+
+	stats->calls++;
+	stats->frames += done;
+	if (res == -EAGAIN)
+		stats->eagain++;
+	if (done && done < frames)
+		stats->partial++;
+
+	stats->blocked_ns += ns;
+	if (ns > stats->blocked_max_ns)
+		stats->blocked_max_ns = ns;
+
+	// avail is negative after an xrun, which is counted separately
+	if (avail >= 0) {
+		if (stats->avail_min < 0 || avail < stats->avail_min)
+			stats->avail_min = avail;
+		if (avail > stats->avail_max)
+			stats->avail_max = avail;
+	}
+}
+
+/* Write or read up to `frames` frames from or to `data`, depending on the
+   stream direction.
+
+   With interleaved access, short transfers are retried until all frames
+   were transferred, without taking the GIL in between.
+
+   Returns the number of frames transferred, 0 if the device wasn't ready in
+   non-blocking mode, or a negative error code. A buffer underrun or overrun
+   is reported as -EPIPE, after the stream was recovered, unless some frames
+   were transferred before it happened.
+
+   This doesn't update the meters: callers that have float32 samples meter
+   them with alsameter_update_float() instead of converting them again. */
+static snd_pcm_sframes_t
+alsapcm_transfer_unmetered(alsapcm_t *self, void *data,
+						   snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t res, avail;
+	snd_pcm_uframes_t done = 0;
+	uint64_t start, ns;
+	bool interleaved = self->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
+		self->access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+	if ((res = alsapcm_transfer_prepare(self)) < 0)
+		return res;
+
+	ALSAPCM_BEGIN_BLOCKING(self)
+	start = alsapcm_stats_begin(self, &avail);
+	if (interleaved)
+		res = alsapcm_transfer_interleaved(self, data, frames, &done);
+	else
+		res = alsapcm_transfer_frames(self, data, frames);
+	ns = alsapcm_stats_end(start);
+	ALSAPCM_END_BLOCKING(self)
+
+	alsapcm_stats_update(self, frames, res, done, avail, ns);
+	return alsapcm_transfer_finish(self, res, done);
+}
+
+/* Update the meters with `frames` frames in the device format, interleaved
+   or with one buffer per channel depending on the access type */
+static void
+alsapcm_meter(alsapcm_t *self, void *data, snd_pcm_sframes_t frames)
+{
+	if (!self->meters || frames <= 0)
+		return;
+
+	if (self->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
+		self->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		alsameter_update(self->meters, self->format, self->channels, data,
+						 frames);
+	else
+		alsameter_update_planar(self->meters, self->format, self->channels,
+								data, frames);
+}
+
+/* Like alsapcm_transfer_unmetered(), and update the meters with the frames
+   that were transferred */
+static snd_pcm_sframes_t
+alsapcm_transfer(alsapcm_t *self, void *data, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t res = alsapcm_transfer_unmetered(self, data, frames);
+
+	alsapcm_meter(self, data, res);
+	return res;
+}
+
+/* Set the meters up again after the hardware parameters changed, since they
+   depend on the format, channels and rate. If the new format can't be
+   converted to float32, metering is turned off. */
+static int
+alsapcm_reset_meters(alsapcm_t *self)
+{
+	if (!self->meters)
+		return 0;
+
+	alsameter_free(self->meters);
+	self->meters = NULL;
+
+	if (!alsaconv_supported(self->format))
+		return 0;
+
+	if (!(self->meters = alsameter_new(self->format, self->channels,
+									   self->rate))) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	return 0;
+}
+
+/* Check whether the interleaved (planar == false) or non-interleaved
+   (planar == true) transfer functions may be used with this PCM */
+static int
+alsapcm_check_access(alsapcm_t *self, bool planar)
+{
+	bool interleaved = self->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
+		self->access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+	if (interleaved == planar) {
+		PyErr_Format(ALSAAudioError(self), planar ?
+					 "PCM uses interleaved access [%s]" :
+					 "PCM uses non-interleaved access [%s]",
+					 self->cardname);
+		return -1;
+	}
+	return 0;
+}
+
+/* Produce the next buffer for playback, or consume a captured buffer.
+
+   In ring buffer mode, the ring is drained or filled without taking the GIL,
+   and an empty or full ring counts as an xrun of the ring.
+
+   Otherwise, the callback runs on the shared buffer, with the GIL held, in
+   the interpreter that called start(). PyGILState_Ensure() would always
+   pick the main interpreter, so the thread keeps a thread state of its own.
+   Returns -1 if it raised, after stashing the exception away for stop() */
+static int
+alsapcm_thread_exchange(alsapcm_t *self)
+{
+	PyObject *res;
+	size_t frames;
+	int rc = 0;
+
+	if (self->ring) {
+		if (self->pcmtype == SND_PCM_STREAM_PLAYBACK) {
+			frames = alsaring_read(self->ring, self->cbbuffer, self->cbframes);
+			if (frames < self->cbframes) {
+				snd_pcm_format_set_silence(self->format,
+										   self->cbbuffer + frames * self->framesize,
+										   (self->cbframes - frames) * self->channels);
+				atomic_fetch_add(&self->ring->xruns, 1);
+			}
+		}
+		else {
+			frames = alsaring_write(self->ring, self->cbbuffer, self->cbframes);
+			if (frames < self->cbframes)
+				atomic_fetch_add(&self->ring->xruns, 1);
+		}
+		return 0;
+	}
+
+	if (!self->tstate) {
+		self->tstate = PyThreadState_New(self->interp);
+		if (!self->tstate) {
+			self->thread_error = -ENOMEM;
+			return -1;
+		}
+	}
+
+	PyEval_RestoreThread(self->tstate);
+
+	res = PyObject_CallFunctionObjArgs(self->callback, self->cbview, NULL);
+	if (res) {
+		Py_DECREF(res);
+	}
+	else {
+		PyErr_Fetch(&self->thread_exc_type, &self->thread_exc_value,
+					&self->thread_exc_tb);
+		rc = -1;
+	}
+
+	PyEval_SaveThread();
+
+	return rc;
+}
+
+/* Apply the software gain to the next buffer the I/O thread plays. The
+   thread takes the lock just for the gain, so that set_gain() can be
+   called while it runs. */
+static void
+alsapcm_thread_gain_apply(alsapcm_t *self)
+{
+	pthread_mutex_lock(&self->lock);
+	if (alsapcm_gain_active(self))
+		alsapcm_gain_apply(self, self->cbbuffer, self->cbframes);
+	pthread_mutex_unlock(&self->lock);
+}
+
+/* Account a transfer of `frames` frames by the I/O thread from or to
+   `data`, with result `res`: count it for stats(), move the ramp on by the
+   frames the device accepted, and update the meters, which enable_meters()
+   may replace while the thread runs. */
+static void
+alsapcm_thread_account(alsapcm_t *self, char *data, snd_pcm_uframes_t frames,
+					   snd_pcm_sframes_t res, snd_pcm_sframes_t avail,
+					   uint64_t ns)
+{
+	pthread_mutex_lock(&self->lock);
+	alsapcm_stats_update(self, frames, res, 0, avail, ns);
+	if (self->pcmtype == SND_PCM_STREAM_PLAYBACK)
+		alsapcm_gain_advance(self, res);
+	alsapcm_meter(self, data, res);
+	pthread_mutex_unlock(&self->lock);
+}
+
+/* The realtime I/O thread. It only takes the GIL to run the callback (and
+   never in ring buffer mode), and recovers from xruns by itself, counting
+   them. */
+static void *
+alsapcm_thread_main(void *arg)
+{
+	alsapcm_t *self = (alsapcm_t *)arg;
+	bool playback = self->pcmtype == SND_PCM_STREAM_PLAYBACK;
+	snd_pcm_uframes_t done = 0;
+	snd_pcm_sframes_t res, avail;
+	uint64_t start;
+	char *data;
+
+	while (!atomic_load(&self->thread_stop)) {
+		if (playback && done == 0) {
+			if (alsapcm_thread_exchange(self) < 0)
+				break;
+			alsapcm_thread_gain_apply(self);
+		}
+
+		data = self->cbbuffer + done * self->framesize;
+		start = alsapcm_stats_begin(self, &avail);
+		res = alsapcm_transfer_frames(self, data, self->cbframes - done);
+		alsapcm_thread_account(self, data, self->cbframes - done, res, avail,
+							   alsapcm_stats_end(start));
+		if (res == -EAGAIN) {
+			// Don't spin in non-blocking mode
+			snd_pcm_wait(self->handle, 100);
+			continue;
+		}
+		if (res < 0) {
+			if (res == -EPIPE)
+				atomic_fetch_add(&self->xruns, 1);
+
+			res = snd_pcm_recover(self->handle, res, 1);
+			if (res < 0) {
+				self->thread_error = res;
+				break;
+			}
+			// Partial captures are discarded, partial playback is retried
+			if (!playback)
+				done = 0;
+			continue;
+		}
+
+		done += res;
+		if (done < self->cbframes)
+			continue;
+		done = 0;
+
+		if (!playback && alsapcm_thread_exchange(self) < 0)
+			break;
+	}
+
+	if (self->tstate) {
+		PyEval_RestoreThread(self->tstate);
+		PyThreadState_Clear(self->tstate);
+		self->tstate = NULL;
+		PyThreadState_DeleteCurrent();
+	}
+
+	return NULL;
+}
+
+/* The side of the ring buffer that the I/O thread uses */
+#define alsapcm_ring_side(self) \
+	((self)->pcmtype == SND_PCM_STREAM_PLAYBACK ? \
+	 ALSARING_CONSUMER : ALSARING_PRODUCER)
+
+/* Free what start() set up for the I/O thread, once it isn't running */
+static void
+alsapcm_thread_free(alsapcm_t *self)
+{
+	if (self->ring)
+		alsaring_unclaim(self->ring, alsapcm_ring_side(self));
+	self->ring = NULL;
+	Py_CLEAR(self->cbview);
+	Py_CLEAR(self->callback);
+	PyMem_Free(self->cbbuffer);
+	self->cbbuffer = NULL;
+}
+
+/* Stop and join the I/O thread, and free its resources. Errors and
+   exceptions from the thread remain stashed for the caller.
+
+   The object's lock is held by the caller, and is let go while waiting,
+   since the callback may call methods of the PCM. */
+static void
+alsapcm_thread_join(alsapcm_t *self)
+{
+	alsaaudio_state_t *state = alsaaudio_state_of(self);
+	PyObject *res;
+
+	if (!self->thread_running)
+		return;
+
+	if (self->thread_joining) {
+		// Another thread is joining, wait until it is done
+		while (self->thread_running) {
+			Py_BEGIN_ALLOW_THREADS
+			pthread_cond_wait(&self->cond, &self->lock);
+			Py_END_ALLOW_THREADS
+		}
+		return;
+	}
+
+	self->thread_joining = true;
+	atomic_store(&self->thread_stop, 1);
+	alsalock_release(&self->lock);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(self->thread, NULL);
+	Py_END_ALLOW_THREADS
+
+	alsalock_acquire(&self->lock);
+	self->thread_joining = false;
+	self->thread_running = false;
+	pthread_cond_broadcast(&self->cond);
+
+	/* The callback may have kept a reference to the view */
+	res = PyObject_CallMethod(self->cbview, "release", NULL);
+	if (res)
+		Py_DECREF(res);
+	else
+		PyErr_Clear();
+
+	alsapcm_thread_free(self);
+
+	// The set is gone if the module was cleared first
+	if (state->running && PySet_Discard(state->running, (PyObject *)self) < 0)
+		PyErr_WriteUnraisable((PyObject *)self);
+
+	/* Drop the reference that kept us alive while the thread was running */
+	Py_DECREF(self);
+}
+
+static void
+alsapcm_thread_clear_errors(alsapcm_t *self)
+{
+	Py_CLEAR(self->thread_exc_type);
+	Py_CLEAR(self->thread_exc_value);
+	Py_CLEAR(self->thread_exc_tb);
+	self->thread_error = 0;
+}
+
+/* The stream can't be reconfigured, nor its state changed, while the I/O
+   thread runs or an mmap area is handed out. Raises EBUSY and returns -1 */
+static int
+alsapcm_check_busy(alsapcm_t *self)
+{
+	if (self->thread_running || self->mmap_view) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(-EBUSY),
+					 self->cardname);
+		return -1;
+	}
+	return 0;
+}
+
+/* Like alsapcm_check_busy(), for the methods that reconfigure the stream,
+   which can't run under a transfer in another thread either */
+static int
+alsapcm_check_config(alsapcm_t *self)
+{
+	if (self->io_busy) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(-EBUSY),
+					 self->cardname);
+		return -1;
+	}
+	return alsapcm_check_busy(self);
+}
+
+/* Wait until no transfer is in flight. The lock is held by the caller, and
+   is let go while waiting. */
+static void
+alsapcm_io_wait(alsapcm_t *self)
+{
+	while (self->io_busy) {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_cond_wait(&self->cond, &self->lock);
+		Py_END_ALLOW_THREADS
+	}
+}
+
+/* Mark the PCM as busy with a transfer, see ALSAPCM_BEGIN_BLOCKING(). If
+   another thread's transfer is in flight, wait for it to return, or with
+   `wait` false, raise EBUSY. Returns -1 with an exception set on failure. */
+static int
+alsapcm_io_begin(alsapcm_t *self, bool wait)
+{
+	if (self->io_busy && !wait) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(-EBUSY),
+					 self->cardname);
+		return -1;
+	}
+
+	alsapcm_io_wait(self);
+	if (self->closing) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return -1;
+	}
+
+	self->io_busy = true;
+	return 0;
+}
+
+static void
+alsapcm_io_end(alsapcm_t *self)
+{
+	self->io_busy = false;
+	pthread_cond_broadcast(&self->cond);
+}
+
+/* Define name_locked() for a transfer method, which runs under the lock
+   and marks the PCM as busy with a transfer, see alsapcm_io_begin() */
+#define ALSAPCM_IO_METHOD(name, wait)									\
+	static PyObject *													\
+	name##_locked(alsapcm_t *self, PyObject *args)						\
+	{																	\
+		PyObject *res = NULL;											\
+		alsalock_acquire(&self->lock);									\
+		if (alsapcm_io_begin(self, wait) == 0) {						\
+			res = name(self, args);										\
+			alsapcm_io_end(self);										\
+		}																\
+		alsalock_release(&self->lock);									\
+		return res;														\
+	}
+
+#if PY_MAJOR_VERSION >= 3
+/* Invalidate the memoryview handed out by mmap_begin(), so that it can't be
+   used to access the ring buffer after the area was committed or unmapped */
+static void
+alsapcm_mmap_release(alsapcm_t *self)
+{
+	if (self->mmap_view) {
+		PyObject *res = PyObject_CallMethod(self->mmap_view, "release", NULL);
+		if (res)
+			Py_DECREF(res);
+		else
+			PyErr_Clear();
+		Py_CLEAR(self->mmap_view);
+	}
+	self->mmap_frames = 0;
+}
+#endif
+
+static void alsapcm_dealloc(alsapcm_t *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+#if PY_MAJOR_VERSION >= 3
+	if (self->mmap_view) {
+		PyObject *type, *value, *traceback;
+
+		PyErr_Fetch(&type, &value, &traceback);
+		alsapcm_mmap_release(self);
+		PyErr_Restore(type, value, traceback);
+	}
+#endif
+	alsapoller_detach(&self->poller);
+	if (self->handle) {
+		Py_BEGIN_ALLOW_THREADS
+		snd_pcm_close(self->handle);
+		Py_END_ALLOW_THREADS
+	}
+	alsapcm_thread_clear_errors(self);
+	PyMem_Free(self->convbuf);
+	PyMem_Free(self->matrix);
+	alsameter_free(self->meters);
+	alsaresampler_free(self->resampler);
+	PyMem_Free(self->pending);
+	PyMem_Free(self->pollfds);
+	free(self->cardname);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->lock);
+	PyObject_Del(self);
+	Py_DECREF(tp);
+}
+
+static PyObject *
+alsapcm_close(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":close"))
+		return NULL;
+
+	if (self->handle)
+	{
+		snd_pcm_t *handle;
+
+		alsapoller_detach(&self->poller);
+		alsapcm_thread_join(self);
+		alsapcm_thread_clear_errors(self);
+
+		// Stop a transfer that blocks in another thread, and wait for it
+		// to return before the handle goes away. Transfers that were
+		// waiting for it give up.
+		self->closing = true;
+		if (self->io_busy && self->handle) {
+			Py_BEGIN_ALLOW_THREADS
+			snd_pcm_drop(self->handle);
+			Py_END_ALLOW_THREADS
+		}
+		alsapcm_io_wait(self);
+		self->closing = false;
+
+		// Another close() may have finished while we waited
+		if (!self->handle)
+			Py_RETURN_NONE;
+
+		self->io_busy = true;
+#if PY_MAJOR_VERSION >= 3
+		alsapcm_mmap_release(self);
+#endif
+		// Like the drain below, this is best effort
+		if (self->pcmtype == SND_PCM_STREAM_PLAYBACK)
+			alsapcm_write_pending(self);
+		// Other threads see the PCM as closed while we wait
+		handle = self->handle;
+		self->handle = 0;
+
+		ALSAPCM_BEGIN_BLOCKING(self)
+		if (self->pcmtype == SND_PCM_STREAM_PLAYBACK)
+			snd_pcm_drain(handle);
+		snd_pcm_close(handle);
+		ALSAPCM_END_BLOCKING(self)
+
+		PyMem_Free(self->convbuf);
+		self->convbuf = NULL;
+		self->convsize = 0;
+		PyMem_Free(self->pending);
+		self->pending = NULL;
+		self->pendingcap = 0;
+		self->npending = 0;
+		PyMem_Free(self->pollfds);
+		self->pollfds = NULL;
+		self->npollfds = 0;
+		alsapcm_io_end(self);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+alsapcm_dumpinfo(alsapcm_t *self, PyObject *args)
+{
+	unsigned int val,val2;
+	snd_pcm_access_t acc;
+	snd_pcm_format_t fmt;
+	snd_pcm_subformat_t subfmt;
+	int dir;
+	snd_pcm_uframes_t frames;
+	snd_pcm_hw_params_t *hwparams;
+	snd_pcm_hw_params_alloca(&hwparams);
+	snd_pcm_hw_params_current(self->handle,hwparams);
+
+	if (!PyArg_ParseTuple(args,":dumpinfo"))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	printf("PCM handle name = '%s'\n", snd_pcm_name(self->handle));
+	printf("PCM state = %s\n",
+		   snd_pcm_state_name(snd_pcm_state(self->handle)));
+
+	snd_pcm_hw_params_get_access(hwparams, &acc);
+	printf("access type = %s\n", snd_pcm_access_name(acc));
+
+	snd_pcm_hw_params_get_format(hwparams, &fmt);
+	printf("format = '%s' (%s)\n",
+		   snd_pcm_format_name(fmt),
+		   snd_pcm_format_description(fmt));
+
+	snd_pcm_hw_params_get_subformat(hwparams, &subfmt);
+	printf("subformat = '%s' (%s)\n",
+		   snd_pcm_subformat_name(subfmt),
+		   snd_pcm_subformat_description(subfmt));
+
+	snd_pcm_hw_params_get_channels(hwparams, &val);
+	printf("channels = %d\n", val);
+
+	snd_pcm_hw_params_get_rate(hwparams, &val, &dir);
+	printf("rate = %d bps\n", val);
+
+	snd_pcm_hw_params_get_period_time(hwparams, &val, &dir);
+	printf("period time = %d us\n", val);
+
+	snd_pcm_hw_params_get_period_size(hwparams, &frames, &dir);
+	printf("period size = %d frames\n", (int)frames);
+
+	snd_pcm_hw_params_get_buffer_time(hwparams, &val, &dir);
+	printf("buffer time = %d us\n", val);
+
+	snd_pcm_hw_params_get_buffer_size(hwparams, &frames);
+	printf("buffer size = %d frames\n", (int)frames);
+
+	snd_pcm_hw_params_get_periods(hwparams, &val, &dir);
+	printf("periods per buffer = %d\n", val);
+
+	snd_pcm_hw_params_get_rate_numden(hwparams, &val, &val2);
+	printf("exact rate = %d/%d bps\n", val, val2);
+
+	val = snd_pcm_hw_params_get_sbits(hwparams);
+	printf("significant bits = %d\n", val);
+
+	val = snd_pcm_format_width(self->format);
+	printf("nominal bits = %d\n", val);
+
+	val = snd_pcm_format_physical_width(self->format);
+	printf("physical bits = %d\n", val);
+
+	val = snd_pcm_hw_params_is_batch(hwparams);
+	printf("is batch = %d\n", val);
+
+	val = snd_pcm_hw_params_is_block_transfer(hwparams);
+	printf("is block transfer = %d\n", val);
+
+	val = snd_pcm_hw_params_is_double(hwparams);
+	printf("is double = %d\n", val);
+
+	val = snd_pcm_hw_params_is_half_duplex(hwparams);
+	printf("is half duplex = %d\n", val);
+
+	val = snd_pcm_hw_params_is_joint_duplex(hwparams);
+	printf("is joint duplex = %d\n", val);
+
+	val = snd_pcm_hw_params_can_overrange(hwparams);
+	printf("can overrange = %d\n", val);
+
+	val = snd_pcm_hw_params_can_mmap_sample_resolution(hwparams);
+	printf("can mmap = %d\n", val);
+
+	val = snd_pcm_hw_params_can_pause(hwparams);
+	printf("can pause = %d\n", val);
+
+	val = snd_pcm_hw_params_can_resume(hwparams);
+	printf("can resume = %d\n", val);
+
+	val = snd_pcm_hw_params_can_sync_start(hwparams);
+	printf("can sync start = %d\n", val);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+alsapcm_info(alsapcm_t *self, PyObject *args)
+{
+	PyObject *info;
+	PyObject *value;
+
+	unsigned int val,val2;
+	snd_pcm_access_t acc;
+	snd_pcm_format_t fmt;
+	snd_pcm_subformat_t subfmt;
+	int dir;
+	snd_pcm_uframes_t frames;
+	snd_pcm_hw_params_t *hwparams;
+	snd_pcm_hw_params_alloca(&hwparams);
+	snd_pcm_hw_params_current(self->handle,hwparams);
+
+	snd_pcm_info_t * pcm_info;
+	snd_pcm_info_alloca(&pcm_info);
+
+	if (!PyArg_ParseTuple(args,":info"))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	info = PyDict_New();
+
+	value=PyUnicode_FromString(snd_pcm_name(self->handle));
+	PyDict_SetItemString(info,"name",value);
+	Py_DECREF(value);
+
+	snd_pcm_info(self->handle, pcm_info);
+
+	value = PyLong_FromLong((long) snd_pcm_info_get_card(pcm_info));
+	PyDict_SetItemString(info,"card_no",value);
+	Py_DECREF(value);
+
+	value = PyLong_FromUnsignedLong((unsigned long) snd_pcm_info_get_device(pcm_info));
+	PyDict_SetItemString(info,"device_no",value);
+	Py_DECREF(value);
+
+	value = PyLong_FromUnsignedLong((unsigned long) snd_pcm_info_get_subdevice(pcm_info));
+	PyDict_SetItemString(info,"subdevice_no",value);
+	Py_DECREF(value);
+
+	value=PyUnicode_FromString(snd_pcm_state_name(snd_pcm_state(self->handle)));
+	PyDict_SetItemString(info,"state",value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_access(hwparams, &acc);
+	value=PyUnicode_FromString(snd_pcm_access_name(acc));
+	PyDict_SetItemString(info,"access_type",value);
+	Py_DECREF(value);
+
+	value = PyLong_FromUnsignedLong((unsigned long) self->pcmtype);
+	PyDict_SetItemString(info," (call value) type",value);
+	Py_DECREF(value);
+	value=PyUnicode_FromString(snd_pcm_stream_name((snd_pcm_stream_t) self->pcmtype));
+	PyDict_SetItemString(info," (call value) type_name",value);
+	Py_DECREF(value);
+
+	value = PyLong_FromUnsignedLong((unsigned long) self->pcmmode);
+	PyDict_SetItemString(info," (call value) mode",value);
+	Py_DECREF(value);
+	switch(self->pcmmode){
+		case 0:
+			value = PyUnicode_FromString("PCM_NORMAL");
+			break;
+		case SND_PCM_NONBLOCK:
+			value = PyUnicode_FromString("PCM_NONBLOCK");
+			break;
+		case SND_PCM_ASYNC:
+			value = PyUnicode_FromString("PCM_ASYNC");
+			break;
+	}
+	PyDict_SetItemString(info," (call value) mode_name",value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_format(hwparams, &fmt);
+	value=PyLong_FromUnsignedLong((unsigned long)fmt);
+	PyDict_SetItemString(info,"format",value);
+	Py_DECREF(value);
+	value=PyUnicode_FromString(snd_pcm_format_name(fmt));
+	PyDict_SetItemString(info,"format_name",value);
+	Py_DECREF(value);
+	value=PyUnicode_FromString(snd_pcm_format_description(fmt));
+	PyDict_SetItemString(info,"format_description",value);
+	Py_DECREF(value);
+
+
+	snd_pcm_hw_params_get_subformat(hwparams, &subfmt);
+	value=PyUnicode_FromString(snd_pcm_subformat_name(subfmt));
+	PyDict_SetItemString(info,"subformat_name",value);
+	Py_DECREF(value);
+	value=PyUnicode_FromString(snd_pcm_subformat_description(subfmt));
+	PyDict_SetItemString(info,"subformat_description",value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_channels(hwparams, &val);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"channels", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_rate(hwparams, &val, &dir);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"rate", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_period_time(hwparams, &val, &dir);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"period_time", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_period_size(hwparams, &frames, &dir);
+	value=PyLong_FromUnsignedLong((unsigned long) frames);
+	PyDict_SetItemString(info,"period_size", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_buffer_time(hwparams, &val, &dir);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"buffer_time", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_buffer_size(hwparams, &frames);
+	value=PyLong_FromUnsignedLong((unsigned long) frames);
+	PyDict_SetItemString(info,"buffer_size", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_periods(hwparams, &val, &dir);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"periods", value);
+	Py_DECREF(value);
+
+	snd_pcm_hw_params_get_rate_numden(hwparams, &val, &val2);
+	value=PyTuple_Pack(2,PyLong_FromUnsignedLong((unsigned long) val) \
+				,PyLong_FromUnsignedLong((unsigned long) val2));
+	PyDict_SetItemString(info,"rate_numden", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_get_sbits(hwparams);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"significant_bits", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_format_width(self->format);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"nominal_bits", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_format_physical_width(self->format);
+	value=PyLong_FromUnsignedLong((unsigned long) val);
+	PyDict_SetItemString(info,"physical_bits", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_is_batch(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"is_batch", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_is_block_transfer(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"is_block_transfer", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_is_double(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"is_double", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_is_half_duplex(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"is_half_duplex", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_is_joint_duplex(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"is_joint_duplex", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_can_overrange(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"can_overrange", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_can_mmap_sample_resolution(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"can_mmap_sample_resolution", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_can_pause(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"can_pause", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_can_resume(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"can_resume", value);
+	Py_DECREF(value);
+
+	val = snd_pcm_hw_params_can_sync_start(hwparams);
+	value=PyBool_FromLong((unsigned long) val);
+	PyDict_SetItemString(info,"can_sync_start", value);
+	Py_DECREF(value);
+
+	return info;
+}
+
+static PyObject *
+alsa_asoundlib_version(PyObject * module, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":asoundlib_version"))
+		return NULL;
+
+	return PyUnicode_FromString(snd_asoundlib_version());
+}
+
+static PyObject *
+alsapcm_state(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":state"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	return PyLong_FromUnsignedLong((unsigned long) snd_pcm_state(self->handle));
+}
+
+static PyObject *
+alsapcm_htimestamp(alsapcm_t *self, PyObject *args)
+{
+	snd_htimestamp_t tstamp;
+	snd_pcm_uframes_t avail;
+	PyObject *result = NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_htimestamp(self->handle , &avail, &tstamp);
+
+	result = PyTuple_New(3);
+	PyTuple_SetItem(result, 0, PyLong_FromLongLong(tstamp.tv_sec));
+	PyTuple_SetItem(result, 1, PyLong_FromLong(tstamp.tv_nsec));
+	PyTuple_SetItem(result, 2, PyLong_FromLong(avail));
+
+	return result;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyStructSequence_Field alsastatus_fields[] = {
+	{"state", "The PCM state, one of the PCM_STATE_* constants"},
+	{"avail", "Frames that can be read or written"},
+	{"delay", "Frames until a frame written now is heard, or since a frame "
+	 "ready to be read was captured"},
+	{"avail_max", "The largest avail since the last call"},
+	{"trigger_tstamp", "When the stream was started or stopped, in seconds"},
+	{"tstamp", "When this status was taken, in seconds"},
+	{"audio_tstamp", "The position of the stream, in seconds"},
+	{"overrange", "Overrange events since the last call"},
+	{NULL}
+};
+
+static PyStructSequence_Desc alsastatus_desc = {
+	"alsaaudio.Status",
+	"A snapshot of the PCM's state taken by PCM.status()",
+	alsastatus_fields,
+	8
+};
+
+static PyObject *
+alsapcm_tstamp_seconds(const snd_htimestamp_t *tstamp)
+{
+	return PyFloat_FromDouble(tstamp->tv_sec + tstamp->tv_nsec * 1e-9);
+}
+
+static PyObject *
+alsapcm_status(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t trigger, tstamp, audio_tstamp;
+	PyObject *result;
+	int res, i;
+
+	if (!PyArg_ParseTuple(args,":status"))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_status_alloca(&status);
+	res = snd_pcm_status(self->handle, status);
+	if (res < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	snd_pcm_status_get_trigger_htstamp(status, &trigger);
+	snd_pcm_status_get_htstamp(status, &tstamp);
+	snd_pcm_status_get_audio_htstamp(status, &audio_tstamp);
+
+	result = PyStructSequence_New(alsaaudio_state_of(self)->status_type);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0,
+		PyLong_FromLong(snd_pcm_status_get_state(status)));
+	PyStructSequence_SET_ITEM(result, 1,
+		PyLong_FromUnsignedLong(snd_pcm_status_get_avail(status)));
+	PyStructSequence_SET_ITEM(result, 2,
+		PyLong_FromLong(snd_pcm_status_get_delay(status)));
+	PyStructSequence_SET_ITEM(result, 3,
+		PyLong_FromUnsignedLong(snd_pcm_status_get_avail_max(status)));
+	PyStructSequence_SET_ITEM(result, 4, alsapcm_tstamp_seconds(&trigger));
+	PyStructSequence_SET_ITEM(result, 5, alsapcm_tstamp_seconds(&tstamp));
+	PyStructSequence_SET_ITEM(result, 6, alsapcm_tstamp_seconds(&audio_tstamp));
+	PyStructSequence_SET_ITEM(result, 7,
+		PyLong_FromUnsignedLong(snd_pcm_status_get_overrange(status)));
+
+	for (i = 0; i < 8; i++) {
+		if (!PyStructSequence_GET_ITEM(result, i)) {
+			Py_DECREF(result);
+			return NULL;
+		}
+	}
+
+	return result;
+}
+
+static PyStructSequence_Field alsastats_fields[] = {
+	{"calls", "Transfers made by read() and write() and their variants"},
+	{"frames", "Frames transferred"},
+	{"xruns", "Buffer underruns or overruns"},
+	{"eagain", "Transfers that found the device not ready in non-blocking "
+	 "mode"},
+	{"partial", "Transfers that moved some, but not all frames"},
+	{"blocked_ns", "Time spent in transfers without the GIL, in "
+	 "nanoseconds"},
+	{"max_blocked_ns", "The longest time spent in a single transfer, in "
+	 "nanoseconds"},
+	{"min_avail", "The fewest frames available when a transfer started, "
+	 "or None"},
+	{"max_avail", "The most frames available when a transfer started, "
+	 "or None"},
+	{NULL}
+};
+
+static PyStructSequence_Desc alsastats_desc = {
+	"alsaaudio.Stats",
+	"Performance counters of a PCM, as returned by PCM.stats()",
+	alsastats_fields,
+	9
+};
+
+static PyObject *
+alsapcm_avail_or_none(snd_pcm_sframes_t avail)
+{
+	if (avail < 0) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return PyLong_FromLong(avail);
+}
+
+static PyObject *
+alsapcm_stats(alsapcm_t *self, PyObject *args, PyObject *kwds)
+{
+	alsapcm_stats_t *stats = &self->stats;
+	unsigned long xruns = atomic_load(&self->xruns);
+	PyObject *result;
+	int reset = 0, i;
+
+	char *kw[] = { "reset", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:stats", kw, &reset))
+		return NULL;
+
+	result = PyStructSequence_New(alsaaudio_state_of(self)->stats_type);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0,
+		PyLong_FromUnsignedLongLong(stats->calls));
+	PyStructSequence_SET_ITEM(result, 1,
+		PyLong_FromUnsignedLongLong(stats->frames));
+	PyStructSequence_SET_ITEM(result, 2,
+		PyLong_FromUnsignedLong(xruns - stats->xruns_base));
+	PyStructSequence_SET_ITEM(result, 3,
+		PyLong_FromUnsignedLongLong(stats->eagain));
+	PyStructSequence_SET_ITEM(result, 4,
+		PyLong_FromUnsignedLongLong(stats->partial));
+	PyStructSequence_SET_ITEM(result, 5,
+		PyLong_FromUnsignedLongLong(stats->blocked_ns));
+	PyStructSequence_SET_ITEM(result, 6,
+		PyLong_FromUnsignedLongLong(stats->blocked_max_ns));
+	PyStructSequence_SET_ITEM(result, 7,
+		alsapcm_avail_or_none(stats->avail_min));
+	PyStructSequence_SET_ITEM(result, 8,
+		alsapcm_avail_or_none(stats->avail_max));
+
+	for (i = 0; i < 9; i++) {
+		if (!PyStructSequence_GET_ITEM(result, i)) {
+			Py_DECREF(result);
+			return NULL;
+		}
+	}
+
+	// The snapshot and the reset are atomic with respect to the transfers
+	// and the I/O thread, which update the counters under the lock
+	if (reset) {
+		memset(stats, 0, sizeof(*stats));
+		stats->avail_min = stats->avail_max = -1;
+		stats->xruns_base = xruns;
+	}
+
+	return result;
+}
+
+static PyObject *
+alsapcm_enable_stats(alsapcm_t *self, PyObject *args)
+{
+	int enable = 1;
+
+	if (!PyArg_ParseTuple(args,"|p:enable_stats", &enable))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	atomic_store(&self->stats_timing, enable);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+alsapcm_set_sw_params(alsapcm_t *self, PyObject *args, PyObject *kwds)
+{
+	long values[ALSAPCM_SW_PARAMS] = { -1, -1, -1, -1, -1, -1 };
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t frames;
+	PyObject *result, *value;
+	int res, i, period_event = 0;
+
+	char *kw[] = { "avail_min", "start_threshold", "stop_threshold",
+				   "silence_threshold", "silence_size", "period_event",
+				   NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$llllll:set_sw_params", kw,
+									 &values[ALSAPCM_SW_AVAIL_MIN],
+									 &values[ALSAPCM_SW_START_THRESHOLD],
+									 &values[ALSAPCM_SW_STOP_THRESHOLD],
+									 &values[ALSAPCM_SW_SILENCE_THRESHOLD],
+									 &values[ALSAPCM_SW_SILENCE_SIZE],
+									 &values[ALSAPCM_SW_PERIOD_EVENT]))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	res = alsapcm_apply_sw_params(self, values);
+	if (res < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	// Remember them, to apply them again if the hardware parameters change
+	for (i = 0; i < ALSAPCM_SW_PARAMS; i++)
+		if (values[i] >= 0)
+			self->swparams[i] = values[i];
+
+	snd_pcm_sw_params_alloca(&swparams);
+	res = snd_pcm_sw_params_current(self->handle, swparams);
+	if (res < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	if (!(result = PyDict_New()))
+		return NULL;
+
+	for (i = 0; i < ALSAPCM_SW_PARAMS; i++) {
+		frames = 0;
+		switch (i) {
+		case ALSAPCM_SW_AVAIL_MIN:
+			snd_pcm_sw_params_get_avail_min(swparams, &frames);
+			break;
+		case ALSAPCM_SW_START_THRESHOLD:
+			snd_pcm_sw_params_get_start_threshold(swparams, &frames);
+			break;
+		case ALSAPCM_SW_STOP_THRESHOLD:
+			snd_pcm_sw_params_get_stop_threshold(swparams, &frames);
+			break;
+		case ALSAPCM_SW_SILENCE_THRESHOLD:
+			snd_pcm_sw_params_get_silence_threshold(swparams, &frames);
+			break;
+		case ALSAPCM_SW_SILENCE_SIZE:
+			snd_pcm_sw_params_get_silence_size(swparams, &frames);
+			break;
+		case ALSAPCM_SW_PERIOD_EVENT:
+			snd_pcm_sw_params_get_period_event(swparams, &period_event);
+			frames = period_event;
+			break;
+		}
+
+		value = i == ALSAPCM_SW_PERIOD_EVENT ? PyBool_FromLong(frames) :
+			PyLong_FromUnsignedLong(frames);
+		if (!value || PyDict_SetItemString(result, kw[i], value) < 0) {
+			Py_XDECREF(value);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(value);
+	}
+
+	return result;
+}
+#endif
+
+static PyObject *
+alsapcm_set_tstamp_mode(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_tstamp_t mode = SND_PCM_TSTAMP_ENABLE;
+	int err;
+
+	if (!PyArg_ParseTuple(args,"|i:set_tstamp_mode", &mode))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	snd_pcm_sw_params_t* swParams;
+	snd_pcm_sw_params_alloca( &swParams);
+
+	snd_pcm_sw_params_current(self->handle, swParams);
+
+	snd_pcm_sw_params_set_tstamp_mode(self->handle, swParams, mode);
+
+	err = snd_pcm_sw_params(self->handle, swParams);
+
+	if (err < 0) {
+		PyErr_SetString(PyExc_RuntimeError, "Unable to set pcm tstamp mode!");
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+alsapcm_get_tstamp_mode(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_tstamp_t mode;
+	int err;
+
+	if (!PyArg_ParseTuple(args,":get_tstamp_mode"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_sw_params_t* swParams;
+	snd_pcm_sw_params_alloca( &swParams);
+
+	snd_pcm_sw_params_current(self->handle, swParams);
+
+	err = snd_pcm_sw_params_get_tstamp_mode(swParams, &mode);
+
+	if (err < 0) {
+		PyErr_SetString(PyExc_RuntimeError, "Unable to get pcm tstamp mode!");
+		return NULL;
+	}
+
+	return PyLong_FromUnsignedLong((unsigned long) mode);
+}
+
+static PyObject *
+alsapcm_set_tstamp_type(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_tstamp_type_t type = SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY;
+	int err;
+
+	if (!PyArg_ParseTuple(args,"|i:set_tstamp_type", &type))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	snd_pcm_sw_params_t* swParams;
+	snd_pcm_sw_params_alloca( &swParams);
+
+	snd_pcm_sw_params_current(self->handle, swParams);
+
+	snd_pcm_sw_params_set_tstamp_type(self->handle, swParams, type);
+
+	err = snd_pcm_sw_params(self->handle, swParams);
+
+	if (err < 0) {
+		PyErr_SetString(PyExc_RuntimeError, "Unable to set pcm tstamp type!");
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+alsapcm_get_tstamp_type(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_tstamp_type_t type;
+	int err;
+
+	if (!PyArg_ParseTuple(args,":get_tstamp_type"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_sw_params_t* swParams;
+	snd_pcm_sw_params_alloca( &swParams);
+
+	snd_pcm_sw_params_current(self->handle, swParams);
+
+	err = snd_pcm_sw_params_get_tstamp_type(swParams, &type);
+
+	if (err < 0) {
+		PyErr_SetString(PyExc_RuntimeError, "Unable to get pcm tstamp type!");
+		return NULL;
+	}
+
+	return PyLong_FromUnsignedLong((unsigned long) type);
+}
+
+
+// auxiliary function
+
+static PyObject *
+alsapcm_getformats(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_t *pcm = self->handle;
+	if (!pcm) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	int err = snd_pcm_hw_params_any(pcm, params);
+	if (err < 0) {
+		PyErr_SetString(ALSAAudioError(self), "Cannot get hardware parameters");
+		return NULL;
+	}
+
+	PyObject *fmts = PyDict_New();
+	for (size_t i = 0; i < ARRAY_SIZE(ALSAFormats); ++i) {
+		snd_pcm_format_t format = ALSAFormats[i];
+		if (!snd_pcm_hw_params_test_format(pcm, params, format)) {
+			const char *name = snd_pcm_format_name(format);
+			PyObject *pname=PyUnicode_FromString(name);
+			PyObject *value=PyLong_FromLong((long)format);
+			PyDict_SetItem(fmts,pname,value);
+		}
+	}
+	return fmts;
+}
+
+static PyObject *
+alsapcm_getratemaxmin(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_t *pcm = self->handle;
+	if (!pcm) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	int err = snd_pcm_hw_params_any(pcm, params);
+	if (err < 0) {
+		PyErr_SetString(ALSAAudioError(self), "Cannot get hardware parameters");
+		return NULL;
+	}
+
+	unsigned min, max;
+	if (snd_pcm_hw_params_get_rate_min(params, &min,NULL)<0) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Cannot get minimum supported bitrate");
+		return NULL;
+	}
+	if (snd_pcm_hw_params_get_rate_max(params, &max,NULL)<0) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Cannot get maximum supported bitrate");
+		return NULL;
+	}
+
+	PyObject *minp=PyLong_FromLong(min);
+	PyObject *maxp=PyLong_FromLong(max);
+	return PyTuple_Pack(2, minp, maxp);
+}
+
+static PyObject *
+alsapcm_getrates(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_t *pcm = self->handle;
+	if (!pcm) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	int err = snd_pcm_hw_params_any(pcm, params);
+	if (err < 0) {
+		PyErr_SetString(ALSAAudioError(self), "Cannot get hardware parameters");
+		return NULL;
+	}
+
+	unsigned min, max;
+	if (snd_pcm_hw_params_get_rate_min(params, &min, NULL) <0 ) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Cannot get minimum supported bitrate");
+		return NULL;
+	}
+	if (snd_pcm_hw_params_get_rate_max(params, &max, NULL) < 0) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Cannot get maximum supported bitrate");
+		return NULL;
+	}
+
+	if (min == max) {
+		return PyLong_FromLong(min);
+	}
+	else if (!snd_pcm_hw_params_test_rate(pcm, params, min + 1, 0)) {
+		PyObject *minp=PyLong_FromLong(min);
+		PyObject *maxp=PyLong_FromLong(max);
+		return PyTuple_Pack(2,minp,maxp);
+	}
+	else {
+		PyObject *rates=PyList_New(0);
+		for (size_t i=0; i<ARRAY_SIZE(ALSARates); i++) {
+			unsigned rate = ALSARates[i];
+			if (!snd_pcm_hw_params_test_rate(pcm, params, rate, 0)) {
+				PyObject *prate=PyLong_FromLong(rate);
+				PyList_Append(rates,prate);
+			}
+		}
+		return rates;
+	}
+}
+
+static PyObject *
+alsapcm_getchannels(alsapcm_t *self,PyObject *args)
+{
+	snd_pcm_t *pcm = self->handle;
+	if (!pcm) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	int err = snd_pcm_hw_params_any(pcm, params);
+	if (err < 0) {
+		PyErr_SetString(ALSAAudioError(self), "Cannot get hardware parameters");
+		return NULL;
+	}
+
+	unsigned min, max;
+	if (snd_pcm_hw_params_get_channels_min(params, &min) < 0) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Cannot get minimum supported number of channels");
+		return NULL;
+	}
+
+	if (snd_pcm_hw_params_get_channels_max(params, &max) < 0) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Cannot get maximum supported number of channels");
+		return NULL;
+	}
+
+	PyObject *out = PyList_New(0);
+	for (unsigned ch=min;ch<=max;++ch) {
+		if (!snd_pcm_hw_params_test_channels(pcm, params, ch)) {
+			PyObject *pch=PyLong_FromLong(ch);
+			PyList_Append(out,pch);
+		}
+	}
+	return out;
+}
+
+static PyObject *
+alsapcm_setchannels(alsapcm_t *self, PyObject *args)
+{
+	int channels, saved;
+	int res;
+
+	if (!PyArg_ParseTuple(args,"i:setchannels", &channels))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	PyErr_WarnEx(PyExc_DeprecationWarning,
+				 "This function is deprecated. "
+				 "Please use the named parameter `channels` to `PCM()` instead", 1);
+
+	saved = self->channels;
+	self->channels = channels;
+	Py_BEGIN_ALLOW_THREADS
+	res = alsapcm_setup(self);
+	Py_END_ALLOW_THREADS
+	if (res < 0)
+	{
+		self->channels = saved;
+		if (alsapcm_reset_meters(self) == 0)
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+						 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_reset_meters(self) < 0 ||
+		alsapcm_setup_resampler(self) < 0)
+		return NULL;
+
+	return PyLong_FromLong(self->channels);
+}
+
+static PyObject *
+alsapcm_pcmtype(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":pcmtype"))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	return PyLong_FromLong(self->pcmtype);
+}
+
+static PyObject *
+alsapcm_pcmmode(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":pcmmode"))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	return PyLong_FromLong(self->pcmmode);
+}
+
+static PyObject *
+alsapcm_cardname(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":cardname"))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	return PyUnicode_FromString(self->cardname);
+}
+
+static PyObject *
+alsapcm_setrate(alsapcm_t *self, PyObject *args)
+{
+	int rate, saved;
+	int res;
+
+	if (!PyArg_ParseTuple(args,"i:setrate", &rate))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	PyErr_WarnEx(PyExc_DeprecationWarning,
+				 "This function is deprecated. "
+				 "Please use the named parameter `rate` to `PCM()` instead", 1);
+
+	saved = self->rate;
+	self->rate = rate;
+	Py_BEGIN_ALLOW_THREADS
+	res = alsapcm_setup(self);
+	Py_END_ALLOW_THREADS
+	if (res < 0)
+	{
+		self->rate = saved;
+		if (alsapcm_reset_meters(self) == 0)
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+						 self->cardname);
+		return NULL;
+	}
+
+	self->user_rate = rate;
+	if (alsapcm_reset_meters(self) < 0 ||
+		alsapcm_setup_resampler(self) < 0)
+		return NULL;
+
+	return PyLong_FromLong(self->rate);
+}
+
+static PyObject *
+alsapcm_setformat(alsapcm_t *self, PyObject *args)
+{
+	int format, saved;
+	int res;
+
+	if (!PyArg_ParseTuple(args,"i:setformat", &format))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	PyErr_WarnEx(PyExc_DeprecationWarning,
+				 "This function is deprecated. "
+				 "Please use the named parameter `format` to `PCM()` instead", 1);
+
+	saved = self->format;
+	self->format = format;
+	Py_BEGIN_ALLOW_THREADS
+	res = alsapcm_setup(self);
+	Py_END_ALLOW_THREADS
+	if (res < 0)
+	{
+		self->format = saved;
+		if (alsapcm_reset_meters(self) == 0)
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+						 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_reset_meters(self) < 0 ||
+		alsapcm_setup_resampler(self) < 0)
+		return NULL;
+
+	return PyLong_FromLong(self->format);
+}
+
+static PyObject *
+alsapcm_setperiodsize(alsapcm_t *self, PyObject *args)
+{
+	int periodsize, saved;
+	int res;
+
+	if (!PyArg_ParseTuple(args,"i:setperiodsize", &periodsize))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	PyErr_WarnEx(PyExc_DeprecationWarning,
+				 "This function is deprecated. "
+				 "Please use the named parameter `periodsize` to `PCM()` instead", 1);
+
+	saved = self->periodsize;
+	self->periodsize = periodsize;
+	Py_BEGIN_ALLOW_THREADS
+	res = alsapcm_setup(self);
+	Py_END_ALLOW_THREADS
+	if (res < 0)
+	{
+		self->periodsize = saved;
+		if (alsapcm_reset_meters(self) == 0)
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+							 self->cardname);
+
+
+
+		return NULL;
+	}
+
+	if (alsapcm_reset_meters(self) < 0)
+		return NULL;
+
+	return PyLong_FromLong(self->periodsize);
+}
+
+#if PY_MAJOR_VERSION >= 3
+/* Narrow down the configuration space for configure(). Negative period and
+   buffer parameters are left to ALSA. */
+static int
+alsapcm_refine_hw_params(alsapcm_t *self, snd_pcm_hw_params_t *hwparams,
+						 unsigned int *rate, snd_pcm_format_t format,
+						 unsigned int *channels, long period_size,
+						 long periods, long buffer_size, long latency_us)
+{
+	snd_pcm_uframes_t frames;
+	unsigned int val;
+	int res, dir = 0;
+
+	if ((res = snd_pcm_hw_params_any(self->handle, hwparams)) < 0 ||
+		(res = snd_pcm_hw_params_set_access(self->handle, hwparams,
+											self->access)) < 0 ||
+		(res = snd_pcm_hw_params_set_format(self->handle, hwparams,
+											format)) < 0 ||
+		(res = snd_pcm_hw_params_set_channels_near(self->handle, hwparams,
+												   channels)) < 0 ||
+		(res = snd_pcm_hw_params_set_rate_near(self->handle, hwparams,
+											   rate, &dir)) < 0)
+		return res;
+
+	/* For a latency target, the buffer is split in as few periods as
+	   possible, and is as close to the target as the device allows */
+	if (latency_us >= 0) {
+		val = periods > 0 ? periods : 2;
+		if ((res = snd_pcm_hw_params_set_periods_near(self->handle, hwparams,
+													  &val, &dir)) < 0)
+			return res;
+
+		val = latency_us;
+		return snd_pcm_hw_params_set_buffer_time_near(self->handle, hwparams,
+													  &val, &dir);
+	}
+
+	if (period_size > 0) {
+		frames = period_size;
+		if ((res = snd_pcm_hw_params_set_period_size_near(self->handle,
+														  hwparams, &frames,
+														  &dir)) < 0)
+			return res;
+	}
+
+	if (periods > 0) {
+		val = periods;
+		if ((res = snd_pcm_hw_params_set_periods_near(self->handle, hwparams,
+													  &val, &dir)) < 0)
+			return res;
+	}
+
+	if (buffer_size > 0) {
+		frames = buffer_size;
+		if ((res = snd_pcm_hw_params_set_buffer_size_near(self->handle,
+														  hwparams, &frames)) < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+static PyObject *
+alsapcm_configure(alsapcm_t *self, PyObject *args, PyObject *kwds)
+{
+	int rate = -1, format = -1, channels = -1;
+	long period_size = -1, periods = -1, buffer_size = -1, latency_us = -1;
+	unsigned int urate, uchannels, buffer_time;
+	snd_pcm_hw_params_t *hwparams;
+	int res, dir;
+
+	char *kw[] = { "rate", "format", "channels", "period_size", "periods",
+				   "buffer_size", "latency_us", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$iiillll:configure", kw,
+									 &rate, &format, &channels, &period_size,
+									 &periods, &buffer_size, &latency_us))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (latency_us >= 0 && (period_size >= 0 || buffer_size >= 0)) {
+		PyErr_SetString(ALSAAudioError(self),
+						"latency_us can't be combined with "
+						"period_size or buffer_size");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	// What isn't given stays as it is
+	urate = rate > 0 ? (unsigned int)rate : self->user_rate;
+	uchannels = channels > 0 ? (unsigned int)channels : self->channels;
+	if (format < 0)
+		format = self->format;
+	if (period_size < 0 && periods < 0 && buffer_size < 0 && latency_us < 0) {
+		period_size = self->periodsize;
+		periods = self->periods;
+	}
+
+	snd_pcm_hw_params_alloca(&hwparams);
+
+	Py_BEGIN_ALLOW_THREADS
+	snd_pcm_drop(self->handle);
+
+	res = alsapcm_refine_hw_params(self, hwparams, &urate, format, &uchannels,
+								   period_size, periods, buffer_size,
+								   latency_us);
+	if (res >= 0)
+		res = snd_pcm_hw_params(self->handle, hwparams);
+	// Go back to where we were
+	if (res < 0)
+		alsapcm_setup(self);
+	Py_END_ALLOW_THREADS
+
+	if (res < 0) {
+		if (alsapcm_reset_meters(self) == 0)
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+						 self->cardname);
+		return NULL;
+	}
+
+	alsapcm_get_hw_params(self, hwparams);
+	if (rate > 0)
+		self->user_rate = rate;
+
+	// The new hardware parameters are in effect, so whatever depends on
+	// them follows before anything else can fail
+	if (alsapcm_reset_meters(self) < 0 ||
+		alsapcm_setup_resampler(self) < 0)
+		return NULL;
+
+	res = alsapcm_apply_sw_params(self, self->swparams);
+	if (res < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	snd_pcm_hw_params_get_buffer_time(hwparams, &buffer_time, &dir);
+
+	return Py_BuildValue("{s:I,s:i,s:I,s:k,s:I,s:k,s:I}",
+						 "rate", self->rate,
+						 "format", (int)self->format,
+						 "channels", self->channels,
+						 "period_size", self->periodsize,
+						 "periods", self->periods,
+						 "buffer_size", self->buffersize,
+						 "latency_us", buffer_time);
+}
+#endif
+
+/* Make sure the conversion buffer holds at least `size` bytes */
+static char *
+alsapcm_convbuf(alsapcm_t *self, size_t size)
+{
+	if (size > self->convsize) {
+		char *buf = PyMem_Realloc(self->convbuf, size);
+		if (!buf) {
+			PyErr_NoMemory();
+			return NULL;
+		}
+		self->convbuf = buf;
+		self->convsize = size;
+	}
+	return self->convbuf;
+}
+
+static int
+alsapcm_check_float(alsapcm_t *self)
+{
+	if (!alsaconv_supported(self->format)) {
+		PyErr_Format(ALSAAudioError(self), "Cannot convert float32 samples to "
+					 "%s [%s]", snd_pcm_format_name(self->format),
+					 self->cardname);
+		return -1;
+	}
+	return 0;
+}
+
+/* Frames converted at a time by alsapcm_gain_native() */
+#define ALSAPCM_GAIN_CHUNK 256
+
+static bool
+alsapcm_gain_active(alsapcm_t *self)
+{
+	return self->gain_ramp || self->gain != 1.0f;
+}
+
+/* Apply the software gain to `frames` frames of float32 samples, which
+   start `offset` frames into the ramp. This doesn't move the ramp: only
+   the frames the device accepts do, see alsapcm_gain_advance(). */
+static void
+alsapcm_gain_float(alsapcm_t *self, float *samples, snd_pcm_uframes_t frames,
+				   snd_pcm_uframes_t offset)
+{
+	unsigned int channels = self->channels, c;
+	snd_pcm_uframes_t f = 0;
+	float g;
+	size_t i, n;
+
+	for (; f < frames && offset + f < self->gain_ramp; f++) {
+		g = self->gain + self->gain_step * (float)(offset + f + 1);
+		for (c = 0; c < channels; c++)
+			samples[f * channels + c] *= g;
+	}
+
+	g = self->gain_ramp ? self->gain_target : self->gain;
+	if (g == 1.0f)
+		return;
+
+	samples += f * channels;
+	n = (frames - f) * channels;
+	for (i = 0; i < n; i++)
+		samples[i] *= g;
+}
+
+/* Move the ramp on by `frames` frames that the device accepted */
+static void
+alsapcm_gain_advance(alsapcm_t *self, snd_pcm_sframes_t frames)
+{
+	if (frames <= 0 || !self->gain_ramp)
+		return;
+
+	if ((snd_pcm_uframes_t)frames >= self->gain_ramp) {
+		// Don't let rounding errors accumulate
+		self->gain = self->gain_target;
+		self->gain_ramp = 0;
+	}
+	else {
+		self->gain += self->gain_step * (float)frames;
+		self->gain_ramp -= frames;
+	}
+}
+
+/* Like alsapcm_gain_float(), for the sample formats that float32 would
+   truncate: scale the samples in double precision, in place */
+static void
+alsapcm_gain_wide(alsapcm_t *self, char *data, snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t f = 0;
+	float g;
+
+	for (; f < frames && f < self->gain_ramp; f++) {
+		g = self->gain + self->gain_step * (float)(f + 1);
+		alsaconv_scale(self->format, data + f * self->framesize,
+					   self->channels, g);
+	}
+
+	g = self->gain_ramp ? self->gain_target : self->gain;
+	if (g == 1.0f || f == frames)
+		return;
+
+	alsaconv_scale(self->format, data + f * self->framesize,
+				   (frames - f) * self->channels, g);
+}
+
+/* Apply the software gain to `frames` frames in the PCM's sample format,
+   in place. `tmp` holds ALSAPCM_GAIN_CHUNK frames of float32 samples. */
+static void
+alsapcm_gain_native(alsapcm_t *self, char *data, snd_pcm_uframes_t frames,
+					float *tmp)
+{
+	snd_pcm_uframes_t offset = 0;
+
+	if (alsaconv_wide(self->format)) {
+		alsapcm_gain_wide(self, data, frames);
+		return;
+	}
+
+	while (frames) {
+		snd_pcm_uframes_t n = frames < ALSAPCM_GAIN_CHUNK ?
+			frames : ALSAPCM_GAIN_CHUNK;
+
+		alsaconv_to_float(self->format, data, tmp, n * self->channels);
+		alsapcm_gain_float(self, tmp, n, offset);
+		alsaconv_from_float(self->format, tmp, data, n * self->channels,
+							NULL);
+
+		data += n * self->framesize;
+		frames -= n;
+		offset += n;
+	}
+}
+
+/* Make room for `frames` frames in the conversion buffer, followed by the
+   scratch space of alsapcm_gain_native() */
+static char *
+alsapcm_gain_buffer(alsapcm_t *self, snd_pcm_uframes_t frames)
+{
+	size_t size = frames * self->framesize;
+
+	return alsapcm_convbuf(self, size +
+						   sizeof(float) * ALSAPCM_GAIN_CHUNK * self->channels);
+}
+
+/* Apply the software gain to the frames in a buffer from
+   alsapcm_gain_buffer() */
+static void
+alsapcm_gain_apply(alsapcm_t *self, char *buf, snd_pcm_uframes_t frames)
+{
+	alsapcm_gain_native(self, buf, frames,
+						(float *)(buf + frames * self->framesize));
+}
+
+/* Copy `frames` frames for write() to the conversion buffer, and apply the
+   software gain to them */
+static char *
+alsapcm_gain_copy(alsapcm_t *self, const char *data, snd_pcm_uframes_t frames)
+{
+	char *buf;
+
+	if (!(buf = alsapcm_gain_buffer(self, frames)))
+		return NULL;
+
+	memcpy(buf, data, frames * self->framesize);
+	alsapcm_gain_apply(self, buf, frames);
+
+	return buf;
+}
+
+static PyObject *
+alsapcm_set_gain(alsapcm_t *self, PyObject *args, PyObject *kwds)
+{
+	double db, ramp_ms = 0.0;
+	double ramp;
+	float target;
+
+	char *kw[] = { "db", "ramp_ms", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "d|d:set_gain", kw,
+									 &db, &ramp_ms))
+		return NULL;
+
+	// NaN would write silence, +inf would turn it into NaN
+	if (isnan(db) || db == Py_HUGE_VAL) {
+		PyErr_SetString(PyExc_ValueError, "gain must be finite or -inf");
+		return NULL;
+	}
+
+	if (!(ramp_ms >= 0.0) || ramp_ms == Py_HUGE_VAL) {
+		PyErr_SetString(PyExc_ValueError, "ramp_ms must be finite and not "
+						"negative");
+		return NULL;
+	}
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_PLAYBACK) {
+		PyErr_Format(ALSAAudioError(self),
+					 "Software gain is only supported for "
+					 "playback [%s]", self->cardname);
+		return NULL;
+	}
+
+	// write_planar() and the areas of mmap_begin() don't apply the gain
+	if (alsapcm_check_access(self, false) < 0 || alsapcm_check_float(self) < 0)
+		return NULL;
+
+	if (self->mmap_view) {
+		PyErr_Format(ALSAAudioError(self),
+					 "mmap_commit() must be called before "
+					 "the gain is changed [%s]", self->cardname);
+		return NULL;
+	}
+
+	target = (float)pow(10.0, db / 20.0);
+	ramp = ramp_ms > 0.0 ? ramp_ms * self->rate / 1000.0 : 0.0;
+	if (ramp > (double)LONG_MAX)
+		ramp = (double)LONG_MAX;
+
+	self->gain_target = target;
+	if (ramp >= 1.0 && target != self->gain) {
+		self->gain_ramp = (snd_pcm_uframes_t)ramp;
+		self->gain_step = (target - self->gain) / self->gain_ramp;
+	}
+	else {
+		self->gain = target;
+		self->gain_ramp = 0;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+alsapcm_get_gain(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":get_gain"))
+		return NULL;
+
+	if (self->gain <= 0.0f)
+		return PyFloat_FromDouble(-Py_HUGE_VAL);
+
+	return PyFloat_FromDouble(20.0 * log10(self->gain));
+}
+
+static PyObject *
+alsapcm_enable_meters(alsapcm_t *self, PyObject *args)
+{
+	int enable = 1;
+
+	if (!PyArg_ParseTuple(args,"|p:enable_meters", &enable))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	alsameter_free(self->meters);
+	self->meters = NULL;
+
+	if (enable) {
+		if (alsapcm_check_float(self) < 0)
+			return NULL;
+
+		if (!(self->meters = alsameter_new(self->format, self->channels,
+										   self->rate)))
+			return PyErr_NoMemory();
+	}
+
+	Py_RETURN_NONE;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyObject *
+alsapcm_meters(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":meters"))
+		return NULL;
+
+	if (!self->meters) {
+		PyErr_Format(ALSAAudioError(self), "Metering is not enabled [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	return alsameter_read(self->meters,
+						  alsaaudio_state_of(self)->meters_type);
+}
+#endif
+
+/* Whether read() and write() go through float32 samples, to apply the
+   channel matrix or to resample */
+static bool
+alsapcm_processing(alsapcm_t *self)
+{
+	return self->matrix || self->resampler;
+}
+
+/* For the ways to transfer frames that don't go through float32 samples:
+   raise rather than silently bypass the channel matrix or the resampler */
+static int
+alsapcm_check_unprocessed(alsapcm_t *self, const char *method)
+{
+	if (alsapcm_processing(self)) {
+		PyErr_Format(ALSAAudioError(self), "%s() doesn't support the channel "
+					 "matrix or resampling [%s]", method, self->cardname);
+		return -1;
+	}
+	return 0;
+}
+
+/* The number of channels the caller sees */
+static unsigned int
+alsapcm_user_channels(alsapcm_t *self)
+{
+	if (!self->matrix)
+		return self->channels;
+
+	return self->pcmtype == SND_PCM_STREAM_PLAYBACK ?
+		self->matrix_in : self->matrix_out;
+}
+
+static int
+alsapcm_check_matrix(alsapcm_t *self)
+{
+	if (self->matrix &&
+		(self->pcmtype == SND_PCM_STREAM_PLAYBACK ?
+		 self->matrix_out : self->matrix_in) != self->channels) {
+		PyErr_Format(ALSAAudioError(self),
+					 "The channel matrix doesn't match the "
+					 "PCM's %u channels [%s]", self->channels, self->cardname);
+		return -1;
+	}
+	return 0;
+}
+
+/* Make room for `nfloats` float32 samples followed by `nbytes` bytes in the
+   conversion buffer */
+static float *
+alsapcm_floatbuf(alsapcm_t *self, size_t nfloats, size_t nbytes)
+{
+	if (nbytes > PY_SSIZE_T_MAX ||
+		nfloats > (PY_SSIZE_T_MAX - nbytes) / sizeof(float)) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	return (float *)alsapcm_convbuf(self, nfloats * sizeof(float) + nbytes);
+}
+
+/* Keep `frames` frames in the PCM's format that the device didn't accept,
+   replacing the frames that were pending before */
+static int
+alsapcm_keep_pending(alsapcm_t *self, const char *data,
+					 snd_pcm_uframes_t frames)
+{
+	size_t size = frames * self->framesize;
+
+	if (size > self->pendingcap) {
+		char *pending = PyMem_Realloc(self->pending, size);
+
+		if (!pending) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		self->pending = pending;
+		self->pendingcap = size;
+	}
+
+	memcpy(self->pending, data, size);
+	self->npending = frames;
+	return 0;
+}
+
+/* Write the frames the resampler produced that the device didn't accept
+   earlier. Returns the number of frames that are still pending, or a
+   negative error code. */
+static snd_pcm_sframes_t
+alsapcm_write_pending(alsapcm_t *self)
+{
+	snd_pcm_sframes_t res;
+
+	if (!self->npending)
+		return 0;
+
+	res = alsapcm_transfer(self, self->pending, self->npending);
+	alsapcm_gain_advance(self, res);
+	if (res < 0)
+		return res;
+
+	self->npending -= res;
+	memmove(self->pending, self->pending + res * self->framesize,
+			self->npending * self->framesize);
+	return self->npending;
+}
+
+/* write() and write_float() through the channel matrix and the resampler.
+   `data` holds `size` bytes of float32 samples if `is_float` is true, and
+   samples in the PCM's format otherwise.
+
+   The resampler consumes all input at once, so the frames it produced that
+   the device doesn't accept are kept and written first by the next call.
+   Until they are, no new input is taken, and 0 is returned. Otherwise the
+   number of input frames is returned, so that callers that resubmit what
+   wasn't written don't write anything twice. */
+static PyObject *
+alsapcm_write_processed(alsapcm_t *self, const char *data, Py_ssize_t size,
+						bool is_float, bool dither)
+{
+	unsigned int channels = alsapcm_user_channels(self);
+	size_t framesize = channels * (is_float ? sizeof(float) :
+								   self->framesize / self->channels);
+	snd_pcm_uframes_t frames, devframes;
+	snd_pcm_sframes_t res;
+	float *buf, *samples = (float *)data;
+	size_t nfloats;
+	char *dev = NULL;
+
+	if (size % framesize)
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Data size must be a multiple of the "
+					 "size of a frame of %u channels", channels);
+		return NULL;
+	}
+
+	if (alsapcm_check_matrix(self) < 0)
+		return NULL;
+
+	frames = devframes = size / framesize;
+	if (!frames)
+		return PyLong_FromLong(0);
+
+	if (self->resampler) {
+		res = alsapcm_write_pending(self);
+		if (res < 0 && res != -EPIPE) {
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+						 self->cardname);
+			return NULL;
+		}
+		if (res)
+			return PyLong_FromLong(res < 0 ? res : 0);
+	}
+
+	/* Float samples before and after the matrix, followed by the samples
+	   in the PCM's format unless the resampler changes the frame count */
+	nfloats = (is_float ? 0 : frames * channels) +
+		(self->matrix ? frames * self->channels : 0);
+	if (self->resampler) {
+		buf = NULL;
+		if (nfloats && !(buf = alsapcm_floatbuf(self, nfloats, 0)))
+			return NULL;
+	}
+	else {
+		if (!(buf = alsapcm_floatbuf(self, nfloats,
+									 frames * self->framesize)))
+			return NULL;
+		dev = (char *)(buf + nfloats);
+	}
+
+	if (!is_float) {
+		alsaconv_to_float(self->format, data, buf, frames * channels);
+		samples = buf;
+	}
+
+	if (self->matrix) {
+		float *mixed = is_float ? buf : buf + frames * channels;
+
+		alsaconv_mix(self->matrix, self->matrix_in, self->matrix_out,
+					 samples, mixed, frames);
+		samples = mixed;
+	}
+
+	// The resampler keeps its own copy, so the buffer can move
+	if (self->resampler) {
+		Py_ssize_t n = alsaresampler_process(self->resampler, samples,
+											 frames, &samples);
+		if (n < 0)
+			return NULL;
+		if (!n)
+			return PyLong_FromLong(frames);
+
+		devframes = n;
+		if (!(dev = alsapcm_convbuf(self, devframes * self->framesize)))
+			return NULL;
+	}
+
+	// Whatever path they took, the samples are ours to modify by now
+	if (alsapcm_gain_active(self))
+		alsapcm_gain_float(self, samples, devframes, 0);
+	alsaconv_from_float(self->format, samples, dev,
+						devframes * self->channels,
+						dither ? self->dither : NULL);
+
+	res = alsapcm_transfer_unmetered(self, dev, devframes);
+	alsapcm_gain_advance(self, res);
+	if (self->meters && res > 0)
+		alsameter_update_float(self->meters, self->channels, samples, res);
+
+	// The input is consumed, whether the device took all of it or not,
+	// unless drop() in another thread discarded it anyway
+	if (self->resampler && res < (snd_pcm_sframes_t)devframes &&
+		snd_pcm_state(self->handle) != SND_PCM_STATE_SETUP) {
+		snd_pcm_uframes_t written = res > 0 ? res : 0;
+
+		if (alsapcm_keep_pending(self, dev + written * self->framesize,
+								 devframes - written) < 0)
+			return NULL;
+		if (res == -EPIPE)
+			res = 0;
+	}
+
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	return PyLong_FromLong(self->resampler ? (long)frames : (long)res);
+}
+
+/* read() and read_float() through the resampler and the channel matrix.
+   With a resampler, the number of frames returned is about `frames`. */
+static PyObject *
+alsapcm_read_processed(alsapcm_t *self, snd_pcm_uframes_t frames,
+					   bool is_float)
+{
+	unsigned int channels = alsapcm_user_channels(self);
+	size_t samplesize = is_float ? sizeof(float) :
+		self->framesize / self->channels;
+	snd_pcm_uframes_t devframes = frames;
+	snd_pcm_sframes_t res;
+	Py_ssize_t n = 0;
+	PyObject *buffer_obj;
+	float *buf, *samples, *mixed = NULL;
+	size_t nfloats;
+	char *dev;
+
+	if (alsapcm_check_matrix(self) < 0)
+		return NULL;
+
+	if (self->resampler)
+		devframes = alsaresampler_input_frames(self->resampler, frames);
+
+	/* Float samples from the device, float samples after the matrix if
+	   they can't go straight to the result, and samples in the PCM's
+	   format */
+	nfloats = devframes * self->channels;
+	if (self->matrix && !is_float && !self->resampler)
+		nfloats += devframes * channels;
+	if (!(buf = alsapcm_floatbuf(self, nfloats, devframes * self->framesize)))
+		return NULL;
+	dev = (char *)(buf + nfloats);
+	if (self->matrix && !is_float && !self->resampler)
+		mixed = buf + devframes * self->channels;
+
+	res = alsapcm_transfer_unmetered(self, dev, devframes);
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	samples = buf;
+	if (res > 0) {
+		alsaconv_to_float(self->format, dev, buf, res * self->channels);
+		if (self->meters)
+			alsameter_update_float(self->meters, self->channels, buf, res);
+		n = res;
+		if (self->resampler) {
+			n = alsaresampler_process(self->resampler, buf, res, &samples);
+			if (n < 0)
+				return NULL;
+		}
+	}
+
+	buffer_obj = PyBytes_FromStringAndSize(NULL, n * channels * samplesize);
+	if (!buffer_obj)
+		return NULL;
+
+	if (n > 0) {
+		char *dst = PyBytes_AS_STRING(buffer_obj);
+
+		if (self->matrix) {
+			if (is_float)
+				mixed = (float *)dst;
+			// The resampler's output doesn't live in the conversion buffer
+			else if (!mixed &&
+					 !(mixed = alsapcm_floatbuf(self, n * channels, 0))) {
+				Py_DECREF(buffer_obj);
+				return NULL;
+			}
+			alsaconv_mix(self->matrix, self->matrix_in, self->matrix_out,
+						 samples, mixed, n);
+			samples = mixed;
+		}
+
+		if (!is_float)
+			alsaconv_from_float(self->format, samples, dst, n * channels, NULL);
+		else if (samples != (float *)dst)
+			memcpy(dst, samples, n * channels * sizeof(float));
+	}
+
+	return Py_BuildValue("(lN)", (long)(res < 0 ? res : n), buffer_obj);
+}
+
+static PyObject *
+alsapcm_set_channel_matrix(alsapcm_t *self, PyObject *args)
+{
+	PyObject *matrix_obj, *rows = NULL, *row;
+	Py_ssize_t nrows, ncols = 0, r, c;
+	unsigned int device_channels;
+	float *matrix = NULL;
+
+	if (!PyArg_ParseTuple(args,"O:set_channel_matrix", &matrix_obj))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	if (matrix_obj == Py_None) {
+		PyMem_Free(self->matrix);
+		self->matrix = NULL;
+		self->matrix_in = self->matrix_out = 0;
+		Py_RETURN_NONE;
+	}
+
+	if (alsapcm_check_access(self, false) < 0 || alsapcm_check_float(self) < 0)
+		return NULL;
+
+	rows = PySequence_Fast(matrix_obj, "channel matrix must be a sequence "
+						   "of rows");
+	if (!rows)
+		return NULL;
+
+	nrows = PySequence_Fast_GET_SIZE(rows);
+	for (r = 0; r < nrows; r++) {
+		row = PySequence_Fast_GET_ITEM(rows, r);
+		if (!PySequence_Check(row)) {
+			PyErr_SetString(PyExc_TypeError, "channel matrix rows must be "
+							"sequences of gains");
+			goto error;
+		}
+		if (r == 0)
+			ncols = PySequence_Size(row);
+		else if (PySequence_Size(row) != ncols) {
+			PyErr_SetString(ALSAAudioError(self),
+							"All rows of the channel matrix "
+							"must have the same length");
+			goto error;
+		}
+	}
+
+	device_channels = self->pcmtype == SND_PCM_STREAM_PLAYBACK ? nrows : ncols;
+	if (nrows == 0 || ncols == 0 || device_channels != self->channels) {
+		PyErr_Format(ALSAAudioError(self),
+					 "The channel matrix must have %u %s, "
+					 "one per channel of the PCM [%s]", self->channels,
+					 self->pcmtype == SND_PCM_STREAM_PLAYBACK ? "rows" :
+					 "columns", self->cardname);
+		goto error;
+	}
+
+	if (!(matrix = PyMem_New(float, nrows * ncols))) {
+		PyErr_NoMemory();
+		goto error;
+	}
+
+	for (r = 0; r < nrows; r++) {
+		row = PySequence_Fast_GET_ITEM(rows, r);
+		for (c = 0; c < ncols; c++) {
+			PyObject *item = PySequence_GetItem(row, c);
+			double gain;
+
+			if (!item)
+				goto error;
+			gain = PyFloat_AsDouble(item);
+			Py_DECREF(item);
+			if (gain == -1.0 && PyErr_Occurred())
+				goto error;
+			matrix[r * ncols + c] = (float)gain;
+		}
+	}
+
+	Py_DECREF(rows);
+
+	PyMem_Free(self->matrix);
+	self->matrix = matrix;
+	self->matrix_out = nrows;
+	self->matrix_in = ncols;
+
+	Py_RETURN_NONE;
+
+ error:
+	PyMem_Free(matrix);
+	Py_XDECREF(rows);
+	return NULL;
+}
+
+static PyObject *
+alsapcm_read(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_sframes_t res;
+	Py_ssize_t size, sizeout = 0;
+	long frames = -1;
+	PyObject *buffer_obj, *tuple_obj, *res_obj;
+	char *buffer;
+
+	if (!PyArg_ParseTuple(args,"|l:read", &frames))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+  }
+
+	if (self->pcmtype != SND_PCM_STREAM_CAPTURE)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot read from playback PCM [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, false) < 0)
+		return NULL;
+
+	if (frames <= 0)
+		frames = self->periodsize;
+
+	if (alsapcm_processing(self))
+		return alsapcm_read_processed(self, frames, false);
+
+	if (frames > PY_SSIZE_T_MAX / self->framesize)
+		return PyErr_NoMemory();
+	size = (Py_ssize_t)frames * self->framesize;
+
+#if PY_MAJOR_VERSION < 3
+	buffer_obj = PyString_FromStringAndSize(NULL, size);
+	if (!buffer_obj)
+		return NULL;
+	buffer = PyString_AS_STRING(buffer_obj);
+#else
+	buffer_obj = PyBytes_FromStringAndSize(NULL, size);
+	if (!buffer_obj)
+		return NULL;
+	buffer = PyBytes_AS_STRING(buffer_obj);
+#endif
+
+	res = alsapcm_transfer(self, buffer, frames);
+
+	if (res != -EPIPE)
+	{
+		if (res < 0) {
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+						 self->cardname);
+
+			Py_DECREF(buffer_obj);
+			return NULL;
+		}
+		else
+		{
+			sizeout = res * self->framesize;
+		}
+	}
+
+	if (size != sizeout) {
+#if PY_MAJOR_VERSION < 3
+		/* If the following fails, it will free the object */
+		if (_PyString_Resize(&buffer_obj, sizeout))
+			return NULL;
+#else
+		/* If the following fails, it will free the object */
+		if (_PyBytes_Resize(&buffer_obj, sizeout))
+			return NULL;
+#endif
+	}
+
+	res_obj = PyLong_FromLong(res);
+	if (!res_obj) {
+		Py_DECREF(buffer_obj);
+		return NULL;
+	}
+	tuple_obj = PyTuple_New(2);
+	if (!tuple_obj) {
+		Py_DECREF(buffer_obj);
+		Py_DECREF(res_obj);
+		return NULL;
+	}
+	/* Steal reference counts */
+	PyTuple_SET_ITEM(tuple_obj, 0, res_obj);
+	PyTuple_SET_ITEM(tuple_obj, 1, buffer_obj);
+
+	return tuple_obj;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyObject *
+alsapcm_read_into(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_sframes_t res;
+	Py_buffer buf;
+
+	if (!PyArg_ParseTuple(args,"w*:read_into", &buf))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_CAPTURE)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot read from playback PCM [%s]",
+					 self->cardname);
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, false) < 0 ||
+		alsapcm_check_unprocessed(self, "read_into") < 0)
+	{
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	if (buf.len < self->framesize)
+	{
+		PyErr_SetString(ALSAAudioError(self),
+						"Buffer must hold at least one frame");
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	res = alsapcm_transfer(self, buf.buf, buf.len / self->framesize);
+
+	PyBuffer_Release(&buf);
+
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	return PyLong_FromLong(res);
+}
+#endif
+
+static PyObject *alsapcm_write(alsapcm_t *self, PyObject *args)
+{
+	int datalen;
+	char *data;
+	snd_pcm_sframes_t res;
+
+#if PY_MAJOR_VERSION < 3
+	if (!PyArg_ParseTuple(args,"s#:write", &data, &datalen))
+		return NULL;
+#else
+	Py_buffer buf;
+
+	if (!PyArg_ParseTuple(args,"y*:write", &buf))
+		return NULL;
+
+	data = buf.buf;
+	datalen = buf.len;
+#endif
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_PLAYBACK)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot write to capture PCM [%s]",
+					 self->cardname);
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, false) < 0)
+	{
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+		return NULL;
+	}
+
+	if (alsapcm_processing(self))
+	{
+		PyObject *result = alsapcm_write_processed(self, data, datalen,
+												   false, false);
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+		return result;
+	}
+
+	if (datalen % self->framesize)
+	{
+		PyErr_SetString(ALSAAudioError(self),
+						"Data size must be a multiple of framesize");
+
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+		return NULL;
+	}
+
+	if (alsapcm_gain_active(self) &&
+		!(data = alsapcm_gain_copy(self, data, datalen / self->framesize)))
+	{
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+		return NULL;
+	}
+
+	res = alsapcm_transfer(self, data, datalen/self->framesize);
+	alsapcm_gain_advance(self, res);
+
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+
+#if PY_MAJOR_VERSION >= 3
+		PyBuffer_Release(&buf);
+#endif
+
+		return NULL;
+	}
+
+#if PY_MAJOR_VERSION >= 3
+	PyBuffer_Release(&buf);
+#endif
+
+	return PyLong_FromLong(res);
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyObject *
+alsapcm_writev(alsapcm_t *self, PyObject *args)
+{
+	PyObject *seq_obj, *bufs_obj;
+	Py_buffer *bufs = NULL;
+	Py_ssize_t i, n, acquired = 0, total = 0;
+	snd_pcm_sframes_t res, avail;
+	snd_pcm_uframes_t done = 0;
+	uint64_t start, ns;
+	char *carry = NULL;
+	PyObject *result = NULL;
+
+	if (!PyArg_ParseTuple(args,"O:writev", &seq_obj))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_PLAYBACK)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot write to capture PCM [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, false) < 0 ||
+		alsapcm_check_unprocessed(self, "writev") < 0)
+		return NULL;
+
+	bufs_obj = PySequence_Fast(seq_obj, "writev() expects a sequence "
+							   "of buffers");
+	if (!bufs_obj)
+		return NULL;
+
+	n = PySequence_Fast_GET_SIZE(bufs_obj);
+	bufs = PyMem_New(Py_buffer, n ? n : 1);
+	carry = PyMem_Malloc(self->framesize);
+	if (!bufs || !carry)
+	{
+		PyErr_NoMemory();
+		goto exit;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(bufs_obj, i), &bufs[i],
+							   PyBUF_SIMPLE) < 0)
+			goto exit;
+		acquired++;
+		total += bufs[i].len;
+	}
+
+	if (total % self->framesize)
+	{
+		PyErr_SetString(ALSAAudioError(self),
+						"Data size must be a multiple of framesize");
+		goto exit;
+	}
+
+	// The gain needs a copy anyway, so write that in one go
+	if (alsapcm_gain_active(self))
+	{
+		char *gained = alsapcm_gain_buffer(self, total / self->framesize);
+		char *p = gained;
+
+		if (!gained)
+			goto exit;
+		for (i = 0; i < n; i++)
+		{
+			memcpy(p, bufs[i].buf, bufs[i].len);
+			p += bufs[i].len;
+		}
+		alsapcm_gain_apply(self, gained, total / self->framesize);
+
+		res = alsapcm_transfer(self, gained, total / self->framesize);
+		alsapcm_gain_advance(self, res);
+		if (res < 0 && res != -EPIPE)
+			goto error;
+
+		result = PyLong_FromLong(res);
+		goto exit;
+	}
+
+	if ((res = alsapcm_transfer_prepare(self)) < 0)
+		goto error;
+
+	ALSAPCM_BEGIN_BLOCKING(self)
+	{
+		Py_ssize_t carried = 0;
+
+		start = alsapcm_stats_begin(self, &avail);
+		res = 0;
+		for (i = 0; i < n; i++)
+		{
+			char *p = bufs[i].buf;
+			Py_ssize_t len = bufs[i].len;
+			snd_pcm_uframes_t whole;
+
+			// Complete a frame that was split across chunks
+			if (carried)
+			{
+				Py_ssize_t take = self->framesize - carried;
+				if (take > len)
+					take = len;
+				memcpy(carry + carried, p, take);
+				carried += take;
+				p += take;
+				len -= take;
+				if (carried < self->framesize)
+					continue;
+
+				carried = 0;
+				res = alsapcm_transfer_interleaved(self, carry, 1, &done);
+				if (res <= 0)
+					break;
+			}
+
+			whole = len / self->framesize;
+			if (whole)
+			{
+				res = alsapcm_transfer_interleaved(self, p, whole, &done);
+				if (res <= 0)
+					break;
+			}
+
+			carried = len % self->framesize;
+			memcpy(carry, p + whole * self->framesize, carried);
+		}
+		ns = alsapcm_stats_end(start);
+	}
+	ALSAPCM_END_BLOCKING(self)
+
+	alsapcm_stats_update(self, total / self->framesize, res, done, avail, ns);
+	res = alsapcm_transfer_finish(self, res, done);
+	if (res < 0 && res != -EPIPE)
+		goto error;
+
+	result = PyLong_FromLong(res);
+	goto exit;
+
+error:
+	PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+				 self->cardname);
+
+exit:
+	for (i = 0; i < acquired; i++)
+		PyBuffer_Release(&bufs[i]);
+	PyMem_Free(bufs);
+	PyMem_Free(carry);
+	Py_DECREF(bufs_obj);
+
+	return result;
+}
+
+static PyObject *
+alsapcm_write_float(alsapcm_t *self, PyObject *args)
+{
+	Py_buffer buf;
+	int dither = 0;
+	snd_pcm_uframes_t frames;
+	snd_pcm_sframes_t res;
+	char *data;
+	float *samples;
+	PyObject *result = NULL;
+
+	if (!PyArg_ParseTuple(args,"y*|p:write_float", &buf, &dither))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		goto exit;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_PLAYBACK)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot write to capture PCM [%s]",
+					 self->cardname);
+		goto exit;
+	}
+
+	if (alsapcm_check_access(self, false) < 0 || alsapcm_check_float(self) < 0)
+		goto exit;
+
+	if (alsapcm_processing(self))
+	{
+		result = alsapcm_write_processed(self, buf.buf, buf.len, true,
+										 dither);
+		goto exit;
+	}
+
+	if (buf.len % (sizeof(float) * self->channels))
+	{
+		PyErr_SetString(ALSAAudioError(self),
+						"Data size must be a multiple of 4 * channels");
+		goto exit;
+	}
+
+	frames = buf.len / (sizeof(float) * self->channels);
+	if (!alsapcm_gain_active(self))
+	{
+		if (!(data = alsapcm_convbuf(self, frames * self->framesize)))
+			goto exit;
+		samples = buf.buf;
+	}
+	else
+	{
+		// The caller's buffer is read-only, so apply the gain to a copy
+		if (!(samples = (float *)alsapcm_convbuf(self, buf.len +
+												 frames * self->framesize)))
+			goto exit;
+		memcpy(samples, buf.buf, buf.len);
+		alsapcm_gain_float(self, samples, frames, 0);
+		data = (char *)samples + buf.len;
+	}
+
+	alsaconv_from_float(self->format, samples, data, frames * self->channels,
+						dither ? self->dither : NULL);
+
+	res = alsapcm_transfer_unmetered(self, data, frames);
+	alsapcm_gain_advance(self, res);
+	if (self->meters && res > 0)
+		alsameter_update_float(self->meters, self->channels, samples, res);
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		goto exit;
+	}
+
+	result = PyLong_FromLong(res);
+
+exit:
+	PyBuffer_Release(&buf);
+
+	return result;
+}
+
+static PyObject *
+alsapcm_read_float(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_sframes_t res;
+	long frames = -1;
+	PyObject *buffer_obj;
+	char *data;
+
+	if (!PyArg_ParseTuple(args,"|l:read_float", &frames))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_CAPTURE)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot read from playback PCM [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, false) < 0 || alsapcm_check_float(self) < 0)
+		return NULL;
+
+	if (frames <= 0)
+		frames = self->periodsize;
+
+	if (alsapcm_processing(self))
+		return alsapcm_read_processed(self, frames, true);
+
+	if ((size_t)frames > PY_SSIZE_T_MAX / (sizeof(double) * self->channels))
+		return PyErr_NoMemory();
+
+	if (!(data = alsapcm_convbuf(self, frames * self->framesize)))
+		return NULL;
+
+	res = alsapcm_transfer_unmetered(self, data, frames);
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	buffer_obj = PyBytes_FromStringAndSize(NULL, res > 0 ?
+										   res * self->channels * sizeof(float) : 0);
+	if (!buffer_obj)
+		return NULL;
+
+	if (res > 0) {
+		float *samples = (float *)PyBytes_AS_STRING(buffer_obj);
+
+		alsaconv_to_float(self->format, data, samples, res * self->channels);
+		if (self->meters)
+			alsameter_update_float(self->meters, self->channels, samples,
+								   res);
+	}
+
+	return Py_BuildValue("(lN)", (long)res, buffer_obj);
+}
+
+static PyObject *
+alsapcm_write_planar(alsapcm_t *self, PyObject *args)
+{
+	PyObject *seq_obj, *bufs_obj;
+	Py_buffer *bufs = NULL;
+	void **data = NULL;
+	Py_ssize_t i, acquired = 0;
+	Py_ssize_t samplesize = self->framesize / (self->channels ? self->channels : 1);
+	snd_pcm_sframes_t res;
+	PyObject *result = NULL;
+
+	if (!PyArg_ParseTuple(args,"O:write_planar", &seq_obj))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_PLAYBACK)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot write to capture PCM [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, true) < 0)
+		return NULL;
+
+	bufs_obj = PySequence_Fast(seq_obj, "write_planar() expects a sequence "
+							   "of buffers");
+	if (!bufs_obj)
+		return NULL;
+
+	if (PySequence_Fast_GET_SIZE(bufs_obj) != self->channels)
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Expected %u buffers, one per channel, "
+					 "got %zd [%s]", self->channels,
+					 PySequence_Fast_GET_SIZE(bufs_obj), self->cardname);
+		goto exit;
+	}
+
+	bufs = PyMem_New(Py_buffer, self->channels);
+	data = PyMem_New(void *, self->channels);
+	if (!bufs || !data)
+	{
+		PyErr_NoMemory();
+		goto exit;
+	}
+
+	for (i = 0; i < self->channels; i++)
+	{
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(bufs_obj, i), &bufs[i],
+							   PyBUF_SIMPLE) < 0)
+			goto exit;
+		acquired++;
+
+		if (bufs[i].len != bufs[0].len)
+		{
+			PyErr_SetString(ALSAAudioError(self),
+							"All channel buffers must have the same size");
+			goto exit;
+		}
+		data[i] = bufs[i].buf;
+	}
+
+	if (bufs[0].len % samplesize)
+	{
+		PyErr_SetString(ALSAAudioError(self),
+						"Channel buffer size must be a multiple of the sample size");
+		goto exit;
+	}
+
+	res = alsapcm_transfer(self, data, bufs[0].len / samplesize);
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		goto exit;
+	}
+
+	result = PyLong_FromLong(res);
+
+exit:
+	for (i = 0; i < acquired; i++)
+		PyBuffer_Release(&bufs[i]);
+	PyMem_Free(bufs);
+	PyMem_Free(data);
+	Py_DECREF(bufs_obj);
+
+	return result;
+}
+
+static PyObject *
+alsapcm_read_planar(alsapcm_t *self, PyObject *args)
+{
+	PyObject *list_obj, *item;
+	void **data;
+	unsigned int i;
+	Py_ssize_t samplesize = self->framesize / (self->channels ? self->channels : 1);
+	Py_ssize_t size = samplesize * self->periodsize;
+	snd_pcm_sframes_t res;
+
+	if (!PyArg_ParseTuple(args,":read_planar"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (self->pcmtype != SND_PCM_STREAM_CAPTURE)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot read from playback PCM [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, true) < 0)
+		return NULL;
+
+	data = PyMem_New(void *, self->channels);
+	if (!data)
+		return PyErr_NoMemory();
+
+	list_obj = PyList_New(self->channels);
+	if (!list_obj)
+	{
+		PyMem_Free(data);
+		return NULL;
+	}
+
+	for (i = 0; i < self->channels; i++)
+	{
+		item = PyBytes_FromStringAndSize(NULL, size);
+		if (!item)
+		{
+			PyMem_Free(data);
+			Py_DECREF(list_obj);
+			return NULL;
+		}
+		PyList_SET_ITEM(list_obj, i, item);
+		data[i] = PyBytes_AS_STRING(item);
+	}
+
+	res = alsapcm_transfer(self, data, self->periodsize);
+	PyMem_Free(data);
+
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		Py_DECREF(list_obj);
+		return NULL;
+	}
+
+	if (res != (snd_pcm_sframes_t)self->periodsize)
+	{
+		for (i = 0; i < self->channels; i++)
+		{
+			/* The list holds the only reference, so the item may be resized
+			   in place. If this fails, it will free the object. */
+			item = PyList_GET_ITEM(list_obj, i);
+			PyList_SET_ITEM(list_obj, i, NULL);
+			if (_PyBytes_Resize(&item, res > 0 ? res * samplesize : 0))
+			{
+				Py_DECREF(list_obj);
+				return NULL;
+			}
+			PyList_SET_ITEM(list_obj, i, item);
+		}
+	}
+
+	return Py_BuildValue("(lN)", (long)res, list_obj);
+}
+#endif
+
+static PyObject *
+alsapcm_avail(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":avail"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	long avail = snd_pcm_avail(self->handle);
+	// if (avail < 0)
+	// {
+	// 	PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(avail),
+	// 				 self->cardname);
+
+	// 	return NULL;
+	// }
+
+	return PyLong_FromLong(avail);
+}
+
+static PyObject *alsapcm_pause(alsapcm_t *self, PyObject *args)
+{
+	int enabled=1, res;
+
+	if (!PyArg_ParseTuple(args,"|i:pause", &enabled))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_busy(self) < 0)
+		return NULL;
+
+	res = snd_pcm_pause(self->handle, enabled);
+	if (res < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+
+		return NULL;
+	}
+	return PyLong_FromLong(res);
+}
+
+static PyObject *alsapcm_drop(alsapcm_t *self, PyObject *args)
+{
+	int res;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_busy(self) < 0)
+		return NULL;
+
+	self->npending = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = snd_pcm_drop(self->handle);
+	Py_END_ALLOW_THREADS
+
+	if (res < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+
+		return NULL;
+	}
+
+	return PyLong_FromLong(res);
+}
+
+static PyObject *alsapcm_drain(alsapcm_t *self, PyObject *args)
+{
+	int res;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (alsapcm_check_busy(self) < 0)
+		return NULL;
+
+	// Resampled frames the device didn't accept yet go first
+	res = alsapcm_write_pending(self);
+	if (res < 0 && res != -EPIPE)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	ALSAPCM_BEGIN_BLOCKING(self)
+	res = snd_pcm_drain(self->handle);
+	ALSAPCM_END_BLOCKING(self)
+
+	if (res < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+
+		return NULL;
+	}
+
+	return PyLong_FromLong(res);
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyObject *
+alsapcm_mmap_begin(alsapcm_t *self, PyObject *args)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, want;
+	snd_pcm_state_t state;
+	PyObject *view;
+	long requested = -1;
+	char *addr;
+	int res;
+
+	if (!PyArg_ParseTuple(args,"|l:mmap_begin", &requested))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (self->access != SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+		PyErr_Format(ALSAAudioError(self), "PCM was not opened with "
+					 "PCM_ACCESS_MMAP_INTERLEAVED [%s]", self->cardname);
+		return NULL;
+	}
+
+	if (self->mmap_view) {
+		PyErr_Format(ALSAAudioError(self),
+					 "mmap_commit() must be called before "
+					 "the next mmap_begin() [%s]", self->cardname);
+		return NULL;
+	}
+
+	if (alsapcm_check_unprocessed(self, "mmap_begin") < 0)
+		return NULL;
+
+	if (alsapcm_gain_active(self)) {
+		PyErr_Format(ALSAAudioError(self), "mmap_begin() doesn't support the "
+					 "software gain [%s]", self->cardname);
+		return NULL;
+	}
+
+	if (self->thread_running) {
+		res = -EBUSY;
+		goto error;
+	}
+
+	want = requested > 0 ? requested : (snd_pcm_sframes_t)self->periodsize;
+	if (want > (snd_pcm_sframes_t)self->buffersize)
+		want = self->buffersize;
+
+	// After drop() and drain(), we need to prepare the stream again.
+	state = snd_pcm_state(self->handle);
+	if (state == SND_PCM_STATE_SETUP) {
+		res = snd_pcm_prepare(self->handle);
+		if (res < 0)
+			goto error;
+		state = SND_PCM_STATE_PREPARED;
+	}
+
+	// A capture stream doesn't fill the buffer until it was started
+	if (self->pcmtype == SND_PCM_STREAM_CAPTURE &&
+		state == SND_PCM_STATE_PREPARED) {
+		res = snd_pcm_start(self->handle);
+		if (res < 0)
+			goto error;
+	}
+
+	for (;;) {
+		avail = snd_pcm_avail_update(self->handle);
+		if (avail < 0 || avail >= want || (self->pcmmode & SND_PCM_NONBLOCK))
+			break;
+
+		ALSAPCM_BEGIN_BLOCKING(self)
+		res = snd_pcm_wait(self->handle, -1);
+		ALSAPCM_END_BLOCKING(self)
+
+		if (res < 0) {
+			avail = res;
+			break;
+		}
+	}
+
+	if (avail == -EPIPE) {
+		// Recover the stream and report the xrun, just like read() and write()
+		atomic_fetch_add(&self->xruns, 1);
+		res = snd_pcm_prepare(self->handle);
+		if (res < 0)
+			goto error;
+		frames = 0;
+		avail = -EPIPE;
+		addr = NULL;
+	}
+	else if (avail < 0) {
+		res = avail;
+		goto error;
+	}
+	else {
+		frames = avail < want ? avail : want;
+		offset = 0;
+
+		if (frames) {
+			res = snd_pcm_mmap_begin(self->handle, &areas, &offset, &frames);
+			if (res < 0)
+				goto error;
+		}
+		avail = frames;
+
+		/* Interleaved access: all channels share the first area */
+		addr = frames ? (char *)areas[0].addr +
+			(areas[0].first + offset * areas[0].step) / 8 : NULL;
+
+		self->mmap_offset = offset;
+		self->mmap_frames = frames;
+	}
+
+	view = PyMemoryView_FromMemory(addr ? addr : "", frames * self->framesize,
+								   self->pcmtype == SND_PCM_STREAM_PLAYBACK ?
+								   PyBUF_WRITE : PyBUF_READ);
+	if (!view)
+		return NULL;
+
+	if (frames) {
+		Py_INCREF(view);
+		self->mmap_view = view;
+	}
+
+	return Py_BuildValue("(lN)", (long)avail, view);
+
+error:
+	PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+				 self->cardname);
+	return NULL;
+}
+
+static PyObject *
+alsapcm_mmap_commit(alsapcm_t *self, PyObject *args)
+{
+	snd_pcm_uframes_t offset;
+	snd_pcm_sframes_t res, avail;
+	long frames = -1;
+
+	if (!PyArg_ParseTuple(args,"|l:mmap_commit", &frames))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (!self->mmap_view) {
+		PyErr_Format(ALSAAudioError(self),
+					 "mmap_commit() without mmap_begin() [%s]", self->cardname);
+		return NULL;
+	}
+
+	if (frames < 0)
+		frames = self->mmap_frames;
+	else if (frames > (long)self->mmap_frames) {
+		PyErr_Format(ALSAAudioError(self), "Cannot commit %ld frames, only %lu "
+					 "were mapped [%s]", frames,
+					 (unsigned long)self->mmap_frames, self->cardname);
+		return NULL;
+	}
+
+	offset = self->mmap_offset;
+	alsapcm_mmap_release(self);
+
+	res = snd_pcm_mmap_commit(self->handle, offset, frames);
+	if (res >= 0 && res != frames)
+		res = -EPIPE;
+	// Waiting happens in mmap_begin(), so there is no time to count
+	alsapcm_stats_update(self, frames, res, 0, -1, 0);
+
+	if (res == -EPIPE) {
+		// Recover the stream and report the xrun, just like write() and read()
+		atomic_fetch_add(&self->xruns, 1);
+		if (!(res = snd_pcm_prepare(self->handle)))
+			res = -EPIPE;
+	}
+	else if (res >= 0 && self->pcmtype == SND_PCM_STREAM_PLAYBACK &&
+			 snd_pcm_state(self->handle) == SND_PCM_STATE_PREPARED) {
+		// snd_pcm_writei() starts playback once the buffer is full enough;
+		// committed areas have to be started by hand
+		snd_pcm_sw_params_t *swparams;
+		snd_pcm_uframes_t threshold;
+		int err;
+
+		snd_pcm_sw_params_alloca(&swparams);
+		snd_pcm_sw_params_current(self->handle, swparams);
+		snd_pcm_sw_params_get_start_threshold(swparams, &threshold);
+
+		avail = snd_pcm_avail_update(self->handle);
+		if (avail >= 0 &&
+			self->buffersize - (snd_pcm_uframes_t)avail >= threshold) {
+			err = snd_pcm_start(self->handle);
+			if (err < 0)
+				res = err;
+		}
+	}
+
+	if (res < 0 && res != -EPIPE) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	return PyLong_FromLong(res);
+}
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+static PyObject *
+alsapcm_start(alsapcm_t *self, PyObject *args)
+{
+	PyObject *callback;
+	long frames = -1;
+	snd_pcm_state_t state;
+	int res;
+
+	if (!PyArg_ParseTuple(args,"O|l:start", &callback, &frames))
+		return NULL;
+
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	if (PyObject_TypeCheck(callback, alsaaudio_state_of(self)->ring_type)) {
+		if (((alsaring_t *)callback)->framesize != self->framesize) {
+			PyErr_Format(ALSAAudioError(self),
+						 "Ring buffer framesize %d doesn't "
+						 "match PCM framesize %d [%s]",
+						 ((alsaring_t *)callback)->framesize, self->framesize,
+						 self->cardname);
+			return NULL;
+		}
+	}
+	else if (!PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError,
+						"callback must be callable or a RingBuffer");
+		return NULL;
+	}
+
+	if (alsapcm_check_access(self, false) < 0 ||
+		alsapcm_check_unprocessed(self, "start") < 0)
+		return NULL;
+
+	if (alsapcm_check_config(self) < 0)
+		return NULL;
+
+	if (frames <= 0)
+		frames = self->periodsize;
+
+	// After drop() and drain(), we need to prepare the stream again.
+	state = snd_pcm_state(self->handle);
+	if (state == SND_PCM_STATE_SETUP &&
+		(res = snd_pcm_prepare(self->handle)) < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+					 self->cardname);
+		return NULL;
+	}
+
+	alsapcm_thread_clear_errors(self);
+
+	self->cbframes = frames;
+	// Playback buffers are followed by the scratch space of the gain
+	self->cbbuffer = PyMem_Malloc(frames * self->framesize +
+								  (self->pcmtype == SND_PCM_STREAM_PLAYBACK ?
+								   sizeof(float) * ALSAPCM_GAIN_CHUNK *
+								   self->channels : 0));
+	if (!self->cbbuffer)
+		return PyErr_NoMemory();
+
+	if (self->pcmtype == SND_PCM_STREAM_PLAYBACK)
+		snd_pcm_format_set_silence(self->format, self->cbbuffer,
+								   frames * self->channels);
+
+	self->cbview = PyMemoryView_FromMemory(self->cbbuffer,
+										   frames * self->framesize,
+										   self->pcmtype == SND_PCM_STREAM_PLAYBACK ?
+										   PyBUF_WRITE : PyBUF_READ);
+	if (!self->cbview) {
+		PyMem_Free(self->cbbuffer);
+		self->cbbuffer = NULL;
+		return NULL;
+	}
+
+	Py_INCREF(callback);
+	self->callback = callback;
+	if (PyObject_TypeCheck(callback, alsaaudio_state_of(self)->ring_type)) {
+		if (alsaring_claim((alsaring_t *)callback, alsapcm_ring_side(self)) < 0) {
+			alsapcm_thread_free(self);
+			return NULL;
+		}
+		self->ring = (alsaring_t *)callback;
+	}
+
+	/* Let the module stop the thread at exit, if stop() isn't called */
+	if (PySet_Add(alsaaudio_state_of(self)->running, (PyObject *)self) < 0) {
+		alsapcm_thread_free(self);
+		return NULL;
+	}
+
+	/* The thread uses the object, so keep it alive until stop() */
+	Py_INCREF(self);
+	atomic_store(&self->thread_stop, 0);
+	self->interp = PyInterpreterState_Get();
+	self->tstate = NULL;
+
+	res = pthread_create(&self->thread, NULL, alsapcm_thread_main, self);
+	if (res) {
+		PySet_Discard(alsaaudio_state_of(self)->running, (PyObject *)self);
+		alsapcm_thread_free(self);
+		Py_DECREF(self);
+		PyErr_Format(ALSAAudioError(self), "Cannot start thread: %s [%s]",
+					 strerror(res), self->cardname);
+		return NULL;
+	}
+	self->thread_running = true;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+alsapcm_stop(alsapcm_t *self, PyObject *args)
+{
+	int err;
+
+	if (!PyArg_ParseTuple(args,":stop"))
+		return NULL;
+
+	if (!self->thread_running) {
+		PyErr_SetString(ALSAAudioError(self), "PCM was not started");
+		return NULL;
+	}
+
+	/* Keep the object alive across the join, which drops the thread's
+	   reference */
+	Py_INCREF(self);
+	alsapcm_thread_join(self);
+
+	if (self->thread_exc_type) {
+		PyErr_Restore(self->thread_exc_type, self->thread_exc_value,
+					  self->thread_exc_tb);
+		self->thread_exc_type = self->thread_exc_value = self->thread_exc_tb = NULL;
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	err = self->thread_error;
+	if (err < 0) {
+		self->thread_error = 0;
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(err),
+					 self->cardname);
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	Py_DECREF(self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+#endif
+
+static PyObject *
+alsapcm_xruns(alsapcm_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":xruns"))
+		return NULL;
+
+	return PyLong_FromUnsignedLong(atomic_load(&self->xruns));
+}
+
+/* The poll descriptors of a PCM don't change while it is open, so they are
+   fetched once and kept for polldescriptors() and the asyncio support.
+
+   Returns the number of descriptors, or -1 with an exception set. */
+static int
+alsapcm_get_pollfds(alsapcm_t *self)
+{
+	int count, rc;
+
+	if (self->pollfds)
+		return self->npollfds;
+
+	count = snd_pcm_poll_descriptors_count(self->handle);
+	if (count < 0)
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Can't get poll descriptor count [%s]", self->cardname);
+		return -1;
+	}
+
+	self->pollfds = PyMem_New(struct pollfd, count ? count : 1);
+	if (!self->pollfds)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	rc = snd_pcm_poll_descriptors(self->handle, self->pollfds,
+								  (unsigned int)count);
+	if (rc != count)
+	{
+		PyErr_Format(ALSAAudioError(self), "Can't get poll descriptors [%s]",
+					 self->cardname);
+		PyMem_Free(self->pollfds);
+		self->pollfds = NULL;
+		return -1;
+	}
+	self->npollfds = count;
+
+	return count;
+}
+
+static PyObject *
+alsapcm_polldescriptors(alsapcm_t *self, PyObject *args)
+{
+	int i, count;
+	PyObject *result;
+
+	if (!PyArg_ParseTuple(args,":polldescriptors"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	count = alsapcm_get_pollfds(self);
+	if (count < 0)
+		return NULL;
+
+	result = PyList_New(count);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < count; ++i)
+	{
+		PyList_SetItem(result, i,
+					   Py_BuildValue("ih", self->pollfds[i].fd,
+									 self->pollfds[i].events));
+	}
+
+	return result;
+}
+
+static PyObject *
+alsapcm_polldescriptors_revents(alsapcm_t *self, PyObject *args)
+{
+	PyObject *list_obj;
+
+	if (!PyArg_ParseTuple(args, "O!:polldescriptors_revents", &PyList_Type, &list_obj))
+	{
+		PyErr_SetString(PyExc_TypeError, "parameter must be a list.");
+		return NULL;
+	}
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return NULL;
+	}
+
+	Py_ssize_t list_size = PyList_Size(list_obj);
+
+	// Avoid the allocation for the usual handful of descriptors
+	struct pollfd stackfds[8];
+	struct pollfd *fds = stackfds;
+	if (list_size > (Py_ssize_t)(sizeof(stackfds) / sizeof(stackfds[0])))
+	{
+		fds = PyMem_New(struct pollfd, list_size);
+		if (!fds)
+			return PyErr_NoMemory();
+	}
+
+	for (int i = 0; i < list_size; i++)
+	{
+		PyObject *tuple_obj = PyList_GetItem(list_obj, i);
+		if(!PyTuple_Check(tuple_obj)) {
+			PyErr_SetString(PyExc_TypeError, "list items must be tuples.");
+			if (fds != stackfds)
+				PyMem_Free(fds);
+			return NULL;
+		}
+
+		Py_ssize_t tuple_size = PyTuple_Size(tuple_obj);
+		if (tuple_size != 2) {
+			PyErr_SetString(PyExc_TypeError, "tuples inside list must be (fd: int, mask: int)");
+			if (fds != stackfds)
+				PyMem_Free(fds);
+			return NULL;
+		}
+
+		PyObject* t0 = PyTuple_GetItem(tuple_obj, 0);
+		PyObject* t1 = PyTuple_GetItem(tuple_obj, 1);
+
+		if (!PyLong_Check(t0) || !PyLong_Check(t1)) {
+			PyErr_SetString(PyExc_TypeError, "tuples inside list must be (fd: int, mask: int)");
+			if (fds != stackfds)
+				PyMem_Free(fds);
+			return NULL;
+		}
+
+		fds[i].events = 0;
+		fds[i].fd = PyLong_AS_LONG(t0);
+		fds[i].revents = PyLong_AS_LONG(t1);
+	}
+
+	unsigned short revents;
+	int rc = snd_pcm_poll_descriptors_revents(self->handle, fds, (unsigned short)list_size, &revents);
+	if (rc < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+					 self->cardname);
+		if (fds != stackfds)
+			PyMem_Free(fds);
+		return NULL;
+	}
+
+	if (fds != stackfds)
+		PyMem_Free(fds);
+
+	return PyLong_FromLong(revents);
+}
+
+/* ALSA PCM Object Bureaucracy */
+
+ALSALOCK_METHOD(alsapcm_pcmtype, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_pcmmode, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_cardname, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_getchannels, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_setchannels, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_setrate, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_setformat, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_setperiodsize, alsapcm_t)
+#if PY_MAJOR_VERSION >= 3
+ALSALOCK_METHOD_KW(alsapcm_configure, alsapcm_t)
+#endif
+ALSALOCK_METHOD(alsapcm_htimestamp, alsapcm_t)
+#if PY_MAJOR_VERSION >= 3
+ALSALOCK_METHOD(alsapcm_status, alsapcm_t)
+ALSALOCK_METHOD_KW(alsapcm_stats, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_enable_stats, alsapcm_t)
+ALSALOCK_METHOD_KW(alsapcm_set_sw_params, alsapcm_t)
+#endif
+ALSALOCK_METHOD(alsapcm_set_tstamp_type, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_set_tstamp_mode, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_get_tstamp_type, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_get_tstamp_mode, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_dumpinfo, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_info, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_state, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_getformats, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_getratemaxmin, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_getrates, alsapcm_t)
+ALSAPCM_IO_METHOD(alsapcm_read, true)
+#if PY_MAJOR_VERSION >= 3
+ALSAPCM_IO_METHOD(alsapcm_read_into, true)
+#endif
+ALSAPCM_IO_METHOD(alsapcm_write, true)
+#if PY_MAJOR_VERSION >= 3
+ALSAPCM_IO_METHOD(alsapcm_writev, true)
+ALSAPCM_IO_METHOD(alsapcm_write_float, true)
+ALSAPCM_IO_METHOD(alsapcm_read_float, true)
+ALSALOCK_METHOD(alsapcm_set_channel_matrix, alsapcm_t)
+ALSALOCK_METHOD_KW(alsapcm_set_gain, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_get_gain, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_enable_meters, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_meters, alsapcm_t)
+ALSAPCM_IO_METHOD(alsapcm_aread, false)
+ALSAPCM_IO_METHOD(alsapcm_awrite, false)
+ALSAPCM_IO_METHOD(alsapcm_read_planar, true)
+ALSAPCM_IO_METHOD(alsapcm_write_planar, true)
+#endif
+ALSALOCK_METHOD(alsapcm_avail, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_pause, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_drop, alsapcm_t)
+ALSAPCM_IO_METHOD(alsapcm_drain, true)
+#if PY_MAJOR_VERSION >= 3
+ALSALOCK_METHOD(alsapcm_start, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_stop, alsapcm_t)
+#endif
+ALSALOCK_METHOD(alsapcm_xruns, alsapcm_t)
+#if PY_MAJOR_VERSION >= 3
+ALSAPCM_IO_METHOD(alsapcm_mmap_begin, true)
+ALSALOCK_METHOD(alsapcm_mmap_commit, alsapcm_t)
+#endif
+ALSALOCK_METHOD(alsapcm_close, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_polldescriptors, alsapcm_t)
+ALSALOCK_METHOD(alsapcm_polldescriptors_revents, alsapcm_t)
+
+static PyMethodDef alsapcm_methods[] = {
+	{"pcmtype", (PyCFunction)alsapcm_pcmtype_locked, METH_VARARGS},
+	{"pcmmode", (PyCFunction)alsapcm_pcmmode_locked, METH_VARARGS},
+	{"cardname", (PyCFunction)alsapcm_cardname_locked, METH_VARARGS},
+	{"getchannels", (PyCFunction)alsapcm_getchannels_locked, METH_VARARGS},
+	{"setchannels", (PyCFunction)alsapcm_setchannels_locked, METH_VARARGS},
+	{"setrate", (PyCFunction)alsapcm_setrate_locked, METH_VARARGS},
+	{"setformat", (PyCFunction)alsapcm_setformat_locked, METH_VARARGS},
+	{"setperiodsize", (PyCFunction)alsapcm_setperiodsize_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"configure", (PyCFunction)alsapcm_configure_locked, METH_VARARGS|METH_KEYWORDS},
+#endif
+	{"htimestamp", (PyCFunction) alsapcm_htimestamp_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"status", (PyCFunction)alsapcm_status_locked, METH_VARARGS},
+	{"stats", (PyCFunction)alsapcm_stats_locked, METH_VARARGS|METH_KEYWORDS},
+	{"enable_stats", (PyCFunction)alsapcm_enable_stats_locked, METH_VARARGS},
+	{"set_sw_params", (PyCFunction)alsapcm_set_sw_params_locked, METH_VARARGS|METH_KEYWORDS},
+#endif
+	{"set_tstamp_type", (PyCFunction) alsapcm_set_tstamp_type_locked, METH_VARARGS},
+	{"set_tstamp_mode", (PyCFunction) alsapcm_set_tstamp_mode_locked, METH_VARARGS},
+	{"get_tstamp_type", (PyCFunction) alsapcm_get_tstamp_type_locked, METH_VARARGS},
+	{"get_tstamp_mode", (PyCFunction) alsapcm_get_tstamp_mode_locked, METH_VARARGS},
+	{"dumpinfo", (PyCFunction)alsapcm_dumpinfo_locked, METH_VARARGS},
+	{"info", (PyCFunction)alsapcm_info_locked, METH_VARARGS},
+	{"state", (PyCFunction)alsapcm_state_locked, METH_VARARGS},
+	{"getformats", (PyCFunction)alsapcm_getformats_locked, METH_VARARGS},
+	{"getratebounds", (PyCFunction)alsapcm_getratemaxmin_locked, METH_VARARGS},
+	{"getrates", (PyCFunction)alsapcm_getrates_locked, METH_VARARGS},
+	{"read", (PyCFunction)alsapcm_read_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"read_into", (PyCFunction)alsapcm_read_into_locked, METH_VARARGS},
+#endif
+	{"write", (PyCFunction)alsapcm_write_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"writev", (PyCFunction)alsapcm_writev_locked, METH_VARARGS},
+	{"write_float", (PyCFunction)alsapcm_write_float_locked, METH_VARARGS},
+	{"read_float", (PyCFunction)alsapcm_read_float_locked, METH_VARARGS},
+	{"set_channel_matrix", (PyCFunction)alsapcm_set_channel_matrix_locked, METH_VARARGS},
+	{"set_gain", (PyCFunction)alsapcm_set_gain_locked, METH_VARARGS|METH_KEYWORDS},
+	{"get_gain", (PyCFunction)alsapcm_get_gain_locked, METH_VARARGS},
+	{"enable_meters", (PyCFunction)alsapcm_enable_meters_locked, METH_VARARGS},
+	{"meters", (PyCFunction)alsapcm_meters_locked, METH_VARARGS},
+	{"aread", (PyCFunction)alsapcm_aread_locked, METH_VARARGS},
+	{"awrite", (PyCFunction)alsapcm_awrite_locked, METH_VARARGS},
+	{"read_planar", (PyCFunction)alsapcm_read_planar_locked, METH_VARARGS},
+	{"write_planar", (PyCFunction)alsapcm_write_planar_locked, METH_VARARGS},
+#endif
+	{"avail", (PyCFunction)alsapcm_avail_locked, METH_VARARGS},
+	{"pause", (PyCFunction)alsapcm_pause_locked, METH_VARARGS},
+	{"drop", (PyCFunction)alsapcm_drop_locked, METH_VARARGS},
+	{"drain", (PyCFunction)alsapcm_drain_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"start", (PyCFunction)alsapcm_start_locked, METH_VARARGS},
+	{"stop", (PyCFunction)alsapcm_stop_locked, METH_VARARGS},
+#endif
+	{"xruns", (PyCFunction)alsapcm_xruns_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"mmap_begin", (PyCFunction)alsapcm_mmap_begin_locked, METH_VARARGS},
+	{"mmap_commit", (PyCFunction)alsapcm_mmap_commit_locked, METH_VARARGS},
+#endif
+	{"close", (PyCFunction)alsapcm_close_locked, METH_VARARGS},
+	{"polldescriptors", (PyCFunction)alsapcm_polldescriptors_locked, METH_VARARGS},
+	{"polldescriptors_revents", (PyCFunction)alsapcm_polldescriptors_revents_locked, METH_VARARGS},
+	{NULL, NULL}
+};
+
+static PyMethodDef alsa_methods[] = {
+	{"asoundlib_version", (PyCFunction) alsa_asoundlib_version, METH_VARARGS},
+	{NULL, NULL}
+};
+
+
+
+static PyType_Slot alsapcm_slots[] = {
+	{ Py_tp_dealloc, (void *)alsapcm_dealloc },
+	{ Py_tp_new, (void *)alsapcm_new },
+	{ Py_tp_doc, "ALSA PCM device." },
+	{ Py_tp_methods, alsapcm_methods },
+	{ 0, NULL },
+};
+
+static PyType_Spec alsapcm_spec = {
+	"alsaaudio.PCM",
+	sizeof(alsapcm_t),
+	0,
+	ALSAAUDIO_TPFLAGS,
+	alsapcm_slots,
+};
+
+
+/******************************************/
+/* Mixer object wrapper				   */
+/******************************************/
+
+#define MIXER_CAP_VOLUME			0x0001
+#define MIXER_CAP_VOLUME_JOINED	 0x0002
+#define MIXER_CAP_PVOLUME		   0x0004
+#define MIXER_CAP_PVOLUME_JOINED	0x0008
+#define MIXER_CAP_CVOLUME		   0x0010
+#define MIXER_CAP_CVOLUME_JOINED	0x0020
+
+#define MIXER_CAP_SWITCH			0x0001
+#define MIXER_CAP_SWITCH_JOINED	 0x0002
+#define MIXER_CAP_PSWITCH		   0x0004
+#define MIXER_CAP_PSWITCH_JOINED	0x0008
+#define MIXER_CAP_CSWITCH		   0x0010
+#define MIXER_CAP_CSWITCH_JOINED	0x0020
+#define MIXER_CAP_CSWITCH_EXCLUSIVE 0x0040
+
+#define MIXER_CHANNEL_ALL -1
+
+static int
+alsamixer_gethandle(char *cardname, snd_mixer_t **handle)
+{
+	int err;
+	if ((err = snd_mixer_open(handle, 0)) < 0)
+		return err;
+	if ((err = snd_mixer_attach(*handle, cardname)) >= 0 &&
+		(err = snd_mixer_selem_register(*handle, NULL, NULL)) >= 0 &&
+		(err = snd_mixer_load(*handle)) >= 0)
+		return 0;
+	snd_mixer_close(*handle);
+	return err;
+}
+
+static PyObject *
+alsamixer_list(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	alsaaudio_state_t *state = alsaaudio_module_state(self);
+	snd_mixer_t *handle;
+	snd_mixer_selem_id_t *sid;
+	snd_mixer_elem_t *elem;
+	int err;
+	int cardidx = -1;
+	char hw_device[128];
+	char *device = "default";
+	PyObject *result;
+
+	char *kw[] = { "cardindex", "device", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|is", kw,
+									 &cardidx, &device))
+		return NULL;
+
+	if (cardidx >= 0) {
+		if (cardidx < 32) {
+			snprintf(hw_device, sizeof(hw_device), "hw:%d", cardidx);
+			device = hw_device;
+		}
+		else {
+			PyErr_Format(state->error, "Invalid card number %d", cardidx);
+			return NULL;
+		}
+	}
+
+	snd_mixer_selem_id_alloca(&sid);
+	Py_BEGIN_ALLOW_THREADS
+	err = alsamixer_gethandle(device, &handle);
+	Py_END_ALLOW_THREADS
+	if (err < 0)
+	{
+		PyErr_Format(state->error, "%s [%s]", snd_strerror(err), device);
+		return NULL;
+	}
+
+	result = PyList_New(0);
+
+	for (elem = snd_mixer_first_elem(handle); elem;
+		 elem = snd_mixer_elem_next(elem))
+	{
+		PyObject *mixer;
+		snd_mixer_selem_get_id(elem, sid);
+		mixer = PyUnicode_FromString(snd_mixer_selem_id_get_name(sid));
+		PyList_Append(result,mixer);
+		Py_DECREF(mixer);
+	}
+	snd_mixer_close(handle);
+
+	return result;
+}
+
+static snd_mixer_elem_t *
+alsamixer_find_elem(snd_mixer_t *handle, char *control, int id)
+{
+	snd_mixer_selem_id_t *sid;
+
+	snd_mixer_selem_id_alloca(&sid);
+	snd_mixer_selem_id_set_index(sid, id);
+	snd_mixer_selem_id_set_name(sid, control);
+	return snd_mixer_find_selem(handle, sid);
+}
+
+static PyObject *
+alsamixer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	alsaaudio_state_t *state = alsaaudio_type_state(type);
+	alsamixer_t *self;
+	int err;
+	char *control = "Master";
+	char *device = "default";
+	char hw_device[128];
+	int cardidx = -1;
+	int id = 0;
+	snd_mixer_elem_t *elem;
+	int channel;
+	char *kw[] = { "control", "id", "cardindex", "device", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|siis", kw,
+									 &control, &id, &cardidx, &device)) {
+		return NULL;
+	}
+
+	if (cardidx >= 0) {
+		if (cardidx < 32) {
+			snprintf(hw_device, sizeof(hw_device), "hw:%d", cardidx);
+			device = hw_device;
+		}
+		else {
+			PyErr_Format(state->error, "Invalid card number %d", cardidx);
+			return NULL;
+		}
+	}
+
+	if (!(self = (alsamixer_t *)PyObject_New(alsamixer_t, type)))
+		return NULL;
+
+	pthread_mutex_init(&self->lock, NULL);
+	self->handle = 0;
+	self->pollfds = NULL;
+	self->npollfds = 0;
+	self->poller = NULL;
+
+	// Loading the mixer elements talks to the driver for each of them
+	Py_BEGIN_ALLOW_THREADS
+	err = alsamixer_gethandle(device, &self->handle);
+	Py_END_ALLOW_THREADS
+	if (err < 0)
+	{
+		PyErr_Format(state->error, "%s [%s]", snd_strerror(err), device);
+		// alsamixer_gethandle() closed the handle
+		self->handle = 0;
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	self->cardname = strdup(device);
+	self->controlname = strdup(control);
+	self->controlid = id;
+	if (!self->cardname || !self->controlname) {
+		PyErr_NoMemory();
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	elem = alsamixer_find_elem(self->handle,control, id);
+	if (!elem)
+	{
+		PyErr_Format(state->error,
+					 "Unable to find mixer control %s,%i [%s]",
+					 self->controlname, self->controlid, self->cardname);
+		Py_DECREF(self);
+		return NULL;
+	}
+	/* Determine mixer capabilities */
+	self->volume_cap = self->switch_cap = 0;
+	if (snd_mixer_selem_has_common_volume(elem))
+	{
+		self->volume_cap |= MIXER_CAP_VOLUME;
+		if (snd_mixer_selem_has_playback_volume_joined(elem))
+			self->volume_cap |= MIXER_CAP_VOLUME_JOINED;
+	}
+	else
+	{
+		if (snd_mixer_selem_has_playback_volume(elem))
+		{
+			self->volume_cap |= MIXER_CAP_PVOLUME;
+			if (snd_mixer_selem_has_playback_volume_joined(elem))
+				self->volume_cap |= MIXER_CAP_PVOLUME_JOINED;
+		}
+		if (snd_mixer_selem_has_capture_volume(elem))
+		{
+			self->volume_cap |= MIXER_CAP_CVOLUME;
+			if (snd_mixer_selem_has_capture_volume_joined(elem))
+				self->volume_cap |= MIXER_CAP_CVOLUME_JOINED;
+		}
+	}
+
+	if (snd_mixer_selem_has_common_switch(elem))
+	{
+		self->switch_cap |= MIXER_CAP_SWITCH;
+		if (snd_mixer_selem_has_playback_switch_joined(elem))
+			self->switch_cap |= MIXER_CAP_SWITCH_JOINED;
+	}
+	else
+	{
+		if (snd_mixer_selem_has_playback_switch(elem)) {
+			self->switch_cap |= MIXER_CAP_PSWITCH;
+			if (snd_mixer_selem_has_playback_switch_joined(elem))
+				self->switch_cap |= MIXER_CAP_PSWITCH_JOINED;
+		}
+		if (snd_mixer_selem_has_capture_switch(elem)) {
+			self->switch_cap |= MIXER_CAP_CSWITCH;
+			if (snd_mixer_selem_has_capture_switch_joined(elem))
+				self->switch_cap |= MIXER_CAP_CSWITCH_JOINED;
+			if (snd_mixer_selem_has_capture_switch_exclusive(elem))
+				self->switch_cap |= MIXER_CAP_CSWITCH_EXCLUSIVE;
+		}
+	}
+	self->pchannels = 0;
+	if (self->volume_cap | MIXER_CAP_PVOLUME ||
+		self->switch_cap | MIXER_CAP_PSWITCH)
+	{
+		if (snd_mixer_selem_is_playback_mono(elem)) self->pchannels = 1;
+		else {
+			for (channel=0; channel <= SND_MIXER_SCHN_LAST; channel++) {
+				if (snd_mixer_selem_has_playback_channel(elem, channel))
+					self->pchannels++;
+				else break;
+			}
+		}
+	}
+	self->cchannels = 0;
+	if (self->volume_cap | MIXER_CAP_CVOLUME ||
+		self->switch_cap | MIXER_CAP_CSWITCH)
+	{
+		if (snd_mixer_selem_is_capture_mono(elem))
+			self->cchannels = 1;
+		else
+		{
+			for (channel=0; channel <= SND_MIXER_SCHN_LAST; channel++) {
+				if (snd_mixer_selem_has_capture_channel(elem, channel))
+					self->cchannels++;
+				else break;
+			}
+		}
+	}
+	snd_mixer_selem_get_playback_volume_range(elem, &self->pmin, &self->pmax);
+	snd_mixer_selem_get_capture_volume_range(elem, &self->cmin, &self->cmax);
+	snd_mixer_selem_get_playback_dB_range(elem, &self->pmin_dB, &self->pmax_dB);
+	snd_mixer_selem_get_capture_dB_range(elem, &self->cmin_dB, &self->cmax_dB);
+
+	return (PyObject *)self;
+}
+
+static void alsamixer_dealloc(alsamixer_t *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+
+	alsapoller_detach(&self->poller);
+	if (self->handle) {
+		Py_BEGIN_ALLOW_THREADS
+		snd_mixer_close(self->handle);
+		Py_END_ALLOW_THREADS
+		free(self->cardname);
+		free(self->controlname);
+		self->handle = 0;
+	}
+	PyMem_Free(self->pollfds);
+	pthread_mutex_destroy(&self->lock);
+	PyObject_Del(self);
+	Py_DECREF(type);
+}
+
+static PyObject *
+alsamixer_close(alsamixer_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":close"))
+		return NULL;
+
+	if (self->handle) {
+		snd_mixer_t *handle = self->handle;
+
+		alsapoller_detach(&self->poller);
+		self->handle = 0;
+
+		Py_BEGIN_ALLOW_THREADS
+		snd_mixer_close(handle);
+		Py_END_ALLOW_THREADS
+
+		free(self->cardname);
+		free(self->controlname);
+		PyMem_Free(self->pollfds);
+		self->pollfds = NULL;
+		self->npollfds = 0;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+alsamixer_cardname(alsamixer_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":cardname"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	return PyUnicode_FromString(self->cardname);
+}
+
+static PyObject *
+alsamixer_mixer(alsamixer_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":mixer"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	return PyUnicode_FromString(self->controlname);
+}
+
+static PyObject *
+alsamixer_mixerid(alsamixer_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":mixerid"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	return PyLong_FromLong(self->controlid);
+}
+
+static PyObject *
+alsamixer_volumecap(alsamixer_t *self, PyObject *args)
+{
+	PyObject *result;
+	PyObject *item;
+
+	if (!PyArg_ParseTuple(args,":volumecap")) return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	result = PyList_New(0);
+	if (self->volume_cap & MIXER_CAP_VOLUME)
+	{
+		item = PyUnicode_FromString("Volume");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->volume_cap & MIXER_CAP_VOLUME_JOINED)
+	{
+		item = PyUnicode_FromString("Joined Volume");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->volume_cap & MIXER_CAP_PVOLUME)
+	{
+		item = PyUnicode_FromString("Playback Volume");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->volume_cap & MIXER_CAP_PVOLUME_JOINED)
+	{
+		item = PyUnicode_FromString("Joined Playback Volume");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->volume_cap & MIXER_CAP_CVOLUME)
+	{
+		item = PyUnicode_FromString("Capture Volume");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->volume_cap & MIXER_CAP_CVOLUME_JOINED)
+	{
+		item = PyUnicode_FromString("Joined Capture Volume");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+
+	return result;
+}
+
+static PyObject *
+alsamixer_switchcap(alsamixer_t *self, PyObject *args)
+{
+	PyObject *result;
+	PyObject *item;
+
+	if (!PyArg_ParseTuple(args,":switchcap"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	result = PyList_New(0);
+	if (self->switch_cap & MIXER_CAP_SWITCH)
+	{
+		item = PyUnicode_FromString("Mute");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->switch_cap & MIXER_CAP_SWITCH_JOINED)
+	{
+		item = PyUnicode_FromString("Joined Mute");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->switch_cap & MIXER_CAP_PSWITCH)
+	{
+		item = PyUnicode_FromString("Playback Mute");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->switch_cap & MIXER_CAP_PSWITCH_JOINED)
+	{
+		item = PyUnicode_FromString("Joined Playback Mute");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->switch_cap & MIXER_CAP_CSWITCH)
+	{
+		item = PyUnicode_FromString("Capture Mute");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->switch_cap & MIXER_CAP_CSWITCH_JOINED)
+	{
+		item = PyUnicode_FromString("Joined Capture Mute");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+	if (self->switch_cap & MIXER_CAP_CSWITCH_EXCLUSIVE)
+	{
+		item = PyUnicode_FromString("Capture Exclusive");
+		PyList_Append(result, item);
+		Py_DECREF(item);
+	}
+
+	return result;
+}
+
+static int alsamixer_getpercentage(long min, long max, long value)
+{
+	/* Convert from number in range to percentage */
+	int range = max - min;
+	int tmp;
+
+	if (range == 0)
+		return 0;
+
+	value -= min;
+	tmp = rint((double)value/(double)range * 100);
+	return tmp;
+}
+
+static long alsamixer_getphysvolume(long min, long max, int percentage)
+{
+	/* Convert from percentage to number in range */
+	int range = max - min;
+	int tmp;
+
+	if (range == 0)
+		return 0;
+
+	tmp = rint((double)range * ((double)percentage*.01)) + min;
+	return tmp;
+}
+
+static PyObject *
+alsamixer_getvolume(alsamixer_t *self, PyObject *args, PyObject *kwds)
+{
+	snd_mixer_elem_t *elem;
+	int channel;
+	PyObject *pcmtypeobj = NULL;
+	long pcmtype;
+	int iunits = VOLUME_UNITS_PERCENTAGE;
+	PyObject *result = NULL;
+	char *kw[] = { "pcmtype", "units", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:getvolume", kw, &pcmtypeobj, &iunits)) {
+		return NULL;
+	}
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	pcmtype = get_pcmtype(alsaaudio_state_of(self), pcmtypeobj);
+	if (pcmtype < 0) {
+		return NULL;
+	}
+
+	if (!is_value_volume_unit(iunits)) {
+		PyErr_SetString(ALSAAudioError(self), "Invalid volume units");
+		return NULL;
+	}
+	volume_units_t units = iunits;
+
+	// handle updates that may have occurred
+	snd_mixer_handle_events(self->handle);
+
+	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+
+	if (!pcmtypeobj || (pcmtypeobj == Py_None)) {
+		if (self->pchannels) {
+			pcmtype = SND_PCM_STREAM_PLAYBACK;
+		}
+		else {
+			pcmtype = SND_PCM_STREAM_CAPTURE;
+		}
+	}
+
+	result = PyList_New(0);
+
+	for (channel = 0; channel <= SND_MIXER_SCHN_LAST; channel++) {
+		long ival;
+
+		if (pcmtype == SND_PCM_STREAM_PLAYBACK &&
+			snd_mixer_selem_has_playback_channel(elem, channel))
+		{
+			switch (units)
+			{
+			case VOLUME_UNITS_PERCENTAGE:
+				snd_mixer_selem_get_playback_volume(elem, channel, &ival);
+				ival = alsamixer_getpercentage(self->pmin, self->pmax, ival);
+				break;
+			case VOLUME_UNITS_RAW:
+				snd_mixer_selem_get_playback_volume(elem, channel, &ival);
+				break;
+			case VOLUME_UNITS_DB:
+				snd_mixer_selem_get_playback_dB(elem, channel, &ival);
+				break;
+			}
+
+			PyObject* item = PyLong_FromLong(ival);
+			PyList_Append(result, item);
+			Py_DECREF(item);
+		}
+		else if (pcmtype == SND_PCM_STREAM_CAPTURE
+				 && snd_mixer_selem_has_capture_channel(elem, channel)
+				 && snd_mixer_selem_has_capture_volume(elem)) {
+			switch (units)
+			{
+			case VOLUME_UNITS_PERCENTAGE:
+				snd_mixer_selem_get_capture_volume(elem, channel, &ival);
+				ival = alsamixer_getpercentage(self->cmin, self->cmax, ival);
+				break;
+			case VOLUME_UNITS_RAW:
+				snd_mixer_selem_get_capture_volume(elem, channel, &ival);
+				break;
+			case VOLUME_UNITS_DB:
+				snd_mixer_selem_get_capture_dB(elem, channel, &ival);
+				break;
+			}
+
+			PyObject* item = PyLong_FromLong(ival);
+			PyList_Append(result, item);
+			Py_DECREF(item);
+		}
+	}
+
+	return result;
+}
+
+static PyObject *
+alsamixer_getrange(alsamixer_t *self, PyObject *args, PyObject *kwds)
+{
+	snd_mixer_elem_t *elem;
+	PyObject *pcmtypeobj = NULL;
+	int iunits = VOLUME_UNITS_RAW;
+	long pcmtype;
+	long min = -1, max = -1;
+
+	char *kw[] = { "pcmtype", "units", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:getrange", kw, &pcmtypeobj, &iunits)) {
+		return NULL;
+	}
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	pcmtype = get_pcmtype(alsaaudio_state_of(self), pcmtypeobj);
+	if (pcmtype < 0) {
+		return NULL;
+	}
+
+	if (!is_value_volume_unit(iunits)) {
+		PyErr_SetString(ALSAAudioError(self), "Invalid volume units");
+		return NULL;
+	}
+	volume_units_t units = iunits;
+
+	elem = alsamixer_find_elem(self->handle, self->controlname,
+							   self->controlid);
+
+	if (!pcmtypeobj || (pcmtypeobj == Py_None))
+	{
+		if (self->pchannels) {
+			pcmtype = SND_PCM_STREAM_PLAYBACK;
+		}
+		else {
+			pcmtype = SND_PCM_STREAM_CAPTURE;
+		}
+	}
+
+	if (pcmtype == SND_PCM_STREAM_PLAYBACK)
+	{
+		if (snd_mixer_selem_has_playback_channel(elem, 0))
+		{
+			switch (units)
+			{
+			case VOLUME_UNITS_PERCENTAGE:
+				min = 0;
+				max = 100;
+				break;
+			case VOLUME_UNITS_RAW:
+				min = self->pmin;
+				max = self->pmax;
+				break;
+			case VOLUME_UNITS_DB:
+				min = self->pmin_dB;
+				max = self->pmax_dB;
+				break;
+			}
+			return Py_BuildValue("[ii]", min, max);
+		}
+
+		PyErr_Format(ALSAAudioError(self),
+					 "Mixer %s,%d has no playback channel [%s]",
+					 self->controlname, self->controlid, self->cardname);
+		return NULL;
+	}
+	else
+	{
+		if (snd_mixer_selem_has_capture_channel(elem, 0)
+			&& snd_mixer_selem_has_capture_volume(elem)) {
+			switch (units)
+			{
+			case VOLUME_UNITS_PERCENTAGE:
+				min = 0;
+				max = 100;
+				break;
+			case VOLUME_UNITS_RAW:
+				min = self->cmin;
+				max = self->cmax;
+				break;
+			case VOLUME_UNITS_DB:
+				min = self->cmin_dB;
+				max = self->cmax_dB;
+				break;
+			}
+			return Py_BuildValue("[ii]", min, max);
+		}
+
+		PyErr_Format(ALSAAudioError(self), "Mixer %s,%d has no capture channel "
+					 "or capture volume [%s]",
+					 self->controlname, self->controlid, self->cardname);
+		return NULL;
+	}
+
+	// Unreached statement
+	PyErr_SetString(ALSAAudioError(self), "Huh?");
+	return NULL;
+}
+
+static PyObject *
+alsamixer_getenum(alsamixer_t *self, PyObject *args)
+{
+	snd_mixer_elem_t *elem;
+	PyObject *elems;
+	int i, count, rc;
+	unsigned int index;
+	char name[64];
+	PyObject *result;
+
+	if (!PyArg_ParseTuple(args, ":getenum"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+	if (!snd_mixer_selem_is_enumerated(elem)) {
+		// Not an enumerated control, return an empty tuple
+		return PyTuple_New(0);
+	}
+
+	count = snd_mixer_selem_get_enum_items(elem);
+	if (count < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(count),
+					 self->cardname);
+		return NULL;
+	}
+
+	result = PyTuple_New(2);
+	if (!result)
+		return NULL;
+
+	rc = snd_mixer_selem_get_enum_item(elem, 0, &index);
+	if (rc)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+					 self->cardname);
+		return NULL;
+	}
+	rc = snd_mixer_selem_get_enum_item_name(elem, index, sizeof(name)-1, name);
+	if (rc)
+	{
+		Py_DECREF(result);
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+					 self->cardname);
+		return NULL;
+	}
+
+	PyTuple_SetItem(result, 0, PyUnicode_FromString(name));
+
+	elems = PyList_New(count);
+	if (!elems)
+	{
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		rc = snd_mixer_selem_get_enum_item_name(elem, i, sizeof(name)-1, name);
+		if (rc) {
+			Py_DECREF(elems);
+			Py_DECREF(result);
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+						 self->cardname);
+
+			return NULL;
+		}
+
+		PyList_SetItem(elems, i, PyUnicode_FromString(name));
+	}
+
+	PyTuple_SetItem(result, 1, elems);
+
+	return result;
+}
+
+static PyObject *
+alsamixer_setenum(alsamixer_t *self, PyObject *args)
+{
+	snd_mixer_elem_t *elem;
+	int index, count, rc;
+
+	if (!PyArg_ParseTuple(args, "i:setenum", &index))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+	if (!snd_mixer_selem_is_enumerated(elem)) {
+		PyErr_SetString(ALSAAudioError(self), "Not an enumerated control");
+		return NULL;
+	}
+
+	count = snd_mixer_selem_get_enum_items(elem);
+	if (count < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(count),
+					 self->cardname);
+		return NULL;
+	}
+
+	if (index < 0 || index >= count) {
+		PyErr_Format(ALSAAudioError(self),
+					 "Enum index out of range 0 <= %d < %d", index, count);
+		return NULL;
+	}
+
+	rc = snd_mixer_selem_set_enum_item(elem, 0, index);
+	if (rc)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+					 self->cardname);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+alsamixer_getmute(alsamixer_t *self, PyObject *args)
+{
+	snd_mixer_elem_t *elem;
+	int i;
+	int ival;
+	PyObject *result;
+	PyObject *item;
+
+	if (!PyArg_ParseTuple(args,":getmute"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	elem = alsamixer_find_elem(self->handle, self->controlname,
+							   self->controlid);
+	if (!snd_mixer_selem_has_playback_switch(elem))
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Mixer %s,%d has no playback switch capabilities, [%s]",
+					 self->controlname, self->controlid, self->cardname);
+
+		return NULL;
+	}
+
+	result = PyList_New(0);
+
+	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
+	{
+		if (snd_mixer_selem_has_playback_channel(elem, i))
+		{
+			snd_mixer_selem_get_playback_switch(elem, i, &ival);
+
+			item = PyLong_FromLong(!ival);
+			PyList_Append(result, item);
+			Py_DECREF(item);
+		}
+	}
+	return result;
+}
+
+static PyObject *
+alsamixer_getrec(alsamixer_t *self, PyObject *args)
+{
+	snd_mixer_elem_t *elem;
+	int i;
+	int ival;
+	PyObject *result;
+	PyObject *item;
+
+	if (!PyArg_ParseTuple(args,":getrec"))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	elem = alsamixer_find_elem(self->handle, self->controlname,
+							   self->controlid);
+	if (!snd_mixer_selem_has_capture_switch(elem))
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Mixer %s,%d has no capture switch capabilities [%s]",
+					 self->controlname, self->controlid, self->cardname);
+		return NULL;
+	}
+
+	result = PyList_New(0);
+
+	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
+	{
+		if (snd_mixer_selem_has_capture_channel(elem, i))
 		{
-			self->volume_cap |= MIXER_CAP_CVOLUME;
-			if (snd_mixer_selem_has_capture_volume_joined(elem))
-				self->volume_cap |= MIXER_CAP_CVOLUME_JOINED;
+			snd_mixer_selem_get_capture_switch(elem, i, &ival);
+			item = PyLong_FromLong(ival);
+			PyList_Append(result, item);
+			Py_DECREF(item);
 		}
 	}
+	return result;
+}
 
-	if (snd_mixer_selem_has_common_switch(elem))
-	{
-		self->switch_cap |= MIXER_CAP_SWITCH;
-		if (snd_mixer_selem_has_playback_switch_joined(elem))
-			self->switch_cap |= MIXER_CAP_SWITCH_JOINED;
+static PyObject *
+alsamixer_setvolume(alsamixer_t *self, PyObject *args, PyObject *kwds)
+{
+	snd_mixer_elem_t *elem;
+	int i;
+	long volume;
+	int physvolume;
+	PyObject *pcmtypeobj = NULL;
+	long pcmtype;
+	int iunits = VOLUME_UNITS_PERCENTAGE;
+	int channel = MIXER_CHANNEL_ALL;
+	int done = 0;
+
+	char *kw[] = { "volume", "channel", "pcmtype", "units", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "l|iOi:setvolume", kw, &volume,
+		&channel, &pcmtypeobj, &iunits)) {
+		return NULL;
 	}
-	else
+
+	pcmtype = get_pcmtype(alsaaudio_state_of(self), pcmtypeobj);
+	if (pcmtype < 0) {
+		return NULL;
+	}
+
+	if (!is_value_volume_unit(iunits)) {
+		PyErr_SetString(ALSAAudioError(self), "Invalid volume units");
+		return NULL;
+	}
+	volume_units_t units = iunits;
+
+	if (units == VOLUME_UNITS_PERCENTAGE && (volume < 0 || volume > 100))
 	{
-		if (snd_mixer_selem_has_playback_switch(elem)) {
-			self->switch_cap |= MIXER_CAP_PSWITCH;
-			if (snd_mixer_selem_has_playback_switch_joined(elem))
-				self->switch_cap |= MIXER_CAP_PSWITCH_JOINED;
-		}
-		if (snd_mixer_selem_has_capture_switch(elem)) {
-			self->switch_cap |= MIXER_CAP_CSWITCH;
-			if (snd_mixer_selem_has_capture_switch_joined(elem))
-				self->switch_cap |= MIXER_CAP_CSWITCH_JOINED;
-			if (snd_mixer_selem_has_capture_switch_exclusive(elem))
-				self->switch_cap |= MIXER_CAP_CSWITCH_EXCLUSIVE;
-		}
+		PyErr_SetString(ALSAAudioError(self), "Volume out of range");
+		return NULL;
 	}
-	self->pchannels = 0;
-	if (self->volume_cap | MIXER_CAP_PVOLUME ||
-		self->switch_cap | MIXER_CAP_PSWITCH)
+
+	if (!self->handle)
 	{
-		if (snd_mixer_selem_is_playback_mono(elem)) self->pchannels = 1;
-		else {
-			for (channel=0; channel <= SND_MIXER_SCHN_LAST; channel++) {
-				if (snd_mixer_selem_has_playback_channel(elem, channel))
-					self->pchannels++;
-				else break;
-			}
-		}
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
 	}
-	self->cchannels = 0;
-	if (self->volume_cap | MIXER_CAP_CVOLUME ||
-		self->switch_cap | MIXER_CAP_CSWITCH)
+
+	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+
+	if (!pcmtypeobj || (pcmtypeobj == Py_None))
 	{
-		if (snd_mixer_selem_is_capture_mono(elem))
-			self->cchannels = 1;
+		if (self->pchannels)
+			pcmtype = SND_PCM_STREAM_PLAYBACK;
 		else
+			pcmtype = SND_PCM_STREAM_CAPTURE;
+	}
+
+	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
+	{
+		if (channel == -1 || channel == i)
 		{
-			for (channel=0; channel <= SND_MIXER_SCHN_LAST; channel++) {
-				if (snd_mixer_selem_has_capture_channel(elem, channel))
-					self->cchannels++;
-				else break;
+			if (pcmtype == SND_PCM_STREAM_PLAYBACK &&
+				snd_mixer_selem_has_playback_channel(elem, i)) {
+				switch (units)
+				{
+				case VOLUME_UNITS_PERCENTAGE:
+					physvolume = alsamixer_getphysvolume(self->pmin,
+													 	self->pmax, volume);
+					snd_mixer_selem_set_playback_volume(elem, i, physvolume);
+					break;
+				case VOLUME_UNITS_RAW:
+					snd_mixer_selem_set_playback_volume(elem, i, volume);
+					break;
+				case VOLUME_UNITS_DB:
+					snd_mixer_selem_set_playback_dB(elem, i, volume, 0);
+					break;
+				}
+				done++;
+			}
+			else if (pcmtype == SND_PCM_STREAM_CAPTURE
+					 && snd_mixer_selem_has_capture_channel(elem, i)
+					 && snd_mixer_selem_has_capture_volume(elem))
+			{
+				switch (units)
+				{
+				case VOLUME_UNITS_PERCENTAGE:
+					physvolume = alsamixer_getphysvolume(self->cmin, self->cmax,
+													 	volume);
+					snd_mixer_selem_set_capture_volume(elem, i, physvolume);
+					break;
+				case VOLUME_UNITS_RAW:
+					snd_mixer_selem_set_capture_volume(elem, i, volume);
+					break;
+				case VOLUME_UNITS_DB:
+					snd_mixer_selem_set_capture_dB(elem, i, volume, 0);
+					break;
+				}
+				done++;
 			}
 		}
 	}
-	snd_mixer_selem_get_playback_volume_range(elem, &self->pmin, &self->pmax);
-	snd_mixer_selem_get_capture_volume_range(elem, &self->cmin, &self->cmax);
-	snd_mixer_selem_get_playback_dB_range(elem, &self->pmin_dB, &self->pmax_dB);
-	snd_mixer_selem_get_capture_dB_range(elem, &self->cmin_dB, &self->cmax_dB);
 
-	return (PyObject *)self;
+	if(!done)
+	{
+		PyErr_Format(ALSAAudioError(self), "No such channel [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-static void alsamixer_dealloc(alsamixer_t *self)
+static PyObject *
+alsamixer_setmute(alsamixer_t *self, PyObject *args)
 {
-	if (self->handle) {
-		snd_mixer_close(self->handle);
-		free(self->cardname);
-		free(self->controlname);
-		self->handle = 0;
+	snd_mixer_elem_t *elem;
+	int i;
+	int mute = 0;
+	int done = 0;
+	int channel = MIXER_CHANNEL_ALL;
+	if (!PyArg_ParseTuple(args,"i|i:setmute", &mute, &channel))
+		return NULL;
+
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
 	}
-	PyObject_Del(self);
+
+	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+	if (!snd_mixer_selem_has_playback_switch(elem))
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Mixer %s,%d has no playback switch capabilities [%s]",
+					 self->controlname, self->controlid, self->cardname);
+		return NULL;
+	}
+	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
+	{
+		if (channel == MIXER_CHANNEL_ALL || channel == i)
+		{
+			if (snd_mixer_selem_has_playback_channel(elem, i))
+			{
+				snd_mixer_selem_set_playback_switch(elem, i, !mute);
+				done++;
+			}
+		}
+	}
+	if (!done)
+	{
+		PyErr_Format(ALSAAudioError(self), "Invalid channel number [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
 static PyObject *
-alsamixer_close(alsamixer_t *self, PyObject *args)
+alsamixer_setrec(alsamixer_t *self, PyObject *args)
 {
-	if (!PyArg_ParseTuple(args,":close"))
+	snd_mixer_elem_t *elem;
+	int i;
+	int rec = 0;
+	int done = 0;
+	int channel = MIXER_CHANNEL_ALL;
+
+	if (!PyArg_ParseTuple(args,"i|i:setrec", &rec, &channel))
 		return NULL;
 
-	if (self->handle) {
-		snd_mixer_close(self->handle);
-		free(self->cardname);
-		free(self->controlname);
-		self->handle = 0;
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return NULL;
+	}
+
+	elem = alsamixer_find_elem(self->handle, self->controlname,
+							   self->controlid);
+	if (!snd_mixer_selem_has_capture_switch(elem))
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Mixer %s,%d has no record switch capabilities [%s]",
+					 self->controlname, self->controlid, self->cardname);
+		return NULL;
+	}
+	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
+	{
+		if (channel == MIXER_CHANNEL_ALL || channel == i)
+		{
+			if (snd_mixer_selem_has_capture_channel(elem, i))
+			{
+				snd_mixer_selem_set_capture_switch(elem, i, rec);
+				done++;
+			}
+		}
+	}
+	if (!done)
+	{
+		PyErr_Format(ALSAAudioError(self), "Invalid channel number [%s]",
+					 self->cardname);
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* Like alsapcm_get_pollfds(), for the mixer */
+static int
+alsamixer_get_pollfds(alsamixer_t *self)
+{
+	int count, rc;
+
+	if (self->pollfds)
+		return self->npollfds;
+
+	count = snd_mixer_poll_descriptors_count(self->handle);
+	if (count < 0)
+	{
+		PyErr_Format(ALSAAudioError(self),
+					 "Can't get poll descriptor count [%s]", self->cardname);
+		return -1;
+	}
+
+	self->pollfds = PyMem_New(struct pollfd, count ? count : 1);
+	if (!self->pollfds)
+	{
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	rc = snd_mixer_poll_descriptors(self->handle, self->pollfds,
+									(unsigned int)count);
+	if (rc != count)
+	{
+		PyErr_Format(ALSAAudioError(self), "Can't get poll descriptors [%s]",
+					 self->cardname);
+		PyMem_Free(self->pollfds);
+		self->pollfds = NULL;
+		return -1;
 	}
+	self->npollfds = count;
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	return count;
 }
 
 static PyObject *
-alsamixer_cardname(alsamixer_t *self, PyObject *args)
+alsamixer_polldescriptors(alsamixer_t *self, PyObject *args)
 {
-	if (!PyArg_ParseTuple(args,":cardname"))
+	int i, count;
+	PyObject *result;
+
+	if (!PyArg_ParseTuple(args,":polldescriptors"))
 		return NULL;
 
 	if (!self->handle)
 	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
 		return NULL;
 	}
 
-	return PyUnicode_FromString(self->cardname);
+	count = alsamixer_get_pollfds(self);
+	if (count < 0)
+		return NULL;
+
+	result = PyList_New(count);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < count; ++i)
+	{
+		PyList_SetItem(result, i,
+					   Py_BuildValue("ih", self->pollfds[i].fd,
+									 self->pollfds[i].events));
+	}
+
+	return result;
 }
 
 static PyObject *
-alsamixer_mixer(alsamixer_t *self, PyObject *args)
+alsamixer_handleevents(alsamixer_t *self, PyObject *args)
 {
-	if (!PyArg_ParseTuple(args,":mixer"))
+	int handled;
+
+	if (!PyArg_ParseTuple(args,":handleevents"))
 		return NULL;
 
 	if (!self->handle)
 	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
 		return NULL;
 	}
 
-	return PyUnicode_FromString(self->controlname);
+	handled = snd_mixer_handle_events(self->handle);
+	if (handled < 0)
+	{
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(handled),
+					 self->cardname);
+		return NULL;
+	}
+
+	return PyLong_FromLong(handled);
 }
 
-static PyObject *
-alsamixer_mixerid(alsamixer_t *self, PyObject *args)
+ALSALOCK_METHOD(alsamixer_cardname, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_close, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_mixer, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_mixerid, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_switchcap, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_volumecap, alsamixer_t)
+ALSALOCK_METHOD_KW(alsamixer_getvolume, alsamixer_t)
+ALSALOCK_METHOD_KW(alsamixer_getrange, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_getenum, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_getmute, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_getrec, alsamixer_t)
+ALSALOCK_METHOD_KW(alsamixer_setvolume, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_setenum, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_setmute, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_setrec, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_polldescriptors, alsamixer_t)
+ALSALOCK_METHOD(alsamixer_handleevents, alsamixer_t)
+#if PY_MAJOR_VERSION >= 3
+ALSALOCK_METHOD(alsamixer_wait_event, alsamixer_t)
+#endif
+
+static PyMethodDef alsamixer_methods[] = {
+	{"cardname", (PyCFunction)alsamixer_cardname_locked, METH_VARARGS},
+	{"close", (PyCFunction)alsamixer_close_locked, METH_VARARGS},
+	{"mixer", (PyCFunction)alsamixer_mixer_locked, METH_VARARGS},
+	{"mixerid", (PyCFunction)alsamixer_mixerid_locked, METH_VARARGS},
+	{"switchcap", (PyCFunction)alsamixer_switchcap_locked, METH_VARARGS},
+	{"volumecap", (PyCFunction)alsamixer_volumecap_locked, METH_VARARGS},
+	{"getvolume", (PyCFunction)alsamixer_getvolume_locked, METH_VARARGS | METH_KEYWORDS},
+	{"getrange", (PyCFunction)alsamixer_getrange_locked, METH_VARARGS | METH_KEYWORDS},
+	{"getenum", (PyCFunction)alsamixer_getenum_locked, METH_VARARGS},
+	{"getmute", (PyCFunction)alsamixer_getmute_locked, METH_VARARGS},
+	{"getrec", (PyCFunction)alsamixer_getrec_locked, METH_VARARGS},
+	{"setvolume", (PyCFunction)alsamixer_setvolume_locked, METH_VARARGS | METH_KEYWORDS},
+	{"setenum", (PyCFunction)alsamixer_setenum_locked, METH_VARARGS},
+	{"setmute", (PyCFunction)alsamixer_setmute_locked, METH_VARARGS},
+	{"setrec", (PyCFunction)alsamixer_setrec_locked, METH_VARARGS},
+	{"polldescriptors", (PyCFunction)alsamixer_polldescriptors_locked, METH_VARARGS},
+	{"handleevents", (PyCFunction)alsamixer_handleevents_locked, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"wait_event", (PyCFunction)alsamixer_wait_event_locked, METH_VARARGS},
+#endif
+
+	{NULL, NULL}
+};
+
+
+static PyType_Slot alsamixer_slots[] = {
+	{ Py_tp_dealloc, (void *)alsamixer_dealloc },
+	{ Py_tp_new, (void *)alsamixer_new },
+	{ Py_tp_doc, "ALSA Mixer Control." },
+	{ Py_tp_methods, alsamixer_methods },
+	{ 0, NULL },
+};
+
+static PyType_Spec alsamixer_spec = {
+	"alsaaudio.Mixer",
+	sizeof(alsamixer_t),
+	0,
+	ALSAAUDIO_TPFLAGS,
+	alsamixer_slots,
+};
+
+
+/******************************************/
+/* Duplex object wrapper				  */
+/******************************************/
+
+/* Create one side of a duplex stream as a regular PCM object */
+static alsapcm_t *
+alsaduplex_open_pcm(PyTypeObject *type, long pcmtype, int pcmmode,
+					char *device, int rate, int channels, int format,
+					int periodsize, int periods)
 {
-	if (!PyArg_ParseTuple(args,":mixerid"))
+	PyObject *args, *kwds, *pcm;
+
+	args = PyTuple_New(0);
+	if (!args)
 		return NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	kwds = Py_BuildValue("{s:l,s:i,s:s,s:i,s:i,s:i,s:i,s:i}",
+						 "type", pcmtype, "mode", pcmmode, "device", device,
+						 "rate", rate, "channels", channels, "format", format,
+						 "periodsize", periodsize, "periods", periods);
+	if (!kwds) {
+		Py_DECREF(args);
 		return NULL;
 	}
 
-	return PyLong_FromLong(self->controlid);
+	pcm = PyObject_Call((PyObject *)type, args, kwds);
+	Py_DECREF(args);
+	Py_DECREF(kwds);
+
+	return (alsapcm_t *)pcm;
 }
 
 static PyObject *
-alsamixer_volumecap(alsamixer_t *self, PyObject *args)
+alsaduplex_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-	PyObject *result;
-	PyObject *item;
+	alsaaudio_state_t *state = alsaaudio_type_state(type);
+	alsaduplex_t *self;
+	PyTypeObject *pcm_type;
+	int res;
+	int pcmmode = 0;
+	char *capture_device = "default";
+	char *playback_device = "default";
+	int rate = 44100;
+	int channels = 2;
+	int format = SND_PCM_FORMAT_S16_LE;
+	int periods = 4;
+	int periodsize = 32;
 
-	if (!PyArg_ParseTuple(args,":volumecap")) return NULL;
+	char *kw[] = { "capture_device", "playback_device", "mode", "rate",
+				   "channels", "format", "periodsize", "periods", NULL };
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ssiiiiii:Duplex", kw,
+									 &capture_device, &playback_device,
+									 &pcmmode, &rate, &channels, &format,
+									 &periodsize, &periods))
 		return NULL;
-	}
 
-	result = PyList_New(0);
-	if (self->volume_cap & MIXER_CAP_VOLUME)
-	{
-		item = PyUnicode_FromString("Volume");
-		PyList_Append(result, item);
-		Py_DECREF(item);
-	}
-	if (self->volume_cap & MIXER_CAP_VOLUME_JOINED)
-	{
-		item = PyUnicode_FromString("Joined Volume");
-		PyList_Append(result, item);
-		Py_DECREF(item);
-	}
-	if (self->volume_cap & MIXER_CAP_PVOLUME)
-	{
-		item = PyUnicode_FromString("Playback Volume");
-		PyList_Append(result, item);
-		Py_DECREF(item);
-	}
-	if (self->volume_cap & MIXER_CAP_PVOLUME_JOINED)
-	{
-		item = PyUnicode_FromString("Joined Playback Volume");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	if (!(self = (alsaduplex_t *)PyObject_New(alsaduplex_t, type)))
+		return NULL;
+
+	pcm_type = state->pcm_type;
+
+	self->linked = false;
+	self->playback = NULL;
+	self->capture = alsaduplex_open_pcm(pcm_type, SND_PCM_STREAM_CAPTURE,
+										pcmmode, capture_device, rate,
+										channels, format, periodsize,
+										periods);
+	if (!self->capture)
+		goto error;
+
+	self->playback = alsaduplex_open_pcm(pcm_type, SND_PCM_STREAM_PLAYBACK,
+										 pcmmode, playback_device, rate,
+										 channels, format, periodsize,
+										 periods);
+	if (!self->playback)
+		goto error;
+
+	if (self->capture->rate != self->playback->rate) {
+		PyErr_Format(state->error, "Capture and playback rates differ "
+					 "(%u and %u)", self->capture->rate, self->playback->rate);
+		goto error;
 	}
-	if (self->volume_cap & MIXER_CAP_CVOLUME)
-	{
-		item = PyUnicode_FromString("Capture Volume");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+
+	// Start and stop both streams together, sample-synchronously
+	res = snd_pcm_link(self->capture->handle, self->playback->handle);
+	if (res < 0) {
+		PyErr_Format(state->error, "%s [%s, %s]", snd_strerror(res),
+					 capture_device, playback_device);
+		goto error;
 	}
-	if (self->volume_cap & MIXER_CAP_CVOLUME_JOINED)
-	{
-		item = PyUnicode_FromString("Joined Capture Volume");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	self->linked = true;
+
+	return (PyObject *)self;
+
+ error:
+	Py_DECREF(self);
+	return NULL;
+}
+
+static void
+alsaduplex_unlink(alsaduplex_t *self)
+{
+	if (self->linked) {
+		alsalock_acquire(&self->capture->lock);
+		if (self->capture->handle)
+			snd_pcm_unlink(self->capture->handle);
+		alsalock_release(&self->capture->lock);
+		self->linked = false;
 	}
+}
 
-	return result;
+static void
+alsaduplex_dealloc(alsaduplex_t *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+
+	if (self->capture)
+		alsaduplex_unlink(self);
+	Py_XDECREF(self->capture);
+	Py_XDECREF(self->playback);
+	PyObject_Del(self);
+	Py_DECREF(type);
 }
 
 static PyObject *
-alsamixer_switchcap(alsamixer_t *self, PyObject *args)
+alsaduplex_close(alsaduplex_t *self, PyObject *args)
 {
-	PyObject *result;
-	PyObject *item;
+	PyObject *res;
 
-	if (!PyArg_ParseTuple(args,":switchcap"))
+	if (!PyArg_ParseTuple(args,":close"))
 		return NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	alsaduplex_unlink(self);
+
+	res = PyObject_CallMethod((PyObject *)self->playback, "close", NULL);
+	if (!res)
 		return NULL;
-	}
+	Py_DECREF(res);
 
-	result = PyList_New(0);
-	if (self->switch_cap & MIXER_CAP_SWITCH)
-	{
-		item = PyUnicode_FromString("Mute");
-		PyList_Append(result, item);
-		Py_DECREF(item);
-	}
-	if (self->switch_cap & MIXER_CAP_SWITCH_JOINED)
-	{
-		item = PyUnicode_FromString("Joined Mute");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	return PyObject_CallMethod((PyObject *)self->capture, "close", NULL);
+}
+
+static PyObject *
+alsaduplex_capture(alsaduplex_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":capture"))
+		return NULL;
+
+	Py_INCREF(self->capture);
+	return (PyObject *)self->capture;
+}
+
+static PyObject *
+alsaduplex_playback(alsaduplex_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":playback"))
+		return NULL;
+
+	Py_INCREF(self->playback);
+	return (PyObject *)self->playback;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyObject *
+alsaduplex_transfer(alsaduplex_t *self, PyObject *args)
+{
+	alsapcm_t *capture = self->capture;
+	alsapcm_t *playback = self->playback;
+	Py_buffer buf;
+	PyObject *buffer_obj = NULL, *result = NULL;
+	snd_pcm_sframes_t wres, rres, wavail, ravail;
+	snd_pcm_uframes_t wframes, wdone = 0, rdone = 0;
+	uint64_t start, wns, rns;
+	char *buffer, *data;
+
+	if (!PyArg_ParseTuple(args,"y*:transfer", &buf))
+		return NULL;
+
+	if (!capture->handle || !playback->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		goto exit;
 	}
-	if (self->switch_cap & MIXER_CAP_PSWITCH)
-	{
-		item = PyUnicode_FromString("Playback Mute");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+
+	if (alsapcm_check_unprocessed(capture, "transfer") < 0 ||
+		alsapcm_check_unprocessed(playback, "transfer") < 0)
+		goto exit;
+
+	if (buf.len % playback->framesize) {
+		PyErr_SetString(ALSAAudioError(self),
+						"Data size must be a multiple of framesize");
+		goto exit;
 	}
-	if (self->switch_cap & MIXER_CAP_PSWITCH_JOINED)
-	{
-		item = PyUnicode_FromString("Joined Playback Mute");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	wframes = buf.len / playback->framesize;
+
+	data = buf.buf;
+	if (wframes && alsapcm_gain_active(playback) &&
+		!(data = alsapcm_gain_copy(playback, buf.buf, wframes)))
+		goto exit;
+
+	buffer_obj = PyBytes_FromStringAndSize(NULL, capture->periodsize *
+										   capture->framesize);
+	if (!buffer_obj)
+		goto exit;
+	buffer = PyBytes_AS_STRING(buffer_obj);
+
+	if ((wres = alsapcm_transfer_prepare(playback)) < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(wres),
+					 playback->cardname);
+		goto exit;
 	}
-	if (self->switch_cap & MIXER_CAP_CSWITCH)
-	{
-		item = PyUnicode_FromString("Capture Mute");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	if ((rres = alsapcm_transfer_prepare(capture)) < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rres),
+					 capture->cardname);
+		goto exit;
 	}
-	if (self->switch_cap & MIXER_CAP_CSWITCH_JOINED)
-	{
-		item = PyUnicode_FromString("Joined Capture Mute");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+
+	// Writing first lets the playback side start the linked streams. Both
+	// PCMs are busy with the transfer, see alsaduplex_transfer_locked()
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_unlock(&playback->lock);
+	pthread_mutex_unlock(&capture->lock);
+	start = alsapcm_stats_begin(playback, &wavail);
+	wres = wframes ?
+		alsapcm_transfer_interleaved(playback, data, wframes, &wdone) : 0;
+	wns = alsapcm_stats_end(start);
+	start = alsapcm_stats_begin(capture, &ravail);
+	rres = alsapcm_transfer_interleaved(capture, buffer, capture->periodsize,
+										&rdone);
+	rns = alsapcm_stats_end(start);
+	pthread_mutex_lock(&capture->lock);
+	pthread_mutex_lock(&playback->lock);
+	Py_END_ALLOW_THREADS
+
+	if (wframes)
+		alsapcm_stats_update(playback, wframes, wres, wdone, wavail, wns);
+	alsapcm_stats_update(capture, capture->periodsize, rres, rdone, ravail,
+						 rns);
+	wres = alsapcm_transfer_finish(playback, wres, wdone);
+	rres = alsapcm_transfer_finish(capture, rres, rdone);
+	alsapcm_gain_advance(playback, wres);
+
+	if (playback->meters && wres > 0)
+		alsameter_update(playback->meters, playback->format,
+						 playback->channels, data, wres);
+	if (capture->meters && rres > 0)
+		alsameter_update(capture->meters, capture->format,
+						 capture->channels, buffer, rres);
+
+	if (wres < 0 && wres != -EPIPE) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(wres),
+					 playback->cardname);
+		goto exit;
 	}
-	if (self->switch_cap & MIXER_CAP_CSWITCH_EXCLUSIVE)
-	{
-		item = PyUnicode_FromString("Capture Exclusive");
-		PyList_Append(result, item);
-		Py_DECREF(item);
+	if (rres < 0 && rres != -EPIPE) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rres),
+					 capture->cardname);
+		goto exit;
 	}
 
+	/* If the following fails, it will free the object */
+	if (_PyBytes_Resize(&buffer_obj, rdone * capture->framesize))
+		goto exit;
+
+	result = Py_BuildValue("(llO)", (long)wres, (long)rres, buffer_obj);
+
+ exit:
+	Py_XDECREF(buffer_obj);
+	PyBuffer_Release(&buf);
+
 	return result;
 }
 
-static int alsamixer_getpercentage(long min, long max, long value)
+/* Lock both PCMs, always the capture side first, and mark both as busy with
+   a transfer once neither is, see alsapcm_io_begin() */
+static PyObject *
+alsaduplex_transfer_locked(alsaduplex_t *self, PyObject *args)
 {
-	/* Convert from number in range to percentage */
-	int range = max - min;
-	int tmp;
+	alsapcm_t *capture = self->capture;
+	alsapcm_t *playback = self->playback;
+	PyObject *res = NULL;
+
+	for (;;) {
+		alsalock_acquire(&capture->lock);
+		alsapcm_io_wait(capture);
+		alsalock_acquire(&playback->lock);
+		if (!playback->io_busy)
+			break;
 
-	if (range == 0)
-		return 0;
+		// Don't keep the capture side locked while waiting
+		alsalock_release(&capture->lock);
+		alsapcm_io_wait(playback);
+		alsalock_release(&playback->lock);
+	}
 
-	value -= min;
-	tmp = rint((double)value/(double)range * 100);
-	return tmp;
+	if (capture->closing || playback->closing)
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+	else {
+		capture->io_busy = playback->io_busy = true;
+		res = alsaduplex_transfer(self, args);
+		alsapcm_io_end(playback);
+		alsapcm_io_end(capture);
+	}
+
+	alsalock_release(&playback->lock);
+	alsalock_release(&capture->lock);
+
+	return res;
 }
+#endif
 
-static long alsamixer_getphysvolume(long min, long max, int percentage)
-{
-	/* Convert from percentage to number in range */
-	int range = max - min;
-	int tmp;
+static PyMethodDef alsaduplex_methods[] = {
+	{"capture", (PyCFunction)alsaduplex_capture, METH_VARARGS},
+	{"playback", (PyCFunction)alsaduplex_playback, METH_VARARGS},
+#if PY_MAJOR_VERSION >= 3
+	{"transfer", (PyCFunction)alsaduplex_transfer_locked, METH_VARARGS},
+#endif
+	{"close", (PyCFunction)alsaduplex_close, METH_VARARGS},
+	{NULL, NULL}
+};
 
-	if (range == 0)
-		return 0;
+static PyType_Slot alsaduplex_slots[] = {
+	{ Py_tp_dealloc, (void *)alsaduplex_dealloc },
+	{ Py_tp_new, (void *)alsaduplex_new },
+	{ Py_tp_doc, "Linked ALSA capture and playback PCM devices." },
+	{ Py_tp_methods, alsaduplex_methods },
+	{ 0, NULL },
+};
 
-	tmp = rint((double)range * ((double)percentage*.01)) + min;
-	return tmp;
-}
+static PyType_Spec alsaduplex_spec = {
+	"alsaaudio.Duplex",
+	sizeof(alsaduplex_t),
+	0,
+	ALSAAUDIO_TPFLAGS,
+	alsaduplex_slots,
+};
+
+/******************************************/
+/* asyncio support						*/
+/******************************************/
 
+/* asyncio.get_running_loop(), imported on first use */
 static PyObject *
-alsamixer_getvolume(alsamixer_t *self, PyObject *args, PyObject *kwds)
+alsapoller_running_loop(alsaaudio_state_t *state)
 {
-	snd_mixer_elem_t *elem;
-	int channel;
-	PyObject *pcmtypeobj = NULL;
-	long pcmtype;
-	int iunits = VOLUME_UNITS_PERCENTAGE;
-	PyObject *result = NULL;
-	char *kw[] = { "pcmtype", "units", NULL };
+	if (!state->get_running_loop) {
+		PyObject *asyncio = PyImport_ImportModule("asyncio");
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:getvolume", kw, &pcmtypeobj, &iunits)) {
-		return NULL;
+		if (!asyncio)
+			return NULL;
+		state->get_running_loop = PyObject_GetAttrString(asyncio,
+														 "get_running_loop");
+		Py_DECREF(asyncio);
+		if (!state->get_running_loop)
+			return NULL;
 	}
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
-		return NULL;
-	}
+	return PyObject_CallObject(state->get_running_loop, NULL);
+}
 
-	pcmtype = get_pcmtype(pcmtypeobj);
-	if (pcmtype < 0) {
-		return NULL;
+/* The owner's cached poll descriptors */
+static int
+alsapoller_pollfds(alsapoller_t *self, struct pollfd **fds)
+{
+	if (self->is_mixer) {
+		alsamixer_t *mixer = (alsamixer_t *)self->owner;
+
+		*fds = mixer->pollfds;
+		return mixer->npollfds;
 	}
+	else {
+		alsapcm_t *pcm = (alsapcm_t *)self->owner;
 
-	if (!is_value_volume_unit(iunits)) {
-		PyErr_SetString(ALSAAudioError, "Invalid volume units");
-		return NULL;
+		*fds = pcm->pollfds;
+		return pcm->npollfds;
 	}
-	volume_units_t units = iunits;
+}
 
-	// handle updates that may have occurred
-	snd_mixer_handle_events(self->handle);
+/* Stop watching the owner's poll descriptors. Doesn't disturb a pending
+   exception. */
+static void
+alsapoller_unregister(alsapoller_t *self)
+{
+	PyObject *type, *value, *traceback, *res;
+	struct pollfd *fds;
+	int i, count;
 
-	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+	if (!self->loop)
+		return;
 
-	if (!pcmtypeobj || (pcmtypeobj == Py_None)) {
-		if (self->pchannels) {
-			pcmtype = SND_PCM_STREAM_PLAYBACK;
+	PyErr_Fetch(&type, &value, &traceback);
+
+	count = alsapoller_pollfds(self, &fds);
+	for (i = 0; i < count; i++) {
+		if (fds[i].events & POLLIN) {
+			res = PyObject_CallMethod(self->loop, "remove_reader", "i",
+									  fds[i].fd);
+			Py_XDECREF(res);
+			PyErr_Clear();
 		}
-		else {
-			pcmtype = SND_PCM_STREAM_CAPTURE;
+		if (fds[i].events & POLLOUT) {
+			res = PyObject_CallMethod(self->loop, "remove_writer", "i",
+									  fds[i].fd);
+			Py_XDECREF(res);
+			PyErr_Clear();
 		}
 	}
+	Py_CLEAR(self->loop);
 
-	result = PyList_New(0);
+	PyErr_Restore(type, value, traceback);
+}
 
-	for (channel = 0; channel <= SND_MIXER_SCHN_LAST; channel++) {
-		long ival;
+/* Watch the owner's poll descriptors in `loop`, unless that is already
+   the case */
+static int
+alsapoller_register(alsapoller_t *self, PyObject *loop)
+{
+	PyObject *res;
+	struct pollfd *fds;
+	int i, count;
 
-		if (pcmtype == SND_PCM_STREAM_PLAYBACK &&
-			snd_mixer_selem_has_playback_channel(elem, channel))
-		{
-			switch (units)
-			{
-			case VOLUME_UNITS_PERCENTAGE:
-				snd_mixer_selem_get_playback_volume(elem, channel, &ival);
-				ival = alsamixer_getpercentage(self->pmin, self->pmax, ival);
-				break;
-			case VOLUME_UNITS_RAW:
-				snd_mixer_selem_get_playback_volume(elem, channel, &ival);
-				break;
-			case VOLUME_UNITS_DB:
-				snd_mixer_selem_get_playback_dB(elem, channel, &ival);
-				break;
-			}
+	if (self->loop == loop)
+		return 0;
 
-			PyObject* item = PyLong_FromLong(ival);
-			PyList_Append(result, item);
-			Py_DECREF(item);
-		}
-		else if (pcmtype == SND_PCM_STREAM_CAPTURE
-				 && snd_mixer_selem_has_capture_channel(elem, channel)
-				 && snd_mixer_selem_has_capture_volume(elem)) {
-			switch (units)
-			{
-			case VOLUME_UNITS_PERCENTAGE:
-				snd_mixer_selem_get_capture_volume(elem, channel, &ival);
-				ival = alsamixer_getpercentage(self->cmin, self->cmax, ival);
-				break;
-			case VOLUME_UNITS_RAW:
-				snd_mixer_selem_get_capture_volume(elem, channel, &ival);
-				break;
-			case VOLUME_UNITS_DB:
-				snd_mixer_selem_get_capture_dB(elem, channel, &ival);
-				break;
-			}
+	alsapoller_unregister(self);
 
-			PyObject* item = PyLong_FromLong(ival);
-			PyList_Append(result, item);
-			Py_DECREF(item);
+	// Set this first, so that a partial registration can be undone
+	Py_INCREF(loop);
+	self->loop = loop;
+
+	count = alsapoller_pollfds(self, &fds);
+	for (i = 0; i < count; i++) {
+		if (fds[i].events & POLLIN) {
+			res = PyObject_CallMethod(loop, "add_reader", "iO",
+									  fds[i].fd, (PyObject *)self);
+			if (!res)
+				goto error;
+			Py_DECREF(res);
+		}
+		if (fds[i].events & POLLOUT) {
+			res = PyObject_CallMethod(loop, "add_writer", "iO",
+									  fds[i].fd, (PyObject *)self);
+			if (!res)
+				goto error;
+			Py_DECREF(res);
 		}
 	}
 
-	return result;
+	return 0;
+
+ error:
+	alsapoller_unregister(self);
+	return -1;
 }
 
-static PyObject *
-alsamixer_getrange(alsamixer_t *self, PyObject *args, PyObject *kwds)
+/* Forget the pending operation */
+static void
+alsapoller_clear_op(alsapoller_t *self)
 {
-	snd_mixer_elem_t *elem;
-	PyObject *pcmtypeobj = NULL;
-	int iunits = VOLUME_UNITS_RAW;
-	long pcmtype;
-	long min = -1, max = -1;
+	PyObject *future = self->future;
 
-	char *kw[] = { "pcmtype", "units", NULL };
+	self->future = NULL;
+	Py_CLEAR(self->buffer_obj);
+	if (self->data.obj)
+		PyBuffer_Release(&self->data);
+	self->frames = self->done = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:getrange", kw, &pcmtypeobj, &iunits)) {
-		return NULL;
+	if (future) {
+		Py_DECREF(future);
+		// The owner is only kept alive while an operation is pending
+		Py_DECREF(self->owner);
 	}
+}
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
-		return NULL;
+/* Complete the pending operation with `result`, stealing the reference.
+   Returns 1, or -1 with an exception set. */
+static int
+alsapoller_resolve(alsapoller_t *self, PyObject *result)
+{
+	PyObject *future = self->future, *done, *res;
+	int rc = -1;
+
+	if (!result)
+		return -1;
+
+	Py_INCREF(future);
+	alsapoller_clear_op(self);
+
+	// The future may have been cancelled before its done callback has run
+	done = PyObject_CallMethod(future, "done", NULL);
+	if (done) {
+		if (PyObject_IsTrue(done))
+			rc = 1;
+		else if ((res = PyObject_CallMethod(future, "set_result", "(O)",
+											result))) {
+			Py_DECREF(res);
+			rc = 1;
+		}
+		Py_DECREF(done);
 	}
 
-	pcmtype = get_pcmtype(pcmtypeobj);
-	if (pcmtype < 0) {
-		return NULL;
+	Py_DECREF(future);
+	Py_DECREF(result);
+
+	return rc;
+}
+
+/* Complete the pending operation with the current exception */
+static void
+alsapoller_fail(alsapoller_t *self)
+{
+	PyObject *future = self->future, *type, *value, *traceback, *res;
+
+	PyErr_Fetch(&type, &value, &traceback);
+	PyErr_NormalizeException(&type, &value, &traceback);
+	if (traceback) {
+		PyException_SetTraceback(value, traceback);
+		Py_DECREF(traceback);
 	}
+	Py_XDECREF(type);
 
-	if (!is_value_volume_unit(iunits)) {
-		PyErr_SetString(ALSAAudioError, "Invalid volume units");
-		return NULL;
+	Py_INCREF(future);
+	alsapoller_clear_op(self);
+
+	res = PyObject_CallMethod(future, "done", NULL);
+	if (res && !PyObject_IsTrue(res)) {
+		Py_DECREF(res);
+		res = PyObject_CallMethod(future, "set_exception", "(O)", value);
 	}
-	volume_units_t units = iunits;
+	if (!res)
+		PyErr_WriteUnraisable(future);
+	Py_XDECREF(res);
 
-	elem = alsamixer_find_elem(self->handle, self->controlname,
-							   self->controlid);
+	Py_DECREF(future);
+	Py_XDECREF(value);
+}
 
-	if (!pcmtypeobj || (pcmtypeobj == Py_None))
-	{
-		if (self->pchannels) {
-			pcmtype = SND_PCM_STREAM_PLAYBACK;
-		}
-		else {
-			pcmtype = SND_PCM_STREAM_CAPTURE;
-		}
+/* Poll the owner's descriptors without waiting, and let ALSA translate
+   the result */
+static int
+alsapoller_revents(alsapoller_t *self, unsigned short *revents)
+{
+	struct pollfd *fds;
+	int i, count, rc;
+
+	count = alsapoller_pollfds(self, &fds);
+	for (i = 0; i < count; i++)
+		fds[i].revents = 0;
+
+	if (poll(fds, count, 0) < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
 	}
 
-	if (pcmtype == SND_PCM_STREAM_PLAYBACK)
-	{
-		if (snd_mixer_selem_has_playback_channel(elem, 0))
-		{
-			switch (units)
-			{
-			case VOLUME_UNITS_PERCENTAGE:
-				min = 0;
-				max = 100;
-				break;
-			case VOLUME_UNITS_RAW:
-				min = self->pmin;
-				max = self->pmax;
-				break;
-			case VOLUME_UNITS_DB:
-				min = self->pmin_dB;
-				max = self->pmax_dB;
-				break;
-			}
-			return Py_BuildValue("[ii]", min, max);
-		}
+	if (self->is_mixer) {
+		alsamixer_t *mixer = (alsamixer_t *)self->owner;
 
-		PyErr_Format(ALSAAudioError, "Mixer %s,%d has no playback channel [%s]",
-					 self->controlname, self->controlid, self->cardname);
-		return NULL;
+		rc = snd_mixer_poll_descriptors_revents(mixer->handle, fds, count,
+												revents);
+		if (rc < 0) {
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+						 mixer->cardname);
+			return -1;
+		}
 	}
-	else
-	{
-		if (snd_mixer_selem_has_capture_channel(elem, 0)
-			&& snd_mixer_selem_has_capture_volume(elem)) {
-			switch (units)
-			{
-			case VOLUME_UNITS_PERCENTAGE:
-				min = 0;
-				max = 100;
-				break;
-			case VOLUME_UNITS_RAW:
-				min = self->cmin;
-				max = self->cmax;
-				break;
-			case VOLUME_UNITS_DB:
-				min = self->cmin_dB;
-				max = self->cmax_dB;
-				break;
-			}
-			return Py_BuildValue("[ii]", min, max);
+	else {
+		alsapcm_t *pcm = (alsapcm_t *)self->owner;
+
+		rc = snd_pcm_poll_descriptors_revents(pcm->handle, fds, count,
+											  revents);
+		if (rc < 0) {
+			PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(rc),
+						 pcm->cardname);
+			return -1;
 		}
-
-		PyErr_Format(ALSAAudioError, "Mixer %s,%d has no capture channel "
-					 "or capture volume [%s]",
-					 self->controlname, self->controlid, self->cardname);
-		return NULL;
 	}
 
-	// Unreached statement
-	PyErr_SetString(ALSAAudioError, "Huh?");
-	return NULL;
+	return 0;
 }
 
-static PyObject *
-alsamixer_getenum(alsamixer_t *self, PyObject *args)
+/* Complete aread() or awrite() with the result of the transfer */
+static int
+alsapoller_pcm_finish(alsapoller_t *self, snd_pcm_sframes_t res)
 {
-	snd_mixer_elem_t *elem;
-	PyObject *elems;
-	int i, count, rc;
-	unsigned int index;
-	char name[64];
-	PyObject *result;
+	alsapcm_t *pcm = (alsapcm_t *)self->owner;
+	Py_ssize_t size;
 
-	if (!PyArg_ParseTuple(args, ":getenum"))
-		return NULL;
+	if (!self->buffer_obj)
+		return alsapoller_resolve(self, PyLong_FromLong(res));
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
-		return NULL;
-	}
+	// Like read(), return the number of frames and the data
+	size = res > 0 ? res * pcm->framesize : 0;
+	if (size != PyBytes_GET_SIZE(self->buffer_obj) &&
+		_PyBytes_Resize(&self->buffer_obj, size) < 0)
+		return -1;
 
-	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
-	if (!snd_mixer_selem_is_enumerated(elem)) {
-		// Not an enumerated control, return an empty tuple
-		return PyTuple_New(0);
-	}
+	return alsapoller_resolve(self, Py_BuildValue("(lO)", (long)res,
+												  self->buffer_obj));
+}
 
-	count = snd_mixer_selem_get_enum_items(elem);
-	if (count < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(count),
-					 self->cardname);
-		return NULL;
-	}
+/* Make as much progress as possible on a pending aread() or awrite()
+   without blocking.
 
-	result = PyTuple_New(2);
-	if (!result)
-		return NULL;
+   Returns 1 if the operation completed, 0 if it has to wait for the device,
+   or -1 with an exception set. */
+static int
+alsapoller_pcm_attempt(alsapoller_t *self)
+{
+	alsapcm_t *pcm = (alsapcm_t *)self->owner;
+	snd_pcm_sframes_t avail, res = 0;
+	snd_pcm_uframes_t frames;
+	char *data;
 
-	rc = snd_mixer_selem_get_enum_item(elem, 0, &index);
-	if (rc)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(rc),
-					 self->cardname);
-		return NULL;
+	if (!pcm->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		return -1;
+	}
+
+	switch (snd_pcm_state(pcm->handle)) {
+	case SND_PCM_STATE_SETUP:
+		// After drop() and drain(), we need to prepare the stream again.
+		if ((res = snd_pcm_prepare(pcm->handle)) < 0)
+			goto error;
+		/* fall through */
+	case SND_PCM_STATE_PREPARED:
+		// Capture doesn't produce anything to wait for until started
+		if (pcm->pcmtype == SND_PCM_STREAM_CAPTURE &&
+			(res = snd_pcm_start(pcm->handle)) < 0)
+			goto error;
+		break;
+	default:
+		break;
+	}
+
+	avail = snd_pcm_avail_update(pcm->handle);
+	if (avail == -EPIPE) {
+		atomic_fetch_add(&pcm->xruns, 1);
+		if ((res = snd_pcm_prepare(pcm->handle)) < 0)
+			goto error;
+		return alsapoller_pcm_finish(self, -EPIPE);
+	}
+	if (avail < 0) {
+		res = avail;
+		goto error;
+	}
+
+	frames = self->frames - self->done;
+	if (pcm->pcmtype == SND_PCM_STREAM_CAPTURE) {
+		// Like read(), only deliver whole periods
+		if ((snd_pcm_uframes_t)avail < frames)
+			return 0;
+		data = PyBytes_AS_STRING(self->buffer_obj);
 	}
-	rc = snd_mixer_selem_get_enum_item_name(elem, index, sizeof(name)-1, name);
-	if (rc)
-	{
-		Py_DECREF(result);
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(rc),
-					 self->cardname);
-		return NULL;
+	else {
+		if (!frames)
+			return alsapoller_pcm_finish(self, self->done);
+		if ((snd_pcm_uframes_t)avail < frames)
+			frames = avail;
+		if (!frames)
+			return 0;
+		data = self->data.buf;
+	}
+
+	// Not more than avail, so this doesn't block, even in PCM_NORMAL mode
+	res = alsapcm_transfer(pcm, data + self->done * pcm->framesize, frames);
+	if (pcm->pcmtype == SND_PCM_STREAM_PLAYBACK)
+		alsapcm_gain_advance(pcm, res);
+	if (res == -EPIPE)
+		return alsapoller_pcm_finish(self, -EPIPE);
+	if (res < 0)
+		goto error;
+
+	self->done += res;
+	if (self->done < self->frames)
+		return 0;
+
+	return alsapoller_pcm_finish(self, self->done);
+
+ error:
+	PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(res),
+				 pcm->cardname);
+	return -1;
+}
+
+/* Complete wait_event() once the mixer's descriptors have signalled */
+static int
+alsapoller_mixer_attempt(alsapoller_t *self)
+{
+	alsamixer_t *mixer = (alsamixer_t *)self->owner;
+	int handled;
+
+	if (!mixer->handle) {
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
+		return -1;
 	}
 
-	PyTuple_SetItem(result, 0, PyUnicode_FromString(name));
+	handled = snd_mixer_handle_events(mixer->handle);
+	if (handled < 0) {
+		PyErr_Format(ALSAAudioError(self), "%s [%s]", snd_strerror(handled),
+					 mixer->cardname);
+		return -1;
+	}
 
-	elems = PyList_New(count);
-	if (!elems)
-	{
-		Py_DECREF(result);
+	return alsapoller_resolve(self, PyLong_FromLong(handled));
+}
+
+/* Called by the loop when one of the owner's descriptors is ready (without
+   arguments), and as the done callback of the pending future */
+static PyObject *
+alsapoller_call(alsapoller_t *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *future = NULL;
+	unsigned short revents;
+	int rc = 0;
+
+	if (!PyArg_ParseTuple(args, "|O:_Poller", &future))
 		return NULL;
+
+	// Detaching the owner may drop the last reference otherwise
+	Py_INCREF(self);
+
+	if (future) {
+		// Forget a cancelled operation
+		if (future == self->future)
+			alsapoller_clear_op(self);
 	}
+	else if (self->owner) {
+		PyObject *owner = self->owner;
+		pthread_mutex_t *lock = self->is_mixer ?
+			&((alsamixer_t *)owner)->lock : &((alsapcm_t *)owner)->lock;
 
-	for (i = 0; i < count; ++i)
-	{
-		rc = snd_mixer_selem_get_enum_item_name(elem, i, sizeof(name)-1, name);
-		if (rc) {
-			Py_DECREF(elems);
-			Py_DECREF(result);
-			PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(rc),
-						 self->cardname);
+		// Completing the operation may drop the owner, too
+		Py_INCREF(owner);
+		alsalock_acquire(lock);
 
-			return NULL;
+		// The owner may have been closed while we waited for it
+		rc = self->owner ? alsapoller_revents(self, &revents) : 0;
+		if (rc == 0 && self->owner && revents) {
+			if (!self->future) {
+				// Nobody is waiting: skip the event, as the next operation is
+				// usually awaited right away. Only stop watching if the owner
+				// stays idle, instead of spinning on a ready descriptor.
+				if (++self->idle >= ALSAPOLLER_MAX_IDLE)
+					alsapoller_unregister(self);
+			}
+			else if (self->is_mixer)
+				rc = alsapoller_mixer_attempt(self);
+			// Don't stall the loop behind a transfer in another thread
+			else if (!(rc = alsapcm_io_begin((alsapcm_t *)owner, false))) {
+				rc = alsapoller_pcm_attempt(self);
+				alsapcm_io_end((alsapcm_t *)owner);
+			}
 		}
 
-		PyList_SetItem(elems, i, PyUnicode_FromString(name));
+		if (rc < 0) {
+			if (self->future) {
+				alsapoller_fail(self);
+				rc = 0;
+			}
+			else
+				alsapoller_unregister(self);
+		}
+
+		alsalock_release(lock);
+		Py_DECREF(owner);
 	}
 
-	PyTuple_SetItem(result, 1, elems);
+	Py_DECREF(self);
 
-	return result;
+	if (rc < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-static PyObject *
-alsamixer_setenum(alsamixer_t *self, PyObject *args)
+/* Return the owner's poller, creating it on first use. Raises if an
+   operation is already pending. */
+static alsapoller_t *
+alsapoller_get(PyObject *owner, alsapoller_t **slot, bool is_mixer,
+			   const char *cardname)
 {
-	snd_mixer_elem_t *elem;
-	int index, count, rc;
+	alsapoller_t *self = *slot;
 
-	if (!PyArg_ParseTuple(args, "i:setenum", &index))
-		return NULL;
+	if (self) {
+		if (self->future) {
+			PyErr_Format(ALSAAudioError(owner),
+						 "Another asynchronous operation is pending [%s]",
+						 cardname);
+			return NULL;
+		}
+		return self;
+	}
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	self = PyObject_GC_New(alsapoller_t,
+						   alsaaudio_state_of(owner)->poller_type);
+	if (!self)
 		return NULL;
-	}
 
-	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
-	if (!snd_mixer_selem_is_enumerated(elem)) {
-		PyErr_SetString(ALSAAudioError, "Not an enumerated control");
+	self->owner = owner;
+	self->is_mixer = is_mixer;
+	self->loop = NULL;
+	self->idle = 0;
+	self->future = NULL;
+	self->buffer_obj = NULL;
+	self->data.obj = NULL;
+	self->frames = self->done = 0;
+	PyObject_GC_Track(self);
+
+	*slot = self;
+	return self;
+}
+
+/* Start the operation set up by the caller: complete it right away if the
+   device is ready, and watch the owner's descriptors in the running loop
+   otherwise. Returns the future. */
+static PyObject *
+alsapoller_begin(alsapoller_t *self)
+{
+	PyObject *loop, *future, *res;
+	unsigned short revents;
+	int rc;
+
+	loop = alsapoller_running_loop(alsaaudio_state_of(self));
+	if (!loop) {
+		alsapoller_clear_op(self);
 		return NULL;
 	}
 
-	count = snd_mixer_selem_get_enum_items(elem);
-	if (count < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(count),
-					 self->cardname);
+	future = PyObject_CallMethod(loop, "create_future", NULL);
+	if (!future) {
+		Py_DECREF(loop);
+		alsapoller_clear_op(self);
 		return NULL;
 	}
 
-	if (index < 0 || index >= count) {
-		PyErr_Format(ALSAAudioError, "Enum index out of range 0 <= %d < %d",
-					 index, count);
-		return NULL;
+	Py_INCREF(future);
+	self->future = future;
+	self->idle = 0;
+	Py_INCREF(self->owner);
+
+	if (self->is_mixer) {
+		rc = alsapoller_revents(self, &revents);
+		if (rc == 0 && revents)
+			rc = alsapoller_mixer_attempt(self);
+	}
+	else
+		rc = alsapoller_pcm_attempt(self);
+
+	if (rc == 0) {
+		if (alsapoller_register(self, loop) < 0)
+			rc = -1;
+		else if (!(res = PyObject_CallMethod(future, "add_done_callback", "(O)",
+											 (PyObject *)self)))
+			rc = -1;
+		else
+			Py_DECREF(res);
 	}
+	Py_DECREF(loop);
 
-	rc = snd_mixer_selem_set_enum_item(elem, 0, index);
-	if (rc)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(rc),
-					 self->cardname);
+	if (rc < 0) {
+		alsapoller_clear_op(self);
+		Py_DECREF(future);
 		return NULL;
 	}
 
-	Py_RETURN_NONE;
+	return future;
 }
 
-static PyObject *
-alsamixer_getmute(alsamixer_t *self, PyObject *args)
+/* Called when the owner is closed or deallocated */
+static void
+alsapoller_detach(alsapoller_t **slot)
 {
-	snd_mixer_elem_t *elem;
-	int i;
-	int ival;
-	PyObject *result;
-	PyObject *item;
+	alsapoller_t *self = *slot;
 
-	if (!PyArg_ParseTuple(args,":getmute"))
-		return NULL;
+	if (!self)
+		return;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
-		return NULL;
+	if (self->future) {
+		PyObject *type, *value, *traceback;
+
+		PyErr_Fetch(&type, &value, &traceback);
+		PyErr_SetString(ALSAAudioError(self), self->is_mixer ?
+						"Mixer is closed" : "PCM device is closed");
+		alsapoller_fail(self);
+		PyErr_Restore(type, value, traceback);
 	}
 
-	elem = alsamixer_find_elem(self->handle, self->controlname,
-							   self->controlid);
-	if (!snd_mixer_selem_has_playback_switch(elem))
-	{
-		PyErr_Format(ALSAAudioError,
-					 "Mixer %s,%d has no playback switch capabilities, [%s]",
-					 self->controlname, self->controlid, self->cardname);
+	alsapoller_unregister(self);
+	self->owner = NULL;
+	*slot = NULL;
+	Py_DECREF(self);
+}
 
-		return NULL;
-	}
+static int
+alsapoller_traverse(alsapoller_t *self, visitproc visit, void *arg)
+{
+	Py_VISIT(Py_TYPE(self));
+	Py_VISIT(self->loop);
+	Py_VISIT(self->future);
+	Py_VISIT(self->buffer_obj);
+	Py_VISIT(self->data.obj);
+	if (self->future)
+		Py_VISIT(self->owner);
+	return 0;
+}
 
-	result = PyList_New(0);
+static int
+alsapoller_clear(alsapoller_t *self)
+{
+	alsapoller_clear_op(self);
+	Py_CLEAR(self->loop);
+	return 0;
+}
 
-	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
-	{
-		if (snd_mixer_selem_has_playback_channel(elem, i))
-		{
-			snd_mixer_selem_get_playback_switch(elem, i, &ival);
+static void
+alsapoller_dealloc(alsapoller_t *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
 
-			item = PyLong_FromLong(!ival);
-			PyList_Append(result, item);
-			Py_DECREF(item);
-		}
-	}
-	return result;
+	PyObject_GC_UnTrack(self);
+	alsapoller_clear(self);
+	PyObject_GC_Del(self);
+	Py_DECREF(type);
+}
+
+static PyType_Slot alsapoller_slots[] = {
+	{ Py_tp_dealloc, (void *)alsapoller_dealloc },
+	{ Py_tp_call, (void *)alsapoller_call },
+	{ Py_tp_doc, "Watches ALSA poll descriptors in an asyncio event loop." },
+	{ Py_tp_traverse, (void *)alsapoller_traverse },
+	{ Py_tp_clear, (void *)alsapoller_clear },
+	{ 0, NULL },
+};
+
+static PyType_Spec alsapoller_spec = {
+	"alsaaudio._Poller",
+	sizeof(alsapoller_t),
+	0,
+	ALSAAUDIO_TPFLAGS | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+	alsapoller_slots,
+};
+
+#if PY_MAJOR_VERSION >= 3
+static alsapoller_t *
+alsapcm_poller(alsapcm_t *self)
+{
+	if (alsapcm_get_pollfds(self) < 0)
+		return NULL;
+
+	return alsapoller_get((PyObject *)self, &self->poller, false,
+						  self->cardname);
 }
 
 static PyObject *
-alsamixer_getrec(alsamixer_t *self, PyObject *args)
+alsapcm_aread(alsapcm_t *self, PyObject *args)
 {
-	snd_mixer_elem_t *elem;
-	int i;
-	int ival;
-	PyObject *result;
-	PyObject *item;
+	alsapoller_t *poller;
 
-	if (!PyArg_ParseTuple(args,":getrec"))
+	if (!PyArg_ParseTuple(args,":aread"))
 		return NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	if (!self->handle) {
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
 		return NULL;
 	}
 
-	elem = alsamixer_find_elem(self->handle, self->controlname,
-							   self->controlid);
-	if (!snd_mixer_selem_has_capture_switch(elem))
+	if (self->pcmtype != SND_PCM_STREAM_CAPTURE)
 	{
-		PyErr_Format(ALSAAudioError,
-					 "Mixer %s,%d has no capture switch capabilities [%s]",
-					 self->controlname, self->controlid, self->cardname);
+		PyErr_Format(ALSAAudioError(self), "Cannot read from playback PCM [%s]",
+					 self->cardname);
 		return NULL;
 	}
 
-	result = PyList_New(0);
+	if (alsapcm_check_access(self, false) < 0 ||
+		alsapcm_check_unprocessed(self, "aread") < 0)
+		return NULL;
 
-	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
-	{
-		if (snd_mixer_selem_has_capture_channel(elem, i))
-		{
-			snd_mixer_selem_get_capture_switch(elem, i, &ival);
-			item = PyLong_FromLong(ival);
-			PyList_Append(result, item);
-			Py_DECREF(item);
-		}
-	}
-	return result;
+	if (!(poller = alsapcm_poller(self)))
+		return NULL;
+
+	poller->buffer_obj = PyBytes_FromStringAndSize(NULL,
+		self->framesize * self->periodsize);
+	if (!poller->buffer_obj)
+		return NULL;
+	poller->frames = self->periodsize;
+
+	return alsapoller_begin(poller);
 }
 
 static PyObject *
-alsamixer_setvolume(alsamixer_t *self, PyObject *args, PyObject *kwds)
+alsapcm_awrite(alsapcm_t *self, PyObject *args)
 {
-	snd_mixer_elem_t *elem;
-	int i;
-	long volume;
-	int physvolume;
-	PyObject *pcmtypeobj = NULL;
-	long pcmtype;
-	int iunits = VOLUME_UNITS_PERCENTAGE;
-	int channel = MIXER_CHANNEL_ALL;
-	int done = 0;
+	alsapoller_t *poller;
+	Py_buffer buf;
 
-	char *kw[] = { "volume", "channel", "pcmtype", "units", NULL };
+	if (!PyArg_ParseTuple(args,"y*:awrite", &buf))
+		return NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "l|iOi:setvolume", kw, &volume,
-		&channel, &pcmtypeobj, &iunits)) {
+	if (!self->handle)
+	{
+		PyErr_SetString(ALSAAudioError(self), "PCM device is closed");
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
 
-	pcmtype = get_pcmtype(pcmtypeobj);
-	if (pcmtype < 0) {
+	if (self->pcmtype != SND_PCM_STREAM_PLAYBACK)
+	{
+		PyErr_Format(ALSAAudioError(self), "Cannot write to capture PCM [%s]",
+					 self->cardname);
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
 
-	if (!is_value_volume_unit(iunits)) {
-		PyErr_SetString(ALSAAudioError, "Invalid volume units");
+	if (alsapcm_check_access(self, false) < 0 ||
+		alsapcm_check_unprocessed(self, "awrite") < 0)
+	{
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
-	volume_units_t units = iunits;
 
-	if (units == VOLUME_UNITS_PERCENTAGE && (volume < 0 || volume > 100))
+	if (buf.len % self->framesize)
 	{
-		PyErr_SetString(ALSAAudioError, "Volume out of range");
+		PyErr_SetString(ALSAAudioError(self),
+						"Data size must be a multiple of framesize");
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
 
-	if (!self->handle)
+	if (!(poller = alsapcm_poller(self)))
 	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+		PyBuffer_Release(&buf);
 		return NULL;
 	}
 
-	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
+	poller->frames = buf.len / self->framesize;
 
-	if (!pcmtypeobj || (pcmtypeobj == Py_None))
+	// The gain goes on a copy, which is what the poller writes then
+	if (alsapcm_gain_active(self))
 	{
-		if (self->pchannels)
-			pcmtype = SND_PCM_STREAM_PLAYBACK;
-		else
-			pcmtype = SND_PCM_STREAM_CAPTURE;
-	}
+		PyObject *copy = PyBytes_FromStringAndSize(NULL, buf.len);
+		char *tmp = alsapcm_gain_buffer(self, 0);
+		int rc;
 
-	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
-	{
-		if (channel == -1 || channel == i)
+		if (copy && tmp)
 		{
-			if (pcmtype == SND_PCM_STREAM_PLAYBACK &&
-				snd_mixer_selem_has_playback_channel(elem, i)) {
-				switch (units)
-				{
-				case VOLUME_UNITS_PERCENTAGE:
-					physvolume = alsamixer_getphysvolume(self->pmin,
-													 	self->pmax, volume);
-					snd_mixer_selem_set_playback_volume(elem, i, physvolume);
-					break;
-				case VOLUME_UNITS_RAW:
-					snd_mixer_selem_set_playback_volume(elem, i, volume);
-					break;
-				case VOLUME_UNITS_DB:
-					snd_mixer_selem_set_playback_dB(elem, i, volume, 0);
-					break;
-				}
-				done++;
-			}
-			else if (pcmtype == SND_PCM_STREAM_CAPTURE
-					 && snd_mixer_selem_has_capture_channel(elem, i)
-					 && snd_mixer_selem_has_capture_volume(elem))
-			{
-				switch (units)
-				{
-				case VOLUME_UNITS_PERCENTAGE:
-					physvolume = alsamixer_getphysvolume(self->cmin, self->cmax,
-													 	volume);
-					snd_mixer_selem_set_capture_volume(elem, i, physvolume);
-					break;
-				case VOLUME_UNITS_RAW:
-					snd_mixer_selem_set_capture_volume(elem, i, volume);
-					break;
-				case VOLUME_UNITS_DB:
-					snd_mixer_selem_set_capture_dB(elem, i, volume, 0);
-					break;
-				}
-				done++;
-			}
+			memcpy(PyBytes_AS_STRING(copy), buf.buf, buf.len);
+			alsapcm_gain_native(self, PyBytes_AS_STRING(copy), poller->frames,
+								(float *)tmp);
 		}
+		PyBuffer_Release(&buf);
+		rc = copy && tmp ?
+			PyObject_GetBuffer(copy, &buf, PyBUF_SIMPLE) : -1;
+		Py_XDECREF(copy);
+		if (rc < 0)
+			return NULL;
 	}
 
-	if(!done)
-	{
-		PyErr_Format(ALSAAudioError, "No such channel [%s]",
-					 self->cardname);
-		return NULL;
-	}
+	// The poller keeps the buffer until the operation completes
+	poller->data = buf;
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	return alsapoller_begin(poller);
 }
 
-static PyObject *
-alsamixer_setmute(alsamixer_t *self, PyObject *args)
-{
-	snd_mixer_elem_t *elem;
-	int i;
-	int mute = 0;
-	int done = 0;
-	int channel = MIXER_CHANNEL_ALL;
-	if (!PyArg_ParseTuple(args,"i|i:setmute", &mute, &channel))
+static PyObject *
+alsamixer_wait_event(alsamixer_t *self, PyObject *args)
+{
+	alsapoller_t *poller;
+
+	if (!PyArg_ParseTuple(args,":wait_event"))
 		return NULL;
 
 	if (!self->handle)
 	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+		PyErr_SetString(ALSAAudioError(self), "Mixer is closed");
 		return NULL;
 	}
 
-	elem = alsamixer_find_elem(self->handle,self->controlname,self->controlid);
-	if (!snd_mixer_selem_has_playback_switch(elem))
-	{
-		PyErr_Format(ALSAAudioError,
-					 "Mixer %s,%d has no playback switch capabilities [%s]",
-					 self->controlname, self->controlid, self->cardname);
+	if (alsamixer_get_pollfds(self) < 0)
 		return NULL;
+
+	if (!(poller = alsapoller_get((PyObject *)self, &self->poller, true,
+								  self->cardname)))
+		return NULL;
+
+	return alsapoller_begin(poller);
+}
+#endif
+
+/******************************************/
+/* Device monitor						  */
+/******************************************/
+
+/* Keeps the lists returned by cards() and pcms() between calls, and only
+   builds them again after a card was added or removed. Cards come and go
+   with their control devices in /dev/snd, which inotify reports; while
+   there is no /dev/snd, /dev is watched for it to appear. */
+
+#define ALSADEVMON_DIR "/dev/snd"
+
+typedef struct {
+	PyObject_HEAD;
+	pthread_mutex_t lock;	// Held by every method, see alsalock_acquire()
+	int fd;
+	int wd;
+	bool watching_dev;
+	PyObject *cards;
+	PyObject *pcms[2];		// playback, then capture
+} alsadevmon_t;
+
+static void
+alsadevmon_forget(alsadevmon_t *self)
+{
+	Py_CLEAR(self->cards);
+	Py_CLEAR(self->pcms[0]);
+	Py_CLEAR(self->pcms[1]);
+}
+
+static int
+alsadevmon_watch(alsadevmon_t *self)
+{
+	if (self->wd >= 0)
+		inotify_rm_watch(self->fd, self->wd);
+
+	self->watching_dev = false;
+	self->wd = inotify_add_watch(self->fd, ALSADEVMON_DIR,
+								 IN_CREATE | IN_DELETE | IN_ATTRIB |
+								 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF);
+	if (self->wd < 0 && errno == ENOENT) {
+		self->watching_dev = true;
+		self->wd = inotify_add_watch(self->fd, "/dev", IN_CREATE | IN_MOVED_TO);
 	}
-	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
-	{
-		if (channel == MIXER_CHANNEL_ALL || channel == i)
-		{
-			if (snd_mixer_selem_has_playback_channel(elem, i))
-			{
-				snd_mixer_selem_set_playback_switch(elem, i, !mute);
-				done++;
+
+	if (self->wd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, ALSADEVMON_DIR);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read the pending events without blocking, and forget the lists if a
+   card was added or removed. Returns 1 if so, 0 if not, and -1 with an
+   exception set on failure. */
+static int
+alsadevmon_update(alsadevmon_t *self)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false, rewatch = false;
+	ssize_t len;
+	char *p;
+
+	if (self->fd < 0) {
+		PyErr_SetString(ALSAAudioError(self), "DeviceMonitor is closed");
+		return -1;
+	}
+
+	for (;;) {
+		len = read(self->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len < 0) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			// Events were lost, so anything may have happened
+			if (ev->mask & IN_Q_OVERFLOW)
+				changed = true;
+			// Events for a watch we have replaced
+			else if (ev->wd != self->wd)
+				continue;
+			// /dev/snd went away with the last card
+			else if (ev->mask & IN_IGNORED) {
+				self->wd = -1;
+				changed = rewatch = true;
 			}
+			else if (self->watching_dev) {
+				if (ev->len && strcmp(ev->name, "snd") == 0)
+					changed = rewatch = true;
+			}
+			else if (ev->len && strncmp(ev->name, "controlC", 8) == 0)
+				changed = true;
 		}
 	}
-	if (!done)
-	{
-		PyErr_Format(ALSAAudioError, "Invalid channel number [%s]",
-					 self->cardname);
-		return NULL;
-	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	if (rewatch && alsadevmon_watch(self) < 0)
+		return -1;
+
+	if (changed)
+		alsadevmon_forget(self);
+
+	return changed;
 }
 
 static PyObject *
-alsamixer_setrec(alsamixer_t *self, PyObject *args)
+alsadevmon_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-	snd_mixer_elem_t *elem;
-	int i;
-	int rec = 0;
-	int done = 0;
-	int channel = MIXER_CHANNEL_ALL;
+	alsadevmon_t *self;
+	char *kw[] = { NULL };
 
-	if (!PyArg_ParseTuple(args,"i|i:setrec", &rec, &channel))
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, ":DeviceMonitor", kw))
 		return NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	if (!(self = (alsadevmon_t *)PyObject_New(alsadevmon_t, type)))
 		return NULL;
-	}
 
-	elem = alsamixer_find_elem(self->handle, self->controlname,
-							   self->controlid);
-	if (!snd_mixer_selem_has_capture_switch(elem))
-	{
-		PyErr_Format(ALSAAudioError,
-					 "Mixer %s,%d has no record switch capabilities [%s]",
-					 self->controlname, self->controlid, self->cardname);
+	pthread_mutex_init(&self->lock, NULL);
+	self->wd = -1;
+	self->watching_dev = false;
+	self->cards = NULL;
+	self->pcms[0] = self->pcms[1] = NULL;
+
+	self->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (self->fd < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		Py_DECREF(self);
 		return NULL;
 	}
-	for (i = 0; i <= SND_MIXER_SCHN_LAST; i++)
-	{
-		if (channel == MIXER_CHANNEL_ALL || channel == i)
-		{
-			if (snd_mixer_selem_has_capture_channel(elem, i))
-			{
-				snd_mixer_selem_set_capture_switch(elem, i, rec);
-				done++;
-			}
-		}
-	}
-	if (!done)
-	{
-		PyErr_Format(ALSAAudioError, "Invalid channel number [%s]",
-					 self->cardname);
+
+	if (alsadevmon_watch(self) < 0) {
+		Py_DECREF(self);
 		return NULL;
 	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	return (PyObject *)self;
+}
+
+static void
+alsadevmon_dealloc(alsadevmon_t *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+
+	if (self->fd >= 0)
+		close(self->fd);
+	alsadevmon_forget(self);
+	pthread_mutex_destroy(&self->lock);
+	PyObject_Del(self);
+	Py_DECREF(type);
 }
 
 static PyObject *
-alsamixer_polldescriptors(alsamixer_t *self, PyObject *args)
+alsadevmon_cards(alsadevmon_t *self, PyObject *args)
 {
-	int i, count, rc;
-	PyObject *result;
-	struct pollfd *fds;
+	PyObject *list;
 
-	if (!PyArg_ParseTuple(args,":polldescriptors"))
+	if (!PyArg_ParseTuple(args,":cards"))
 		return NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	if (alsadevmon_update(self) < 0)
 		return NULL;
+
+	if (!self->cards) {
+		if (!(list = alsacard_ids(alsaaudio_state_of(self))))
+			return NULL;
+		self->cards = PyList_AsTuple(list);
+		Py_DECREF(list);
+		if (!self->cards)
+			return NULL;
 	}
 
-	count = snd_mixer_poll_descriptors_count(self->handle);
-	if (count < 0)
-	{
-		PyErr_Format(ALSAAudioError, "Can't get poll descriptor count [%s]",
-					 self->cardname);
+	Py_INCREF(self->cards);
+	return self->cards;
+}
+
+static PyObject *
+alsadevmon_pcms(alsadevmon_t *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *pcmtypeobj = NULL;
+	PyObject *list, **pcms;
+	long pcmtype;
+
+	char *kw[] = { "pcmtype", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:pcms", kw, &pcmtypeobj))
 		return NULL;
-	}
 
-	fds = (struct pollfd*)calloc(count, sizeof(struct pollfd));
-	if (!fds)
-	{
-		PyErr_Format(PyExc_MemoryError, "Out of memory [%s]",
-					 self->cardname);
+	pcmtype = get_pcmtype(alsaaudio_state_of(self), pcmtypeobj);
+	if (pcmtype < 0)
 		return NULL;
-	}
 
-	result = PyList_New(count);
-	rc = snd_mixer_poll_descriptors(self->handle, fds, (unsigned int)count);
-	if (rc != count)
-	{
-		PyErr_Format(ALSAAudioError, "Can't get poll descriptors [%s]",
-					 self->cardname);
-		free(fds);
+	if (alsadevmon_update(self) < 0)
 		return NULL;
-	}
 
-	for (i = 0; i < count; ++i)
-	{
-		PyList_SetItem(result, i,
-					   Py_BuildValue("ih", fds[i].fd, fds[i].events));
+	pcms = &self->pcms[pcmtype == SND_PCM_STREAM_CAPTURE];
+	if (!*pcms) {
+		if (!(list = alsapcm_names(pcmtype)))
+			return NULL;
+		*pcms = PyList_AsTuple(list);
+		Py_DECREF(list);
+		if (!*pcms)
+			return NULL;
 	}
-	free(fds);
 
-	return result;
+	Py_INCREF(*pcms);
+	return *pcms;
 }
 
 static PyObject *
-alsamixer_handleevents(alsamixer_t *self, PyObject *args)
+alsadevmon_update_method(alsadevmon_t *self, PyObject *args)
 {
-	int handled;
+	int res;
 
-	if (!PyArg_ParseTuple(args,":handleevents"))
+	if (!PyArg_ParseTuple(args,":update"))
 		return NULL;
 
-	if (!self->handle)
-	{
-		PyErr_SetString(ALSAAudioError, "Mixer is closed");
+	if ((res = alsadevmon_update(self)) < 0)
 		return NULL;
-	}
 
-	handled = snd_mixer_handle_events(self->handle);
-	if (handled < 0)
-	{
-		PyErr_Format(ALSAAudioError, "%s [%s]", snd_strerror(handled),
-					 self->cardname);
+	return PyBool_FromLong(res);
+}
+
+static PyObject *
+alsadevmon_fileno(alsadevmon_t *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args,":fileno"))
+		return NULL;
+
+	if (self->fd < 0) {
+		PyErr_SetString(ALSAAudioError(self), "DeviceMonitor is closed");
 		return NULL;
 	}
 
-	return PyLong_FromLong(handled);
+	return PyLong_FromLong(self->fd);
 }
 
-static PyMethodDef alsamixer_methods[] = {
-	{"cardname", (PyCFunction)alsamixer_cardname, METH_VARARGS},
-	{"close", (PyCFunction)alsamixer_close, METH_VARARGS},
-	{"mixer", (PyCFunction)alsamixer_mixer, METH_VARARGS},
-	{"mixerid", (PyCFunction)alsamixer_mixerid, METH_VARARGS},
-	{"switchcap", (PyCFunction)alsamixer_switchcap, METH_VARARGS},
-	{"volumecap", (PyCFunction)alsamixer_volumecap, METH_VARARGS},
-	{"getvolume", (PyCFunction)alsamixer_getvolume, METH_VARARGS | METH_KEYWORDS},
-	{"getrange", (PyCFunction)alsamixer_getrange, METH_VARARGS | METH_KEYWORDS},
-	{"getenum", (PyCFunction)alsamixer_getenum, METH_VARARGS},
-	{"getmute", (PyCFunction)alsamixer_getmute, METH_VARARGS},
-	{"getrec", (PyCFunction)alsamixer_getrec, METH_VARARGS},
-	{"setvolume", (PyCFunction)alsamixer_setvolume, METH_VARARGS | METH_KEYWORDS},
-	{"setenum", (PyCFunction)alsamixer_setenum, METH_VARARGS},
-	{"setmute", (PyCFunction)alsamixer_setmute, METH_VARARGS},
-	{"setrec", (PyCFunction)alsamixer_setrec, METH_VARARGS},
-	{"polldescriptors", (PyCFunction)alsamixer_polldescriptors, METH_VARARGS},
-	{"handleevents", (PyCFunction)alsamixer_handleevents, METH_VARARGS},
-
-	{NULL, NULL}
-};
-
-#if PY_VERSION_HEX < 0x02020000
 static PyObject *
-alsamixer_getattr(alsapcm_t *self, char *name)
+alsadevmon_close(alsadevmon_t *self, PyObject *args)
 {
-	return Py_FindMethod(alsamixer_methods, (PyObject *)self, name);
+	if (!PyArg_ParseTuple(args,":close"))
+		return NULL;
+
+	if (self->fd >= 0) {
+		close(self->fd);
+		self->fd = -1;
+		self->wd = -1;
+	}
+	alsadevmon_forget(self);
+
+	Py_RETURN_NONE;
 }
-#endif
 
-static PyTypeObject ALSAMixerType = {
-#if PY_MAJOR_VERSION < 3
-	PyObject_HEAD_INIT(&PyType_Type)
-	0,							  /* ob_size */
-#else
-	PyVarObject_HEAD_INIT(&PyType_Type, 0)
-#endif
-	"alsaaudio.Mixer",			  /* tp_name */
-	sizeof(alsamixer_t),			/* tp_basicsize */
-	0,							  /* tp_itemsize */
-	/* methods */
-	(destructor) alsamixer_dealloc, /* tp_dealloc */
-	0,							  /* print */
-#if PY_VERSION_HEX < 0x02020000
-	(getattrfunc)alsamixer_getattr, /* tp_getattr */
-#else
-	0,							  /* tp_getattr */
-#endif
-	0,							  /* tp_setattr */
-	0,							  /* tp_compare */
-	0,							  /* tp_repr */
-	0,							  /* tp_as_number */
-	0,							  /* tp_as_sequence */
-	0,							  /* tp_as_mapping */
-	0,							  /* tp_hash */
-	0,							  /* tp_call */
-	0,							  /* tp_str */
-#if PY_VERSION_HEX >= 0x02020000
-	PyObject_GenericGetAttr,		/* tp_getattro*/
-#else
-	0,							  /* tp_getattro*/
-#endif
-	0,							  /* tp_setattro*/
-	0,							  /* tp_as_buffer*/
-	Py_TPFLAGS_DEFAULT,			 /* tp_flags */
-	"ALSA Mixer Control.",		  /* tp_doc */
-	0,							/* tp_traverse */
-	0,							/* tp_clear */
-	0,							/* tp_richcompare */
-	0,							/* tp_weaklistoffset */
-	0,							/* tp_iter */
-	0,							/* tp_iternext */
-	alsamixer_methods,			/* tp_methods */
-	0,							/* tp_members */
+ALSALOCK_METHOD(alsadevmon_cards, alsadevmon_t)
+ALSALOCK_METHOD_KW(alsadevmon_pcms, alsadevmon_t)
+ALSALOCK_METHOD(alsadevmon_update_method, alsadevmon_t)
+ALSALOCK_METHOD(alsadevmon_fileno, alsadevmon_t)
+ALSALOCK_METHOD(alsadevmon_close, alsadevmon_t)
+
+static PyMethodDef alsadevmon_methods[] = {
+	{"cards", (PyCFunction)alsadevmon_cards_locked, METH_VARARGS},
+	{"pcms", (PyCFunction)alsadevmon_pcms_locked, METH_VARARGS|METH_KEYWORDS},
+	{"update", (PyCFunction)alsadevmon_update_method_locked, METH_VARARGS},
+	{"fileno", (PyCFunction)alsadevmon_fileno_locked, METH_VARARGS},
+	{"close", (PyCFunction)alsadevmon_close_locked, METH_VARARGS},
+	{NULL, NULL}
+};
+
+static PyType_Slot alsadevmon_slots[] = {
+	{ Py_tp_dealloc, (void *)alsadevmon_dealloc },
+	{ Py_tp_new, (void *)alsadevmon_new },
+	{ Py_tp_doc, "Cached lists of cards and PCM devices, kept current on hotplug." },
+	{ Py_tp_methods, alsadevmon_methods },
+	{ 0, NULL },
 };
 
+static PyType_Spec alsadevmon_spec = {
+	"alsaaudio.DeviceMonitor",
+	sizeof(alsadevmon_t),
+	0,
+	ALSAAUDIO_TPFLAGS,
+	alsadevmon_slots,
+};
 
 /******************************************/
 /* Module initialization				  */
@@ -3082,81 +10393,189 @@ static PyMethodDef alsaaudio_methods[] = {
 	{ "cards", (PyCFunction)alsacard_list, METH_VARARGS},
 	{ "pcms", (PyCFunction)alsapcm_list, METH_VARARGS|METH_KEYWORDS},
 	{ "mixers", (PyCFunction)alsamixer_list, METH_VARARGS|METH_KEYWORDS},
+#if PY_MAJOR_VERSION >= 3
+	{ "capabilities", (PyCFunction)alsa_capabilities, METH_VARARGS|METH_KEYWORDS},
+#endif
 	{ 0, 0 },
 };
 
 
-#if PY_MAJOR_VERSION >= 3
-
 #define _EXPORT_INT(mod, name, value) \
-  if (PyModule_AddIntConstant(mod, name, (long) value) == -1) return NULL;
+  if (PyModule_AddIntConstant(mod, name, (long) value) == -1) return -1;
 
-static struct PyModuleDef alsaaudio_module = {
-	PyModuleDef_HEAD_INIT,
-	"alsaaudio",
-	NULL,  /* m_doc */
-	-1,
-	alsaaudio_methods,
-	0,  /* m_reload */
-	0,  /* m_traverse */
-	0,  /* m_clear */
-	0,  /* m_free */
+static int
+alsaaudio_traverse(PyObject *m, visitproc visit, void *arg)
+{
+	alsaaudio_state_t *state = PyModule_GetState(m);
+
+	Py_VISIT(state->error);
+	Py_VISIT(state->pcm_type);
+	Py_VISIT(state->mixer_type);
+	Py_VISIT(state->ring_type);
+	Py_VISIT(state->duplex_type);
+	Py_VISIT(state->devmon_type);
+	Py_VISIT(state->poller_type);
+	Py_VISIT(state->meters_type);
+	Py_VISIT(state->status_type);
+	Py_VISIT(state->stats_type);
+	Py_VISIT(state->caps_type);
+	Py_VISIT(state->caps_cache);
+	Py_VISIT(state->get_running_loop);
+	Py_VISIT(state->running);
+	return 0;
+}
+
+static int
+alsaaudio_clear(PyObject *m)
+{
+	alsaaudio_state_t *state = PyModule_GetState(m);
+
+	Py_CLEAR(state->error);
+	Py_CLEAR(state->pcm_type);
+	Py_CLEAR(state->mixer_type);
+	Py_CLEAR(state->ring_type);
+	Py_CLEAR(state->duplex_type);
+	Py_CLEAR(state->devmon_type);
+	Py_CLEAR(state->poller_type);
+	Py_CLEAR(state->meters_type);
+	Py_CLEAR(state->status_type);
+	Py_CLEAR(state->stats_type);
+	Py_CLEAR(state->caps_type);
+	Py_CLEAR(state->caps_cache);
+	Py_CLEAR(state->get_running_loop);
+	Py_CLEAR(state->running);
+	return 0;
+}
+
+static void
+alsaaudio_free(void *m)
+{
+	alsaaudio_clear((PyObject *)m);
+}
+
+/* Registered with atexit: stop the I/O threads of PCMs whose stop() wasn't
+   called, before the interpreter is finalized under their feet. Errors of
+   the threads are dropped, as nobody is left to see them. */
+static PyObject *
+alsaaudio_stop_threads(PyObject *m, PyObject *unused)
+{
+	alsaaudio_state_t *state = PyModule_GetState(m);
+	PyObject *pcms;
+	Py_ssize_t i;
+
+	if (!state->running)
+		Py_RETURN_NONE;
+
+	pcms = PySequence_List(state->running);
+	if (!pcms)
+		return NULL;
+
+	for (i = 0; i < PyList_GET_SIZE(pcms); i++) {
+		alsapcm_t *pcm = (alsapcm_t *)PyList_GET_ITEM(pcms, i);
+
+		alsalock_acquire(&pcm->lock);
+		alsapcm_thread_join(pcm);
+		alsapcm_thread_clear_errors(pcm);
+		alsalock_release(&pcm->lock);
+	}
+	Py_DECREF(pcms);
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef alsaaudio_stop_threads_def = {
+	"_stop_threads", (PyCFunction)alsaaudio_stop_threads, METH_NOARGS
 };
 
-#else
+static int
+alsaaudio_register_atexit(PyObject *m)
+{
+	PyObject *atexit, *func, *res = NULL;
 
-#define _EXPORT_INT(mod, name, value) \
-  if (PyModule_AddIntConstant(mod, name, (long) value) == -1) return;
+	func = PyCFunction_NewEx(&alsaaudio_stop_threads_def, m, NULL);
+	if (!func)
+		return -1;
 
-#endif // 3.0
+	atexit = PyImport_ImportModule("atexit");
+	if (atexit) {
+		res = PyObject_CallMethod(atexit, "register", "O", func);
+		Py_DECREF(atexit);
+	}
+	Py_DECREF(func);
 
-#if PY_MAJOR_VERSION < 3
-void initalsaaudio(void)
-#else
-PyObject *PyInit_alsaaudio(void)
-#endif
+	if (!res)
+		return -1;
+	Py_DECREF(res);
+	return 0;
+}
+
+/* Create a type of the module from `spec`, and add it to the module unless
+   it is private */
+static PyTypeObject *
+alsaaudio_add_type(PyObject *m, PyType_Spec *spec, bool public)
 {
-	PyObject *m;
-	ALSAPCMType.tp_new = alsapcm_new;
-	ALSAMixerType.tp_new = alsamixer_new;
+	PyTypeObject *type;
 
-#if PY_VERSION_HEX < 0x03090000
-	PyEval_InitThreads();
-#endif
+	type = (PyTypeObject *)PyType_FromModuleAndSpec(m, spec, NULL);
+	if (type && public && PyModule_AddType(m, type) < 0)
+		Py_CLEAR(type);
 
-#if PY_MAJOR_VERSION < 3
-	m = Py_InitModule3("alsaaudio", alsaaudio_methods);
-	if (!m)
-		return;
-#else
+	return type;
+}
 
-	m = PyModule_Create(&alsaaudio_module);
-	if (!m)
-		return NULL;
+static PyTypeObject *
+alsaaudio_add_structseq(PyObject *m, PyStructSequence_Desc *desc)
+{
+	PyTypeObject *type;
 
-#endif
+	type = PyStructSequence_NewType(desc);
+	if (type && PyModule_AddType(m, type) < 0)
+		Py_CLEAR(type);
 
-	ALSAAudioError = PyErr_NewException("alsaaudio.ALSAAudioError", NULL,
-										NULL);
-	if (!ALSAAudioError)
-#if PY_MAJOR_VERSION < 3
-		return;
-#else
-		return NULL;
-#endif
+	return type;
+}
 
-	/* Each call to PyModule_AddObject decrefs it; compensate: */
+static int
+alsaaudio_exec(PyObject *m)
+{
+	alsaaudio_state_t *state = PyModule_GetState(m);
+
+	state->error = PyErr_NewException("alsaaudio.ALSAAudioError", NULL, NULL);
+	if (!state->error)
+		return -1;
+
+	/* PyModule_AddObject steals the reference on success only */
+	Py_INCREF(state->error);
+	if (PyModule_AddObject(m, "ALSAAudioError", state->error) < 0) {
+		Py_DECREF(state->error);
+		return -1;
+	}
+
+	if (!(state->pcm_type = alsaaudio_add_type(m, &alsapcm_spec, true)) ||
+		!(state->mixer_type = alsaaudio_add_type(m, &alsamixer_spec, true)) ||
+		!(state->ring_type = alsaaudio_add_type(m, &alsaring_spec, true)) ||
+		!(state->duplex_type = alsaaudio_add_type(m, &alsaduplex_spec, true)) ||
+		!(state->devmon_type = alsaaudio_add_type(m, &alsadevmon_spec, true)) ||
+		!(state->poller_type = alsaaudio_add_type(m, &alsapoller_spec, false)))
+		return -1;
 
-	Py_INCREF(&ALSAPCMType);
-	PyModule_AddObject(m, "PCM", (PyObject *)&ALSAPCMType);
+	if (!(state->meters_type = alsaaudio_add_structseq(m, &alsameters_desc)) ||
+		!(state->status_type = alsaaudio_add_structseq(m, &alsastatus_desc)) ||
+		!(state->stats_type = alsaaudio_add_structseq(m, &alsastats_desc)) ||
+		!(state->caps_type = alsaaudio_add_structseq(m, &alsacaps_desc)))
+		return -1;
 
-	Py_INCREF(&ALSAMixerType);
-	PyModule_AddObject(m, "Mixer", (PyObject *)&ALSAMixerType);
+	if (!(state->caps_cache = PyDict_New()))
+		return -1;
 
-	Py_INCREF(ALSAAudioError);
-	PyModule_AddObject(m, "ALSAAudioError", ALSAAudioError);
+	if (!(state->running = PySet_New(NULL)))
+		return -1;
 
-	PyModule_AddFunctions(m, alsa_methods);
+	if (alsaaudio_register_atexit(m) < 0)
+		return -1;
+
+	if (PyModule_AddFunctions(m, alsa_methods) < 0)
+		return -1;
 
 	_EXPORT_INT(m, "PCM_PLAYBACK",SND_PCM_STREAM_PLAYBACK);
 	_EXPORT_INT(m, "PCM_CAPTURE",SND_PCM_STREAM_CAPTURE);
@@ -3165,6 +10584,18 @@ PyObject *PyInit_alsaaudio(void)
 	_EXPORT_INT(m, "PCM_NONBLOCK",SND_PCM_NONBLOCK);
 	_EXPORT_INT(m, "PCM_ASYNC",SND_PCM_ASYNC);
 
+	/* PCM access types */
+	_EXPORT_INT(m, "PCM_ACCESS_RW_INTERLEAVED",SND_PCM_ACCESS_RW_INTERLEAVED);
+	_EXPORT_INT(m, "PCM_ACCESS_RW_NONINTERLEAVED",SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	_EXPORT_INT(m, "PCM_ACCESS_MMAP_INTERLEAVED",SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	_EXPORT_INT(m, "PCM_ACCESS_MMAP_NONINTERLEAVED",SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+
+	/* Resampling qualities, indices into ALSAResampleQualities */
+	_EXPORT_INT(m, "PCM_RESAMPLE_NONE",0);
+	_EXPORT_INT(m, "PCM_RESAMPLE_FAST",1);
+	_EXPORT_INT(m, "PCM_RESAMPLE_MEDIUM",2);
+	_EXPORT_INT(m, "PCM_RESAMPLE_BEST",3);
+
 	/* PCM Formats */
 	_EXPORT_INT(m, "PCM_FORMAT_S8",SND_PCM_FORMAT_S8);
 	_EXPORT_INT(m, "PCM_FORMAT_U8",SND_PCM_FORMAT_U8);
@@ -3246,7 +10677,35 @@ PyObject *PyInit_alsaaudio(void)
 	_EXPORT_INT(m, "VOLUME_UNITS_RAW", VOLUME_UNITS_RAW)
 	_EXPORT_INT(m, "VOLUME_UNITS_DB", VOLUME_UNITS_DB)
 
-#if PY_MAJOR_VERSION >= 3
-	return m;
+	return 0;
+}
+
+static PyModuleDef_Slot alsaaudio_slots[] = {
+	{ Py_mod_exec, (void *)alsaaudio_exec },
+#if PY_VERSION_HEX >= 0x030C0000
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+	// Each object has its own lock, see alsalock_acquire()
+	{ Py_mod_gil, Py_MOD_GIL_NOT_USED },
 #endif
+	{ 0, NULL },
+};
+
+static struct PyModuleDef alsaaudio_module = {
+	PyModuleDef_HEAD_INIT,
+	"alsaaudio",
+	NULL,  /* m_doc */
+	sizeof(alsaaudio_state_t),
+	alsaaudio_methods,
+	alsaaudio_slots,
+	alsaaudio_traverse,
+	alsaaudio_clear,
+	alsaaudio_free,
+};
+
+PyMODINIT_FUNC
+PyInit_alsaaudio(void)
+{
+	return PyModuleDef_Init(&alsaaudio_module);
 }
@@ -10,6 +10,17 @@
 
 import unittest
 import alsaaudio
+import asyncio
+import errno
+import importlib
+import math
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
 import warnings
 from contextlib import closing
 
@@ -101,6 +112,16 @@ class PCMTest(unittest.TestCase):
 			pcm = alsaaudio.PCM(cardindex=c)
 			pcm.close()
 
+	def testPCMOpenFailure(self):
+		"A PCM object that failed to open is freed"
+
+		before = sys.getrefcount(alsaaudio.PCM)
+		for i in range(100):
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				alsaaudio.PCM(device='pyalsaaudio_no_such_device')
+		# Each leaked object would hold a reference to the type
+		self.assertLess(sys.getrefcount(alsaaudio.PCM), before + 10)
+
 	def testPCMAll(self):
 		"Run all PCM methods on an open object"
 
@@ -160,6 +181,837 @@ class PCMTest(unittest.TestCase):
 				self.assertEqual(len(w), 1, method + " expected a warning")
 				self.assertTrue(issubclass(w[-1].category, DeprecationWarning), method + " expected a DeprecationWarning")
 
+	def testReadIntoPlayback(self):
+		"read_into() on a playback PCM raises an error"
+
+		with closing(alsaaudio.PCM()) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.read_into(bytearray(4096))
+
+	def testWriteLoops(self):
+		"write() doesn't return before all data was written in PCM_NORMAL mode"
+
+		with closing(alsaaudio.PCM(periodsize=256, periods=4)) as pcm:
+			self.assertEqual(pcm.write(b'\0' * 4 * 256 * 8), 256 * 8)
+			pcm.drop()
+
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.read(1024)
+
+	def testWritev(self):
+		"writev() accepts frames that are split across buffers"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			chunks = [b'\0' * 3, bytearray(1021), memoryview(b'\0' * 1024)]
+			self.assertEqual(pcm.writev(chunks), 512)
+			self.assertEqual(pcm.writev([]), 0)
+			pcm.drop()
+
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.writev([b'\0' * 3])
+
+	def testWriteFloat(self):
+		"write_float() converts float32 samples to the PCM's format"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			data = struct.pack('512f', *([0.5, -2.0] * 256))
+			self.assertEqual(pcm.write_float(data), 256)
+			self.assertEqual(pcm.write_float(data, True), 256)
+			pcm.drop()
+
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.write_float(b'\0' * 4)
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.read_float()
+
+		with closing(alsaaudio.PCM(format=alsaaudio.PCM_FORMAT_MU_LAW)) as pcm:
+			if pcm.info()['format'] == alsaaudio.PCM_FORMAT_MU_LAW:
+				with self.assertRaises(alsaaudio.ALSAAudioError):
+					pcm.write_float(b'\0' * 8)
+
+	def testWriteFloatNaN(self):
+		"write_float() writes NaN as silence"
+
+		with tempfile.TemporaryDirectory() as tmp:
+			path = os.path.join(tmp, 'out.raw')
+			with closing(alsaaudio.PCM(device='file:FILE=%s,FORMAT=raw' % path,
+									   channels=1, rate=48000, periodsize=64,
+									   format=alsaaudio.PCM_FORMAT_S16_LE)) as pcm:
+				data = struct.pack('64f', *([float('nan')] * 64))
+				self.assertEqual(pcm.write_float(data), 64)
+			with open(path, 'rb') as f:
+				written = f.read()
+			self.assertEqual(written[:128], b'\0' * 128)
+
+	def testChannelMatrix(self):
+		"set_channel_matrix() changes the frame size seen by write()"
+
+		with closing(alsaaudio.PCM(channels=2, periodsize=256)) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.set_channel_matrix([[1.0], [1.0], [1.0]])
+
+			# Mono to stereo
+			pcm.set_channel_matrix([[1.0], [1.0]])
+			self.assertEqual(pcm.write(b'\0' * 2 * 256), 256)
+			self.assertEqual(pcm.write_float(b'\0' * 4 * 256), 256)
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.write(b'\0' * 3)
+
+			# The other transfer functions would bypass the matrix
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.writev([b'\0' * 4 * 256])
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.start(lambda buf: None)
+
+			pcm.set_channel_matrix(None)
+			self.assertEqual(pcm.write(b'\0' * 4 * 256), 256)
+			pcm.drop()
+
+	def testChannelMatrixMix(self):
+		"The channel matrix mixes each frame into the PCM's channels"
+
+		with tempfile.TemporaryDirectory() as tmp:
+			path = os.path.join(tmp, 'out.raw')
+			with closing(alsaaudio.PCM(device='file:FILE=%s,FORMAT=raw' % path,
+									   channels=2, rate=48000, periodsize=64,
+									   format=alsaaudio.PCM_FORMAT_FLOAT_LE)) as pcm:
+				pcm.set_channel_matrix([[1.0, 0.5], [0.25, -1.0]])
+				data = [0.125 * (i % 7) - 0.5 for i in range(2 * 64)]
+				# An odd number of frames, then the rest of the period
+				self.assertEqual(pcm.write_float(struct.pack('126f', *data[:126])), 63)
+				self.assertEqual(pcm.write_float(struct.pack('2f', *data[126:])), 1)
+			with open(path, 'rb') as f:
+				written = struct.unpack('128f', f.read()[:4 * 128])
+			for i in range(64):
+				l, r = data[2 * i], data[2 * i + 1]
+				self.assertAlmostEqual(written[2 * i], l + 0.5 * r, places=6)
+				self.assertAlmostEqual(written[2 * i + 1], 0.25 * l - r, places=6)
+
+	def testGain(self):
+		"set_gain() ramps towards the new gain while writing"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			self.assertEqual(pcm.get_gain(), 0.0)
+			pcm.set_gain(-6.0)
+			self.assertAlmostEqual(pcm.get_gain(), -6.0, places=3)
+
+			pcm.set_gain(0.0, ramp_ms=1000)
+			self.assertAlmostEqual(pcm.get_gain(), -6.0, places=3)
+			self.assertEqual(pcm.write(b'\1\0' * 2 * 256), 256)
+			gain = pcm.get_gain()
+			self.assertGreater(gain, -6.0)
+			self.assertLess(gain, 0.0)
+			pcm.drop()
+
+			pcm.set_gain(float('-inf'))
+			self.assertEqual(pcm.get_gain(), float('-inf'))
+
+			for db in (float('nan'), float('inf')):
+				with self.assertRaises(ValueError):
+					pcm.set_gain(db)
+			with self.assertRaises(ValueError):
+				pcm.set_gain(0.0, ramp_ms=-1)
+			self.assertEqual(pcm.get_gain(), float('-inf'))
+
+		with closing(alsaaudio.PCM(alsaaudio.PCM_CAPTURE)) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.set_gain(-6.0)
+
+	def testGainS32(self):
+		"32 bit samples keep their full precision under a gain"
+
+		gain = struct.unpack('f', struct.pack('f', 10 ** (-6.0 / 20)))[0]
+		data = [(2 ** 31 - 1 - 65537 * i) * (-1) ** i for i in range(2 * 64)]
+		with tempfile.TemporaryDirectory() as tmp:
+			path = os.path.join(tmp, 'out.raw')
+			with closing(alsaaudio.PCM(device='file:FILE=%s,FORMAT=raw' % path,
+									   channels=2, rate=48000, periodsize=64,
+									   format=alsaaudio.PCM_FORMAT_S32_LE)) as pcm:
+				pcm.set_gain(-6.0)
+				self.assertEqual(pcm.write(struct.pack('<128i', *data)), 64)
+			with open(path, 'rb') as f:
+				written = struct.unpack('<128i', f.read()[:4 * 128])
+		self.assertEqual(list(written), [round(x * gain) for x in data])
+
+	def testGainUnsupportedAccess(self):
+		"The paths that don't apply the gain refuse it"
+
+		try:
+			pcm = alsaaudio.PCM(access=alsaaudio.PCM_ACCESS_RW_NONINTERLEAVED)
+		except alsaaudio.ALSAAudioError:
+			pass
+		else:
+			with closing(pcm):
+				with self.assertRaises(alsaaudio.ALSAAudioError):
+					pcm.set_gain(-6.0)
+
+		try:
+			pcm = alsaaudio.PCM(access=alsaaudio.PCM_ACCESS_MMAP_INTERLEAVED)
+		except alsaaudio.ALSAAudioError:
+			self.skipTest("mmap access is not supported")
+
+		with closing(pcm):
+			pcm.set_gain(-6.0)
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.mmap_begin()
+
+			pcm.set_gain(0.0)
+			pcm.mmap_begin()
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.set_gain(-6.0)
+			pcm.mmap_commit(0)
+
+	def testGainShortWrite(self):
+		"The gain ramp only moves on by the frames the device accepted"
+
+		with closing(alsaaudio.PCM(mode=alsaaudio.PCM_NONBLOCK,
+								   periodsize=256)) as pcm:
+			rate = pcm.info()['rate']
+			start = 10 ** (-6.0 / 20)
+			pcm.set_gain(-6.0)
+			pcm.set_gain(0.0, ramp_ms=1000)
+
+			# More than fits into the device's buffer
+			frames = pcm.write(b'\1\0' * 2 * 2 * rate)
+			self.assertGreater(frames, 0)
+			self.assertLess(frames, rate)
+			expected = 20 * math.log10(start + (1 - start) * frames / rate)
+			self.assertAlmostEqual(pcm.get_gain(), expected, places=3)
+			pcm.drop()
+
+	def testMeters(self):
+		"meters() reports the levels of the frames written"
+
+		with closing(alsaaudio.PCM(channels=2, periodsize=256)) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.meters()
+
+			pcm.enable_meters()
+			# Full scale on the left, silence on the right
+			pcm.write(struct.pack('<512h', *([-32768, 0] * 256)))
+			meters = pcm.meters()
+			pcm.drop()
+
+			self.assertEqual(meters.peak, (0.0, float('-inf')))
+			self.assertAlmostEqual(meters.rms[0], 0.0, places=3)
+			self.assertEqual(len(meters.momentary), 2)
+
+			meters = pcm.meters()
+			self.assertEqual(meters.peak, (float('-inf'), float('-inf')))
+
+	def testMetersReconfigure(self):
+		"The meters follow changes of the channel count"
+
+		with closing(alsaaudio.PCM(channels=2, periodsize=256)) as pcm:
+			pcm.enable_meters()
+			with warnings.catch_warnings():
+				warnings.simplefilter('ignore', DeprecationWarning)
+				pcm.setchannels(1)
+			pcm.write(struct.pack('<256h', *([-32768] * 256)))
+			meters = pcm.meters()
+			pcm.drop()
+
+			self.assertEqual(meters.peak, (0.0,))
+
+			pcm.configure(channels=2)
+			pcm.write(struct.pack('<512h', *([-32768, 0] * 256)))
+			meters = pcm.meters()
+			pcm.drop()
+
+			self.assertEqual(meters.peak, (0.0, float('-inf')))
+
+	def testMetersThread(self):
+		"The I/O thread updates the meters"
+
+		def callback(buf: memoryview):
+			buf[:] = struct.pack('<%dh' % (len(buf) // 2),
+								 *([-32768] * (len(buf) // 2)))
+
+		with closing(alsaaudio.PCM(channels=2, periodsize=256)) as pcm:
+			pcm.enable_meters()
+			pcm.start(callback)
+			time.sleep(0.1)
+			pcm.stop()
+			pcm.drop()
+
+			self.assertEqual(pcm.meters().peak, (0.0, 0.0))
+
+	def testStatus(self):
+		"status() agrees with state() and avail()"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			status = pcm.status()
+			self.assertEqual(status.state, pcm.state())
+			self.assertEqual(status.state, status[0])
+			self.assertGreater(status.avail, 0)
+			self.assertIsInstance(status.tstamp, float)
+
+	def testStats(self):
+		"stats() counts the frames written, and starts over after a reset"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			stats = pcm.stats()
+			self.assertEqual(stats.calls, 0)
+			self.assertIsNone(stats.min_avail)
+
+			pcm.write(b'\0' * 4 * 256)
+			stats = pcm.stats()
+			self.assertEqual(stats.calls, 1)
+			self.assertEqual(stats.blocked_ns, 0)
+			self.assertIsNone(stats.min_avail)
+
+			pcm.enable_stats()
+			pcm.write(b'\0' * 4 * 256)
+			stats = pcm.stats(reset=True)
+			self.assertEqual(stats.calls, 2)
+			self.assertEqual(stats.frames, 512)
+			self.assertEqual(stats.frames, stats[1])
+			self.assertGreaterEqual(stats.max_avail, stats.min_avail)
+			self.assertGreaterEqual(stats.blocked_ns, stats.max_blocked_ns)
+
+			self.assertEqual(pcm.stats().calls, 0)
+
+	def testConfigure(self):
+		"configure() reports the configuration that info() reports"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			config = pcm.configure(rate=48000, periods=4)
+			info = pcm.info()
+			self.assertEqual(config['rate'], info['rate'])
+			self.assertEqual(config['period_size'], info['period_size'])
+			self.assertEqual(config['buffer_size'], info['buffer_size'])
+
+			config = pcm.configure(latency_us=20000)
+			self.assertEqual(config['buffer_size'], pcm.info()['buffer_size'])
+
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.configure(latency_us=20000, buffer_size=1024)
+
+	def testSwParams(self):
+		"Software parameters are applied and reported back"
+
+		with closing(alsaaudio.PCM(periodsize=256, start_threshold=512)) as pcm:
+			params = pcm.set_sw_params()
+			self.assertEqual(params['start_threshold'], 512)
+
+			params = pcm.set_sw_params(avail_min=512, stop_threshold=sys.maxsize)
+			self.assertEqual(params['avail_min'], 512)
+			self.assertEqual(params['start_threshold'], 512)
+			self.assertGreaterEqual(params['stop_threshold'], pcm.info()['buffer_size'])
+
+	def testResample(self):
+		"write() takes frames at the requested rate when resampling"
+
+		with self.assertRaises(alsaaudio.ALSAAudioError):
+			alsaaudio.PCM(resample=42)
+
+		with closing(alsaaudio.PCM(rate=44100, channels=2,
+								   resample=alsaaudio.PCM_RESAMPLE_MEDIUM)) as pcm:
+			self.assertEqual(pcm.write(bytes(4 * 256)), 256)
+			self.assertEqual(pcm.write_float(bytes(8 * 256)), 256)
+			pcm.drop()
+
+	def testMmapWithoutMmapAccess(self):
+		"mmap_begin() requires PCM_ACCESS_MMAP_INTERLEAVED"
+
+		with closing(alsaaudio.PCM()) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.mmap_begin()
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.mmap_commit()
+
+	def testPlanarWithInterleavedAccess(self):
+		"write_planar() requires non-interleaved access and write() doesn't"
+
+		with closing(alsaaudio.PCM()) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.write_planar([b'\0\0', b'\0\0'])
+
+		try:
+			pcm = alsaaudio.PCM(access=alsaaudio.PCM_ACCESS_RW_NONINTERLEAVED)
+		except alsaaudio.ALSAAudioError:
+			self.skipTest("non-interleaved access is not supported")
+
+		with closing(pcm):
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.write(b'\0\0\0\0')
+
+class PCMCallbackTest(unittest.TestCase):
+	"""Test the callback mode of PCM objects"""
+
+	def testCallbackPlayback(self):
+		"Play silence from the I/O thread for a short while"
+
+		calls = []
+
+		def callback(buf: memoryview):
+			calls.append(len(buf))
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			pcm.start(callback)
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.write(b'\0' * 1024)
+			time.sleep(0.2)
+			pcm.stop()
+			pcm.drop()
+
+		self.assertGreater(len(calls), 0)
+
+	def testCallbackStats(self):
+		"stats() counts the transfers of the I/O thread"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			pcm.start(lambda buf: None)
+			time.sleep(0.1)
+			pcm.stop()
+			pcm.drop()
+
+			stats = pcm.stats()
+			self.assertGreater(stats.calls, 0)
+			self.assertGreater(stats.frames, 0)
+
+	def testCallbackException(self):
+		"An exception in the callback is raised by stop()"
+
+		def callback(buf: memoryview):
+			raise ValueError("expected")
+
+		with closing(alsaaudio.PCM()) as pcm:
+			pcm.start(callback)
+			time.sleep(0.05)
+			with self.assertRaises(ValueError):
+				pcm.stop()
+
+	def testBusyWhileRunning(self):
+		"The stream can't be reconfigured while the I/O thread runs"
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			pcm.start(lambda buf: None)
+			try:
+				for method, args in (('setrate', (48000,)), ('setchannels', (1,)),
+									 ('pause', ()), ('drop', ()), ('drain', ()),
+									 ('set_sw_params', ())):
+					with self.assertRaises(alsaaudio.ALSAAudioError):
+						with warnings.catch_warnings():
+							warnings.simplefilter('ignore', DeprecationWarning)
+							getattr(pcm, method)(*args)
+				with self.assertRaises(alsaaudio.ALSAAudioError):
+					pcm.configure(rate=48000)
+			finally:
+				pcm.stop()
+
+	def testExitWithoutStop(self):
+		"A thread that is never stopped is stopped at exit"
+
+		script = ('import alsaaudio\n'
+				  'pcm = alsaaudio.PCM(periodsize=256)\n'
+				  'pcm.start(lambda buf: None)\n')
+		proc = subprocess.run([sys.executable, '-c', script], timeout=10)
+		self.assertEqual(proc.returncode, 0)
+
+	def testStopWithoutStart(self):
+		with closing(alsaaudio.PCM()) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.stop()
+			with self.assertRaises(TypeError):
+				pcm.start(None) # pyright: ignore[reportArgumentType]
+
+class RingBufferTest(unittest.TestCase):
+	"""Test RingBuffer objects"""
+
+	def testWrapAround(self):
+		ring = alsaaudio.RingBuffer(5, 4)
+		self.assertEqual(ring.capacity(), 8)
+		self.assertEqual(ring.write(b'abcd' * 6), 6)
+		self.assertEqual(ring.read(4), b'abcd' * 4)
+		self.assertEqual(ring.write(b'efgh' * 10), 6)
+		self.assertEqual(ring.space(), 0)
+
+		buf = bytearray(4 * 8)
+		self.assertEqual(ring.read_into(buf), 8)
+		self.assertEqual(bytes(buf), b'abcd' * 2 + b'efgh' * 6)
+		self.assertEqual(ring.available(), 0)
+		self.assertEqual(ring.read(), b'')
+
+	def testPartialFrame(self):
+		ring = alsaaudio.RingBuffer(16, 4)
+		with self.assertRaises(alsaaudio.ALSAAudioError):
+			ring.write(b'abc')
+
+	def testPlaybackFromRing(self):
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			ring = alsaaudio.RingBuffer(4096, 4)
+			ring.write(b'\0' * 4 * 4096)
+			pcm.start(ring)
+			time.sleep(0.05)
+			pcm.stop()
+			pcm.drop()
+			self.assertLess(ring.available(), 4096)
+
+		with self.assertRaises(alsaaudio.ALSAAudioError):
+			with closing(alsaaudio.PCM(channels=2)) as pcm:
+				pcm.start(alsaaudio.RingBuffer(16, 3))
+
+	def testSingleConsumer(self):
+		"A ring buffer has one consumer while a playback PCM drains it"
+
+		ring = alsaaudio.RingBuffer(4096, 4)
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm, \
+			 closing(alsaaudio.PCM(periodsize=256)) as other:
+			pcm.start(ring)
+			try:
+				with self.assertRaises(alsaaudio.ALSAAudioError):
+					other.start(ring)
+				with self.assertRaises(alsaaudio.ALSAAudioError):
+					ring.read()
+				# The producer side is still free
+				self.assertEqual(ring.write(b'\0' * 4), 1)
+			finally:
+				pcm.stop()
+				pcm.drop()
+
+		self.assertIsInstance(ring.read(), bytes)
+
+class PCMAsyncTest(unittest.TestCase):
+	"""Test asyncio support"""
+
+	def testAwrite(self):
+		async def play(pcm):
+			for i in range(4):
+				self.assertEqual(await pcm.awrite(b'\0' * 4 * 1000), 1000)
+
+		with closing(alsaaudio.PCM(periodsize=256)) as pcm:
+			asyncio.run(play(pcm))
+
+	def testNoRunningLoop(self):
+		with closing(alsaaudio.PCM()) as pcm:
+			with self.assertRaises(RuntimeError):
+				pcm.awrite(b'\0' * 4)
+
+	def testPendingOperation(self):
+		async def play(pcm):
+			future = pcm.awrite(b'\0' * 4 * 44100)
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.awrite(b'\0' * 4)
+			future.cancel()
+
+		with closing(alsaaudio.PCM()) as pcm:
+			asyncio.run(play(pcm))
+
+	def testCloseWhilePending(self):
+		async def play(pcm):
+			future = pcm.awrite(b'\0' * 4 * 44100)
+			pcm.close()
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				await future
+
+		asyncio.run(play(alsaaudio.PCM()))
+
+class DuplexTest(unittest.TestCase):
+	"""Test Duplex objects"""
+
+	def testTransfer(self):
+		try:
+			duplex = alsaaudio.Duplex(periodsize=256)
+		except alsaaudio.ALSAAudioError:
+			self.skipTest("linked capture and playback are not supported")
+
+		with closing(duplex):
+			self.assertEqual(duplex.capture().pcmtype(), alsaaudio.PCM_CAPTURE)
+			self.assertEqual(duplex.playback().pcmtype(), alsaaudio.PCM_PLAYBACK)
+
+			written, frames, data = duplex.transfer(b'\0' * 4 * 512)
+			self.assertEqual(written, 512)
+			self.assertEqual(len(data), max(frames, 0) * 4)
+
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				duplex.transfer(b'\0' * 3)
+
+class CapabilitiesTest(unittest.TestCase):
+	"""Test capabilities()"""
+
+	def testCached(self):
+		"Capabilities are probed once and agree with the PCM's"
+
+		caps = alsaaudio.capabilities()
+		self.assertIs(alsaaudio.capabilities(), caps)
+		self.assertEqual(caps.device, 'default')
+
+		with closing(alsaaudio.PCM()) as pcm:
+			self.assertEqual(dict(caps.formats), pcm.getformats())
+
+		with self.assertRaises(TypeError):
+			caps.formats['foo'] = 1
+
+	def testDiskCache(self):
+		"The on-disk cache survives a refresh"
+
+		cards = alsaaudio.card_indexes()
+		if not cards:
+			self.skipTest("no sound cards")
+
+		device = 'hw:%d' % cards[0]
+		with tempfile.TemporaryDirectory() as tmp:
+			path = os.path.join(tmp, 'caps.json')
+			try:
+				caps = alsaaudio.capabilities(device, cache=path, refresh=True)
+			except alsaaudio.ALSAAudioError:
+				self.skipTest("%s is busy" % device)
+
+			self.assertTrue(os.path.exists(path))
+			self.assertEqual(alsaaudio.capabilities(device, cache=path), caps)
+
+class DeviceMonitorTest(unittest.TestCase):
+	"""Test DeviceMonitor objects"""
+
+	def testCached(self):
+		"The lists match cards() and pcms(), and are reused while nothing changes"
+
+		with closing(alsaaudio.DeviceMonitor()) as monitor:
+			cards = monitor.cards()
+			self.assertEqual(list(cards), alsaaudio.cards())
+			self.assertEqual(list(monitor.pcms()), alsaaudio.pcms())
+
+			if not monitor.update():
+				self.assertIs(monitor.cards(), cards)
+			self.assertIsInstance(monitor.fileno(), int)
+
+		with self.assertRaises(alsaaudio.ALSAAudioError):
+			monitor.cards()
+
+class VirtualPCMTest(unittest.TestCase):
+	"""Test the virtual PCM device"""
+
+	def testFreeRunning(self):
+		"With CLOCK=0, the device keeps up with any transfer rate"
+
+		with closing(alsaaudio.PCM(device='pyalsaaudio_virtual:CLOCK=0',
+								   periodsize=64)) as pcm:
+			for i in range(100):
+				self.assertEqual(pcm.write(b'\0' * 4 * 64), 64)
+			self.assertEqual(pcm.stats().frames, 6400)
+			self.assertEqual(pcm.xruns(), 0)
+
+		with closing(alsaaudio.PCM(alsaaudio.PCM_CAPTURE,
+								   device='pyalsaaudio_virtual:CLOCK=0',
+								   periodsize=64)) as pcm:
+			self.assertEqual(pcm.read(), (64, b'\0' * 4 * 64))
+
+	def testClock(self):
+		"Blocking writes are paced by the device's clock"
+
+		with closing(alsaaudio.PCM(device='pyalsaaudio_virtual', rate=48000,
+								   periodsize=480, periods=4)) as pcm:
+			start = time.monotonic()
+			for i in range(20):
+				pcm.write(b'\0' * 4 * 480)
+			self.assertGreater(time.monotonic() - start, 0.1)
+
+	def testResampleShortWrite(self):
+		"Resampled frames the device doesn't accept are written later, once"
+
+		with closing(alsaaudio.PCM(mode=alsaaudio.PCM_NONBLOCK,
+								   device='pyalsaaudio_virtual', rate=2000,
+								   periodsize=64, periods=4,
+								   resample=alsaaudio.PCM_RESAMPLE_FAST)) as pcm:
+			self.assertEqual(pcm.info()['rate'], 4000)
+			# Far more than fits into the device's buffer
+			self.assertEqual(pcm.write(b'\0' * 4 * 1000), 1000)
+			# Nothing new is taken while frames are pending
+			self.assertEqual(pcm.write(b'\0' * 4 * 100), 0)
+			pcm.drop()
+			self.assertEqual(pcm.write(b'\0' * 4 * 100), 100)
+			pcm.drop()
+
+	def testXrun(self):
+		"Injected xruns are reported and recovered from like real ones"
+
+		with closing(alsaaudio.PCM(device='pyalsaaudio_virtual:CLOCK=0,XRUN=4',
+								   periodsize=64)) as pcm:
+			results = [pcm.write(b'\0' * 4 * 64) for i in range(32)]
+			self.assertIn(-errno.EPIPE, results)
+			self.assertGreaterEqual(pcm.xruns(), results.count(-errno.EPIPE))
+			self.assertEqual(pcm.stats().xruns, pcm.xruns())
+
+	def testSuspend(self):
+		"An injected suspend makes write() fail"
+
+		with closing(alsaaudio.PCM(device='pyalsaaudio_virtual:CLOCK=0,SUSPEND=2',
+								   periodsize=64)) as pcm:
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				for i in range(32):
+					pcm.write(b'\0' * 4 * 64)
+
+class ThreadStressTest(unittest.TestCase):
+	"""Test PCMs shared by many threads"""
+
+	PCMS = 32
+	THREADS = 32
+	ROUNDS = 200
+
+	def testSharedPCMs(self):
+		"Threads writing to, querying and closing the same PCMs don't crash"
+
+		pcms = [alsaaudio.PCM(device='pyalsaaudio_virtual:CLOCK=0',
+							  periodsize=64)
+				for i in range(self.PCMS)]
+		data = b'\0' * 4 * 64
+		barrier = threading.Barrier(self.THREADS)
+		failures = []
+
+		def worker(n):
+			barrier.wait()
+			try:
+				for i in range(self.ROUNDS):
+					pcm = pcms[(n + i) % self.PCMS]
+					try:
+						pcm.write(data)
+						pcm.avail()
+						pcm.stats()
+						# Some PCMs get closed while others still use them
+						if i == self.ROUNDS // 2 and n % 4 == 0:
+							pcm.close()
+					except alsaaudio.ALSAAudioError:
+						pass
+			except Exception as e:
+				failures.append(e)
+
+		threads = [threading.Thread(target=worker, args=(n,))
+				   for n in range(self.THREADS)]
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+
+		self.assertEqual(failures, [])
+
+		frames = 0
+		for pcm in pcms:
+			try:
+				frames += pcm.stats().frames
+			except alsaaudio.ALSAAudioError:
+				pass
+			pcm.close()
+		self.assertGreater(frames, 0)
+
+	def _blockedWrite(self, stop):
+		"Block a write() to a paced device in a thread, then call `stop`"
+
+		results = []
+		with closing(alsaaudio.PCM(device='pyalsaaudio_virtual', rate=48000,
+								   periodsize=480, periods=4)) as pcm:
+			def writer():
+				try:
+					# Ten seconds of audio, at the device's pace
+					results.append(pcm.write(b'\0' * 4 * 480000))
+				except alsaaudio.ALSAAudioError as e:
+					results.append(e)
+
+			thread = threading.Thread(target=writer)
+			thread.start()
+			time.sleep(0.1)
+
+			# Other methods don't wait for the blocked write()
+			start = time.monotonic()
+			pcm.avail()
+			pcm.status()
+			stop(pcm)
+			thread.join(2)
+			self.assertFalse(thread.is_alive())
+			self.assertLess(time.monotonic() - start, 2)
+
+		self.assertEqual(len(results), 1)
+		return results[0]
+
+	def testDropBlockedWrite(self):
+		"drop() from another thread interrupts a blocked write()"
+
+		result = self._blockedWrite(lambda pcm: pcm.drop())
+		self.assertIsInstance(result, int)
+		self.assertLess(result, 480000)
+
+	def testCloseBlockedWrite(self):
+		"close() from another thread waits for a blocked write() to return"
+
+		result = self._blockedWrite(lambda pcm: pcm.close())
+		if isinstance(result, int):
+			self.assertLess(result, 480000)
+
+	def testReconfigureBlockedWrite(self):
+		"A PCM can't be reconfigured under a write() in another thread"
+
+		def stop(pcm):
+			with self.assertRaises(alsaaudio.ALSAAudioError):
+				pcm.configure(rate=44100)
+			pcm.drop()
+
+		self._blockedWrite(stop)
+
+class SubinterpreterTest(unittest.TestCase):
+	"""Test the module in subinterpreters"""
+
+	SCRIPT = """if True:
+		import alsaaudio
+		pcm = alsaaudio.PCM(device='pyalsaaudio_virtual:CLOCK=0', periodsize=64)
+		assert pcm.write(b'\\0' * 4 * 64) == 64
+		assert isinstance(pcm.status(), alsaaudio.Status)
+		# The I/O thread runs the callback in this interpreter
+		import threading
+		called = threading.Event()
+		pcm.start(lambda buf: called.set())
+		assert called.wait(2)
+		pcm.stop()
+		pcm.close()
+		try:
+			pcm.write(b'\\0' * 4)
+		except alsaaudio.ALSAAudioError:
+			pass
+		else:
+			raise AssertionError('write() on a closed PCM did not raise')
+	"""
+
+	def testIsolated(self):
+		"The module and its I/O thread work in a subinterpreter with its own GIL"
+
+		try:
+			import _interpreters as interpreters
+		except ImportError:
+			try:
+				import _xxsubinterpreters as interpreters
+			except ImportError:
+				self.skipTest('subinterpreters are not available')
+
+		interp = interpreters.create()
+		try:
+			result = interpreters.run_string(interp, self.SCRIPT)
+		finally:
+			interpreters.destroy(interp)
+		self.assertIsNone(result)
+
+		# The main interpreter's module is unaffected
+		with closing(alsaaudio.PCM(device='pyalsaaudio_virtual:CLOCK=0')) as pcm:
+			self.assertIsInstance(pcm.status(), alsaaudio.Status)
+
+	def testReimport(self):
+		"Each instance of the module raises its own ALSAAudioError"
+
+		old = sys.modules.pop('alsaaudio')
+		try:
+			new = importlib.import_module('alsaaudio')
+		finally:
+			sys.modules['alsaaudio'] = old
+		self.assertIsNot(new.ALSAAudioError, old.ALSAAudioError)
+
+		for mod in (old, new):
+			pcm = mod.PCM(device='pyalsaaudio_virtual:CLOCK=0')
+			pcm.close()
+			with self.assertRaises(mod.ALSAAudioError):
+				pcm.write(b'\0' * 4)
+			with self.assertRaises(mod.ALSAAudioError):
+				mod.card_name(999)
+			with self.assertRaises(mod.ALSAAudioError):
+				mod.PCM(device='pyalsaaudio_no_such_device')
+
 class PollDescriptorArgsTest(unittest.TestCase):
 	'''Test invalid args for polldescriptors_revents (takes a list of tuples of 2 integers)'''
 	def testArgsNoList(self):